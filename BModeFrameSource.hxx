@@ -0,0 +1,54 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef BMODEFRAMESOURCE_H
+#define BMODEFRAMESOURCE_H
+
+#include "itkImage.h"
+
+//Sequence of B-mode frames addressed by absolute frame number.
+//
+//Processing code (OpticNerveCalculator) reads frames through this interface
+//so it does not depend on the probe SDK. IntersonArrayDeviceRF implements
+//it for the probe, SimulatedProbeDevice for builds without the SDK and
+//FrameBusDevice for frames shared by FrameBusPublisher.
+class BModeFrameSource
+{
+
+public:
+
+  typedef unsigned char PixelType;
+  typedef itk::Image< PixelType, 2 > ImageType;
+
+  virtual ~BModeFrameSource()
+    {
+    };
+
+  //Number of frames produced so far, frames are numbered from 0
+  virtual long GetNumberOfBModeImagesAcquired() = 0;
+
+  //Frame with the given number, only the most recent frames (the size of
+  //the source's ring buffer) are available. NULL if the frame could not be
+  //read consistently.
+  virtual ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex ) = 0;
+
+};
+
+#endif
@@ -0,0 +1,362 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Minimal micro benchmark harness modeled on Google Benchmark.
+//
+//Benchmarks are registered by name and run with a State that controls the
+//iterations:
+//
+//  suite.Register( "Rescale/512x512", []( Benchmark::State &state )
+//    {
+//    while( state.KeepRunning() )
+//      {
+//      ...
+//      }
+//    } );
+//
+//A benchmark runs for at least minTime seconds (and at least
+//minIterations iterations) after one untimed warm up iteration. Results are
+//printed as a table and can be written as JSON in the Google Benchmark
+//format (context and benchmarks with real_time, cpu_time, time_unit and
+//user counters), so the same regression tooling can compare runs.
+class Benchmark
+{
+
+public:
+
+  struct Result
+    {
+    std::string name;
+    long iterations = 0;
+    //Mean time per iteration in milliseconds
+    double realTime = 0;
+    double cpuTime = 0;
+    std::map< std::string, double > counters;
+    std::string error;
+    };
+
+  class State
+    {
+    public:
+
+      State( double minTime, long minIterations, long maxIterations )
+        : minTime( minTime ), minIterations( minIterations ),
+        maxIterations( maxIterations ), iterations( 0 ), started( false ),
+        warmUp( false ), inIteration( false ), running( false ),
+        realTime( 0 ), cpuTime( 0 )
+        {
+        };
+
+      //True while another iteration should run. The first call starts a
+      //warm up iteration that is not timed.
+      bool KeepRunning()
+        {
+        if( inIteration )
+          {
+          PauseTiming();
+          iterations++;
+          inIteration = false;
+          }
+        warmUp = false;
+        if( !error.empty() )
+          {
+          return false;
+          }
+        if( !started )
+          {
+          started = true;
+          warmUp = true;
+          return true;
+          }
+        if( ( realTime >= minTime && iterations >= minIterations ) ||
+          iterations >= maxIterations )
+          {
+          return false;
+          }
+        inIteration = true;
+        ResumeTiming();
+        return true;
+        };
+
+      //True inside the warm up iteration
+      bool IsWarmUp() const
+        {
+        return warmUp;
+        };
+
+      //Exclude setup inside the loop from the timing
+      void PauseTiming()
+        {
+        if( running )
+          {
+          realTime += std::chrono::duration< double >( Clock::now() -
+            realStart ).count();
+          cpuTime += double( std::clock() - cpuStart ) / CLOCKS_PER_SEC;
+          running = false;
+          }
+        };
+
+      void ResumeTiming()
+        {
+        if( !running )
+          {
+          realStart = Clock::now();
+          cpuStart = std::clock();
+          running = true;
+          }
+        };
+
+      //User counter reported with the result, e.g. the mean time of a
+      //pipeline stage
+      void SetCounter( const std::string &name, double value )
+        {
+        counters[ name ] = value;
+        };
+
+      void SkipWithError( const std::string &message )
+        {
+        error = message;
+        };
+
+      //Number of completed timed iterations
+      long GetIterations() const
+        {
+        return iterations;
+        };
+
+    private:
+
+      friend class Benchmark;
+      typedef std::chrono::steady_clock Clock;
+
+      double minTime;
+      long minIterations;
+      long maxIterations;
+      long iterations;
+      bool started;
+      bool warmUp;
+      bool inIteration;
+      bool running;
+      double realTime;
+      double cpuTime;
+      Clock::time_point realStart;
+      std::clock_t cpuStart;
+      std::map< std::string, double > counters;
+      std::string error;
+    };
+
+  typedef std::function< void( State & ) > Function;
+
+  Benchmark() : minTime( 0.5 ), minIterations( 1 ), maxIterations( 1000000 )
+    {
+    };
+
+  void Register( const std::string &name, Function function )
+    {
+    benchmarks.push_back( std::make_pair( name, function ) );
+    };
+
+  //Only run benchmarks whose name matches the regular expression
+  void SetFilter( const std::string &regex )
+    {
+    filter = regex;
+    };
+
+  void SetMinTime( double seconds )
+    {
+    minTime = seconds;
+    };
+
+  void SetMinIterations( long n )
+    {
+    minIterations = std::max( 1L, n );
+    };
+
+  void SetMaxIterations( long n )
+    {
+    maxIterations = std::max( 1L, n );
+    };
+
+  //Run the selected benchmarks, printing a line per benchmark to out if
+  //not NULL
+  std::vector< Result > Run( std::ostream *out = &std::cout )
+    {
+    std::regex pattern( filter.empty() ? ".*" : filter );
+    std::vector< Result > results;
+    if( out != NULL )
+      {
+      *out << std::left << std::setw( 48 ) << "Benchmark" << std::right
+        << std::setw( 14 ) << "Time (ms)" << std::setw( 14 ) << "CPU (ms)"
+        << std::setw( 12 ) << "Iterations" << std::endl;
+      *out << std::string( 88, '-' ) << std::endl;
+      }
+    for( unsigned int i = 0; i < benchmarks.size(); i++ )
+      {
+      if( !std::regex_search( benchmarks[ i ].first, pattern ) )
+        {
+        continue;
+        }
+      State state( minTime, minIterations, maxIterations );
+      try
+        {
+        benchmarks[ i ].second( state );
+        }
+      catch( std::exception &e )
+        {
+        state.SkipWithError( e.what() );
+        }
+      catch( ... )
+        {
+        state.SkipWithError( "unknown exception" );
+        }
+      state.PauseTiming();
+
+      Result result;
+      result.name = benchmarks[ i ].first;
+      result.iterations = state.GetIterations();
+      result.counters = state.counters;
+      result.error = state.error;
+      if( result.iterations > 0 )
+        {
+        result.realTime = 1000 * state.realTime / result.iterations;
+        result.cpuTime = 1000 * state.cpuTime / result.iterations;
+        }
+      results.push_back( result );
+      if( out != NULL )
+        {
+        Print( *out, result );
+        }
+      }
+    return results;
+    };
+
+  //Google Benchmark compatible JSON
+  static void WriteJSON( std::ostream &out, const std::vector< Result > &results,
+    const std::string &executable )
+    {
+    std::time_t now = std::time( NULL );
+    char date[ 64 ];
+    std::strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%S", std::localtime( &now ) );
+
+    out << "{\n";
+    out << "  \"context\": {\n";
+    out << "    \"date\": \"" << date << "\",\n";
+    out << "    \"executable\": \"" << Escape( executable ) << "\",\n";
+    out << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+    out << "    \"library_build_type\": \"release\"\n";
+#else
+    out << "    \"library_build_type\": \"debug\"\n";
+#endif
+    out << "  },\n";
+    out << "  \"benchmarks\": [";
+    for( unsigned int i = 0; i < results.size(); i++ )
+      {
+      const Result &r = results[ i ];
+      out << ( i == 0 ? "\n" : ",\n" ) << "    {\n";
+      out << "      \"name\": \"" << Escape( r.name ) << "\",\n";
+      out << "      \"run_name\": \"" << Escape( r.name ) << "\",\n";
+      out << "      \"run_type\": \"iteration\",\n";
+      if( !r.error.empty() )
+        {
+        out << "      \"error_occurred\": true,\n";
+        out << "      \"error_message\": \"" << Escape( r.error ) << "\",\n";
+        }
+      out << "      \"iterations\": " << r.iterations << ",\n";
+      out << "      \"real_time\": " << Number( r.realTime ) << ",\n";
+      out << "      \"cpu_time\": " << Number( r.cpuTime ) << ",\n";
+      out << "      \"time_unit\": \"ms\"";
+      for( std::map< std::string, double >::const_iterator it =
+        r.counters.begin(); it != r.counters.end(); ++it )
+        {
+        out << ",\n      \"" << Escape( it->first ) << "\": " << Number( it->second );
+        }
+      out << "\n    }";
+      }
+    out << "\n  ]\n}\n";
+    };
+
+private:
+
+  std::vector< std::pair< std::string, Function > > benchmarks;
+  std::string filter;
+  double minTime;
+  long minIterations;
+  long maxIterations;
+
+  static void Print( std::ostream &out, const Result &r )
+    {
+    out << std::left << std::setw( 48 ) << r.name << std::right;
+    if( !r.error.empty() )
+      {
+      out << "  ERROR: " << r.error << std::endl;
+      return;
+      }
+    out << std::fixed << std::setprecision( 3 ) << std::setw( 14 ) << r.realTime
+      << std::setw( 14 ) << r.cpuTime << std::setw( 12 ) << r.iterations;
+    for( std::map< std::string, double >::const_iterator it =
+      r.counters.begin(); it != r.counters.end(); ++it )
+      {
+      out << "  " << it->first << "=" << it->second;
+      }
+    out << std::defaultfloat << std::endl;
+    };
+
+  static std::string Number( double v )
+    {
+    std::ostringstream s;
+    s << std::setprecision( 10 ) << v;
+    return s.str();
+    };
+
+  static std::string Escape( const std::string &s )
+    {
+    std::string e;
+    for( unsigned int i = 0; i < s.size(); i++ )
+      {
+      if( s[ i ] == '"' || s[ i ] == '\\' )
+        {
+        e += '\\';
+        }
+      e += s[ i ];
+      }
+    return e;
+    };
+
+};
+
+#endif
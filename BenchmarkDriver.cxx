@@ -0,0 +1,556 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Micro benchmarks of the estimator stages and of the display and
+//acquisition hot paths.
+//
+//  UltrasoundBenchmark [--benchmark_filter=<regex>]
+//    [--benchmark_min_time=<seconds>] [--benchmark_out=<file.json>]
+//    [--sizes=<w>x<h>,...] [--frames=<image>,...]
+//
+//Estimator benchmarks run on OcularPhantom frames of the given sizes and on
+//recorded frames (any format ImageIO reads, e.g. nrrd). The time of each
+//step of FitEye and FitNerve is reported as a counter in milliseconds.
+//Results are written as Google Benchmark JSON with --benchmark_out.
+//
+//With BENCHMARK_QT (GUI build) ITKQtHelpers::GetQImageColor is measured,
+//with BENCHMARK_SPECTROSCOPY (ITKUltrasound available) the RF filter chain
+//of SpectroscopyUI. OcularPhantom rendering is measured at each size.
+
+#include "Benchmark.h"
+#include "OpticNerveEstimator.hxx"
+#include "PTXDetector.hxx"
+#include "FrameRingBuffer.hxx"
+#include "ImageIO.h"
+#include "OcularPhantom.hxx"
+
+#ifdef BENCHMARK_QT
+#include "ITKQtHelpers.hxx"
+#endif
+
+#ifdef BENCHMARK_SPECTROSCOPY
+#include "itkCastImageFilter.h"
+#include "itkButterworthBandpass1DFilterFunction.h"
+#include "itkForward1DFFTImageFilter.h"
+#include "itkInverse1DFFTImageFilter.h"
+#include "itkFrequencyDomain1DImageFilter.h"
+#include "itkAbsImageFilter.h"
+#include "itkAddImageFilter.h"
+#include "itkMultiplyImageFilter.h"
+#include "itkBinaryThresholdImageFilter.h"
+#include "itkLog10ImageFilter.h"
+#endif
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef OpticNerveEstimator::ImageType ImageType;
+typedef itk::Image< unsigned char, 2 > BModeImageType;
+typedef itk::Image< short, 2 > RFImageType;
+typedef itk::Image< short, 3 > RFImageType3d;
+
+struct Frame
+  {
+  std::string name;
+  ImageType::Pointer image;
+  };
+
+template < typename TImage >
+typename TImage::Pointer CreateImage( int width, int height )
+{
+  typename TImage::Pointer image = TImage::New();
+  typename TImage::RegionType region;
+  region.SetIndex( 0, 0 );
+  region.SetIndex( 1, 0 );
+  region.SetSize( 0, width );
+  region.SetSize( 1, height );
+  image->SetRegions( region );
+  image->Allocate();
+  return image;
+}
+
+//Phantom frame with the geometry scaled to the image size
+ImageType::Pointer CreateSyntheticFrame( int width, int height, unsigned int seed )
+{
+  OcularPhantom< ImageType > phantom;
+  phantom.SetImageSize( width, height );
+  return phantom.Render( seed );
+}
+
+void ReportStageTimes( Benchmark::State &state,
+  const OpticNerveEstimator::StageTimes &sum, const std::vector< int > &counts )
+{
+  for( int i = 0; i < OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES; i++ )
+    {
+    if( counts[ i ] > 0 )
+      {
+      state.SetCounter( std::string( OpticNerveEstimator::StageTimes::GetName( i ) ) + "_ms",
+        1000 * sum.seconds[ i ] / counts[ i ] );
+      }
+    }
+}
+
+//Sum of the step times, skipping the warm up iteration
+void AccumulateStageTimes( const Benchmark::State &state,
+  const OpticNerveEstimator::StageTimes &times,
+  OpticNerveEstimator::StageTimes &sum, std::vector< int > &counts )
+{
+  if( state.IsWarmUp() )
+    {
+    return;
+    }
+  for( int i = 0; i < OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES; i++ )
+    {
+    if( times.seconds[ i ] >= 0 )
+      {
+      sum.seconds[ i ] = ( counts[ i ] == 0 ? 0 : sum.seconds[ i ] ) + times.seconds[ i ];
+      counts[ i ]++;
+      }
+    }
+}
+
+void RegisterEstimator( Benchmark &suite, const Frame &frame )
+{
+  const ImageType::Pointer image = frame.image;
+
+  suite.Register( "OpticNerveEstimator/Fit/" + frame.name,
+    [ image ]( Benchmark::State &state )
+    {
+    OpticNerveEstimator::StageTimes sum;
+    std::vector< int > counts( OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES, 0 );
+    long successes = 0;
+    while( state.KeepRunning() )
+      {
+      OpticNerveEstimator estimator;
+      if( estimator.Fit( image ) == OpticNerveEstimator::ESTIMATION_SUCCESS &&
+        !state.IsWarmUp() )
+        {
+        successes++;
+        }
+      AccumulateStageTimes( state, estimator.GetStageTimes(), sum, counts );
+      }
+    ReportStageTimes( state, sum, counts );
+    state.SetCounter( "success_rate",
+      successes / std::max( 1.0, ( double )state.GetIterations() ) );
+    } );
+
+  for( int factor = 2; factor <= 4; factor *= 2 )
+    {
+    std::ostringstream name;
+    name << "OpticNerveEstimator/FitDecimated" << factor << "/" << frame.name;
+    suite.Register( name.str(), [ image, factor ]( Benchmark::State &state )
+      {
+      OpticNerveEstimator::StageTimes sum;
+      std::vector< int > counts( OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES, 0 );
+      long successes = 0;
+      while( state.KeepRunning() )
+        {
+        OpticNerveEstimator estimator;
+        if( estimator.FitDecimated( image, factor ) ==
+          OpticNerveEstimator::ESTIMATION_SUCCESS && !state.IsWarmUp() )
+          {
+          successes++;
+          }
+        AccumulateStageTimes( state, estimator.GetStageTimes(), sum, counts );
+        }
+      ReportStageTimes( state, sum, counts );
+      state.SetCounter( "success_rate",
+        successes / std::max( 1.0, ( double )state.GetIterations() ) );
+      } );
+    }
+
+  suite.Register( "OpticNerveEstimator/FitEye/" + frame.name,
+    [ image ]( Benchmark::State &state )
+    {
+    OpticNerveEstimator::StageTimes sum;
+    std::vector< int > counts( OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES, 0 );
+    while( state.KeepRunning() )
+      {
+      OpticNerveEstimator estimator;
+      estimator.FitEye( image, true, "" );
+      AccumulateStageTimes( state, estimator.GetStageTimes(), sum, counts );
+      }
+    ReportStageTimes( state, sum, counts );
+    } );
+
+  suite.Register( "OpticNerveEstimator/FitNerve/" + frame.name,
+    [ image ]( Benchmark::State &state )
+    {
+    //Nerve region from the eye, outside of the timing
+    OpticNerveEstimator eyeEstimator;
+    ImageType::RegionType region;
+    if( !eyeEstimator.FitEye( image, false, "" ) ||
+      !eyeEstimator.ComputeNerveRegion( eyeEstimator.GetEye(),
+      image->GetLargestPossibleRegion(), region ) )
+      {
+      state.SkipWithError( "eye fit failed, no nerve region" );
+      return;
+      }
+    OpticNerveEstimator::StageTimes sum;
+    std::vector< int > counts( OpticNerveEstimator::StageTimes::NUMBER_OF_STAGES, 0 );
+    while( state.KeepRunning() )
+      {
+      OpticNerveEstimator estimator;
+      ImageType::RegionType nerveRegion = region;
+      estimator.FitNerve( image, nerveRegion, true, "" );
+      AccumulateStageTimes( state, estimator.GetStageTimes(), sum, counts );
+      }
+    ReportStageTimes( state, sum, counts );
+    } );
+}
+
+void RegisterDisplay( Benchmark &suite, int width, int height )
+{
+  std::ostringstream name;
+  name << width << "x" << height;
+
+  suite.Register( "OcularPhantom/Render/" + name.str(),
+    [ width, height ]( Benchmark::State &state )
+    {
+    OcularPhantom< ImageType > phantom;
+    phantom.SetImageSize( width, height );
+    phantom.parameters.jitter = 0.05;
+    ImageType::Pointer image;
+    uint32_t seed = 0;
+    while( state.KeepRunning() )
+      {
+      phantom.Render( image, seed++ );
+      }
+    } );
+
+  //M-mode: depth along x, time along y
+  suite.Register( "PTXDetector/DetectMMode/" + name.str(),
+    [ width, height ]( Benchmark::State &state )
+    {
+    typedef PTXDetector< double > PTXDetectorType;
+    PTXDetectorType::ImageType2d::Pointer mmode =
+      CreateImage< PTXDetectorType::ImageType2d >( width, height );
+    std::mt19937 generator( 7 );
+    std::uniform_real_distribution< double > uniform( 0, 255 );
+    double *p = mmode->GetBufferPointer();
+    for( size_t i = 0; i < mmode->GetPixelContainer()->Size(); i++ )
+      {
+      p[ i ] = uniform( generator );
+      }
+    while( state.KeepRunning() )
+      {
+      PTXDetectorType::RGBImageTypePointer overlay =
+        PTXDetectorType::DetectMMode( mmode );
+      }
+    } );
+
+#ifdef BENCHMARK_QT
+  suite.Register( "ITKQtHelpers/GetQImageColor/" + name.str(),
+    [ width, height ]( Benchmark::State &state )
+    {
+    BModeImageType::Pointer bmode = CreateImage< BModeImageType >( width, height );
+    unsigned char *p = bmode->GetBufferPointer();
+    for( size_t i = 0; i < bmode->GetPixelContainer()->Size(); i++ )
+      {
+      p[ i ] = ( unsigned char )( i * 31 );
+      }
+    while( state.KeepRunning() )
+      {
+      QImage image = ITKQtHelpers::GetQImageColor< BModeImageType >( bmode,
+        bmode->GetLargestPossibleRegion(), QImage::Format_RGB16 );
+      }
+    } );
+#endif
+}
+
+RFImageType::Pointer CreateRFFrame( int samples, int lines, unsigned int seed )
+{
+  RFImageType::Pointer rf = CreateImage< RFImageType >( samples, lines );
+  std::mt19937 generator( seed );
+  std::normal_distribution< double > noise( 0, 200 );
+  short *p = rf->GetBufferPointer();
+  for( int l = 0; l < lines; l++ )
+    {
+    for( int s = 0; s < samples; s++ )
+      {
+      const double echo = 2000 * std::exp( -s / ( 0.5 * samples ) ) *
+        std::sin( 0.6 * s );
+      *p++ = ( short )std::max( -32768.0, std::min( 32767.0, echo + noise( generator ) ) );
+      }
+    }
+  return rf;
+}
+
+void RegisterAcquisition( Benchmark &suite, int samples, int lines, int ringSize )
+{
+  std::ostringstream name;
+  name << samples << "x" << lines;
+
+  //Push: acquisition callback copying a frame into the ring
+  suite.Register( "FrameRingBuffer/Add/" + name.str(),
+    [ samples, lines, ringSize ]( Benchmark::State &state )
+    {
+    FrameRingBuffer< RFImageType > ring( ringSize );
+    RFImageType::SizeType size;
+    size[ 0 ] = samples;
+    size[ 1 ] = lines;
+    ring.Allocate( size );
+    RFImageType::Pointer frame = CreateRFFrame( samples, lines, 1 );
+    while( state.KeepRunning() )
+      {
+      ring.Add( frame->GetBufferPointer() );
+      }
+    } );
+
+  //Pop: reader taking a copy of the most recent frame
+  suite.Register( "FrameRingBuffer/GetImageAbsolute/" + name.str(),
+    [ samples, lines, ringSize ]( Benchmark::State &state )
+    {
+    FrameRingBuffer< RFImageType > ring( ringSize );
+    RFImageType::SizeType size;
+    size[ 0 ] = samples;
+    size[ 1 ] = lines;
+    ring.Allocate( size );
+    RFImageType::Pointer frame = CreateRFFrame( samples, lines, 1 );
+    for( int i = 0; i < ringSize; i++ )
+      {
+      ring.Add( frame->GetBufferPointer() );
+      }
+    while( state.KeepRunning() )
+      {
+      RFImageType::Pointer copy =
+        ring.GetImageAbsolute( ring.GetNumberOfFrames() - 1 );
+      }
+    } );
+
+  //Ordered snapshot of the whole ring into a 3D image, the work of
+  //IntersonArrayDeviceRF::GetRingBufferRFOrdered
+  std::ostringstream orderedName;
+  orderedName << "FrameRingBuffer/GetRingBufferRFOrdered/" << ringSize << "x" << name.str();
+  suite.Register( orderedName.str(),
+    [ samples, lines, ringSize ]( Benchmark::State &state )
+    {
+    FrameRingBuffer< RFImageType > ring( ringSize );
+    RFImageType::SizeType size;
+    size[ 0 ] = samples;
+    size[ 1 ] = lines;
+    ring.Allocate( size );
+    RFImageType::Pointer frame = CreateRFFrame( samples, lines, 1 );
+    for( int i = 0; i < ringSize + 3; i++ )
+      {
+      ring.Add( frame->GetBufferPointer() );
+      }
+    while( state.KeepRunning() )
+      {
+      RFImageType3d::Pointer image = RFImageType3d::New();
+      RFImageType3d::RegionType region;
+      region.SetIndex( 0, 0 );
+      region.SetIndex( 1, 0 );
+      region.SetIndex( 2, 0 );
+      region.SetSize( 0, samples );
+      region.SetSize( 1, lines );
+      region.SetSize( 2, ringSize );
+      image->SetRegions( region );
+      image->Allocate();
+      ring.CopyOrdered( image->GetBufferPointer(), samples * lines,
+        ringSize );
+      }
+    } );
+
+#ifdef BENCHMARK_SPECTROSCOPY
+  //RF display chain of SpectroscopyUI: band pass in the frequency domain,
+  //then sign( rf ) * log10( 1 + |rf| )
+  suite.Register( "Spectroscopy/RFFilterChain/" + name.str(),
+    [ samples, lines ]( Benchmark::State &state )
+    {
+    typedef itk::Image< double, 2 > RealImageType;
+    typedef itk::CastImageFilter< RFImageType, RealImageType > CastFilter;
+    typedef itk::Forward1DFFTImageFilter< RealImageType > ForwardFFTFilter;
+    typedef itk::FrequencyDomain1DImageFilter< ForwardFFTFilter::OutputImageType > FrequencyFilter;
+    typedef itk::Inverse1DFFTImageFilter< ForwardFFTFilter::OutputImageType, RealImageType > InverseFFTFilter;
+    typedef itk::BinaryThresholdImageFilter< RealImageType, RealImageType > ThresholdFilter;
+    typedef itk::AbsImageFilter< RealImageType, RealImageType > AbsFilter;
+    typedef itk::AddImageFilter< RealImageType > AddFilter;
+    typedef itk::Log10ImageFilter< RealImageType, RealImageType > LogFilter;
+    typedef itk::MultiplyImageFilter< RealImageType > MultiplyFilter;
+
+    CastFilter::Pointer cast = CastFilter::New();
+    ForwardFFTFilter::Pointer forward = ForwardFFTFilter::New();
+    forward->SetInput( cast->GetOutput() );
+    itk::ButterworthBandpass1DFilterFunction::Pointer bandpass =
+      itk::ButterworthBandpass1DFilterFunction::New();
+    bandpass->SetLowerFrequency( 0.1 );
+    bandpass->SetUpperFrequency( 0.6 );
+    FrequencyFilter::Pointer frequency = FrequencyFilter::New();
+    frequency->SetFilterFunction( bandpass );
+    frequency->SetInput( forward->GetOutput() );
+    InverseFFTFilter::Pointer inverse = InverseFFTFilter::New();
+    inverse->SetInput( frequency->GetOutput() );
+    ThresholdFilter::Pointer threshold = ThresholdFilter::New();
+    threshold->SetLowerThreshold( 0 );
+    threshold->SetInsideValue( 1 );
+    threshold->SetOutsideValue( -1 );
+    threshold->SetInput( inverse->GetOutput() );
+    AbsFilter::Pointer abs = AbsFilter::New();
+    abs->SetInput( inverse->GetOutput() );
+    AddFilter::Pointer add = AddFilter::New();
+    add->SetConstant2( 1 );
+    add->SetInput( abs->GetOutput() );
+    LogFilter::Pointer log = LogFilter::New();
+    log->SetInput( add->GetOutput() );
+    MultiplyFilter::Pointer multiply = MultiplyFilter::New();
+    multiply->SetInput1( log->GetOutput() );
+    multiply->SetInput2( threshold->GetOutput() );
+
+    unsigned int seed = 0;
+    while( state.KeepRunning() )
+      {
+      state.PauseTiming();
+      RFImageType::Pointer rf = CreateRFFrame( samples, lines, seed++ );
+      state.ResumeTiming();
+      cast->SetInput( rf );
+      multiply->Update();
+      }
+    } );
+#endif
+}
+
+std::vector< std::string > Split( const std::string &s, char separator )
+{
+  std::vector< std::string > parts;
+  std::stringstream stream( s );
+  std::string part;
+  while( std::getline( stream, part, separator ) )
+    {
+    if( !part.empty() )
+      {
+      parts.push_back( part );
+      }
+    }
+  return parts;
+}
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+int main( int argc, char **argv )
+{
+  Benchmark suite;
+  std::string outFile;
+  std::string sizes = "256x192,512x384,1024x768";
+  std::string frames;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    if( GetFlag( arg, "benchmark_filter", value ) )
+      {
+      suite.SetFilter( value );
+      }
+    else if( GetFlag( arg, "benchmark_min_time", value ) )
+      {
+      suite.SetMinTime( std::atof( value.c_str() ) );
+      }
+    else if( GetFlag( arg, "benchmark_out", value ) )
+      {
+      outFile = value;
+      }
+    else if( GetFlag( arg, "sizes", value ) )
+      {
+      sizes = value;
+      }
+    else if( GetFlag( arg, "frames", value ) )
+      {
+      frames = value;
+      }
+    else
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--benchmark_filter=<regex>]"
+        << " [--benchmark_min_time=<seconds>] [--benchmark_out=<file.json>]"
+        << " [--sizes=<w>x<h>,...] [--frames=<image>,...]" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::vector< std::string > sizeList = Split( sizes, ',' );
+  for( unsigned int i = 0; i < sizeList.size(); i++ )
+    {
+    int width = 0;
+    int height = 0;
+    if( std::sscanf( sizeList[ i ].c_str(), "%dx%d", &width, &height ) != 2 ||
+      width <= 0 || height <= 0 )
+      {
+      std::cerr << "Invalid size: " << sizeList[ i ] << std::endl;
+      return EXIT_FAILURE;
+      }
+    Frame frame;
+    frame.name = "synthetic/" + sizeList[ i ];
+    frame.image = CreateSyntheticFrame( width, height, 1 );
+    RegisterEstimator( suite, frame );
+    RegisterDisplay( suite, width, height );
+    }
+
+  std::vector< std::string > frameList = Split( frames, ',' );
+  for( unsigned int i = 0; i < frameList.size(); i++ )
+    {
+    Frame frame;
+    frame.name = "recorded/" + frameList[ i ];
+    try
+      {
+      frame.image = ImageIO< ImageType >::ReadImageMapped( frameList[ i ] );
+      }
+    catch( itk::ExceptionObject &e )
+      {
+      std::cerr << "Could not read " << frameList[ i ] << ": " << e << std::endl;
+      return EXIT_FAILURE;
+      }
+    RegisterEstimator( suite, frame );
+    }
+
+  //Interson RF frames: 2048 samples by 127 lines
+  RegisterAcquisition( suite, 2048, 127, 32 );
+  RegisterAcquisition( suite, 1024, 127, 128 );
+
+  std::vector< Benchmark::Result > results = suite.Run();
+
+  if( !outFile.empty() )
+    {
+    std::ofstream out( outFile.c_str() );
+    if( !out )
+      {
+      std::cerr << "Could not write " << outFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    Benchmark::WriteJSON( out, results, argv[ 0 ] );
+    }
+
+  return EXIT_SUCCESS;
+}
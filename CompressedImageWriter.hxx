@@ -0,0 +1,200 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef COMPRESSEDIMAGEWRITER_H
+#define COMPRESSEDIMAGEWRITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ImageIO.h"
+#include "RFCompression.h"
+
+//Writes images on background threads so recording never waits on the
+//disk or the codec.
+//
+//Files ending in ".rfz" are compressed with RFCompression (lossless unless
+//a maximum error is set), everything else goes through ImageIO::saveImage.
+//Queued images must not be modified by the caller after Write, the device
+//Get*Image calls return copies so this holds for frames grabbed from the
+//ring buffers.
+template <typename TImage>
+class CompressedImageWriter
+{
+
+public:
+
+  typedef TImage Image;
+  typedef typename Image::Pointer ImagePointer;
+
+  CompressedImageWriter( int numberOfThreads = 1, int maxQueueLength = 64 )
+    : maxError( 0 ), maxQueued( maxQueueLength ), nWritten( 0 ),
+    nFailed( 0 ), stop( false ), nBusy( 0 )
+    {
+    for( int i = 0; i < std::max( 1, numberOfThreads ); i++ )
+      {
+      threads.push_back( std::thread( &CompressedImageWriter::Run, this ) );
+      }
+    };
+
+  ~CompressedImageWriter()
+    {
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      stop = true;
+      }
+    hasWork.notify_all();
+    for( unsigned int i = 0; i < threads.size(); i++ )
+      {
+      threads[ i ].join();
+      }
+    };
+
+  //Bounded error for quantized compression, 0 for lossless
+  void SetMaximumError( int e )
+    {
+    maxError = e;
+    };
+
+  int GetMaximumError()
+    {
+    return maxError;
+    };
+
+  //Queue an image for writing. Blocks only if the queue is full, which
+  //means the disk can not keep up.
+  void Write( ImagePointer image, const std::string &filename )
+    {
+    std::unique_lock< std::mutex > lock( mutex );
+    hasSpace.wait( lock, [ this ] { return (int)queue.size() < maxQueued; } );
+    queue.push_back( Job( image, filename ) );
+    lock.unlock();
+    hasWork.notify_one();
+    };
+
+  //Block until everything queued so far is on disk
+  void Flush()
+    {
+    std::unique_lock< std::mutex > lock( mutex );
+    isIdle.wait( lock, [ this ] { return queue.empty() && nBusy == 0; } );
+    };
+
+  int GetNumberOfQueuedImages()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return queue.size() + nBusy;
+    };
+
+  long GetNumberOfImagesWritten()
+    {
+    return nWritten;
+    };
+
+  long GetNumberOfFailures()
+    {
+    return nFailed;
+    };
+
+private:
+
+  struct Job
+    {
+    Job( ImagePointer i, const std::string &f ) : image( i ), filename( f ) {};
+    ImagePointer image;
+    std::string filename;
+    };
+
+  std::atomic< int > maxError;
+  int maxQueued;
+  std::atomic< long > nWritten;
+  std::atomic< long > nFailed;
+
+  bool stop;
+  int nBusy;
+  std::deque< Job > queue;
+  std::mutex mutex;
+  std::condition_variable hasWork;
+  std::condition_variable hasSpace;
+  std::condition_variable isIdle;
+  std::vector< std::thread > threads;
+
+  void Run()
+    {
+    while( true )
+      {
+      std::unique_lock< std::mutex > lock( mutex );
+      hasWork.wait( lock, [ this ] { return stop || !queue.empty(); } );
+      if( queue.empty() )
+        {
+        return;
+        }
+      Job job = queue.front();
+      queue.pop_front();
+      nBusy++;
+      lock.unlock();
+      hasSpace.notify_one();
+
+      bool success = true;
+      try
+        {
+        if( CompressedImageDispatch< Image >::IsCompressedFilename(
+          job.filename ) )
+          {
+          success = CompressedImageDispatch< Image >::WriteImage( job.image,
+            job.filename, maxError );
+          }
+        else
+          {
+          ImageIO< Image >::saveImage( job.image, job.filename );
+          }
+        }
+      catch( ... )
+        {
+        success = false;
+        }
+      if( success )
+        {
+        nWritten++;
+        }
+      else
+        {
+        nFailed++;
+        std::cerr << "Failed to write " << job.filename << std::endl;
+        }
+
+      lock.lock();
+      nBusy--;
+      if( queue.empty() && nBusy == 0 )
+        {
+        isIdle.notify_all();
+        }
+      }
+    };
+
+};
+
+#endif
@@ -0,0 +1,256 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef DISTANCETRANSFORM_H
+#define DISTANCETRANSFORM_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "ParallelRows.h"
+
+//Exact Euclidean distance transform of 2D masks in linear time
+//(Felzenszwalb and Huttenlocher, separable lower envelope of parabolas).
+//
+//Replacement for ApproximateSignedDistanceMapImageFilter followed by
+//MinimumMaximumImageCalculator where only the positive part (outside the
+//object) and its maximum are used:
+//  - distances are in physical units (anisotropic spacing supported)
+//  - like the iso contour of the ITK filter the boundary lies half a pixel
+//    from the object, outside pixels get the distance to the nearest
+//    object pixel center minus half the smallest spacing
+//  - object pixels get 0 instead of a negative distance
+//  - the maximum and its first index in raster order (same tie breaking
+//    as MinimumMaximumImageCalculator) are found in the column pass
+//
+//Rows and then columns are processed in parallel with ParallelRows.
+template < typename TMaskImage >
+class DistanceTransform
+{
+
+public:
+
+  typedef TMaskImage MaskImageType;
+  typedef typename MaskImageType::Pointer MaskImagePointer;
+  typedef typename MaskImageType::PixelType MaskPixelType;
+  typedef typename MaskImageType::IndexType IndexType;
+  typedef itk::Image< float, 2 > DistanceImageType;
+  typedef DistanceImageType::Pointer DistanceImagePointer;
+
+  struct Result
+    {
+    //Largest distance, 0 if the mask has no object or no background pixels
+    double maximum;
+    //Index of the maximum in the index space of the mask
+    IndexType index;
+    //Distance map if requested
+    DistanceImagePointer distance;
+    };
+
+  //Distance of all pixels not equal to insideValue to the object formed by
+  //the pixels equal to insideValue
+  static Result Compute( const MaskImageType *mask, MaskPixelType insideValue,
+    bool createDistanceImage = false, int nThreads = 0 )
+    {
+    static_assert( MaskImageType::ImageDimension == 2,
+      "DistanceTransform supports 2D images only" );
+
+    const typename MaskImageType::RegionType region = mask->GetBufferedRegion();
+    const int width = region.GetSize()[ 0 ];
+    const int height = region.GetSize()[ 1 ];
+    const double sx = mask->GetSpacing()[ 0 ];
+    const double sy = mask->GetSpacing()[ 1 ];
+    const MaskPixelType *in = mask->GetBufferPointer();
+    const double infinity = std::numeric_limits< double >::max() / 4;
+
+    Result result;
+    result.maximum = 0;
+    result.index = region.GetIndex();
+
+    //Squared distance along the rows, two linear scans per row
+    std::vector< double > rowDistance( ( size_t )width * height );
+    ParallelRows::For( 0, height, [ & ]( int y0, int y1, int )
+      {
+      for( int y = y0; y < y1; y++ )
+        {
+        const MaskPixelType *row = in + ( size_t )y * width;
+        double *d = &rowDistance[ ( size_t )y * width ];
+        int last = -1;
+        for( int x = 0; x < width; x++ )
+          {
+          if( row[ x ] == insideValue )
+            {
+            last = x;
+            }
+          d[ x ] = last < 0 ? infinity : ( x - last ) * sx;
+          }
+        last = -1;
+        for( int x = width - 1; x >= 0; x-- )
+          {
+          if( row[ x ] == insideValue )
+            {
+            last = x;
+            }
+          if( last >= 0 )
+            {
+            d[ x ] = std::min( d[ x ], ( last - x ) * sx );
+            }
+          d[ x ] = d[ x ] < infinity ? d[ x ] * d[ x ] : infinity;
+          }
+        }
+      }, nThreads );
+
+    //Lower envelope along the columns, per chunk maximum
+    const int nChunks = ParallelRows::GetNumberOfChunks( width, nThreads );
+    std::vector< double > chunkMaximum( nChunks, -1 );
+    std::vector< size_t > chunkIndex( nChunks, 0 );
+    ParallelRows::For( 0, width, [ & ]( int x0, int x1, int chunk )
+      {
+      std::vector< double > f( height );
+      std::vector< double > d( height );
+      std::vector< int > v( height );
+      std::vector< double > z( height + 1 );
+      double maximum = -1;
+      size_t maximumIndex = 0;
+      for( int x = x0; x < x1; x++ )
+        {
+        for( int y = 0; y < height; y++ )
+          {
+          f[ y ] = rowDistance[ ( size_t )y * width + x ];
+          }
+        LowerEnvelope( f, d, v, z, sy, infinity );
+        for( int y = 0; y < height; y++ )
+          {
+          rowDistance[ ( size_t )y * width + x ] = d[ y ];
+          const size_t offset = ( size_t )y * width + x;
+          if( d[ y ] < infinity &&
+            ( d[ y ] > maximum || ( d[ y ] == maximum && offset < maximumIndex ) ) )
+            {
+            maximum = d[ y ];
+            maximumIndex = offset;
+            }
+          }
+        }
+      chunkMaximum[ chunk ] = maximum;
+      chunkIndex[ chunk ] = maximumIndex;
+      }, nThreads );
+
+    double maximum = -1;
+    size_t maximumIndex = 0;
+    for( int i = 0; i < nChunks; i++ )
+      {
+      if( chunkMaximum[ i ] > maximum ||
+        ( chunkMaximum[ i ] == maximum && chunkIndex[ i ] < maximumIndex ) )
+        {
+        maximum = chunkMaximum[ i ];
+        maximumIndex = chunkIndex[ i ];
+        }
+      }
+    const double halfPixel = 0.5 * std::min( sx, sy );
+    if( maximum > 0 )
+      {
+      result.maximum = std::max( 0.0, std::sqrt( maximum ) - halfPixel );
+      result.index[ 0 ] += maximumIndex % width;
+      result.index[ 1 ] += maximumIndex / width;
+      }
+
+    if( createDistanceImage )
+      {
+      result.distance = DistanceImageType::New();
+      typename DistanceImageType::RegionType outRegion;
+      outRegion.SetIndex( 0, region.GetIndex()[ 0 ] );
+      outRegion.SetIndex( 1, region.GetIndex()[ 1 ] );
+      outRegion.SetSize( 0, width );
+      outRegion.SetSize( 1, height );
+      result.distance->SetRegions( outRegion );
+      result.distance->SetSpacing( mask->GetSpacing() );
+      result.distance->SetOrigin( mask->GetOrigin() );
+      result.distance->SetDirection( mask->GetDirection() );
+      result.distance->Allocate();
+      float *out = result.distance->GetBufferPointer();
+      for( size_t i = 0; i < rowDistance.size(); i++ )
+        {
+        const double d = rowDistance[ i ];
+        out[ i ] = d > 0 && d < infinity ?
+          std::max( 0.0, std::sqrt( d ) - halfPixel ) : 0;
+        }
+      }
+    return result;
+    };
+
+private:
+
+  //1D squared distance transform of f with sample spacing s:
+  //  d( p ) = min_q f( q ) + ( s ( p - q ) )^2
+  static void LowerEnvelope( const std::vector< double > &f,
+    std::vector< double > &d, std::vector< int > &v, std::vector< double > &z,
+    double s, double infinity )
+    {
+    const int n = f.size();
+    const double s2 = s * s;
+    int k = -1;
+    for( int q = 0; q < n; q++ )
+      {
+      if( f[ q ] >= infinity )
+        {
+        continue;
+        }
+      double intersection = 0;
+      while( k >= 0 )
+        {
+        const int p = v[ k ];
+        intersection = ( ( f[ q ] + s2 * q * q ) - ( f[ p ] + s2 * p * p ) ) /
+          ( 2 * s2 * ( q - p ) );
+        if( intersection > z[ k ] )
+          {
+          break;
+          }
+        k--;
+        }
+      k++;
+      v[ k ] = q;
+      z[ k ] = k == 0 ? -infinity : intersection;
+      z[ k + 1 ] = infinity;
+      }
+
+    if( k < 0 )
+      {
+      std::fill( d.begin(), d.end(), infinity );
+      return;
+      }
+    int j = 0;
+    for( int q = 0; q < n; q++ )
+      {
+      while( z[ j + 1 ] < q )
+        {
+        j++;
+        }
+      const double dq = s * ( q - v[ j ] );
+      d[ q ] = dq * dq + f[ v[ j ] ];
+      }
+    };
+
+};
+
+#endif
@@ -0,0 +1,412 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef ELLIPSETEMPLATECACHE_H
+#define ELLIPSETEMPLATECACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include "itkImage.h"
+#include "itkContinuousIndex.h"
+
+#include "ITKFilterFunctions.h"
+
+//Cache of the ring templates and registration masks used by
+//OpticNerveEstimator::FitEye.
+//
+//Templates only depend on the radii, the pixel spacing and the ring
+//parameters, the eye center only shifts them. Radii are quantized (in
+//pixels) and each template is built once into a small patch centered on
+//the ellipse: ring rasterized with 4x4 supersampling, Gauss smoothed,
+//thresholded and rescaled like the per frame pipeline. A lookup then only
+//pastes the patch into an image of the frame geometry, with bilinear sub
+//pixel shift for the ring and nearest neighbor for the mask.
+//
+//The cache is thread safe and shared by all estimators (GetShared).
+//Templates are built outside the lock, the least recently used entries
+//are evicted once more than GetMaximumNumberOfEntries are held.
+class EllipseTemplateCache
+{
+
+public:
+
+  typedef itk::Image< float, 2 > ImageType;
+
+  struct Parameters
+    {
+    //Radii of the inner ellipse of the ring (physical units)
+    double radiusX;
+    double radiusY;
+    //Outer radii are ringFactor times the inner radii
+    double ringFactor;
+    //Smoothing sigma in pixels
+    double blurFactor;
+    //Smoothed ring values above threshold are set to 100
+    double threshold;
+    //Quantization of the radii in pixels
+    double radiusStep;
+    };
+
+  EllipseTemplateCache( size_t maxEntries = 32 )
+    : maxNumberOfEntries( maxEntries ), nHits( 0 ), nMisses( 0 )
+    {
+    };
+
+  //Cache shared by all estimators of the process
+  static EllipseTemplateCache &GetShared()
+    {
+    static EllipseTemplateCache shared;
+    return shared;
+    };
+
+  void SetMaximumNumberOfEntries( size_t n )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    maxNumberOfEntries = std::max< size_t >( 1, n );
+    Evict();
+    };
+
+  size_t GetMaximumNumberOfEntries()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return maxNumberOfEntries;
+    };
+
+  size_t GetNumberOfEntries()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return entries.size();
+    };
+
+  long GetNumberOfHits()
+    {
+    return nHits;
+    };
+
+  long GetNumberOfMisses()
+    {
+    return nMisses;
+    };
+
+  void Clear()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    entries.clear();
+    lru.clear();
+    };
+
+  //Ring template (0 - 100) and mask (0 / 100, ellipse halfway between the
+  //inner and outer ring radii) centered at center, with the geometry of
+  //reference. Returned images are new and can be modified.
+  void GetTemplates( const ImageType *reference,
+    const ImageType::PointType &center, const Parameters &params,
+    ImageType::Pointer &ring, ImageType::Pointer &mask )
+    {
+    const ImageType::SpacingType spacing = reference->GetSpacing();
+    const double step = params.radiusStep > 0 ? params.radiusStep : 0.5;
+
+    Key key;
+    key.radiusX = std::max( 1L,
+      ( long )std::floor( params.radiusX / spacing[ 0 ] / step + 0.5 ) );
+    key.radiusY = std::max( 1L,
+      ( long )std::floor( params.radiusY / spacing[ 1 ] / step + 0.5 ) );
+    key.step = step;
+    key.spacingX = spacing[ 0 ];
+    key.spacingY = spacing[ 1 ];
+    key.ringFactor = params.ringFactor;
+    key.blurFactor = params.blurFactor;
+    key.threshold = params.threshold;
+
+    EntryPointer entry = Find( key );
+    if( !entry )
+      {
+      nMisses++;
+      entry = Build( key );
+      entry = Insert( key, entry );
+      }
+    else
+      {
+      nHits++;
+      }
+
+    itk::ContinuousIndex< double, 2 > centerIndex;
+    reference->TransformPhysicalPointToContinuousIndex( center, centerIndex );
+    ring = Paste( reference, entry->ring, centerIndex, true );
+    mask = Paste( reference, entry->mask, centerIndex, false );
+    };
+
+private:
+
+  struct Key
+    {
+    long radiusX;
+    long radiusY;
+    double step;
+    double spacingX;
+    double spacingY;
+    double ringFactor;
+    double blurFactor;
+    double threshold;
+
+    bool operator<( const Key &o ) const
+      {
+      return std::tie( radiusX, radiusY, step, spacingX, spacingY,
+        ringFactor, blurFactor, threshold ) <
+        std::tie( o.radiusX, o.radiusY, o.step, o.spacingX, o.spacingY,
+        o.ringFactor, o.blurFactor, o.threshold );
+      };
+    };
+
+  //Patches are centered on the ellipse center, pixel ( halfX, halfY )
+  struct Entry
+    {
+    ImageType::Pointer ring;
+    ImageType::Pointer mask;
+    };
+  typedef std::shared_ptr< const Entry > EntryPointer;
+  typedef std::list< Key > LRUList;
+
+  struct Item
+    {
+    EntryPointer entry;
+    LRUList::iterator position;
+    };
+
+  std::map< Key, Item > entries;
+  LRUList lru;
+  size_t maxNumberOfEntries;
+  std::atomic< long > nHits;
+  std::atomic< long > nMisses;
+  std::mutex mutex;
+
+  EntryPointer Find( const Key &key )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    std::map< Key, Item >::iterator it = entries.find( key );
+    if( it == entries.end() )
+      {
+      return EntryPointer();
+      }
+    lru.splice( lru.begin(), lru, it->second.position );
+    return it->second.entry;
+    };
+
+  //Another thread may have built the same template in the meantime, the
+  //first one inserted wins
+  EntryPointer Insert( const Key &key, EntryPointer entry )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    std::map< Key, Item >::iterator it = entries.find( key );
+    if( it != entries.end() )
+      {
+      return it->second.entry;
+      }
+    lru.push_front( key );
+    Item item;
+    item.entry = entry;
+    item.position = lru.begin();
+    entries[ key ] = item;
+    Evict();
+    return entry;
+    };
+
+  void Evict()
+    {
+    while( entries.size() > maxNumberOfEntries )
+      {
+      entries.erase( lru.back() );
+      lru.pop_back();
+      }
+    };
+
+  static EntryPointer Build( const Key &key )
+    {
+    //Radii in pixels
+    const double r1 = key.radiusX * key.step;
+    const double r2 = key.radiusY * key.step;
+    const double rf = key.ringFactor;
+    const double rm = ( rf + 1 ) / 2;
+    const int halfX = ( int )std::ceil( std::max( rf, 1.0 ) * r1 +
+      4 * key.blurFactor ) + 2;
+    const int halfY = ( int )std::ceil( std::max( rf, 1.0 ) * r2 +
+      4 * key.blurFactor ) + 2;
+
+    ImageType::SpacingType spacing;
+    spacing[ 0 ] = key.spacingX;
+    spacing[ 1 ] = key.spacingY;
+    ImageType::PointType origin;
+    origin[ 0 ] = -halfX * spacing[ 0 ];
+    origin[ 1 ] = -halfY * spacing[ 1 ];
+    ImageType::SizeType size;
+    size[ 0 ] = 2 * halfX + 1;
+    size[ 1 ] = 2 * halfY + 1;
+
+    ImageType::Pointer ring = CreatePatch( size, spacing, origin );
+    ImageType::Pointer mask = CreatePatch( size, spacing, origin );
+    float *ringBuffer = ring->GetBufferPointer();
+    float *maskBuffer = mask->GetBufferPointer();
+
+    //Ring coverage with 4x4 supersampling, mask by pixel center
+    const int nSub = 4;
+    for( int y = 0; y < ( int )size[ 1 ]; y++ )
+      {
+      for( int x = 0; x < ( int )size[ 0 ]; x++ )
+        {
+        int nInside = 0;
+        for( int sy = 0; sy < nSub; sy++ )
+          {
+          const double py = ( y - halfY + ( sy + 0.5 ) / nSub - 0.5 ) / r2;
+          for( int sx = 0; sx < nSub; sx++ )
+            {
+            const double px = ( x - halfX + ( sx + 0.5 ) / nSub - 0.5 ) / r1;
+            const double d = px * px + py * py;
+            if( d > 1 && d <= rf * rf )
+              {
+              nInside++;
+              }
+            }
+          }
+        const size_t offset = ( size_t )y * size[ 0 ] + x;
+        ringBuffer[ offset ] = 100.0f * nInside / ( nSub * nSub );
+
+        const double mx = ( x - halfX ) / ( rm * r1 );
+        const double my = ( y - halfY ) / ( rm * r2 );
+        maskBuffer[ offset ] = mx * mx + my * my <= 1 ? 100 : 0;
+        }
+      }
+
+    ITKFilterFunctions<ImageType>::SigmaArrayType sigma;
+    sigma[ 0 ] = key.blurFactor * spacing[ 0 ];
+    sigma[ 1 ] = key.blurFactor * spacing[ 1 ];
+    ITKFilterFunctions<ImageType>::GaussSmooth( ring, sigma, ring );
+    ITKFilterFunctions<ImageType>::PixelChain()
+      .ThresholdAbove( key.threshold, 100 )
+      .Rescale( 0, 100 )
+      .Apply( ring, ring );
+
+    std::shared_ptr< Entry > entry = std::make_shared< Entry >();
+    entry->ring = ring;
+    entry->mask = mask;
+    return entry;
+    };
+
+  static ImageType::Pointer CreatePatch( const ImageType::SizeType &size,
+    const ImageType::SpacingType &spacing, const ImageType::PointType &origin )
+    {
+    ImageType::Pointer image = ImageType::New();
+    ImageType::IndexType index;
+    index.Fill( 0 );
+    image->SetRegions( ImageType::RegionType( index, size ) );
+    image->Allocate();
+    image->FillBuffer( 0 );
+    image->SetSpacing( spacing );
+    image->SetOrigin( origin );
+    return image;
+    };
+
+  //Image with the geometry of reference and the patch center placed at
+  //centerIndex
+  static ImageType::Pointer Paste( const ImageType *reference,
+    const ImageType *patch, const itk::ContinuousIndex< double, 2 > &centerIndex,
+    bool interpolate )
+    {
+    const ImageType::RegionType region = reference->GetLargestPossibleRegion();
+    ImageType::Pointer image = ImageType::New();
+    image->SetRegions( region );
+    image->Allocate();
+    image->FillBuffer( 0 );
+    image->SetSpacing( reference->GetSpacing() );
+    image->SetOrigin( reference->GetOrigin() );
+    image->SetDirection( reference->GetDirection() );
+
+    const int width = region.GetSize()[ 0 ];
+    const int height = region.GetSize()[ 1 ];
+    const int patchWidth = patch->GetLargestPossibleRegion().GetSize()[ 0 ];
+    const int patchHeight = patch->GetLargestPossibleRegion().GetSize()[ 1 ];
+    const int halfX = patchWidth / 2;
+    const int halfY = patchHeight / 2;
+    const float *in = patch->GetBufferPointer();
+    float *out = image->GetBufferPointer();
+
+    //Patch coordinate of output pixel x: x - cx + half
+    const double cx = centerIndex[ 0 ] - region.GetIndex()[ 0 ];
+    const double cy = centerIndex[ 1 ] - region.GetIndex()[ 1 ];
+    if( !interpolate )
+      {
+      const int shiftX = ( int )std::floor( cx + 0.5 ) - halfX;
+      const int shiftY = ( int )std::floor( cy + 0.5 ) - halfY;
+      const int x0 = std::max( 0, shiftX );
+      const int x1 = std::min( width, shiftX + patchWidth );
+      for( int y = std::max( 0, shiftY );
+        y < std::min( height, shiftY + patchHeight ); y++ )
+        {
+        if( x1 > x0 )
+          {
+          std::copy( in + ( size_t )( y - shiftY ) * patchWidth + x0 - shiftX,
+            in + ( size_t )( y - shiftY ) * patchWidth + x1 - shiftX,
+            out + ( size_t )y * width + x0 );
+          }
+        }
+      return image;
+      }
+
+    const int shiftX = ( int )std::floor( cx ) - halfX;
+    const int shiftY = ( int )std::floor( cy ) - halfY;
+    //Patch position of output pixel x is x - shiftX - fx
+    const float fx = cx - std::floor( cx );
+    const float fy = cy - std::floor( cy );
+    const float w00 = ( 1 - fx ) * ( 1 - fy );
+    const float w01 = fx * ( 1 - fy );
+    const float w10 = ( 1 - fx ) * fy;
+    const float w11 = fx * fy;
+    for( int y = std::max( 0, shiftY ); y <= std::min( height - 1, shiftY + patchHeight ); y++ )
+      {
+      //Rows py - 1 and py of the patch contribute to output row y
+      const int py = y - shiftY;
+      for( int x = std::max( 0, shiftX ); x <= std::min( width - 1, shiftX + patchWidth ); x++ )
+        {
+        const int px = x - shiftX;
+        float v = 0;
+        if( py < patchHeight )
+          {
+          if( px < patchWidth ) v += w00 * in[ py * patchWidth + px ];
+          if( px > 0 ) v += w01 * in[ py * patchWidth + px - 1 ];
+          }
+        if( py > 0 )
+          {
+          if( px < patchWidth ) v += w10 * in[ ( py - 1 ) * patchWidth + px ];
+          if( px > 0 ) v += w11 * in[ ( py - 1 ) * patchWidth + px - 1 ];
+          }
+        out[ ( size_t )y * width + x ] = v;
+        }
+      }
+    return image;
+    };
+
+};
+
+#endif
@@ -0,0 +1,439 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef ESTIMATIONPROTOCOL_H
+#define ESTIMATIONPROTOCOL_H
+
+//Streaming protocol between OpticNerveServer and its clients.
+//
+//Messages over a TCP connection, each a MessageHeader followed by
+//MessageHeader::size bytes of payload. All fields are in the byte order of
+//the hosts (little endian on the supported platforms).
+//
+//  MESSAGE_FRAME  (client -> server): FrameHeader, then samples * lines
+//                 unsigned char pixels in probe layout (depth along the
+//                 first dimension, see BModeFrameSource)
+//  MESSAGE_RESULT (server -> client): ResultHeader, then overlayWidth *
+//                 overlayHeight RGB pixels if an overlay was requested
+//                 (FRAME_OVERLAY) and the estimate was accepted
+//
+//Every frame is answered with exactly one result, in completion order, so
+//results are matched to frames by FrameHeader::id. Frames arriving while
+//the server is a full ring buffer behind are answered with RESULT_DROPPED.
+//When the server estimates on its own probe (OpticNerveServer --device)
+//clients only receive results, the id is the frame number of the probe.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+//Blocking TCP socket, IPv4 and IPv6
+class EstimationSocket
+{
+
+public:
+
+#ifdef _WIN32
+  typedef SOCKET HandleType;
+#else
+  typedef int HandleType;
+#endif
+
+  typedef std::shared_ptr< EstimationSocket > Pointer;
+
+  EstimationSocket( HandleType h = InvalidHandle() )
+    : handle( h )
+    {
+    };
+
+  ~EstimationSocket()
+    {
+    Close();
+    };
+
+  //Once per process before the first socket (WSAStartup on Windows)
+  static bool Initialize()
+    {
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup( MAKEWORD( 2, 2 ), &data ) == 0;
+#else
+    return true;
+#endif
+    };
+
+  bool IsValid() const
+    {
+    return handle != InvalidHandle();
+    };
+
+  //Listen on address ("127.0.0.1" for local clients only, "0.0.0.0" for
+  //all interfaces) and port
+  bool Listen( const std::string &address, int port, int backlog = 8 )
+    {
+    Close();
+    addrinfo *info = Resolve( address, port, true );
+    for( addrinfo *a = info; a != NULL && !IsValid(); a = a->ai_next )
+      {
+      handle = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+      if( !IsValid() )
+        {
+        continue;
+        }
+      const int reuse = 1;
+      setsockopt( handle, SOL_SOCKET, SO_REUSEADDR, ( const char * )&reuse,
+        sizeof( reuse ) );
+      if( bind( handle, a->ai_addr, ( int )a->ai_addrlen ) != 0 ||
+        listen( handle, backlog ) != 0 )
+        {
+        Close();
+        }
+      }
+    if( info != NULL )
+      {
+      freeaddrinfo( info );
+      }
+    return IsValid();
+    };
+
+  //Blocks until a client connects, NULL once the socket is shut down
+  Pointer Accept()
+    {
+    HandleType client = accept( handle, NULL, NULL );
+    if( client == InvalidHandle() )
+      {
+      return Pointer();
+      }
+    Pointer connection( new EstimationSocket( client ) );
+    connection->SetNoDelay();
+    return connection;
+    };
+
+  bool Connect( const std::string &host, int port )
+    {
+    Close();
+    addrinfo *info = Resolve( host, port, false );
+    for( addrinfo *a = info; a != NULL && !IsValid(); a = a->ai_next )
+      {
+      handle = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+      if( IsValid() && connect( handle, a->ai_addr, ( int )a->ai_addrlen ) != 0 )
+        {
+        Close();
+        }
+      }
+    if( info != NULL )
+      {
+      freeaddrinfo( info );
+      }
+    if( IsValid() )
+      {
+      SetNoDelay();
+      }
+    return IsValid();
+    };
+
+  //Send or receive exactly size bytes, false if the connection is closed
+  bool Send( const void *data, size_t size )
+    {
+    const char *p = ( const char * )data;
+    while( size > 0 )
+      {
+      const int n = send( handle, p, ( int )std::min< size_t >( size, 1 << 30 ),
+        SendFlags() );
+      if( n <= 0 )
+        {
+        return false;
+        }
+      p += n;
+      size -= n;
+      }
+    return true;
+    };
+
+  bool Receive( void *data, size_t size )
+    {
+    char *p = ( char * )data;
+    while( size > 0 )
+      {
+      const int n = recv( handle, p, ( int )std::min< size_t >( size, 1 << 30 ), 0 );
+      if( n <= 0 )
+        {
+        return false;
+        }
+      p += n;
+      size -= n;
+      }
+    return true;
+    };
+
+  //Wakes up threads blocked in Accept or Receive on this socket
+  void Shutdown()
+    {
+    if( IsValid() )
+      {
+#ifdef _WIN32
+      shutdown( handle, SD_BOTH );
+#else
+      shutdown( handle, SHUT_RDWR );
+#endif
+      }
+    };
+
+  void Close()
+    {
+    if( IsValid() )
+      {
+#ifdef _WIN32
+      closesocket( handle );
+#else
+      close( handle );
+#endif
+      handle = InvalidHandle();
+      }
+    };
+
+private:
+
+  HandleType handle;
+
+  EstimationSocket( const EstimationSocket & );
+  EstimationSocket &operator=( const EstimationSocket & );
+
+  static HandleType InvalidHandle()
+    {
+#ifdef _WIN32
+    return INVALID_SOCKET;
+#else
+    return -1;
+#endif
+    };
+
+  static int SendFlags()
+    {
+#ifdef MSG_NOSIGNAL
+    return MSG_NOSIGNAL;
+#else
+    return 0;
+#endif
+    };
+
+  //Frames and results are single messages, do not wait for more data
+  void SetNoDelay()
+    {
+    const int noDelay = 1;
+    setsockopt( handle, IPPROTO_TCP, TCP_NODELAY, ( const char * )&noDelay,
+      sizeof( noDelay ) );
+    };
+
+  static addrinfo *Resolve( const std::string &host, int port, bool passive )
+    {
+    addrinfo hints;
+    std::memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo *info = NULL;
+    if( getaddrinfo( host.empty() ? NULL : host.c_str(),
+      std::to_string( port ).c_str(), &hints, &info ) != 0 )
+      {
+      return NULL;
+      }
+    return info;
+    };
+
+};
+
+
+class EstimationProtocol
+{
+
+public:
+
+  static const uint32_t Magic = 0x314e4f45;
+  static const int DefaultPort = 7341;
+  //Largest accepted payload, a 4096 x 4096 frame or overlay
+  static const uint32_t MaximumPayload = 3 * 4096 * 4096 + 64;
+
+  enum MessageType
+    {
+    MESSAGE_FRAME = 1,
+    MESSAGE_RESULT = 2
+    };
+
+  enum FrameFlags
+    {
+    //Return the overlay of the estimate with the result
+    FRAME_OVERLAY = 1
+    };
+
+  enum ResultStatus
+    {
+    RESULT_SUCCESS = 0,
+    RESULT_FAIL_EYE = 1,
+    RESULT_FAIL_NERVE = 2,
+    //Estimated with a confidence below the minimum of the server
+    RESULT_REJECTED = 3,
+    //Not estimated, the server is behind
+    RESULT_DROPPED = 4,
+    RESULT_ERROR = 5
+    };
+
+  struct MessageHeader
+    {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t size;
+    uint32_t reserved;
+    };
+
+  struct FrameHeader
+    {
+    int64_t  id;
+    uint32_t samples;
+    uint32_t lines;
+    uint32_t flags;
+    uint32_t reserved;
+    };
+
+  struct ResultHeader
+    {
+    int64_t  id;
+    int32_t  status;
+    //OpticNerveCalculator::EstimateTier
+    int32_t  tier;
+    //Nerve width in pixels (OpticNerveEstimator::Nerve::width), -1 if not
+    //estimated
+    double   width;
+    double   confidence;
+    //Mean width of the accepted full resolution estimates so far
+    double   mean;
+    int32_t  truncated;
+    int32_t  reserved;
+    uint32_t overlayWidth;
+    uint32_t overlayHeight;
+    };
+
+  static_assert( sizeof( MessageHeader ) == 16 && sizeof( FrameHeader ) == 24 &&
+    sizeof( ResultHeader ) == 56, "Protocol structures must not be padded" );
+
+  static bool SendFrame( EstimationSocket &socket, const FrameHeader &frame,
+    const unsigned char *pixels )
+    {
+    const size_t n = ( size_t )frame.samples * frame.lines;
+    return SendHeader( socket, MESSAGE_FRAME, sizeof( frame ) + n ) &&
+      socket.Send( &frame, sizeof( frame ) ) && socket.Send( pixels, n );
+    };
+
+  //rgb holds 3 * overlayWidth * overlayHeight bytes, may be NULL if there
+  //is no overlay
+  static bool SendResult( EstimationSocket &socket, const ResultHeader &result,
+    const unsigned char *rgb )
+    {
+    const size_t n = rgb == NULL ? 0 :
+      3 * ( size_t )result.overlayWidth * result.overlayHeight;
+    ResultHeader header = result;
+    if( n == 0 )
+      {
+      header.overlayWidth = 0;
+      header.overlayHeight = 0;
+      }
+    return SendHeader( socket, MESSAGE_RESULT, sizeof( header ) + n ) &&
+      socket.Send( &header, sizeof( header ) ) && ( n == 0 || socket.Send( rgb, n ) );
+    };
+
+  //Reads the next message. False if the connection is closed or the
+  //message is malformed.
+  static bool ReceiveMessage( EstimationSocket &socket, MessageHeader &header,
+    std::vector< unsigned char > &payload )
+    {
+    if( !socket.Receive( &header, sizeof( header ) ) ||
+      header.magic != Magic || header.size > MaximumPayload )
+      {
+      return false;
+      }
+    payload.resize( header.size );
+    return header.size == 0 || socket.Receive( &payload[ 0 ], header.size );
+    };
+
+  //Split a frame payload, NULL if it is inconsistent
+  static const unsigned char *ParseFrame( const std::vector< unsigned char > &payload,
+    FrameHeader &frame )
+    {
+    if( payload.size() < sizeof( frame ) )
+      {
+      return NULL;
+      }
+    std::memcpy( &frame, &payload[ 0 ], sizeof( frame ) );
+    if( frame.samples == 0 || frame.lines == 0 || payload.size() !=
+      sizeof( frame ) + ( size_t )frame.samples * frame.lines )
+      {
+      return NULL;
+      }
+    return &payload[ sizeof( frame ) ];
+    };
+
+  //Split a result payload, the overlay pointer is NULL if there is none
+  static bool ParseResult( const std::vector< unsigned char > &payload,
+    ResultHeader &result, const unsigned char *&rgb )
+    {
+    if( payload.size() < sizeof( result ) )
+      {
+      return false;
+      }
+    std::memcpy( &result, &payload[ 0 ], sizeof( result ) );
+    const size_t n = 3 * ( size_t )result.overlayWidth * result.overlayHeight;
+    if( payload.size() != sizeof( result ) + n )
+      {
+      return false;
+      }
+    rgb = n > 0 ? &payload[ sizeof( result ) ] : NULL;
+    return true;
+    };
+
+private:
+
+  static bool SendHeader( EstimationSocket &socket, MessageType type, size_t size )
+    {
+    MessageHeader header;
+    header.magic = Magic;
+    header.type = type;
+    header.size = ( uint32_t )size;
+    header.reserved = 0;
+    return socket.Send( &header, sizeof( header ) );
+    };
+
+};
+
+#endif
@@ -0,0 +1,650 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef FASTMEANSQUARESMETRIC2D_H
+#define FASTMEANSQUARESMETRIC2D_H
+
+//Mean squares metric specialized for the 2D registrations of the optic
+//nerve estimator (affine eye ring, similarity nerve bars).
+//
+//Computes the same value and derivative as MeanSquaresImageToImageMetricv4
+//with linear interpolators, a fixed image mask and the default moving
+//image gradient filter (recursive Gaussian, sigma = largest spacing) but
+//without the generic machinery:
+//  - the masked fixed image samples are collected once in Initialize
+//    into contiguous arrays (SoA), relative to the transform center
+//  - the moving image and its gradient are stored per pixel together
+//    with their right, lower and lower right neighbors, so bilinear
+//    interpolation of value and gradient is three 4-float loads per sample
+//  - per evaluation the transform and the physical to index mapping are
+//    folded into a single 2x3 matrix, samples are mapped and interpolated
+//    four at a time with SSE2
+//  - the Jacobian of affine and similarity transforms is evaluated
+//    analytically from six accumulated sums
+//
+//The derivative follows the ITKv4 convention (negative gradient of the
+//value) so the metric can be used directly with the v4 optimizers.
+
+#include "itkConfigure.h"
+#include "itkObjectToObjectMetricBase.h"
+#include "itkImage.h"
+#include "itkAffineTransform.h"
+#include "itkSimilarity2DTransform.h"
+#include "itkShrinkImageFilter.h"
+#include "itkGradientRecursiveGaussianImageFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || \
+  ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define FASTMEANSQUARES_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if ITK_VERSION_MAJOR < 5
+#define FASTMEANSQUARES_THROW throw ( itk::ExceptionObject )
+#else
+#define FASTMEANSQUARES_THROW
+#endif
+
+
+class FastMeanSquaresMetric2D : public itk::ObjectToObjectMetricBase
+{
+
+public:
+
+  typedef FastMeanSquaresMetric2D Self;
+  typedef itk::ObjectToObjectMetricBase Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+  typedef itk::SmartPointer< const Self > ConstPointer;
+
+  itkNewMacro( Self );
+  itkTypeMacro( FastMeanSquaresMetric2D, ObjectToObjectMetricBase );
+
+  typedef itk::Image< float, 2 > ImageType;
+  typedef itk::Image< unsigned char, 2 > MaskImageType;
+  typedef itk::Transform< double, 2, 2 > TransformType;
+  typedef itk::AffineTransform< double, 2 > AffineTransformType;
+  typedef itk::Similarity2DTransform< double > SimilarityTransformType;
+
+  typedef Superclass::MeasureType MeasureType;
+  typedef Superclass::DerivativeType DerivativeType;
+  typedef Superclass::ParametersType ParametersType;
+  typedef Superclass::ParametersValueType ParametersValueType;
+  typedef Superclass::NumberOfParametersType NumberOfParametersType;
+
+  //Template image, sampled on its grid
+  void SetFixedImage( ImageType *image )
+    {
+    fixedImage = image;
+    };
+
+  //Image the template is aligned to, interpolated at mapped points
+  void SetMovingImage( ImageType *image )
+    {
+    movingImage = image;
+    };
+
+  //Only fixed samples with a nonzero mask value are used
+  void SetFixedImageMask( MaskImageType *mask )
+    {
+    fixedMask = mask;
+    };
+
+  //Subsample both images by this factor before registration, same as the
+  //shrink factor of ImageRegistrationMethodv4
+  void SetShrinkFactor( int factor )
+    {
+    shrinkFactor = std::max( 1, factor );
+    };
+
+  //AffineTransform< double, 2 > or Similarity2DTransform< double >. The
+  //center of the transform must be set before Initialize.
+  void SetTransform( TransformType *t )
+    {
+    transform = t;
+    };
+
+  //Number of fixed samples inside the mask
+  size_t GetNumberOfSamples() const
+    {
+    return nSamples;
+    };
+
+  void Initialize() FASTMEANSQUARES_THROW override
+    {
+    if( fixedImage.IsNull() || movingImage.IsNull() || transform.IsNull() )
+      {
+      itkExceptionMacro( "Fixed image, moving image and transform required" );
+      }
+    if( dynamic_cast< SimilarityTransformType * >( transform.GetPointer() ) )
+      {
+      isSimilarity = true;
+      }
+    else if( dynamic_cast< AffineTransformType * >( transform.GetPointer() ) )
+      {
+      isSimilarity = false;
+      }
+    else
+      {
+      itkExceptionMacro( "Only affine and similarity 2D transforms supported" );
+      }
+
+    ImageType::Pointer fixed = Shrink( fixedImage );
+    ImageType::Pointer moving = Shrink( movingImage );
+    InitializeSamples( fixed );
+    InitializeMoving( moving );
+    };
+
+  MeasureType GetValue() const override
+    {
+    Sums sums;
+    Evaluate( sums, false );
+    if( sums.count == 0 )
+      {
+      itkExceptionMacro( "All samples map outside the moving image" );
+      }
+    return sums.value / sums.count;
+    };
+
+  void GetDerivative( DerivativeType &derivative ) const override
+    {
+    MeasureType value;
+    GetValueAndDerivative( value, derivative );
+    };
+
+  void GetValueAndDerivative( MeasureType &value,
+    DerivativeType &derivative ) const override
+    {
+    Sums sums;
+    Evaluate( sums, true );
+    if( sums.count == 0 )
+      {
+      itkExceptionMacro( "All samples map outside the moving image" );
+      }
+    value = sums.value / sums.count;
+
+    //Map the sums of w * g_i * r_j and w * g_i to the parameters
+    const double n = sums.count;
+    const double *s = sums.gradient;
+    derivative.SetSize( GetNumberOfParameters() );
+    if( isSimilarity )
+      {
+      const SimilarityTransformType *similarity =
+        static_cast< const SimilarityTransformType * >(
+          transform.GetPointer() );
+      const double c = std::cos( similarity->GetAngle() );
+      const double sn = std::sin( similarity->GetAngle() );
+      const double scale = similarity->GetScale();
+      derivative[ 0 ] = ( c * s[ 0 ] - sn * s[ 1 ] + sn * s[ 2 ]
+        + c * s[ 3 ] ) / n;
+      derivative[ 1 ] = scale * ( -sn * s[ 0 ] - c * s[ 1 ] + c * s[ 2 ]
+        - sn * s[ 3 ] ) / n;
+      derivative[ 2 ] = s[ 4 ] / n;
+      derivative[ 3 ] = s[ 5 ] / n;
+      }
+    else
+      {
+      for( unsigned int i = 0; i < 6; i++ )
+        {
+        derivative[ i ] = s[ i ] / n;
+        }
+      }
+    };
+
+  NumberOfParametersType GetNumberOfParameters() const override
+    {
+    return transform->GetNumberOfParameters();
+    };
+
+  NumberOfParametersType GetNumberOfLocalParameters() const override
+    {
+    return GetNumberOfParameters();
+    };
+
+  void SetParameters( ParametersType &parameters ) override
+    {
+    transform->SetParameters( parameters );
+    };
+
+  const ParametersType &GetParameters() const override
+    {
+    return transform->GetParameters();
+    };
+
+  bool HasLocalSupport() const override
+    {
+    return false;
+    };
+
+  void UpdateTransformParameters( const DerivativeType &derivative,
+    ParametersValueType factor ) override
+    {
+    ParametersType parameters = transform->GetParameters();
+    for( unsigned int i = 0; i < parameters.Size(); i++ )
+      {
+      parameters[ i ] += factor * derivative[ i ];
+      }
+    transform->SetParameters( parameters );
+    };
+
+protected:
+
+  FastMeanSquaresMetric2D()
+    : shrinkFactor( 1 ), isSimilarity( false ), nSamples( 0 ),
+    width( 0 ), height( 0 )
+    {
+    };
+
+  ~FastMeanSquaresMetric2D()
+    {
+    };
+
+private:
+
+  typedef itk::CovariantVector< float, 2 > GradientPixelType;
+  typedef itk::Image< GradientPixelType, 2 > GradientImageType;
+  typedef itk::GradientRecursiveGaussianImageFilter< ImageType,
+    GradientImageType > GradientFilterType;
+  typedef itk::ShrinkImageFilter< ImageType, ImageType > ShrinkFilterType;
+
+  //Number of floats stored per moving pixel: value, x and y gradient,
+  //each with the 2x2 neighborhood used for bilinear interpolation
+  enum { QuadStride = 12 };
+
+  struct Sums
+    {
+    Sums() : value( 0 ), count( 0 )
+      {
+      std::fill( gradient, gradient + 6, 0.0 );
+      };
+    double value;
+    double count;
+    //w gx rx, w gx ry, w gy rx, w gy ry, w gx, w gy with w = 2 (f - m)
+    double gradient[ 6 ];
+    };
+
+  ImageType::Pointer fixedImage;
+  ImageType::Pointer movingImage;
+  MaskImageType::Pointer fixedMask;
+  TransformType::Pointer transform;
+  int shrinkFactor;
+  bool isSimilarity;
+
+  //Fixed samples relative to the transform center, padded to a multiple
+  //of four with zero weight
+  size_t nSamples;
+  std::vector< float > sampleX;
+  std::vector< float > sampleY;
+  std::vector< float > sampleValue;
+  std::vector< float > sampleWeight;
+  double centerX;
+  double centerY;
+
+  //Moving image geometry and interpolation quads
+  int width;
+  int height;
+  std::vector< float > quads;
+  double indexMatrix[ 2 ][ 2 ];
+  double indexOrigin[ 2 ];
+
+  ImageType::Pointer Shrink( ImageType *image )
+    {
+    if( shrinkFactor == 1 )
+      {
+      return image;
+      }
+    ShrinkFilterType::Pointer shrink = ShrinkFilterType::New();
+    shrink->SetInput( image );
+    shrink->SetShrinkFactors( shrinkFactor );
+    shrink->Update();
+    return shrink->GetOutput();
+    };
+
+  void InitializeSamples( ImageType *fixed )
+    {
+    const TransformType::FixedParametersType &center =
+      transform->GetFixedParameters();
+    centerX = center[ 0 ];
+    centerY = center[ 1 ];
+
+    sampleX.clear();
+    sampleY.clear();
+    sampleValue.clear();
+    sampleWeight.clear();
+
+    const ImageType::RegionType region = fixed->GetBufferedRegion();
+    const ImageType::SizeType size = region.GetSize();
+    const float *buffer = fixed->GetBufferPointer();
+    ImageType::IndexType index;
+    for( unsigned int y = 0; y < size[ 1 ]; y++ )
+      {
+      index[ 1 ] = region.GetIndex()[ 1 ] + y;
+      for( unsigned int x = 0; x < size[ 0 ]; x++ )
+        {
+        index[ 0 ] = region.GetIndex()[ 0 ] + x;
+        ImageType::PointType point;
+        fixed->TransformIndexToPhysicalPoint( index, point );
+        if( fixedMask.IsNotNull() )
+          {
+          MaskImageType::IndexType maskIndex;
+          if( !fixedMask->TransformPhysicalPointToIndex( point, maskIndex ) ||
+            fixedMask->GetPixel( maskIndex ) == 0 )
+            {
+            continue;
+            }
+          }
+        sampleX.push_back( point[ 0 ] - centerX );
+        sampleY.push_back( point[ 1 ] - centerY );
+        sampleValue.push_back( buffer[ y * size[ 0 ] + x ] );
+        sampleWeight.push_back( 1 );
+        }
+      }
+    nSamples = sampleX.size();
+    while( sampleX.size() % 4 != 0 )
+      {
+      sampleX.push_back( 0 );
+      sampleY.push_back( 0 );
+      sampleValue.push_back( 0 );
+      sampleWeight.push_back( 0 );
+      }
+    };
+
+  void InitializeMoving( ImageType *moving )
+    {
+    double maximumSpacing = 0;
+    for( unsigned int i = 0; i < 2; i++ )
+      {
+      maximumSpacing = std::max( maximumSpacing, moving->GetSpacing()[ i ] );
+      }
+    GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
+    gradientFilter->SetInput( moving );
+    gradientFilter->SetSigma( maximumSpacing );
+    gradientFilter->SetNormalizeAcrossScale( true );
+    gradientFilter->Update();
+    GradientImageType::Pointer gradient = gradientFilter->GetOutput();
+
+    const ImageType::RegionType region = moving->GetBufferedRegion();
+    width = region.GetSize()[ 0 ];
+    height = region.GetSize()[ 1 ];
+    const float *value = moving->GetBufferPointer();
+    const GradientPixelType *g = gradient->GetBufferPointer();
+
+    //Neighbors beyond the last row and column are clamped, matching
+    //LinearInterpolateImageFunction at the image border
+    quads.resize( ( size_t )width * height * QuadStride );
+    for( int y = 0; y < height; y++ )
+      {
+      const int y1 = std::min( y + 1, height - 1 );
+      for( int x = 0; x < width; x++ )
+        {
+        const int x1 = std::min( x + 1, width - 1 );
+        const size_t n[ 4 ] = { ( size_t )y * width + x,
+          ( size_t )y * width + x1, ( size_t )y1 * width + x,
+          ( size_t )y1 * width + x1 };
+        float *q = &quads[ ( ( size_t )y * width + x ) * QuadStride ];
+        for( int k = 0; k < 4; k++ )
+          {
+          q[ k ] = value[ n[ k ] ];
+          q[ 4 + k ] = g[ n[ k ] ][ 0 ];
+          q[ 8 + k ] = g[ n[ k ] ][ 1 ];
+          }
+        }
+      }
+
+    //Physical point to continuous index:
+    //  ci = S^-1 D^-1 ( p - origin )
+    const ImageType::DirectionType inverseDirection =
+      moving->GetInverseDirection();
+    const ImageType::SpacingType spacing = moving->GetSpacing();
+    const ImageType::PointType origin = moving->GetOrigin();
+    const ImageType::IndexType start = region.GetIndex();
+    for( unsigned int i = 0; i < 2; i++ )
+      {
+      indexOrigin[ i ] = 0;
+      for( unsigned int j = 0; j < 2; j++ )
+        {
+        indexMatrix[ i ][ j ] = inverseDirection[ i ][ j ] / spacing[ i ];
+        indexOrigin[ i ] -= indexMatrix[ i ][ j ] * origin[ j ];
+        }
+      //Relative to the buffer start
+      indexOrigin[ i ] -= start[ i ];
+      }
+    };
+
+  //Accumulate value (and derivative) sums over all samples
+  void Evaluate( Sums &sums, bool withDerivative ) const
+    {
+    //Mapping from sample (relative to center) to moving continuous index:
+    //  p = M r + center + t,  ci = I p + o
+    const TransformType::ParametersType &parameters =
+      transform->GetParameters();
+    double m[ 2 ][ 2 ];
+    double t[ 2 ];
+    if( isSimilarity )
+      {
+      const double c = std::cos( parameters[ 1 ] ) * parameters[ 0 ];
+      const double s = std::sin( parameters[ 1 ] ) * parameters[ 0 ];
+      m[ 0 ][ 0 ] = c;
+      m[ 0 ][ 1 ] = -s;
+      m[ 1 ][ 0 ] = s;
+      m[ 1 ][ 1 ] = c;
+      t[ 0 ] = parameters[ 2 ];
+      t[ 1 ] = parameters[ 3 ];
+      }
+    else
+      {
+      m[ 0 ][ 0 ] = parameters[ 0 ];
+      m[ 0 ][ 1 ] = parameters[ 1 ];
+      m[ 1 ][ 0 ] = parameters[ 2 ];
+      m[ 1 ][ 1 ] = parameters[ 3 ];
+      t[ 0 ] = parameters[ 4 ];
+      t[ 1 ] = parameters[ 5 ];
+      }
+    const double p0[ 2 ] = { centerX + t[ 0 ], centerY + t[ 1 ] };
+    float a[ 2 ][ 3 ];
+    for( unsigned int i = 0; i < 2; i++ )
+      {
+      a[ i ][ 0 ] = indexMatrix[ i ][ 0 ] * m[ 0 ][ 0 ] +
+        indexMatrix[ i ][ 1 ] * m[ 1 ][ 0 ];
+      a[ i ][ 1 ] = indexMatrix[ i ][ 0 ] * m[ 0 ][ 1 ] +
+        indexMatrix[ i ][ 1 ] * m[ 1 ][ 1 ];
+      a[ i ][ 2 ] = indexMatrix[ i ][ 0 ] * p0[ 0 ] +
+        indexMatrix[ i ][ 1 ] * p0[ 1 ] + indexOrigin[ i ];
+      }
+
+#ifdef FASTMEANSQUARES_USE_SSE2
+    EvaluateSSE2( a, sums, withDerivative );
+#else
+    EvaluateScalar( a, sums, withDerivative );
+#endif
+    };
+
+  void EvaluateScalar( const float a[ 2 ][ 3 ], Sums &sums,
+    bool withDerivative ) const
+    {
+    const float maxX = width - 1;
+    const float maxY = height - 1;
+    for( size_t k = 0; k < nSamples; k++ )
+      {
+      const float rx = sampleX[ k ];
+      const float ry = sampleY[ k ];
+      float cx = a[ 0 ][ 0 ] * rx + a[ 0 ][ 1 ] * ry + a[ 0 ][ 2 ];
+      float cy = a[ 1 ][ 0 ] * rx + a[ 1 ][ 1 ] * ry + a[ 1 ][ 2 ];
+      if( cx < -0.5f || cx > maxX + 0.5f || cy < -0.5f || cy > maxY + 0.5f )
+        {
+        continue;
+        }
+      cx = std::min( std::max( cx, 0.f ), maxX );
+      cy = std::min( std::max( cy, 0.f ), maxY );
+      const int ix = ( int )cx;
+      const int iy = ( int )cy;
+      const float fx = cx - ix;
+      const float fy = cy - iy;
+      const float w[ 4 ] = { ( 1 - fx ) * ( 1 - fy ), fx * ( 1 - fy ),
+        ( 1 - fx ) * fy, fx * fy };
+      const float *q = &quads[ ( ( size_t )iy * width + ix ) * QuadStride ];
+      float mv = 0;
+      float gx = 0;
+      float gy = 0;
+      for( int i = 0; i < 4; i++ )
+        {
+        mv += w[ i ] * q[ i ];
+        gx += w[ i ] * q[ 4 + i ];
+        gy += w[ i ] * q[ 8 + i ];
+        }
+      const float diff = sampleValue[ k ] - mv;
+      sums.value += diff * diff;
+      sums.count += 1;
+      if( withDerivative )
+        {
+        const float wd = 2 * diff;
+        sums.gradient[ 0 ] += wd * gx * rx;
+        sums.gradient[ 1 ] += wd * gx * ry;
+        sums.gradient[ 2 ] += wd * gy * rx;
+        sums.gradient[ 3 ] += wd * gy * ry;
+        sums.gradient[ 4 ] += wd * gx;
+        sums.gradient[ 5 ] += wd * gy;
+        }
+      }
+    };
+
+#ifdef FASTMEANSQUARES_USE_SSE2
+  static double HorizontalSum( __m128 v )
+    {
+    float f[ 4 ];
+    _mm_storeu_ps( f, v );
+    return ( double )f[ 0 ] + f[ 1 ] + f[ 2 ] + f[ 3 ];
+    };
+
+  void EvaluateSSE2( const float a[ 2 ][ 3 ], Sums &sums,
+    bool withDerivative ) const
+    {
+    const __m128 a00 = _mm_set1_ps( a[ 0 ][ 0 ] );
+    const __m128 a01 = _mm_set1_ps( a[ 0 ][ 1 ] );
+    const __m128 a02 = _mm_set1_ps( a[ 0 ][ 2 ] );
+    const __m128 a10 = _mm_set1_ps( a[ 1 ][ 0 ] );
+    const __m128 a11 = _mm_set1_ps( a[ 1 ][ 1 ] );
+    const __m128 a12 = _mm_set1_ps( a[ 1 ][ 2 ] );
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps( 1.f );
+    const __m128 two = _mm_set1_ps( 2.f );
+    const __m128 lowX = _mm_set1_ps( -0.5f );
+    const __m128 maxX = _mm_set1_ps( ( float )( width - 1 ) );
+    const __m128 maxY = _mm_set1_ps( ( float )( height - 1 ) );
+    const __m128 highX = _mm_set1_ps( width - 0.5f );
+    const __m128 highY = _mm_set1_ps( height - 0.5f );
+    const __m128 stride = _mm_set1_ps( ( float )width );
+
+    //Partial sums are kept in float lanes for a block of samples and then
+    //added to the double totals to limit rounding error
+    const size_t blockSize = 1024;
+    const size_t nPadded = sampleX.size();
+    for( size_t block = 0; block < nPadded; block += blockSize )
+      {
+      __m128 sValue = zero;
+      __m128 sCount = zero;
+      __m128 s[ 6 ] = { zero, zero, zero, zero, zero, zero };
+      const size_t blockEnd = std::min( nPadded, block + blockSize );
+      for( size_t k = block; k < blockEnd; k += 4 )
+        {
+        const __m128 rx = _mm_loadu_ps( &sampleX[ k ] );
+        const __m128 ry = _mm_loadu_ps( &sampleY[ k ] );
+        __m128 cx = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a00, rx ),
+          _mm_mul_ps( a01, ry ) ), a02 );
+        __m128 cy = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a10, rx ),
+          _mm_mul_ps( a11, ry ) ), a12 );
+
+        //Inside the buffer and not a padding sample
+        __m128 inside = _mm_and_ps(
+          _mm_and_ps( _mm_cmpge_ps( cx, lowX ), _mm_cmple_ps( cx, highX ) ),
+          _mm_and_ps( _mm_cmpge_ps( cy, lowX ), _mm_cmple_ps( cy, highY ) ) );
+        inside = _mm_and_ps( inside,
+          _mm_cmpgt_ps( _mm_loadu_ps( &sampleWeight[ k ] ), zero ) );
+        if( _mm_movemask_ps( inside ) == 0 )
+          {
+          continue;
+          }
+
+        cx = _mm_min_ps( _mm_max_ps( cx, zero ), maxX );
+        cy = _mm_min_ps( _mm_max_ps( cy, zero ), maxY );
+        const __m128i ixi = _mm_cvttps_epi32( cx );
+        const __m128i iyi = _mm_cvttps_epi32( cy );
+        const __m128 ix = _mm_cvtepi32_ps( ixi );
+        const __m128 iy = _mm_cvtepi32_ps( iyi );
+        const __m128 fx = _mm_sub_ps( cx, ix );
+        const __m128 fy = _mm_sub_ps( cy, iy );
+        const __m128 gx0 = _mm_sub_ps( one, fx );
+        const __m128 gy0 = _mm_sub_ps( one, fy );
+        const __m128 w00 = _mm_mul_ps( gx0, gy0 );
+        const __m128 w10 = _mm_mul_ps( fx, gy0 );
+        const __m128 w01 = _mm_mul_ps( gx0, fy );
+        const __m128 w11 = _mm_mul_ps( fx, fy );
+
+        //Offsets are exact in float for images below 2^24 pixels
+        int offset[ 4 ];
+        _mm_storeu_si128( ( __m128i * )offset, _mm_cvttps_epi32(
+          _mm_add_ps( _mm_mul_ps( iy, stride ), ix ) ) );
+
+        __m128 value[ 3 ];
+        for( int c = 0; c < 3; c++ )
+          {
+          __m128 q0 = _mm_loadu_ps( &quads[ offset[ 0 ] * QuadStride + 4 * c ] );
+          __m128 q1 = _mm_loadu_ps( &quads[ offset[ 1 ] * QuadStride + 4 * c ] );
+          __m128 q2 = _mm_loadu_ps( &quads[ offset[ 2 ] * QuadStride + 4 * c ] );
+          __m128 q3 = _mm_loadu_ps( &quads[ offset[ 3 ] * QuadStride + 4 * c ] );
+          _MM_TRANSPOSE4_PS( q0, q1, q2, q3 );
+          value[ c ] = _mm_add_ps(
+            _mm_add_ps( _mm_mul_ps( q0, w00 ), _mm_mul_ps( q1, w10 ) ),
+            _mm_add_ps( _mm_mul_ps( q2, w01 ), _mm_mul_ps( q3, w11 ) ) );
+          }
+
+        const __m128 diff = _mm_and_ps( inside,
+          _mm_sub_ps( _mm_loadu_ps( &sampleValue[ k ] ), value[ 0 ] ) );
+        sValue = _mm_add_ps( sValue, _mm_mul_ps( diff, diff ) );
+        sCount = _mm_add_ps( sCount, _mm_and_ps( inside, one ) );
+        if( withDerivative )
+          {
+          const __m128 wd = _mm_mul_ps( two, diff );
+          const __m128 wgx = _mm_mul_ps( wd, value[ 1 ] );
+          const __m128 wgy = _mm_mul_ps( wd, value[ 2 ] );
+          s[ 0 ] = _mm_add_ps( s[ 0 ], _mm_mul_ps( wgx, rx ) );
+          s[ 1 ] = _mm_add_ps( s[ 1 ], _mm_mul_ps( wgx, ry ) );
+          s[ 2 ] = _mm_add_ps( s[ 2 ], _mm_mul_ps( wgy, rx ) );
+          s[ 3 ] = _mm_add_ps( s[ 3 ], _mm_mul_ps( wgy, ry ) );
+          s[ 4 ] = _mm_add_ps( s[ 4 ], wgx );
+          s[ 5 ] = _mm_add_ps( s[ 5 ], wgy );
+          }
+        }
+      sums.value += HorizontalSum( sValue );
+      sums.count += HorizontalSum( sCount );
+      for( int i = 0; i < 6; i++ )
+        {
+        sums.gradient[ i ] += HorizontalSum( s[ i ] );
+        }
+      }
+    };
+#endif
+
+};
+
+#endif
@@ -0,0 +1,507 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef FRAMEBUSDEVICE_H
+#define FRAMEBUSDEVICE_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "BModeFrameSource.hxx"
+#include "SharedFrameBus.hxx"
+
+//Probe backend that reads the frames FrameBusPublisher acquires from a
+//SharedFrameBus, selected with the CMake option USE_FRAME_BUS (see
+//ProbeDevice.hxx). Several applications can run on one probe this way.
+//
+//Provides the part of the IntersonArrayDeviceRF interface the
+//applications use, with the bus in place of the ring buffers: ring buffer
+//indices are bus slots and frames are copied out of the shared memory on
+//access. The probe belongs to the publisher, so settings can not be
+//changed here. The setters only succeed for the current settings of the
+//publisher and a sweep only runs at those settings.
+//
+//The bus name is SharedFrameBus::GetDefaultName() (environment variable
+//ULTRASOUND_FRAME_BUS) unless set with SetBusName.
+class FrameBusDevice : public BModeFrameSource
+{
+
+public:
+
+  typedef unsigned char PixelType;
+  typedef itk::Image< PixelType, 2 > ImageType;
+  typedef itk::Image< PixelType, 3 > ImageType3d;
+
+  typedef short RFPixelType;
+  typedef itk::Image< RFPixelType, 2 > RFImageType;
+  typedef itk::Image< RFPixelType, 3 > RFImageType3d;
+
+  typedef std::vector< int > FrequenciesType;
+
+  typedef void ( *HardButtonCallbackType )( void *instance );
+
+  //The hard button stays with the publisher, the callback is never called
+  class HWControls
+    {
+  public:
+    void SetNewHardButtonCallback( HardButtonCallbackType callback, void *instance )
+      {
+      hardButtonCallback = callback;
+      hardButtonInstance = instance;
+      };
+
+  private:
+    HardButtonCallbackType hardButtonCallback = NULL;
+    void *hardButtonInstance = NULL;
+    };
+  typedef HWControls HWControlsType;
+
+  struct SweepPoint
+    {
+    SweepPoint( unsigned char f = 0, unsigned char v = 0, int n = 1 )
+      : frequencyIndex( f ), voltage( v ), nSamples( n ) {};
+    unsigned char frequencyIndex;
+    unsigned char voltage;
+    int nSamples;
+    };
+
+  struct SweepResult
+    {
+    SweepPoint point;
+    bool success;
+    std::vector< RFImageType::Pointer > rfImages;
+    std::vector< ImageType::Pointer > bModeImages;
+    };
+
+  FrameBusDevice()
+    : busName( SharedFrameBus::GetDefaultName() ), probeIsRunning( false ),
+    rfData( false ), geometryGeneration( 0 )
+    {
+    };
+
+  //Set before ConnectProbe
+  void SetBusName( const std::string &name )
+    {
+    busName = name;
+    };
+
+  //Maps the bus. Fails if there is no publisher or it acquires the other
+  //kind of frames (B-mode or RF) than requested.
+  bool ConnectProbe( bool rf )
+    {
+    if( bus.IsOpen() && !bus.IsClosed() && rfData == rf )
+      {
+      return true;
+      }
+    if( !bus.Open( busName ) )
+      {
+      std::cerr << "No frame bus " << busName << ", is FrameBusPublisher running?"
+        << std::endl;
+      return false;
+      }
+    const SharedFrameBus::FrameInfo &info = bus.GetFrameInfo();
+    const uint32_t type = rf ? SharedFrameBus::FRAME_RF : SharedFrameBus::FRAME_BMODE;
+    const uint32_t pixelSize = rf ? sizeof( RFPixelType ) : sizeof( PixelType );
+    if( info.frameType != type || info.pixelSize != pixelSize )
+      {
+      std::cerr << "Frame bus " << busName << " carries "
+        << ( info.frameType == SharedFrameBus::FRAME_RF ? "RF" : "B-mode" )
+        << " frames, restart FrameBusPublisher " << ( rf ? "with" : "without" )
+        << " --rf" << std::endl;
+      bus.Close();
+      return false;
+      }
+    rfData = rf;
+    geometryGeneration++;
+    return true;
+    };
+
+  bool IsProbeConnected()
+    {
+    return bus.IsOpen() && !bus.IsClosed();
+    };
+
+  //Frames keep arriving while stopped, the publisher owns the acquisition
+  bool Start()
+    {
+    probeIsRunning = bus.IsOpen();
+    return probeIsRunning;
+    };
+
+  void Stop()
+    {
+    probeIsRunning = false;
+    };
+
+  FrequenciesType GetFrequencies()
+    {
+    FrequenciesType frequencies;
+    if( bus.IsOpen() )
+      {
+      const SharedFrameBus::FrameInfo &info = bus.GetFrameInfo();
+      frequencies.assign( info.frequencies, info.frequencies +
+        std::min< uint32_t >( info.nFrequencies, SharedFrameBus::MaximumFrequencies ) );
+      }
+    return frequencies;
+    };
+
+  unsigned char GetFrequency()
+    {
+    return bus.IsOpen() ? bus.GetFrameInfo().frequencyIndex : 0;
+    };
+
+  bool SetFrequency( unsigned char fIndex )
+    {
+    return bus.IsOpen() && fIndex == bus.GetFrameInfo().frequencyIndex;
+    };
+
+  unsigned char GetVoltage()
+    {
+    return bus.IsOpen() ? bus.GetFrameInfo().voltage : 0;
+    };
+
+  bool SetVoltage( unsigned char voltage )
+    {
+    return bus.IsOpen() && voltage == bus.GetFrameInfo().voltage;
+    };
+
+  bool SetFrequencyAndVoltage( unsigned char fIndex, unsigned char voltage )
+    {
+    return SetFrequency( fIndex ) && SetVoltage( voltage );
+    };
+
+  bool GetDoubler()
+    {
+    return false;
+    };
+
+  void SetDoubler( bool )
+    {
+    };
+
+  int GetDepth()
+    {
+    return bus.IsOpen() ? bus.GetFrameInfo().depth : 0;
+    };
+
+  //Returns the depth of the publisher
+  int SetDepth( int )
+    {
+    return GetDepth();
+    };
+
+  float GetMmPerPixel()
+    {
+    return bus.IsOpen() ? bus.GetFrameInfo().mmPerPixel : 0;
+    };
+
+  //The geometry is fixed by the publisher for the lifetime of the bus, so
+  //it only changes when ConnectProbe maps a new bus
+  unsigned long GetGeometryGeneration()
+    {
+    return geometryGeneration;
+    };
+
+  HWControlsType &GetHWControls()
+    {
+    return hwControls;
+    };
+
+  int GetNumberOfLines()
+    {
+    return bus.IsOpen() ? bus.GetFrameInfo().lines : 0;
+    };
+
+  int GetBModeDepthResolution()
+    {
+    return bus.IsOpen() && !rfData ? bus.GetFrameInfo().samples : 0;
+    };
+
+  int GetRFModeDepthResolution()
+    {
+    return bus.IsOpen() && rfData ? bus.GetFrameInfo().samples : 0;
+    };
+
+  //The publisher sizes the bus (FrameBusPublisher --slots)
+  void SetRingBufferSize( int )
+    {
+    };
+
+  int GetRingBufferSize()
+    {
+    return bus.IsOpen() ? bus.GetNumberOfSlots() : 0;
+    };
+
+  //Only the process owning the probe can keep a compressed history, the
+  //bus holds just its slots. Exports here are always empty.
+  void SetHistoryMemoryBudget( size_t, size_t )
+    {
+    };
+
+  ImageType3d::Pointer GetBModeHistory( double )
+    {
+    return NULL;
+    };
+
+  RFImageType3d::Pointer GetRFHistory( double )
+    {
+    return NULL;
+    };
+
+  double GetBModeHistoryDuration()
+    {
+    return 0;
+    };
+
+  double GetRFHistoryDuration()
+    {
+    return 0;
+    };
+
+  ImageType::Pointer GetBModeImage( int ringBufferIndex )
+    {
+    return GetImageAbsolute< ImageType >( false, GetFrameInSlot( ringBufferIndex ) );
+    };
+
+  ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex ) override
+    {
+    return GetImageAbsolute< ImageType >( false, absoluteIndex );
+    };
+
+  long GetNumberOfBModeImagesAcquired() override
+    {
+    return bus.IsOpen() && !rfData ? bus.GetNumberOfFrames() : 0;
+    };
+
+  int GetCurrentBModeIndex()
+    {
+    return rfData ? -1 : GetCurrentIndex();
+    };
+
+  RFImageType::Pointer GetRFImage( int ringBufferIndex )
+    {
+    return GetImageAbsolute< RFImageType >( true, GetFrameInSlot( ringBufferIndex ) );
+    };
+
+  RFImageType::Pointer GetRFImageAbsolute( int absoluteIndex )
+    {
+    return GetImageAbsolute< RFImageType >( true, absoluteIndex );
+    };
+
+  int GetCurrentRFIndex()
+    {
+    return rfData ? GetCurrentIndex() : -1;
+    };
+
+  //Snapshot of the RF frames in the bus, oldest frame first, NULL if there
+  //are none. Frames overwritten while copying are dropped together with
+  //all older ones, as in FrameRingBuffer::CopyOrdered.
+  RFImageType3d::Pointer GetRingBufferRFOrdered()
+    {
+    if( !bus.IsOpen() || !rfData )
+      {
+      return NULL;
+      }
+    const SharedFrameBus::FrameInfo &info = bus.GetFrameInfo();
+    const long n = bus.GetNumberOfFrames();
+    const long count = std::min< long >( n, bus.GetNumberOfSlots() );
+    if( count == 0 )
+      {
+      return NULL;
+      }
+    const size_t frameSize = ( size_t )info.samples * info.lines;
+    std::vector< RFPixelType > frames( count * frameSize );
+    long k = 0;
+    for( long a = n - count; a < n; a++ )
+      {
+      if( !bus.CopyFrame( a, &frames[ k * frameSize ] ) )
+        {
+        k = 0;
+        continue;
+        }
+      k++;
+      }
+    if( k == 0 )
+      {
+      return NULL;
+      }
+    RFImageType3d::Pointer image = RFImageType3d::New();
+    RFImageType3d::RegionType region;
+    region.SetIndex( 0, 0 );
+    region.SetIndex( 1, 0 );
+    region.SetIndex( 2, 0 );
+    region.SetSize( 0, info.samples );
+    region.SetSize( 1, info.lines );
+    region.SetSize( 2, k );
+    image->SetRegions( region );
+    image->Allocate();
+    std::copy( frames.begin(), frames.begin() + k * frameSize,
+      image->GetBufferPointer() );
+    return image;
+    };
+
+  //Records the next nSamples frames of each point. Points at other than
+  //the current settings of the publisher fail.
+  std::vector< SweepResult > Sweep( const std::vector< SweepPoint > &points )
+    {
+    std::vector< SweepResult > results( points.size() );
+    for( unsigned int i = 0; i < points.size(); i++ )
+      {
+      SweepResult &result = results[ i ];
+      result.point = points[ i ];
+      result.success = SetFrequencyAndVoltage( points[ i ].frequencyIndex,
+        points[ i ].voltage );
+      long last = bus.IsOpen() ? bus.GetNumberOfFrames() : 0;
+      for( int sample = 0; result.success && sample < points[ i ].nSamples; sample++ )
+        {
+        if( !WaitForFrames( last + 1 ) )
+          {
+          result.success = false;
+          break;
+          }
+        last = bus.GetNumberOfFrames();
+        //A frame that could not be read consistently is replaced by the
+        //next one
+        if( rfData )
+          {
+          RFImageType::Pointer image = GetRFImageAbsolute( last - 1 );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.rfImages.push_back( image );
+          }
+        else
+          {
+          ImageType::Pointer image = GetBModeImageAbsolute( last - 1 );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.bModeImages.push_back( image );
+          }
+        }
+      }
+    return results;
+    };
+
+  //Block until at least count frames have been published. Returns false
+  //after two seconds or once the publisher closed the bus.
+  bool WaitForFrames( long count )
+    {
+    const std::chrono::steady_clock::time_point timeout =
+      std::chrono::steady_clock::now() + std::chrono::seconds( 2 );
+    //There is no cross process notification, poll at well above the
+    //frame rate
+    while( bus.IsOpen() && bus.GetNumberOfFrames() < count )
+      {
+      if( bus.IsClosed() || std::chrono::steady_clock::now() > timeout )
+        {
+        return false;
+        }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+      }
+    return bus.IsOpen();
+    };
+
+private:
+
+  enum { MaxAttempts = 4 };
+
+  SharedFrameBus bus;
+  std::string busName;
+  bool probeIsRunning;
+  bool rfData;
+  unsigned long geometryGeneration;
+
+  HWControlsType hwControls;
+
+  int GetCurrentIndex()
+    {
+    const long n = bus.IsOpen() ? bus.GetNumberOfFrames() : 0;
+    return n > 0 ? ( n - 1 ) % bus.GetNumberOfSlots() : -1;
+    };
+
+  //Most recent frame in a slot, -1 if there is none
+  long GetFrameInSlot( int slot )
+    {
+    const long n = bus.IsOpen() ? bus.GetNumberOfFrames() : 0;
+    if( n == 0 )
+      {
+      return -1;
+      }
+    const int nSlots = bus.GetNumberOfSlots();
+    const long last = n - 1;
+    const long a = last - ( ( last - slot ) % nSlots + nSlots ) % nSlots;
+    return a >= 0 ? a : -1;
+    };
+
+  //Copy of frame number a. If the frame has already been overwritten the
+  //frame now in its slot is returned, as from FrameRingBuffer. NULL if
+  //the bus does not carry this kind of frame or the slot was rewritten
+  //during every one of MaxAttempts copies.
+  template< typename TImage >
+  typename TImage::Pointer GetImageAbsolute( bool rf, long a )
+    {
+    if( !bus.IsOpen() || rf != rfData ||
+      bus.GetFrameInfo().pixelSize != sizeof( typename TImage::PixelType ) )
+      {
+      return NULL;
+      }
+    const SharedFrameBus::FrameInfo &info = bus.GetFrameInfo();
+    typename TImage::Pointer image = TImage::New();
+    typename TImage::IndexType index;
+    index.Fill( 0 );
+    typename TImage::SizeType size;
+    size[ 0 ] = info.samples;
+    size[ 1 ] = info.lines;
+    typename TImage::RegionType region;
+    region.SetIndex( index );
+    region.SetSize( size );
+    image->SetRegions( region );
+    image->Allocate();
+    image->FillBuffer( 0 );
+    if( a < 0 )
+      {
+      return image;
+      }
+    const int nSlots = bus.GetNumberOfSlots();
+    for( int attempt = 0; attempt < MaxAttempts; attempt++ )
+      {
+      if( bus.CopyFrame( a, image->GetBufferPointer() ) )
+        {
+        return image;
+        }
+      a = GetFrameInSlot( a % nSlots );
+      }
+    return NULL;
+    };
+
+};
+
+#endif
@@ -0,0 +1,216 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Acquires from the probe and publishes the frames on a SharedFrameBus, so
+//any number of applications built with USE_FRAME_BUS (FrameBusDevice) can
+//use the probe at the same time.
+//
+//  FrameBusPublisher [--name=<bus>] [--rf] [--slots=<n>]
+//    [--frequency=<index>] [--voltage=<v>] [--depth=<mm>]
+//
+//B-mode frames by default, RF frames with --rf. The probe settings are
+//fixed while publishing, consumers can not change them. Frames are copied
+//into the bus on the acquisition thread, straight from the buffer of the
+//probe. The acquisition backend is SimulatedProbeDevice in builds with
+//USE_SIMULATED_PROBE, IntersonArrayDeviceRF otherwise.
+
+#ifdef USE_SIMULATED_PROBE
+#include "SimulatedProbeDevice.hxx"
+typedef SimulatedProbeDevice AcquisitionDevice;
+#else
+#include "IntersonArrayDeviceRF.hxx"
+typedef IntersonArrayDeviceRF AcquisitionDevice;
+#endif
+
+#include "SharedFrameBus.hxx"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+volatile std::sig_atomic_t stopPublishing = 0;
+
+void StopPublishing( int )
+{
+  stopPublishing = 1;
+}
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+int main( int argc, char **argv )
+{
+  std::string name = SharedFrameBus::GetDefaultName();
+  bool rf = false;
+  int nSlots = 64;
+  int frequencyIndex = -1;
+  int voltage = -1;
+  int depth = -1;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    bool valid = true;
+    if( GetFlag( arg, "name", value ) )
+      {
+      name = value;
+      valid = !name.empty() && name.find( '/' ) == std::string::npos;
+      }
+    else if( arg == "--rf" )
+      {
+      rf = true;
+      }
+    else if( GetFlag( arg, "slots", value ) )
+      {
+      nSlots = std::atoi( value.c_str() );
+      valid = nSlots > 0;
+      }
+    else if( GetFlag( arg, "frequency", value ) )
+      {
+      frequencyIndex = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "voltage", value ) )
+      {
+      voltage = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "depth", value ) )
+      {
+      depth = std::atoi( value.c_str() );
+      }
+    else
+      {
+      valid = false;
+      }
+    if( !valid )
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--name=<bus>] [--rf] [--slots=<n>]"
+        << " [--frequency=<index>] [--voltage=<v>] [--depth=<mm>]" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  AcquisitionDevice device;
+  if( !device.ConnectProbe( rf ) )
+    {
+    std::cerr << "Could not connect the probe" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( ( frequencyIndex >= 0 && !device.SetFrequency( frequencyIndex ) ) ||
+    ( voltage >= 0 && !device.SetVoltage( voltage ) ) )
+    {
+    std::cerr << "Invalid frequency or voltage" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( depth > 0 )
+    {
+    device.SetDepth( depth );
+    }
+
+  SharedFrameBus::FrameInfo info;
+  std::memset( &info, 0, sizeof( info ) );
+  info.frameType = rf ? SharedFrameBus::FRAME_RF : SharedFrameBus::FRAME_BMODE;
+  info.pixelSize = rf ? sizeof( AcquisitionDevice::RFPixelType ) :
+    sizeof( AcquisitionDevice::PixelType );
+  info.samples = rf ? device.GetRFModeDepthResolution() :
+    device.GetBModeDepthResolution();
+  info.lines = device.GetNumberOfLines();
+  info.mmPerPixel = device.GetMmPerPixel();
+  info.depth = device.GetDepth();
+  info.frequencyIndex = device.GetFrequency();
+  info.voltage = device.GetVoltage();
+  const AcquisitionDevice::FrequenciesType frequencies = device.GetFrequencies();
+  info.nFrequencies = std::min< size_t >( frequencies.size(),
+    SharedFrameBus::MaximumFrequencies );
+  for( unsigned int i = 0; i < info.nFrequencies; i++ )
+    {
+    info.frequencies[ i ] = frequencies[ i ];
+    }
+
+  SharedFrameBus bus;
+  if( !bus.Create( name, info, nSlots ) )
+    {
+    std::cerr << "Could not create the frame bus " << name << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  if( rf )
+    {
+    device.SetNewRFFrameCallback( [ &bus ]( const AcquisitionDevice::RFPixelType *pixels )
+      {
+      bus.Publish( pixels );
+      } );
+    }
+  else
+    {
+    device.SetNewBModeFrameCallback( [ &bus ]( const AcquisitionDevice::PixelType *pixels )
+      {
+      bus.Publish( pixels );
+      } );
+    }
+
+  std::signal( SIGINT, StopPublishing );
+  std::signal( SIGTERM, StopPublishing );
+  if( !device.Start() )
+    {
+    std::cerr << "Could not start the probe" << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::cout << "Publishing " << ( rf ? "RF" : "B-mode" ) << " frames of "
+    << info.samples << " x " << info.lines << " on " << name << " ("
+    << nSlots << " slots)" << std::endl;
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point lastReport = Clock::now();
+  long lastFrames = 0;
+  while( !stopPublishing )
+    {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+    const Clock::time_point now = Clock::now();
+    const double seconds = std::chrono::duration< double >( now - lastReport ).count();
+    if( seconds >= 10 )
+      {
+      const long frames = bus.GetNumberOfFrames();
+      std::cout << frames << " frames, " << ( frames - lastFrames ) / seconds
+        << " fps" << std::endl;
+      lastReport = now;
+      lastFrames = frames;
+      }
+    }
+
+  device.Stop();
+  std::cout << "Published " << bus.GetNumberOfFrames() << " frames" << std::endl;
+  bus.Close();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,376 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef FRAMEHISTORY_H
+#define FRAMEHISTORY_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "RFCompression.h"
+
+//Long term, compressed, in memory history of frames for retrospective
+//export ("save the last 10 seconds").
+//
+//Push is called from the acquisition callback and only copies the frame
+//into a preallocated staging buffer. If all staging buffers are in use the
+//frame is dropped (counted in GetNumberOfDroppedFrames) instead of
+//blocking acquisition. A separate ingestion thread compresses staged
+//frames with RFCompression and appends them to the history, discarding
+//the oldest frames once the memory budget is exceeded.
+//
+//Frames of different geometry (after a depth change) are kept, exports
+//only return the most recent run of frames with the current geometry. A
+//change of geometry is either a change of the image size or of the
+//geometry generation of the device, as depth changes only alter the
+//spacing.
+template <typename TImage>
+class FrameHistory
+{
+
+public:
+
+  typedef TImage ImageType;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::SizeType SizeType;
+  typedef itk::Image< PixelType, ImageType::ImageDimension + 1 > VolumeType;
+  typedef typename VolumeType::Pointer VolumePointer;
+
+  FrameHistory( int nStagingBuffers = 16 )
+    : memoryBudget( 0 ), maxError( 0 ), generation( 0 ),
+    nStaging( nStagingBuffers ), nBusy( 0 ), enabled( false ),
+    memoryUsage( 0 ), nDropped( 0 ), stop( false )
+    {
+    imageSize.Fill( 0 );
+    };
+
+  ~FrameHistory()
+    {
+    Disable();
+    };
+
+  //Start recording with the given budget for the compressed frames. The
+  //budget can be changed at any time, 0 stops recording and frees the
+  //history.
+  void SetMemoryBudget( size_t bytes )
+    {
+    if( bytes == 0 )
+      {
+      Disable();
+      return;
+      }
+    std::lock_guard< std::mutex > lock( mutex );
+    memoryBudget = bytes;
+    EvictLocked();
+    if( !thread.joinable() )
+      {
+      stop = false;
+      thread = std::thread( &FrameHistory::Run, this );
+      }
+    enabled = true;
+    };
+
+  size_t GetMemoryBudget()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return memoryBudget;
+    };
+
+  //Bounded error for the compression of stored frames, 0 for lossless
+  void SetMaximumError( int e )
+    {
+    maxError = e;
+    };
+
+  //Geometry of the frames passed to Push, with the geometry generation of
+  //the device they come from
+  void SetImageSize( const SizeType &size, unsigned long g = 0 )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    generation = g;
+    if( size == imageSize )
+      {
+      return;
+      }
+    imageSize = size;
+    //Staged frames of the old size are released by the ingestion thread,
+    //the pool is refilled lazily with buffers of the new size
+    free.clear();
+    };
+
+  //Copy a frame into the history. Never blocks on compression.
+  void Push( const PixelType *buffer )
+    {
+    if( !enabled )
+      {
+      return;
+      }
+    Staged staged;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      const size_t nPixels = NumberOfPixels( imageSize );
+      if( nPixels == 0 )
+        {
+        return;
+        }
+      if( !free.empty() )
+        {
+        staged.pixels.swap( free.back() );
+        free.pop_back();
+        }
+      else if( (int)( queue.size() + nBusy ) < nStaging )
+        {
+        staged.pixels.resize( nPixels );
+        }
+      else
+        {
+        nDropped++;
+        return;
+        }
+      staged.size = imageSize;
+      staged.generation = generation;
+      }
+    staged.time = Clock::now();
+    std::memcpy( &staged.pixels[ 0 ], buffer,
+      staged.pixels.size() * sizeof( PixelType ) );
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      queue.push_back( std::move( staged ) );
+      }
+    hasWork.notify_one();
+    };
+
+  //Frames of the most recent seconds (all if seconds <= 0), oldest first,
+  //stacked along the last axis. Returns NULL if the history is empty.
+  VolumePointer ExportLastSeconds( double seconds )
+    {
+    std::vector< RecordPointer > selected;
+    SizeType size;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      if( records.empty() )
+        {
+        return NULL;
+        }
+      size = records.back()->size;
+      const unsigned long g = records.back()->generation;
+      const Clock::time_point start = records.back()->time -
+        std::chrono::duration_cast< Clock::duration >(
+          std::chrono::duration< double >( seconds ) );
+      for( typename std::deque< RecordPointer >::reverse_iterator it =
+        records.rbegin(); it != records.rend(); ++it )
+        {
+        if( ( seconds > 0 && ( *it )->time < start ) ||
+          ( *it )->size != size || ( *it )->generation != g )
+          {
+          break;
+          }
+        selected.push_back( *it );
+        }
+      }
+
+    typename VolumeType::SizeType volumeSize;
+    typename VolumeType::IndexType volumeIndex;
+    volumeIndex.Fill( 0 );
+    for( unsigned int i = 0; i < ImageType::ImageDimension; i++ )
+      {
+      volumeSize[ i ] = size[ i ];
+      }
+    volumeSize[ ImageType::ImageDimension ] = selected.size();
+    VolumePointer volume = VolumeType::New();
+    volume->SetRegions( typename VolumeType::RegionType( volumeIndex,
+      volumeSize ) );
+    volume->Allocate();
+
+    const size_t nPixels = NumberOfPixels( size );
+    const size_t lineLength = size[ 0 ];
+    const size_t nLines = nPixels / lineLength;
+    PixelType *out = volume->GetBufferPointer();
+    for( size_t i = 0; i < selected.size(); i++ )
+      {
+      const Record &record = *selected[ selected.size() - 1 - i ];
+      Codec::Decode( &record.data[ 0 ], record.data.size(), lineLength,
+        nLines, record.maxError, out + i * nPixels );
+      }
+    return volume;
+    };
+
+  //Seconds of history currently held
+  double GetDuration()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    if( records.empty() )
+      {
+      return 0;
+      }
+    return std::chrono::duration< double >(
+      records.back()->time - records.front()->time ).count();
+    };
+
+  size_t GetMemoryUsage()
+    {
+    return memoryUsage;
+    };
+
+  long GetNumberOfFrames()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return records.size();
+    };
+
+  long GetNumberOfDroppedFrames()
+    {
+    return nDropped;
+    };
+
+private:
+
+  typedef std::chrono::steady_clock Clock;
+  typedef RFCompression< PixelType > Codec;
+
+  struct Staged
+    {
+    std::vector< PixelType > pixels;
+    SizeType size;
+    unsigned long generation;
+    Clock::time_point time;
+    };
+
+  struct Record
+    {
+    std::vector< uint8_t > data;
+    SizeType size;
+    unsigned long generation;
+    int maxError;
+    Clock::time_point time;
+    };
+  typedef std::shared_ptr< Record > RecordPointer;
+
+  std::deque< RecordPointer > records;
+  size_t memoryBudget;
+  std::atomic< int > maxError;
+  SizeType imageSize;
+  unsigned long generation;
+
+  std::deque< Staged > queue;
+  std::vector< std::vector< PixelType > > free;
+  int nStaging;
+  int nBusy;
+
+  std::atomic< bool > enabled;
+  std::atomic< size_t > memoryUsage;
+  std::atomic< long > nDropped;
+
+  bool stop;
+  std::mutex mutex;
+  std::condition_variable hasWork;
+  std::thread thread;
+
+  static size_t NumberOfPixels( const SizeType &size )
+    {
+    size_t n = 1;
+    for( unsigned int i = 0; i < ImageType::ImageDimension; i++ )
+      {
+      n *= size[ i ];
+      }
+    return n;
+    };
+
+  void Disable()
+    {
+    enabled = false;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      stop = true;
+      }
+    hasWork.notify_all();
+    if( thread.joinable() )
+      {
+      thread.join();
+      }
+    std::lock_guard< std::mutex > lock( mutex );
+    queue.clear();
+    free.clear();
+    records.clear();
+    memoryUsage = 0;
+    memoryBudget = 0;
+    };
+
+  void EvictLocked()
+    {
+    while( !records.empty() && memoryUsage > memoryBudget )
+      {
+      memoryUsage -= records.front()->data.size();
+      records.pop_front();
+      }
+    };
+
+  void Run()
+    {
+    while( true )
+      {
+      Staged staged;
+        {
+        std::unique_lock< std::mutex > lock( mutex );
+        hasWork.wait( lock, [ this ] { return stop || !queue.empty(); } );
+        if( stop )
+          {
+          return;
+          }
+        staged = std::move( queue.front() );
+        queue.pop_front();
+        nBusy++;
+        }
+
+      RecordPointer record = std::make_shared< Record >();
+      record->size = staged.size;
+      record->generation = staged.generation;
+      record->time = staged.time;
+      record->maxError = maxError;
+      Codec::Encode( &staged.pixels[ 0 ], staged.size[ 0 ],
+        staged.pixels.size() / staged.size[ 0 ], record->maxError,
+        record->data );
+      record->data.shrink_to_fit();
+
+      std::lock_guard< std::mutex > lock( mutex );
+      nBusy--;
+      records.push_back( record );
+      memoryUsage += record->data.size();
+      EvictLocked();
+      if( staged.size == imageSize )
+        {
+        free.push_back( std::vector< PixelType >() );
+        free.back().swap( staged.pixels );
+        }
+      }
+    };
+
+};
+
+#endif
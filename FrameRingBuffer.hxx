@@ -0,0 +1,459 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef FRAMERINGBUFFER_H
+#define FRAMERINGBUFFER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "itkImage.h"
+
+//Ring buffer of equally sized frames filled by the probe callbacks.
+//
+//Frame number a (counting all frames ever added) lives in slot
+//a % GetSize(). This invariant is kept when the ring is resized, so
+//absolute frame numbers stay valid across resizes for as long as the
+//frame is still in the ring.
+//
+//Resizing allocates the new slots without blocking acquisition. Only the
+//swap, which moves the slots of the most recent frames to their new
+//positions, happens under the lock.
+//
+//Pixel data is copied in and out without holding the lock. Each slot
+//carries a sequence number (seqlock): 2a + 1 while frame a is written,
+//2a + 2 once it is complete. Readers copy a slot and check that the
+//sequence number did not change during the copy, so reads never block
+//the acquisition callback and torn frames are detected.
+template <typename TImage>
+class FrameRingBuffer
+{
+
+public:
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::SizeType SizeType;
+
+  FrameRingBuffer( int size = 10 )
+    : nFrames( 0 ), writingFrame( false ), frameInterval( 0 ),
+    hasLastFrameTime( false )
+    {
+    imageSize.Fill( 0 );
+    ring.resize( std::max( 1, size ) );
+    };
+
+  //Set the frame geometry and (re)allocate all slots. Frames in the ring
+  //are discarded, the frame count keeps running.
+  void Allocate( const SizeType &size )
+    {
+    std::lock_guard< std::mutex > resizeLock( resizeMutex );
+    std::vector< SlotPointer > slots( GetSize() );
+    for( unsigned int i = 0; i < slots.size(); i++ )
+      {
+      slots[ i ] = CreateSlot( size );
+      }
+    std::lock_guard< std::mutex > lock( mutex );
+    imageSize = size;
+    ring.swap( slots );
+    };
+
+  SizeType GetImageSize()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return imageSize;
+    };
+
+  //Number of pixels of one frame
+  size_t GetFrameSize()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return NumberOfPixels();
+    };
+
+  //Resize the ring while acquisition is running. The most recent
+  //min( old, new ) frames are kept.
+  void SetSize( int size )
+    {
+    size = std::max( 1, size );
+    std::lock_guard< std::mutex > resizeLock( resizeMutex );
+    const int oldSize = GetSize();
+    if( size == oldSize )
+      {
+      return;
+      }
+
+    //Allocate outside of the lock, the ring geometry can only change
+    //while holding resizeMutex
+    std::vector< SlotPointer > fresh;
+    if( ring[ 0 ] )
+      {
+      for( int i = oldSize; i < size; i++ )
+        {
+        fresh.push_back( CreateSlot( imageSize ) );
+        }
+      }
+
+    std::vector< SlotPointer > slots( size );
+    std::lock_guard< std::mutex > lock( mutex );
+    //A frame being written keeps its slot
+    const long n = nFrames + ( writingFrame ? 1 : 0 );
+    const int keep = std::min( oldSize, size );
+    for( int k = 0; k < keep; k++ )
+      {
+      //Slots of frames not yet acquired are migrated as well (a < 0), they
+      //just carry no data
+      const long a = n - 1 - k;
+      slots[ Modulo( a, size ) ] = ring[ Modulo( a, oldSize ) ];
+      }
+    for( int i = 0; i < size; i++ )
+      {
+      if( !slots[ i ] && !fresh.empty() )
+        {
+        slots[ i ] = fresh.back();
+        fresh.pop_back();
+        }
+      }
+    ring.swap( slots );
+    };
+
+  int GetSize()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return ring.size();
+    };
+
+  //Size the ring to hold the given duration at the measured frame rate.
+  //Uses expectedFrameRate until a frame rate has been measured.
+  void SetSizeInSeconds( double seconds, double expectedFrameRate = 30 )
+    {
+    double rate = GetFrameRate();
+    if( rate <= 0 )
+      {
+      rate = expectedFrameRate;
+      }
+    SetSize( ( int )std::ceil( seconds * rate ) );
+    };
+
+  //Frames per second, averaged over recent frames. 0 if unknown.
+  double GetFrameRate()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return frameInterval > 0 ? 1.0 / frameInterval : 0;
+    };
+
+  //Copy a frame into the next slot. buffer holds a full frame of the
+  //current image size. Only one thread may add frames.
+  void Add( const PixelType *buffer )
+    {
+    SlotPointer slot;
+    size_t nPixels;
+    long n;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      n = nFrames;
+      slot = ring[ n % ring.size() ];
+      if( !slot )
+        {
+        return;
+        }
+      nPixels = NumberOfPixels();
+      writingFrame = true;
+
+      const Clock::time_point now = Clock::now();
+      if( hasLastFrameTime )
+        {
+        const double dt =
+          std::chrono::duration< double >( now - lastFrameTime ).count();
+        //Ignore gaps from stopping the probe
+        if( dt < 1.0 )
+          {
+          frameInterval = frameInterval > 0 ?
+            0.9 * frameInterval + 0.1 * dt : dt;
+          }
+        }
+      lastFrameTime = now;
+      hasLastFrameTime = true;
+      }
+
+    slot->sequence.store( 2 * n + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    std::memcpy( slot->image->GetBufferPointer(), buffer,
+      nPixels * sizeof( PixelType ) );
+    slot->sequence.store( 2 * n + 2, std::memory_order_release );
+
+    std::lock_guard< std::mutex > lock( mutex );
+    writingFrame = false;
+    nFrames = n + 1;
+    };
+
+  //Total number of frames added
+  long GetNumberOfFrames()
+    {
+    return nFrames;
+    };
+
+  //Slot of the most recent frame, -1 if there is none
+  int GetCurrentIndex()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    const long n = nFrames;
+    return n > 0 ? ( n - 1 ) % ring.size() : -1;
+    };
+
+  //Copy of the frame in a slot. NULL for a negative slot (as from
+  //GetCurrentIndex without frames), before Allocate, or if the slot was
+  //rewritten during every one of MaxAttempts copies, so no consistent
+  //frame was read.
+  ImagePointer GetImage( int slot )
+    {
+    if( slot < 0 )
+      {
+      return NULL;
+      }
+    SlotPointer s;
+    SizeType size;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      s = ring[ slot % ring.size() ];
+      size = imageSize;
+      }
+    if( !s )
+      {
+      return NULL;
+      }
+    ImagePointer copy = CreateImage( size );
+    for( int attempt = 0; attempt < MaxAttempts; attempt++ )
+      {
+      if( CopySlot( s, -1, copy->GetBufferPointer(),
+        copy->GetPixelContainer()->Size() ) )
+        {
+        return copy;
+        }
+      }
+    return NULL;
+    };
+
+  //Copy of frame number a. If the frame has already been overwritten the
+  //frame now in its slot is returned. NULL for negative frame numbers and
+  //as for GetImage.
+  ImagePointer GetImageAbsolute( long a )
+    {
+    if( a < 0 )
+      {
+      return NULL;
+      }
+    SlotPointer s;
+    SizeType size;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      s = ring[ a % ring.size() ];
+      size = imageSize;
+      }
+    if( !s )
+      {
+      return NULL;
+      }
+    ImagePointer copy = CreateImage( size );
+    for( int attempt = 0; attempt < MaxAttempts; attempt++ )
+      {
+      if( CopySlot( s, -1, copy->GetBufferPointer(),
+        copy->GetPixelContainer()->Size() ) )
+        {
+        return copy;
+        }
+      }
+    return NULL;
+    };
+
+  //Copy the most recent frames, at most maxFrames, oldest first into out
+  //(frameSize pixels per frame) without stopping acquisition. One block
+  //copy per frame. Frames overwritten while copying are dropped together
+  //with all older ones, so the result is always a contiguous run of
+  //frames. Returns the number of frames copied, the number of the first
+  //one is returned in firstFrame. Nothing is copied if the frames in the
+  //ring do not have frameSize pixels, e.g. after a reallocation the caller
+  //did not size out for.
+  long CopyOrdered( PixelType *out, size_t frameSize, int maxFrames,
+    long *firstFrame = NULL )
+    {
+    MemorySink sink( out, frameSize );
+    return CopyOrdered( sink, frameSize, maxFrames, firstFrame );
+    };
+
+  //As above, writing frames through a sink with the methods
+  //  PixelType *GetBuffer( long k ) : where to copy output frame k
+  //  bool Commit( long k )          : frame k in the buffer is valid
+  //Output positions restart at 0 if older frames had to be dropped.
+  template <typename TSink>
+  long CopyOrdered( TSink &sink, size_t frameSize, int maxFrames,
+    long *firstFrame = NULL )
+    {
+    std::vector< SlotPointer > slots;
+    size_t nPixels;
+    long n;
+      {
+      std::lock_guard< std::mutex > lock( mutex );
+      slots = ring;
+      nPixels = NumberOfPixels();
+      n = nFrames;
+      }
+    if( nPixels != frameSize )
+      {
+      if( firstFrame != NULL )
+        {
+        *firstFrame = n;
+        }
+      return 0;
+      }
+    const long count = std::min< long >( std::min< long >( n, slots.size() ),
+      maxFrames );
+    long first = n - count;
+    long k = 0;
+    for( long a = n - count; a < n; a++ )
+      {
+      if( !CopySlot( slots[ a % slots.size() ], a, sink.GetBuffer( k ),
+        nPixels ) || !sink.Commit( k ) )
+        {
+        first = a + 1;
+        k = 0;
+        continue;
+        }
+      k++;
+      }
+    if( firstFrame != NULL )
+      {
+      *firstFrame = first;
+      }
+    return k;
+    };
+
+private:
+
+  typedef std::chrono::steady_clock Clock;
+
+  enum { MaxAttempts = 4 };
+
+  struct Slot
+    {
+    Slot() : sequence( 0 ) {};
+    ImagePointer image;
+    std::atomic< long > sequence;
+    };
+  typedef std::shared_ptr< Slot > SlotPointer;
+
+  class MemorySink
+    {
+    public:
+      MemorySink( PixelType *o, size_t n ) : out( o ), nPixels( n ) {};
+      PixelType *GetBuffer( long k )
+        {
+        return out + k * nPixels;
+        };
+      bool Commit( long )
+        {
+        return true;
+        };
+    private:
+      PixelType *out;
+      size_t nPixels;
+    };
+
+  std::vector< SlotPointer > ring;
+  SizeType imageSize;
+  std::atomic< long > nFrames;
+  bool writingFrame;
+
+  double frameInterval;
+  bool hasLastFrameTime;
+  Clock::time_point lastFrameTime;
+
+  //mutex guards ring, imageSize and the frame bookkeeping, resizeMutex
+  //serializes reallocations
+  std::mutex mutex;
+  std::mutex resizeMutex;
+
+  //Seqlock read of a slot. With frame >= 0 the slot must hold exactly that
+  //frame, otherwise any complete frame is accepted. Fails for slots not
+  //allocated yet.
+  static bool CopySlot( const SlotPointer &slot, long frame, PixelType *out,
+    size_t nPixels )
+    {
+    if( !slot )
+      {
+      return false;
+      }
+    const long before = slot->sequence.load( std::memory_order_acquire );
+    if( ( before & 1 ) != 0 || ( frame >= 0 && before != 2 * frame + 2 ) )
+      {
+      return false;
+      }
+    std::memcpy( out, slot->image->GetBufferPointer(),
+      nPixels * sizeof( PixelType ) );
+    std::atomic_thread_fence( std::memory_order_acquire );
+    return slot->sequence.load( std::memory_order_relaxed ) == before;
+    };
+
+  static int Modulo( long a, int n )
+    {
+    long m = a % n;
+    return m < 0 ? m + n : m;
+    };
+
+  size_t NumberOfPixels()
+    {
+    size_t n = 1;
+    for( unsigned int i = 0; i < ImageType::ImageDimension; i++ )
+      {
+      n *= imageSize[ i ];
+      }
+    return n;
+    };
+
+  static SlotPointer CreateSlot( const SizeType &size )
+    {
+    SlotPointer slot = std::make_shared< Slot >();
+    slot->image = CreateImage( size );
+    return slot;
+    };
+
+  static ImagePointer CreateImage( const SizeType &size )
+    {
+    ImagePointer image = ImageType::New();
+    typename ImageType::IndexType index;
+    index.Fill( 0 );
+    typename ImageType::RegionType region;
+    region.SetIndex( index );
+    region.SetSize( size );
+    image->SetRegions( region );
+    image->Allocate();
+    return image;
+    };
+
+};
+
+#endif
@@ -31,6 +31,12 @@ limitations under the License.
 #include "itkPermuteAxesImageFilter.h"
 #include "itkFlipImageFilter.h"
 
+#include "ParallelRows.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 template < typename TImage >
 class ITKFilterFunctions
 {
@@ -166,6 +172,274 @@ public:
     return image;
     };
 
+  //Overloads writing into output. output may be the input image (in place)
+  //and is (re)allocated only if it is NULL or its size does not match, so
+  //a chain of calls on the same images does not allocate after the first
+  //frame.
+
+  static void Rescale( ImagePointer image, PixelType minI, PixelType maxI,
+    ImagePointer &output )
+    {
+    PixelChain().Rescale( minI, maxI ).Apply( image, output );
+    };
+
+  static void GaussSmooth( ImagePointer image, SigmaArrayType sigma,
+    ImagePointer &output )
+    {
+    GaussianFilterPointer smooth = GaussianFilter::New();
+    smooth->SetSigmaArray( sigma );
+    smooth->SetInput( image );
+    if( output == image )
+      {
+      smooth->InPlaceOn();
+      smooth->Update();
+      image->Graft( smooth->GetOutput() );
+      return;
+      }
+    MatchGeometry( image, output );
+    smooth->GraftOutput( output );
+    smooth->Update();
+    output->Graft( smooth->GetOutput() );
+    };
+
+  static void ThresholdAbove( ImagePointer image, PixelType t,
+    PixelType outside, ImagePointer &output )
+    {
+    PixelChain().ThresholdAbove( t, outside ).Apply( image, output );
+    };
+
+  static void ThresholdBelow( ImagePointer image, PixelType t,
+    PixelType outside, ImagePointer &output )
+    {
+    PixelChain().ThresholdBelow( t, outside ).Apply( image, output );
+    };
+
+  static void BinaryThreshold( ImagePointer image, PixelType tLow,
+    PixelType tHigh, PixelType inside, PixelType outside, ImagePointer &output )
+    {
+    PixelChain().BinaryThreshold( tLow, tHigh, inside, outside ).Apply( image,
+      output );
+    };
+
+  static void Subtract( ImagePointer i1, ImagePointer i2, ImagePointer &output )
+    {
+    MatchGeometry( i1, output );
+    const PixelType *a = i1->GetBufferPointer();
+    const PixelType *b = i2->GetBufferPointer();
+    PixelType *o = output->GetBufferPointer();
+    const size_t n = i1->GetBufferedRegion().GetNumberOfPixels();
+    for( size_t i = 0; i < n; i++ )
+      {
+      o[ i ] = static_cast< PixelType >( a[ i ] - b[ i ] );
+      }
+    };
+
+  static void Add( ImagePointer i1, ImagePointer i2, ImagePointer &output )
+    {
+    MatchGeometry( i1, output );
+    const PixelType *a = i1->GetBufferPointer();
+    const PixelType *b = i2->GetBufferPointer();
+    PixelType *o = output->GetBufferPointer();
+    const size_t n = i1->GetBufferedRegion().GetNumberOfPixels();
+    for( size_t i = 0; i < n; i++ )
+      {
+      o[ i ] = static_cast< PixelType >( a[ i ] + b[ i ] );
+      }
+    };
+
+  //output must not be the input image
+  static void PermuteImage( ImagePointer image, PermuteArray &order,
+    ImagePointer &output )
+    {
+    PermuteFilterPointer permute = PermuteFilter::New();
+    permute->SetOrder( order );
+    permute->SetInput( image );
+    RunGrafted( permute.GetPointer(), output );
+    };
+
+  //output must not be the input image
+  static void FlipImage( ImagePointer image, FlipArray &flip,
+    ImagePointer &output )
+    {
+    FlipFilterPointer flipper = FlipFilter::New();
+    flipper->SetFlipAxes( flip );
+    flipper->SetInput( image );
+    RunGrafted( flipper.GetPointer(), output );
+    };
+
+  //Point wise operations fused into a single pass over the image, e.g.
+  //
+  //  PixelChain().ThresholdAbove( t, 100 ).Rescale( 0, 100 ).Apply( image, image );
+  //
+  //Each operation gives the same result as the corresponding filter
+  //function (values are converted to the pixel type after each step).
+  //Rescale needs the range of the values computed so far, each Rescale in
+  //a chain adds one read only pass.
+  class PixelChain
+    {
+    public:
+
+      //Values above t are set to outside
+      PixelChain &ThresholdAbove( PixelType t, PixelType outside )
+        {
+        return Push( OP_THRESHOLD,
+          itk::NumericTraits< PixelType >::NonpositiveMin(), t, outside );
+        };
+
+      //Values below t are set to outside
+      PixelChain &ThresholdBelow( PixelType t, PixelType outside )
+        {
+        return Push( OP_THRESHOLD, t, itk::NumericTraits< PixelType >::max(),
+          outside );
+        };
+
+      //Values in [ tLow, tHigh ] are set to inside, all others to outside
+      PixelChain &BinaryThreshold( PixelType tLow, PixelType tHigh,
+        PixelType inside, PixelType outside )
+        {
+        return Push( OP_BINARY_THRESHOLD, tLow, tHigh, inside, outside );
+        };
+
+      //Linear map of the current range to [ minI, maxI ]
+      PixelChain &Rescale( PixelType minI, PixelType maxI )
+        {
+        return Push( OP_RESCALE, minI, maxI );
+        };
+
+      //v * scale + shift
+      PixelChain &Linear( double scale, double shift )
+        {
+        return Push( OP_LINEAR, scale, shift );
+        };
+
+      //output may be the input image
+      void Apply( ImagePointer image, ImagePointer &output ) const
+        {
+        const PixelType *in = image->GetBufferPointer();
+        const size_t n = image->GetBufferedRegion().GetNumberOfPixels();
+
+        //Resolve the rescales in order, each from the range of the values
+        //after the operations before it
+        std::vector< Op > resolved = ops;
+        for( size_t k = 0; k < resolved.size(); k++ )
+          {
+          if( resolved[ k ].type != OP_RESCALE )
+            {
+            continue;
+            }
+          double minimum = std::numeric_limits< double >::max();
+          double maximum = -std::numeric_limits< double >::max();
+          for( size_t i = 0; i < n; i++ )
+            {
+            const double v = Evaluate( resolved, k, in[ i ] );
+            minimum = std::min( minimum, v );
+            maximum = std::max( maximum, v );
+            }
+          ResolveRescale( resolved[ k ], minimum, maximum );
+          }
+
+        MatchGeometry( image, output );
+        PixelType *out = output->GetBufferPointer();
+        for( size_t i = 0; i < n; i++ )
+          {
+          out[ i ] = Evaluate( resolved, resolved.size(), in[ i ] );
+          }
+        };
+
+      ImagePointer Apply( ImagePointer image ) const
+        {
+        ImagePointer output;
+        Apply( image, output );
+        return output;
+        };
+
+    private:
+
+      enum OpType
+        {
+        OP_THRESHOLD,
+        OP_BINARY_THRESHOLD,
+        OP_RESCALE,
+        OP_LINEAR,
+        OP_LINEAR_CLAMP
+        };
+
+      struct Op
+        {
+        OpType type;
+        double a;
+        double b;
+        double c;
+        double d;
+        };
+
+      std::vector< Op > ops;
+
+      PixelChain &Push( OpType type, double a, double b, double c = 0,
+        double d = 0 )
+        {
+        Op op = { type, a, b, c, d };
+        ops.push_back( op );
+        return *this;
+        };
+
+      //Same factor and offset as RescaleIntensityImageFilter
+      static void ResolveRescale( Op &op, double minimum, double maximum )
+        {
+        const double outMin = op.a;
+        const double outMax = op.b;
+        double scale = 0;
+        if( minimum != maximum )
+          {
+          scale = ( outMax - outMin ) / ( maximum - minimum );
+          }
+        else if( maximum != 0 )
+          {
+          scale = ( outMax - outMin ) / maximum;
+          }
+        op.type = OP_LINEAR_CLAMP;
+        op.a = scale;
+        op.b = outMin - minimum * scale;
+        op.c = outMin;
+        op.d = outMax;
+        };
+
+      //Value after the first n operations
+      static PixelType Evaluate( const std::vector< Op > &ops, size_t n,
+        PixelType v )
+        {
+        for( size_t k = 0; k < n; k++ )
+          {
+          const Op &op = ops[ k ];
+          switch( op.type )
+            {
+            case OP_THRESHOLD:
+              if( v < static_cast< PixelType >( op.a ) ||
+                v > static_cast< PixelType >( op.b ) )
+                {
+                v = static_cast< PixelType >( op.c );
+                }
+              break;
+            case OP_BINARY_THRESHOLD:
+              v = static_cast< PixelType >( v >= static_cast< PixelType >( op.a ) &&
+                v <= static_cast< PixelType >( op.b ) ? op.c : op.d );
+              break;
+            case OP_LINEAR:
+              v = static_cast< PixelType >( v * op.a + op.b );
+              break;
+            case OP_LINEAR_CLAMP:
+              v = static_cast< PixelType >( v * op.a + op.b );
+              v = std::min( std::max( v, static_cast< PixelType >( op.c ) ),
+                static_cast< PixelType >( op.d ) );
+              break;
+            case OP_RESCALE:
+              break;
+            }
+          }
+        return v;
+        };
+    };
+
   static void AddBorder( ImagePointer image, int w )
     {
     ImageSize size = image->GetLargestPossibleRegion().GetSize();
@@ -175,106 +449,279 @@ public:
 
   static void AddHorizontalBorder( ImagePointer image, int w )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
-
-    for( unsigned int i = 0; i < size[ 0 ]; i++ )
+    const int height = GetHeight( image );
+    w = std::max( 0, std::min( height, w ) );
+    for( int j = 0; j < w; j++ )
       {
-      ImageIndex index;
-      index[ 0 ] = i;
-      for( int j = 0; j < std::min( ( int )size[ 1 ], w ); j++ )
-        {
-        index[ 1 ] = j;
-        image->SetPixel( index, 100 );
-        index[ 1 ] = size[ 1 ] - 1 - j;
-        image->SetPixel( index, 100 );
-        }
+      FillRow( image, j, 0, GetWidth( image ), 100 );
+      FillRow( image, height - 1 - j, 0, GetWidth( image ), 100 );
       }
     };
 
   static void AddHorizontalBorderTop( ImagePointer image, int w )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
-
-    for( int i = 0; i < size[ 0 ]; i++ )
+    w = std::max( 0, std::min( GetHeight( image ), w ) );
+    for( int j = 0; j < w; j++ )
       {
-      ImageIndex index;
-      index[ 0 ] = i;
-      for( int j = 0; j < std::min( ( int )size[ 1 ], w ); j++ )
-        {
-        index[ 1 ] = j;
-        image->SetPixel( index, 100 );
-        }
+      FillRow( image, j, 0, GetWidth( image ), 100 );
       }
     };
 
   static void AddVerticalBorder( ImagePointer image, int w )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
-    for( unsigned int i = 0; i < size[ 1 ]; i++ )
+    const int width = GetWidth( image );
+    w = std::max( 0, std::min( width, w ) );
+    for( int i = 0; i < GetHeight( image ); i++ )
       {
-      ImageIndex index;
-      index[ 1 ] = i;
-      for( int j = 0; j < std::min( ( int )size[ 0 ], w ); j++ )
-        {
-        index[ 0 ] = j;
-        image->SetPixel( index, 100 );
-        index[ 0 ] = size[ 0 ] - 1 - j;
-        image->SetPixel( index, 100 );
-        }
+      FillRow( image, i, 0, w, 100 );
+      FillRow( image, i, width - w, width, 100 );
       }
     };
 
   static void AddVerticalBorderLeft( ImagePointer image, int w )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
-    for( unsigned int i = 0; i < size[ 1 ]; i++ )
+    w = std::max( 0, std::min( GetWidth( image ), w ) );
+    for( int i = 0; i < GetHeight( image ); i++ )
       {
-      ImageIndex index;
-      index[ 1 ] = i;
-      for( int j = 0; j < std::min( ( int )size[ 0 ], w ); j++ )
-        {
-        index[ 0 ] = j;
-        image->SetPixel( index, 100 );
-        }
+      FillRow( image, i, 0, w, 100 );
       }
     };
 
   static void AddVerticalBorderRight( ImagePointer image, int w )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
-    for( unsigned int i = 0; i < size[ 1 ]; i++ )
+    const int width = GetWidth( image );
+    w = std::max( 0, std::min( width, w ) );
+    for( int i = 0; i < GetHeight( image ); i++ )
+      {
+      FillRow( image, i, width - w, width, 100 );
+      }
+    };
+
+  //Divide each row by its maximum. Rows without positive values are set
+  //to 0.
+  static void RescaleRows( ImagePointer image, int nThreads = 0 )
+    {
+    const int width = GetWidth( image );
+    PixelType *buffer = image->GetBufferPointer();
+    ParallelRows::For( 0, GetHeight( image ), [ = ]( int y0, int y1, int )
       {
-      ImageIndex index;
-      index[ 1 ] = i;
-      for( int j = 0; j < std::min( ( int )size[ 0 ], w ); j++ )
+      for( int i = y0; i < y1; i++ )
         {
-        index[ 0 ] = size[ 0 ] - 1 - j;
-        image->SetPixel( index, 100 );
+        PixelType *row = buffer + ( size_t )i * width;
+        const PixelType maxIntensity = RowMaximum( row, width );
+        for( int j = 0; j < width; j++ )
+          {
+          row[ j ] = maxIntensity > 0 ? row[ j ] / maxIntensity : 0;
+          }
         }
-      }
+      }, nThreads );
     };
 
-  static void RescaleRows( ImagePointer image )
+  //Rescale the parts of each row left of and from column on separately:
+  //reference maps to 0 and the maximum of the part (at least 0) to maxI,
+  //values are clamped to [ 0, maxI ]. Parts with a maximum not above
+  //reference are set to 0.
+  static void RescaleRowsAroundColumn( ImagePointer image, int column,
+    PixelType reference, PixelType maxI, int nThreads = 0 )
     {
-    ImageSize size = image->GetLargestPossibleRegion().GetSize();
+    const int width = GetWidth( image );
+    column = std::max( 0, std::min( width, column ) );
+    PixelType *buffer = image->GetBufferPointer();
+    ParallelRows::For( 0, GetHeight( image ), [ = ]( int y0, int y1, int )
+      {
+      for( int i = y0; i < y1; i++ )
+        {
+        PixelType *row = buffer + ( size_t )i * width;
+        RescaleRun( row, column, reference, maxI );
+        RescaleRun( row + column, width - column, reference, maxI );
+        }
+      }, nThreads );
+    };
 
-    //Rescale row by row
-    for( unsigned int i = 0; i < size[ 1 ]; i++ )
+  //Mean of factor x factor blocks. Output pixel i covers input pixels
+  //i * factor .. i * factor + factor - 1 (indices in both images), partial
+  //blocks at the borders are dropped. Spacing, origin and direction are
+  //kept, so physical coordinates of the output are index based like the
+  //ones of the input.
+  static ImagePointer Decimate( ImagePointer image, int factor, int nThreads = 0 )
+    {
+    factor = std::max( 1, factor );
+    const ImageRegion inRegion = image->GetBufferedRegion();
+    ImageRegion outRegion;
+    for( unsigned int d = 0; d < 2; d++ )
       {
-      ImageIndex index;
-      index[ 1 ] = i;
-      float maxIntensity = 0;
-      for( unsigned int j = 0; j < size[ 0 ]; j++ )
+      const long start = inRegion.GetIndex()[ d ];
+      const long end = start + ( long )inRegion.GetSize()[ d ];
+      const long outStart = ( start + factor - 1 ) / factor;
+      outRegion.SetIndex( d, outStart );
+      outRegion.SetSize( d, std::max( 0L, end / factor - outStart ) );
+      }
+    ImagePointer output = Image::New();
+    output->SetRegions( outRegion );
+    output->SetSpacing( image->GetSpacing() );
+    output->SetOrigin( image->GetOrigin() );
+    output->SetDirection( image->GetDirection() );
+    output->Allocate();
+
+    const int inWidth = GetWidth( image );
+    const int width = outRegion.GetSize()[ 0 ];
+    const int x0 = outRegion.GetIndex()[ 0 ] * factor - inRegion.GetIndex()[ 0 ];
+    const int y0 = outRegion.GetIndex()[ 1 ] * factor - inRegion.GetIndex()[ 1 ];
+    const PixelType *in = image->GetBufferPointer();
+    PixelType *out = output->GetBufferPointer();
+    const double scale = 1.0 / ( factor * factor );
+    ParallelRows::For( 0, outRegion.GetSize()[ 1 ], [ = ]( int r0, int r1, int )
+      {
+      std::vector< double > sum( width );
+      for( int i = r0; i < r1; i++ )
         {
-        index[ 0 ] = j;
-        maxIntensity = std::max( ( float )image->GetPixel( index ), maxIntensity );
+        std::fill( sum.begin(), sum.end(), 0.0 );
+        for( int k = 0; k < factor; k++ )
+          {
+          const PixelType *row = in + ( size_t )( y0 + i * factor + k ) * inWidth + x0;
+          for( int j = 0; j < width; j++ )
+            {
+            for( int l = 0; l < factor; l++ )
+              {
+              sum[ j ] += row[ j * factor + l ];
+              }
+            }
+          }
+        PixelType *o = out + ( size_t )i * width;
+        for( int j = 0; j < width; j++ )
+          {
+          o[ j ] = static_cast< PixelType >( sum[ j ] * scale );
+          }
         }
-      for( unsigned int j = 0; j < size[ 0 ]; j++ )
+      }, nThreads );
+    return output;
+    };
+
+  //Inverse of Decimate by nearest neighbor: pixel X of the output (region
+  //in the index space of the decimated image's input) is pixel X / factor
+  //of image, clamped to its buffered region. Geometry is copied from image.
+  static ImagePointer Expand( ImagePointer image, int factor,
+    const ImageRegion &region )
+    {
+    factor = std::max( 1, factor );
+    ImagePointer output = Image::New();
+    output->SetRegions( region );
+    output->SetSpacing( image->GetSpacing() );
+    output->SetOrigin( image->GetOrigin() );
+    output->SetDirection( image->GetDirection() );
+    output->Allocate();
+
+    const ImageRegion inRegion = image->GetBufferedRegion();
+    const int inWidth = GetWidth( image );
+    const int width = region.GetSize()[ 0 ];
+    const PixelType *in = image->GetBufferPointer();
+    PixelType *out = output->GetBufferPointer();
+    std::vector< int > column( width );
+    for( int j = 0; j < width; j++ )
+      {
+      column[ j ] = ExpandedIndex( region.GetIndex()[ 0 ] + j, factor, inRegion, 0 );
+      }
+    for( int i = 0; i < ( int )region.GetSize()[ 1 ]; i++ )
+      {
+      const PixelType *row = in + ( size_t )ExpandedIndex(
+        region.GetIndex()[ 1 ] + i, factor, inRegion, 1 ) * inWidth;
+      PixelType *o = out + ( size_t )i * width;
+      for( int j = 0; j < width; j++ )
         {
-        index[ 0 ] = j;
-        image->SetPixel( index, image->GetPixel( index ) / maxIntensity );
+        o[ j ] = row[ column[ j ] ];
         }
       }
+    return output;
+    };
+
+private:
+
+  //Buffer offset along d of the pixel of a decimated image covering index
+  static int ExpandedIndex( long index, int factor, const ImageRegion &region,
+    unsigned int d )
+    {
+    const long start = region.GetIndex()[ d ];
+    const long i = ( index >= 0 ? index : index - factor + 1 ) / factor;
+    return ( int )std::max( 0L, std::min( ( long )region.GetSize()[ d ] - 1, i - start ) );
+    };
+
+  static int GetWidth( ImagePointer image )
+    {
+    return image->GetBufferedRegion().GetSize()[ 0 ];
+    };
+
+  static int GetHeight( ImagePointer image )
+    {
+    return image->GetBufferedRegion().GetSize()[ 1 ];
+    };
+
+  static void FillRow( ImagePointer image, int row, int begin, int end,
+    PixelType value )
+    {
+    PixelType *p = image->GetBufferPointer() + ( size_t )row * GetWidth( image );
+    std::fill( p + begin, p + end, value );
+    };
+
+  //Maximum of the run and 0
+  static PixelType RowMaximum( const PixelType *row, int n )
+    {
+    PixelType maxIntensity = 0;
+    for( int j = 0; j < n; j++ )
+      {
+      maxIntensity = std::max( row[ j ], maxIntensity );
+      }
+    return maxIntensity;
+    };
+
+  static void RescaleRun( PixelType *row, int n, PixelType reference,
+    PixelType maxI )
+    {
+    const PixelType maxIntensity = RowMaximum( row, n );
+    if( !( maxIntensity > reference ) )
+      {
+      std::fill( row, row + n, PixelType( 0 ) );
+      return;
+      }
+    const PixelType range = maxIntensity - reference;
+    for( int j = 0; j < n; j++ )
+      {
+      PixelType value = ( row[ j ] - reference ) / range;
+      value = std::max( PixelType( 0 ), value ) * maxI;
+      row[ j ] = std::min( maxI, value );
+      }
+    };
+
+  //Allocate output with the size and geometry of image unless it already
+  //has the right size
+  static void MatchGeometry( ImagePointer image, ImagePointer &output )
+    {
+    if( output == image )
+      {
+      return;
+      }
+    const ImageRegion region = image->GetBufferedRegion();
+    if( output.IsNull() || output->GetBufferedRegion() != region )
+      {
+      output = Image::New();
+      output->SetRegions( region );
+      output->Allocate();
+      }
+    output->CopyInformation( image );
+    };
+
+  //Run a filter writing into the buffer of output if there is one
+  template < typename TFilter >
+  static void RunGrafted( TFilter *filter, ImagePointer &output )
+    {
+    if( output.IsNull() )
+      {
+      filter->Update();
+      output = filter->GetOutput();
+      return;
+      }
+    filter->GraftOutput( output );
+    filter->Update();
+    output->Graft( filter->GetOutput() );
     };
 
 };
@@ -35,6 +35,10 @@ limitations under the License.
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkCastImageFilter.h"
 
+#include "MappedImageIO.h"
+#include "RFCompression.h"
+
+#include <cstring>
 #include <vector>
 
 
@@ -69,8 +73,17 @@ public:
   typedef typename itk::CastImageFilter<Image, Image> CastFilter;
   typedef typename CastFilter::Pointer CastFilterPointer;
 
+  //Files ending in ".rfz" are written with the RF codec (RFCompression.h)
   static void WriteImage( ImagePointer image, const std::string &filename )
     {
+    if( CompressedImageDispatch<Image>::IsCompressedFilename( filename ) )
+      {
+      if( !CompressedImageDispatch<Image>::WriteImage( image, filename ) )
+        {
+        itkGenericExceptionMacro( << "Could not write " << filename );
+        }
+      return;
+      }
     ImageWriterPointer writer = ImageWriter::New();
     writer->SetFileName( filename );
     writer->SetInput( image );
@@ -80,6 +93,15 @@ public:
   static ImagePointer ReadImage( const std::string &filename )
     {
     ImagePointer input = NULL;
+    if( CompressedImageDispatch<Image>::IsCompressedFilename( filename ) )
+      {
+      input = CompressedImageDispatch<Image>::ReadImage( filename );
+      if( input.IsNull() )
+        {
+        itkGenericExceptionMacro( << "Could not read " << filename );
+        }
+      return input;
+      }
     ImageReaderPointer imageReader = ImageReader::New();
     imageReader->SetFileName( filename );
     imageReader->Update();
@@ -87,39 +109,47 @@ public:
     return input;
     };
 
+  //Map raw NRRD files without decoding or copying the pixel data, see
+  //MappedImageIO.h. Falls back to the regular reader for anything that can
+  //not be mapped (compressed files, other formats, foreign byte order).
+  static ImagePointer ReadImageMapped( const std::string &filename )
+    {
+    ImagePointer input = MappedImageIO<Image>::ReadImage( filename );
+    if( input.IsNull() )
+      {
+      input = ReadImage( filename );
+      }
+    return input;
+    };
+
+  //Deep copy of buffer, regions and geometry without running a pipeline
   static ImagePointer CopyImage( ImagePointer image )
     {
-    CastFilterPointer cast = CastFilter::New();
-    cast->SetInput( image );
-    cast->Update();
-    return cast->GetOutput();
+    ImagePointer copy = Image::New();
+    copy->CopyInformation( image );
+    copy->SetLargestPossibleRegion( image->GetLargestPossibleRegion() );
+    copy->SetBufferedRegion( image->GetBufferedRegion() );
+    copy->SetRequestedRegion( image->GetRequestedRegion() );
+    copy->Allocate();
+    std::memcpy( copy->GetBufferPointer(), image->GetBufferPointer(),
+      image->GetBufferedRegion().GetNumberOfPixels() * sizeof( Precision ) );
+    return copy;
     };
 
   //Save an image from a vector
   static void saveImage( ImagePointer image, const std::string &filename )
     {
-    ImageWriterPointer writer = ImageWriter::New();
-    writer->SetFileName( filename );
-    writer->SetInput( image );
-    writer->Update();
+    WriteImage( image, filename );
     };
 
   static ImagePointer readImage( const std::string &filename )
     {
-    ImagePointer input = NULL;
-    ImageReaderPointer imageReader = ImageReader::New();
-    imageReader->SetFileName( filename );
-    imageReader->Update();
-    input = imageReader->GetOutput();
-    return input;
+    return ReadImage( filename );
     };
 
   static ImagePointer copyImage( ImagePointer image )
     {
-    CastFilterPointer cast = CastFilter::New();
-    cast->SetInput( image );
-    cast->Update();
-    return cast->GetOutput();
+    return CopyImage( image );
     };
 
 };
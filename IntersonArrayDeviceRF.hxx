@@ -21,6 +21,18 @@ limitations under the License.
 #ifndef INTERSONARRAYDEVICERF_H
 #define INTERSONARRAYDEVICERF_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "IntersonArrayCxxControlsHWControls.h"
@@ -28,7 +40,11 @@ limitations under the License.
 
 #include "itkImage.h"
 
-class IntersonArrayDeviceRF
+#include "BModeFrameSource.hxx"
+#include "FrameRingBuffer.hxx"
+#include "FrameHistory.hxx"
+
+class IntersonArrayDeviceRF : public BModeFrameSource
 {
 
 public:
@@ -37,6 +53,9 @@ public:
 
   typedef ContainerType::PixelType PixelType;
   typedef itk::Image< PixelType, 2 > ImageType;
+  typedef itk::Image< PixelType, 3 > ImageType3d;
+  static_assert( std::is_same< ImageType, BModeFrameSource::ImageType >::value,
+    "B-mode pixel type of the SDK differs from BModeFrameSource" );
 
   typedef ContainerType::RFImagePixelType RFPixelType;
   typedef itk::Image< RFPixelType, 2 > RFImageType;
@@ -45,21 +64,45 @@ public:
   typedef IntersonArrayCxx::Controls::HWControls HWControlsType;
   typedef HWControlsType::FrequenciesType FrequenciesType;
 
+  //One setting of a frequency x voltage sweep
+  struct SweepPoint
+    {
+    SweepPoint( unsigned char f = 0, unsigned char v = 0, int n = 1 )
+      : frequencyIndex( f ), voltage( v ), nSamples( n ) {};
+    unsigned char frequencyIndex;
+    unsigned char voltage;
+    int nSamples;
+    };
+
+  //Frames recorded for a SweepPoint. Depending on the probe mode either
+  //rfImages or bModeImages holds nSamples consecutive frames.
+  struct SweepResult
+    {
+    SweepPoint point;
+    bool success;
+    std::vector< RFImageType::Pointer > rfImages;
+    std::vector< ImageType::Pointer > bModeImages;
+    };
+
   IntersonArrayDeviceRF() 
-    : bModeCurrent( -1 ), rfCurrent( -1 ), nBModeImagesAcquired( 0 )
+    : geometryGeneration( 0 )
     {
     //Setup defaults
     frequencyIndex = 0;
     focusIndex = 0;
     highVoltage = 10;
     gain = 100;
-    depth = 100;
+    //0 selects the default depth of the probe in ConnectProbe
+    depth = 0;
     steering = 0;
     probeId = -1;
 
     SetRingBufferSize( 10 );
     probeIsConnected = false;
     probeIsRunning = false;
+
+    sweepSettleFrames = 2;
+    sweepFrameTimeout = 2000;
     };
 
   ~IntersonArrayDeviceRF()
@@ -70,6 +113,7 @@ public:
     {
     hwControls.StopAcquisition();
     container.StopReadScan();
+    probeIsRunning = false;
     };
 
   bool Start()
@@ -90,48 +134,185 @@ public:
      return probeIsRunning;
     };
 
-  bool GetDoubler()
+  //Probe settings applied together by CommitSettings. Obtain the current
+  //settings with GetSettings, change any combination of fields and commit
+  //them with a single stop/start of the probe.
+  struct Settings
     {
-    return container.GetDoubler();
-    }
-
-  void SetDoubler( bool doubler )
-    {
-    if( doubler != GetDoubler() )
-      {
-      Stop();
-      container.SetDoubler( doubler );
-      Start();
-      }
-    }
+    unsigned char frequencyIndex;
+    unsigned char focusIndex;
+    unsigned char voltage;
+    int gain;
+    int depth;
+    bool doubler;
+    int steering;
+    };
 
-  unsigned char GetFrequency()
+  Settings GetSettings()
     {
-    return frequencyIndex;
+    Settings settings;
+    settings.frequencyIndex = frequencyIndex;
+    settings.focusIndex = focusIndex;
+    settings.voltage = highVoltage;
+    settings.gain = gain;
+    settings.depth = depth;
+    settings.doubler = container.GetDoubler();
+    settings.steering = steering;
+    return settings;
     }
 
-  bool SetFrequency( unsigned char fIndex )
+  //Apply all changed settings as one transaction: stop, apply, reallocate
+  //the ring buffers if the image geometry changed, and restart if the
+  //probe was running. Invalid frequency indices reject the whole
+  //transaction. Returns false if any setting could not be applied, the
+  //remaining settings are still applied.
+  bool CommitSettings( const Settings &settings )
     {
-    if( fIndex == frequencyIndex )
+    const Settings current = GetSettings();
+    const bool frequencyChanged =
+      settings.frequencyIndex != current.frequencyIndex ||
+      settings.focusIndex != current.focusIndex ||
+      settings.steering != current.steering;
+    const bool geometryChanged =
+      settings.depth != current.depth ||
+      settings.doubler != current.doubler ||
+      settings.steering != current.steering;
+    if( !frequencyChanged && !geometryChanged &&
+      settings.voltage == current.voltage && settings.gain == current.gain )
       {
       return true;
       }
-    bool success = false;
-    if( fIndex >= 0 && fIndex < frequencies.size() )
+    if( settings.frequencyIndex >= frequencies.size() && probeIsConnected )
+      {
+      return false;
+      }
+    if( !probeIsConnected )
+      {
+      //Applied by ConnectProbe
+      container.SetDoubler( settings.doubler );
+      frequencyIndex = settings.frequencyIndex;
+      focusIndex = settings.focusIndex;
+      highVoltage = settings.voltage;
+      gain = settings.gain;
+      steering = settings.steering;
+      depth = settings.depth;
+      return true;
+      }
+
+    const bool wasRunning = probeIsRunning;
+    if( wasRunning )
       {
       Stop();
+      }
+
+    bool success = true;
+    if( settings.doubler != current.doubler )
+      {
+      container.SetDoubler( settings.doubler );
+      }
+    if( frequencyChanged )
+      {
       hwControls.GetFrequency( frequencies );
-      if( hwControls.SetFrequencyAndFocus( fIndex, focusIndex,
-        steering ) )
+      if( hwControls.SetFrequencyAndFocus( settings.frequencyIndex,
+        settings.focusIndex, settings.steering ) )
+        {
+        frequencyIndex = settings.frequencyIndex;
+        focusIndex = settings.focusIndex;
+        steering = settings.steering;
+        }
+      else
+        {
+        success = false;
+        }
+      }
+    if( settings.voltage != current.voltage )
+      {
+      if( hwControls.SendHighVoltage( settings.voltage, settings.voltage ) )
+        {
+        highVoltage = settings.voltage;
+        }
+      else
+        {
+        success = false;
+        }
+      }
+    if( settings.gain != current.gain )
+      {
+      if( hwControls.SendDynamic( settings.gain ) )
         {
-        frequencyIndex = fIndex;
-        success = true;
+        gain = settings.gain;
         }
+      else
+        {
+        success = false;
+        }
+      }
+    if( geometryChanged )
+      {
+      depth = hwControls.ValidDepth( settings.depth );
+      if( depth != settings.depth )
+        {
+        std::cout << "Error setting depth" << std::endl;
+        success = false;
+        }
+      height = hwControls.GetLinesPerArray();
+      SetupScanConverter();
+      geometryGeneration++;
+      InitalizeBModeRingBuffer();
+      InitalizeRFRingBuffer();
+      }
+
+    if( wasRunning )
+      {
       Start();
       }
     return success;
     }
 
+  //Incremented whenever the probe is connected or a commit changes the
+  //image geometry (depth, doubler, steering). Consumers caching sizes or
+  //spacings compare it against the generation they were set up with.
+  unsigned long GetGeometryGeneration()
+    {
+    return geometryGeneration;
+    }
+
+  bool GetDoubler()
+    {
+    return container.GetDoubler();
+    }
+
+  void SetDoubler( bool doubler )
+    {
+    Settings settings = GetSettings();
+    settings.doubler = doubler;
+    CommitSettings( settings );
+    }
+
+  unsigned char GetFrequency()
+    {
+    return frequencyIndex;
+    }
+
+  bool SetFrequency( unsigned char fIndex )
+    {
+    Settings settings = GetSettings();
+    settings.frequencyIndex = fIndex;
+    return CommitSettings( settings );
+    }
+
+  unsigned char GetFocus()
+    {
+    return focusIndex;
+    }
+
+  bool SetFocus( unsigned char fIndex )
+    {
+    Settings settings = GetSettings();
+    settings.focusIndex = fIndex;
+    return CommitSettings( settings );
+    }
+
   unsigned char GetVoltage()
     {
     return highVoltage;
@@ -139,47 +320,29 @@ public:
 
   bool SetVoltage( unsigned char voltage )
     {
-    bool success = true;
-    if( highVoltage != voltage )
-      {
-      Stop();
-      success = hwControls.SendHighVoltage( voltage, voltage );
-      if(success){
-         highVoltage = voltage;
-      }
-      Start();
-      }
-    return success;
+    Settings settings = GetSettings();
+    settings.voltage = voltage;
+    return CommitSettings( settings );
     }
 
   bool SetFrequencyAndVoltage( unsigned char fIndex, unsigned char voltage )
     {
-    if( fIndex == frequencyIndex && voltage == highVoltage )
-      {
-      return true;
-      }
-    Stop();
-    bool success = false;
-    if( fIndex >= 0 && fIndex < frequencies.size() )
-      {
-      hwControls.GetFrequency( frequencies );
-      if( hwControls.SetFrequencyAndFocus( frequencyIndex, focusIndex,
-        steering ) )
-        {
-        success = true;
-        frequencyIndex = fIndex;
-        }
-      }
-    if( hwControls.SendHighVoltage( voltage, voltage ) )
-      {
-      highVoltage = voltage;
-      }
-    else
-      {
-      success = false;
-      }
-    Start();
-    return success;
+    Settings settings = GetSettings();
+    settings.frequencyIndex = fIndex;
+    settings.voltage = voltage;
+    return CommitSettings( settings );
+    }
+
+  int GetGain()
+    {
+    return gain;
+    }
+
+  bool SetGain( int g )
+    {
+    Settings settings = GetSettings();
+    settings.gain = g;
+    return CommitSettings( settings );
     }
 
   void SetBMode()
@@ -202,37 +365,244 @@ public:
       }
     }
 
+  int GetDepth()
+    {
+    return depth;
+    }
+
   int SetDepth( int d )
     {
-    if( d == depth )
+    Settings settings = GetSettings();
+    settings.depth = d;
+    CommitSettings( settings );
+    return depth;
+    };
+
+  //Order sweep points so that the expensive frequency changes happen once
+  //per frequency, starting with the current frequency. Voltages run up and
+  //down in alternating order (serpentine) so consecutive points differ by
+  //a single voltage step. Points with identical settings end up adjacent
+  //and need no reconfiguration.
+  std::vector< int > OrderSweep( const std::vector< SweepPoint > &points )
+    {
+    std::vector< int > order( points.size() );
+    for( unsigned int i = 0; i < order.size(); i++ )
       {
-      return d;
+      order[ i ] = i;
       }
-    Stop();
-    depth = hwControls.ValidDepth( d );
-    if( depth != d )
+    const unsigned char current = frequencyIndex;
+    std::stable_sort( order.begin(), order.end(),
+      [ &points, current ]( int a, int b )
       {
-      std::cout << "Error setting depth" << std::endl;
+      const unsigned char fa = points[ a ].frequencyIndex;
+      const unsigned char fb = points[ b ].frequencyIndex;
+      if( fa != fb )
+        {
+        if( fa == current || fb == current )
+          {
+          return fa == current;
+          }
+        return fa < fb;
+        }
+      return points[ a ].voltage < points[ b ].voltage;
+      } );
+
+    //Reverse every other frequency group
+    bool reverse = false;
+    for( unsigned int i = 0; i < order.size(); )
+      {
+      unsigned int j = i + 1;
+      while( j < order.size() && points[ order[ j ] ].frequencyIndex
+        == points[ order[ i ] ].frequencyIndex )
+        {
+        j++;
+        }
+      if( reverse )
+        {
+        std::reverse( order.begin() + i, order.begin() + j );
+        }
+      reverse = !reverse;
+      i = j;
       }
-    SetupScanConverter();
-    InitalizeBModeRingBuffer();
-    InitalizeRFRingBuffer();
+    return order;
+    }
 
-    Start();
+  //Record a frequency x voltage sweep. Points are visited in the order
+  //given by OrderSweep, each change of settings costs a single stop/start
+  //of the probe. Instead of fixed sleeps the probe is considered settled
+  //once sweepSettleFrames frames have been acquired with the new settings.
+  //Results are returned in the order of the input points. The original
+  //frequency and voltage are restored at the end, and a probe started by
+  //the sweep is stopped again.
+  std::vector< SweepResult > Sweep( const std::vector< SweepPoint > &points )
+    {
+    std::vector< SweepResult > results( points.size() );
+    const unsigned char startFrequency = frequencyIndex;
+    const unsigned char startVoltage = highVoltage;
+    const bool rf = container.GetRFData();
 
-    return depth;
-    };
+    const bool wasRunning = probeIsRunning;
+    if( !wasRunning )
+      {
+      Start();
+      }
+
+    std::vector< int > order = OrderSweep( points );
+    for( unsigned int i = 0; i < order.size(); i++ )
+      {
+      const SweepPoint &point = points[ order[ i ] ];
+      SweepResult &result = results[ order[ i ] ];
+      result.point = point;
+      result.success = false;
+
+      if( point.frequencyIndex != frequencyIndex ||
+        point.voltage != highVoltage )
+        {
+        if( !SetFrequencyAndVoltage( point.frequencyIndex, point.voltage ) )
+          {
+          std::cout << "Failed to set frequency index "
+            << ( int )point.frequencyIndex << " and voltage "
+            << ( int )point.voltage << std::endl;
+          continue;
+          }
+        //Frames counted after the restart are acquired with the new
+        //settings, skip the first few while the high voltage settles
+        if( !WaitForFrames( rf, GetNumberOfImagesAcquired( rf )
+          + sweepSettleFrames ) )
+          {
+          std::cout << "Timeout waiting for probe to settle" << std::endl;
+          continue;
+          }
+        }
+
+      result.success = true;
+      long last = GetNumberOfImagesAcquired( rf );
+      for( int sample = 0; sample < point.nSamples; sample++ )
+        {
+        if( !WaitForFrames( rf, last + 1 ) )
+          {
+          std::cout << "Timeout waiting for frame" << std::endl;
+          result.success = false;
+          break;
+          }
+        last = GetNumberOfImagesAcquired( rf );
+        //A frame that could not be read consistently is replaced by the
+        //next one
+        if( rf )
+          {
+          RFImageType::Pointer image = GetRFImage( GetCurrentRFIndex() );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.rfImages.push_back( image );
+          }
+        else
+          {
+          ImageType::Pointer image = GetBModeImage( GetCurrentBModeIndex() );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.bModeImages.push_back( image );
+          }
+        }
+      }
+
+    SetFrequencyAndVoltage( startFrequency, startVoltage );
+    if( !wasRunning )
+      {
+      Stop();
+      }
+    return results;
+    }
+
+  //Number of frames to discard after a reconfiguration during a sweep
+  void SetSweepSettleFrames( int n )
+    {
+    sweepSettleFrames = n;
+    }
 
+  //Block until at least count RF (or B-mode) frames have been acquired in
+  //total. Returns false after sweepFrameTimeout milliseconds.
+  bool WaitForFrames( bool rf, long count )
+    {
+    std::unique_lock< std::mutex > lock( frameMutex );
+    return frameCondition.wait_for( lock,
+      std::chrono::milliseconds( sweepFrameTimeout ),
+      [ this, rf, count ]
+      {
+      return GetNumberOfImagesAcquired( rf ) >= count;
+      } );
+    }
+
+  //Can be called at any time, also while the probe is running. The most
+  //recent frames are kept.
   void SetRingBufferSize( int size )
     {
-    //TODO: would need to allcoate images if called after probe is connected
-    rfRingBuffer.resize( size );
-    bModeRingBuffer.resize( size );
+    rfRing.SetSize( size );
+    bModeRing.SetSize( size );
+    }
+
+  //Size the ring buffers to hold the given number of seconds at the
+  //measured frame rate of each ring
+  void SetRingBufferDuration( double seconds )
+    {
+    rfRing.SetSizeInSeconds( seconds );
+    bModeRing.SetSizeInSeconds( seconds );
+    }
+
+  //Keep a compressed history of frames beyond the ring buffers, limited
+  //to the given number of bytes per mode (see FrameHistory.hxx). 0
+  //disables the history.
+  void SetHistoryMemoryBudget( size_t bModeBytes, size_t rfBytes )
+    {
+    bModeHistory.SetMemoryBudget( bModeBytes );
+    rfHistory.SetMemoryBudget( rfBytes );
+    }
+
+  //The last seconds of B-mode frames from the history, oldest first.
+  //NULL if the history is empty.
+  ImageType3d::Pointer GetBModeHistory( double seconds )
+    {
+    return bModeHistory.ExportLastSeconds( seconds );
+    }
+
+  RFImageType3d::Pointer GetRFHistory( double seconds )
+    {
+    return rfHistory.ExportLastSeconds( seconds );
+    }
+
+  double GetBModeHistoryDuration()
+    {
+    return bModeHistory.GetDuration();
+    }
+
+  double GetRFHistoryDuration()
+    {
+    return rfHistory.GetDuration();
     }
-  
+
   int GetRingBufferSize()
     {
-    return rfRingBuffer.size();
+    return rfRing.GetSize();
+    }
+
+  int GetBModeRingBufferSize()
+    {
+    return bModeRing.GetSize();
+    }
+
+  double GetBModeFrameRate()
+    {
+    return bModeRing.GetFrameRate();
+    }
+
+  double GetRFFrameRate()
+    {
+    return rfRing.GetFrameRate();
     }
 
   bool ConnectProbe( bool rfData )
@@ -306,13 +676,22 @@ public:
     std::cout << "Height: " << height << std::endl;
 
     std::cout << "Valid depth" << std::endl;
-    if( probeId == hwControls.ID_CA_5_0MHz )
-      {
-      depth = 120; // GP-C01 has fixed RF depth of 10.5cm per email
-      }
-    else
+    //A depth committed before connecting is kept if the probe supports it
+    if( depth <= 0 || hwControls.ValidDepth( depth ) != depth )
       {
-      depth = 55; // CP-C01 has fixed RF depth of 5.25cm per email
+      if( depth > 0 )
+        {
+        std::cerr << "Requested depth " << depth
+          << " not supported, using the probe default." << std::endl;
+        }
+      if( probeId == hwControls.ID_CA_5_0MHz )
+        {
+        depth = 120; // GP-C01 has fixed RF depth of 10.5cm per email
+        }
+      else
+        {
+        depth = 55; // CP-C01 has fixed RF depth of 5.25cm per email
+        }
       }
 
     if( hwControls.ValidDepth( depth ) == depth )
@@ -331,6 +710,7 @@ public:
       }
     
     std::cout << "Initalizing Buffers" << std::endl;
+    geometryGeneration++;
     InitalizeBModeRingBuffer();
     InitalizeRFRingBuffer();
     
@@ -349,79 +729,69 @@ public:
 
   ImageType::Pointer GetBModeImage( int ringBufferIndex )
     {
-    ImageType::Pointer image = CreateBModeImage();
-    const ImageType::RegionType & largestRegion =
-      image->GetLargestPossibleRegion();
-    const ImageType::SizeType imageSize = largestRegion.GetSize();
-    PixelType *imageBuffer = image->GetPixelContainer()->GetBufferPointer();
-    PixelType *ringImageBuffer = bModeRingBuffer[ringBufferIndex]->GetPixelContainer()->GetBufferPointer();
-    std::memcpy( imageBuffer, ringImageBuffer,
-                 imageSize[ 0 ] * imageSize[ 1 ] * sizeof( PixelType ) );
-    return image; 
+    return bModeRing.GetImage( ringBufferIndex );
     };
 
-  ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex )
+  ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex ) override
     {
-    return GetBModeImage( absoluteIndex % bModeRingBuffer.size() );
+    return bModeRing.GetImageAbsolute( absoluteIndex );
     };
 
-  long GetNumberOfBModeImagesAcquired()
+  long GetNumberOfBModeImagesAcquired() override
     {
-    return nBModeImagesAcquired;
+    return bModeRing.GetNumberOfFrames();
     };
 
   int GetCurrentBModeIndex()
     {
-    return bModeCurrent;
+    return bModeRing.GetCurrentIndex();
     };
 
   RFImageType::Pointer GetRFImage( int ringBufferIndex )
     {
-    
-    RFImageType::Pointer image = CreateRFImage();
-    const RFImageType::RegionType & largestRegion =
-      image->GetLargestPossibleRegion();
-    const RFImageType::SizeType imageSize = largestRegion.GetSize();
-    RFPixelType *imageBuffer = image->GetPixelContainer()->GetBufferPointer();
-    RFPixelType *ringImageBuffer = rfRingBuffer[ringBufferIndex]->GetPixelContainer()->GetBufferPointer();
-    std::memcpy( imageBuffer, ringImageBuffer,
-                 imageSize[ 0 ] * imageSize[ 1 ] * sizeof( RFPixelType ) );
-    return image; 
+    return rfRing.GetImage( ringBufferIndex );
     };
 
   RFImageType::Pointer GetRFImageAbsolute( int absoluteIndex )
     {
-    return GetRFImage( absoluteIndex % rfRingBuffer.size() );
+    return rfRing.GetImageAbsolute( absoluteIndex );
     };
 
   long GetRFBModeImagesAcquired()
     {
-    return nRFImagesAcquired;
+    return rfRing.GetNumberOfFrames();
     };
 
   int GetCurrentRFIndex()
     {
-    return rfCurrent;
+    return rfRing.GetCurrentIndex();
     };
 
+  //Called on the acquisition thread with every new frame, e.g. by
+  //FrameBusPublisher to publish it without going through the ring
+  //buffers. Set before Start.
+  typedef std::function< void( const PixelType * ) > BModeFrameCallback;
+  typedef std::function< void( const RFPixelType * ) > RFFrameCallback;
+
+  void SetNewBModeFrameCallback( BModeFrameCallback callback )
+    {
+    bModeFrameCallback = callback;
+    }
+
+  void SetNewRFFrameCallback( RFFrameCallback callback )
+    {
+    rfFrameCallback = callback;
+    }
+
   void AddBModeImageToBuffer( PixelType *buffer )
     {
-    unsigned int index = bModeCurrent + 1;
-    if( index >= bModeRingBuffer.size() )
+    if( bModeFrameCallback )
       {
-      index = 0;
+      bModeFrameCallback( buffer );
       }
-    ImageType::Pointer image = bModeRingBuffer[ index ];
-    const ImageType::RegionType & largestRegion =
-      image->GetLargestPossibleRegion();
-    const ImageType::SizeType imageSize = largestRegion.GetSize();
-
-    PixelType *imageBuffer = image->GetPixelContainer()->GetBufferPointer();
-    std::memcpy( imageBuffer, buffer,
-      imageSize[ 0 ] * imageSize[ 1 ] * sizeof( PixelType ) );
-
-    nBModeImagesAcquired++;
-    bModeCurrent = index;
+    bModeRing.Add( buffer );
+    bModeHistory.Push( buffer );
+    NotifyNewFrame();
     }
 
   static void __stdcall AcquireBModeImage( PixelType *buffer, void *instance )
@@ -432,23 +802,13 @@ public:
 
   void AddRFImageToBuffer( RFPixelType *buffer )
     {
-    unsigned int index = rfCurrent + 1;
-    if( index >= rfRingBuffer.size() )
+    if( rfFrameCallback )
       {
-      index = 0;
+      rfFrameCallback( buffer );
       }
-    RFImageType::Pointer image = rfRingBuffer[ index ];
-    const ImageType::RegionType & largestRegion =
-      image->GetLargestPossibleRegion();
-
-    const ImageType::SizeType imageSize = largestRegion.GetSize();
-
-    RFPixelType *imageBuffer = image->GetPixelContainer()->GetBufferPointer();
-    std::memcpy( imageBuffer, buffer,
-      imageSize[ 0 ] * imageSize[ 1 ] * sizeof( RFPixelType ) );
-
-    nRFImagesAcquired++;
-    rfCurrent = index;
+    rfRing.Add( buffer );
+    rfHistory.Push( buffer );
+    NotifyNewFrame();
     }
 
   static void __stdcall AcquireRFImage( RFPixelType *buffer, void *instance )
@@ -493,74 +853,144 @@ public:
      };
 
 
+     //Snapshot of the RF ring buffer in chronological order (oldest frame
+     //first) as a 3D image. Acquisition keeps running during the copy,
+     //frames overwritten while copying are dropped (see
+     //FrameRingBuffer::CopyOrdered). Returns NULL if no frames are
+     //available or the geometry changed during the copy.
      RFImageType3d::Pointer GetRingBufferRFOrdered()
        {
-       bool wasRunning = probeIsRunning;
-       if( wasRunning )
+       const unsigned long generation = geometryGeneration;
+       const RFImageType::SizeType frameSize = rfRing.GetImageSize();
+       const long nFrames = std::min< long >( GetRingBufferSize(),
+         rfRing.GetNumberOfFrames() );
+       if( nFrames == 0 )
          {
-         Stop();
+         return NULL;
          }
- 
-       RFImageType3d::Pointer image = RFImageType3d::New();
-
-       RFImageType3d::IndexType imageIndex3d;
-       imageIndex3d.Fill( 0 );
-
-       RFImageType::IndexType imageIndex2d;
-       imageIndex2d.Fill( 0 );
-       RFImageType3d::SizeType imageSize;
-       imageSize[ 0 ] = ContainerType::MAX_RFSAMPLES;
-       imageSize[ 1 ] = height;
-       imageSize[ 2 ] = GetRingBufferSize();
-
-       RFImageType3d::RegionType imageRegion;
-       imageRegion.SetIndex( imageIndex3d );
-       imageRegion.SetSize( imageSize );
-
-       image->SetRegions( imageRegion );
-       image->Allocate();
-       for(int i=0; i< GetRingBufferSize(); i++)
+
+       RFImageType3d::Pointer image = CreateRFImage3d( frameSize, nFrames );
+       long copied = rfRing.CopyOrdered( image->GetBufferPointer(),
+         frameSize[ 0 ] * frameSize[ 1 ], nFrames );
+       if( copied == 0 || generation != geometryGeneration )
          {
-         int zIndex = 0;
-         if( i <= rfCurrent ){
-          zIndex = GetRingBufferSize() - rfCurrent - 1 + i; 
+         return NULL;
          }
-         else{
-           zIndex = i-rfCurrent-1; 
+       if( copied < nFrames )
+         {
+         RFImageType3d::Pointer cropped =
+           CreateRFImage3d( frameSize, copied );
+         std::memcpy( cropped->GetBufferPointer(), image->GetBufferPointer(),
+           cropped->GetPixelContainer()->Size() * sizeof( RFPixelType ) );
+         image = cropped;
          }
-         imageIndex3d[2] = zIndex;
-         for(unsigned int j=0; j<imageSize[0]; j++)
-            {
-            imageIndex3d[0] = j;
-            imageIndex2d[0] = j;
-            for(unsigned int k=0; k<imageSize[1]; k++)
-              {
-              imageIndex3d[1] = k;
-              imageIndex2d[1] = k;
-              image->SetPixel( imageIndex3d, rfRingBuffer[zIndex]->GetPixel(imageIndex2d) );
-              }
-            }
+       return image;
+       }
+
+     //As above into a caller provided buffer of maxFrames * MAX_RFSAMPLES *
+     //GetNumberOfLines() pixels, sized for the given geometry generation.
+     //Returns the number of frames copied, 0 if the geometry is no longer
+     //that of the buffer.
+     long GetRingBufferRFOrdered( RFPixelType *buffer, int maxFrames,
+       unsigned long generation, long *firstFrame = NULL )
+       {
+       if( generation != geometryGeneration )
+         {
+         return 0;
          }
+       long copied = rfRing.CopyOrdered( buffer,
+         ContainerType::MAX_RFSAMPLES * GetNumberOfLines(), maxFrames,
+         firstFrame );
+       return generation == geometryGeneration ? copied : 0;
+       }
 
-       if( wasRunning )
+     //Stream the RF ring buffer in chronological order straight into a raw
+     //NRRD file, one frame at a time, without an in memory copy of the
+     //whole ring. The file is written under a temporary name and only
+     //replaces filename once complete. Returns the number of frames
+     //written, 0 if nothing was written.
+     long WriteRingBufferRFOrdered( const std::string &filename )
+       {
+       const unsigned long generation = geometryGeneration;
+       const RFImageType::SizeType frameSize = rfRing.GetImageSize();
+       const size_t nPixels = frameSize[ 0 ] * frameSize[ 1 ];
+       const std::string temporary = filename + ".tmp";
+       std::ofstream file( temporary.c_str(), std::ios::binary );
+       if( !file )
          {
-         Start();
+         return 0;
          }
-       return image;
 
+       //The number of frames is only known after the copy, reserve a fixed
+       //width field for it and fill it in at the end
+       file << "NRRD0004\n";
+       file << "type: " << ( std::numeric_limits< RFPixelType >::is_signed ?
+         "" : "u" ) << "int" << 8 * sizeof( RFPixelType ) << "\n";
+       file << "dimension: 3\n";
+       file << "sizes: " << frameSize[ 0 ] << " " << frameSize[ 1 ] << " ";
+       const std::streampos countPosition = file.tellp();
+       file << std::setw( 10 ) << 0 << "\n";
+       file << "encoding: raw\n";
+       const int one = 1;
+       file << "endian: " << ( *( const char * )&one == 1 ? "little" : "big" )
+         << "\n\n";
+       const std::streampos dataStart = file.tellp();
+       NrrdSink sink( file, dataStart, nPixels );
+
+       long copied = rfRing.CopyOrdered( sink, nPixels, GetRingBufferSize() );
+       file.seekp( countPosition );
+       file << std::setw( 10 ) << copied;
+       file.close();
+       bool complete = !file.fail() && copied > 0 &&
+         generation == geometryGeneration;
+
+       //Frames dropped during the copy restart the output at the start of
+       //the data, frames written before that remain behind the last one
+       //and are cut off
+       std::string result = temporary;
+       if( complete && sink.GetNumberOfFrames() > copied )
+         {
+         result = filename + ".trim";
+         complete = CopyFilePrefix( temporary, result, dataStart +
+           ( std::streamoff )( copied * nPixels * sizeof( RFPixelType ) ) );
+         std::remove( temporary.c_str() );
+         }
+       if( complete )
+         {
+         //rename does not replace an existing file on Windows
+         std::remove( filename.c_str() );
+         complete = std::rename( result.c_str(), filename.c_str() ) == 0;
+         }
+       if( !complete )
+         {
+         std::remove( result.c_str() );
+         return 0;
+         }
+       return copied;
        }
 
 private:
 
   //BMode Ringbuffer for storing images continuously
-  std::atomic< int > bModeCurrent;
-  std::vector< ImageType::Pointer > bModeRingBuffer;
-  long nBModeImagesAcquired;
+  FrameRingBuffer< ImageType > bModeRing;
 
   //RF Ringbuffer for storing images continuously
-  std::atomic< int > rfCurrent;
-  std::vector< RFImageType::Pointer > rfRingBuffer;
-  long nRFImagesAcquired;
+  FrameRingBuffer< RFImageType > rfRing;
+
+  //Compressed long term history, disabled unless a memory budget is set
+  FrameHistory< ImageType > bModeHistory;
+  FrameHistory< RFImageType > rfHistory;
+
+  //Signaled for every new frame, used to wait for frames during sweeps
+  std::mutex frameMutex;
+  std::condition_variable frameCondition;
+  int sweepSettleFrames;
+  int sweepFrameTimeout;
+
+  std::atomic< unsigned long > geometryGeneration;
+
+  BModeFrameCallback bModeFrameCallback;
+  RFFrameCallback rfFrameCallback;
 
   //Probe setups
   bool probeIsConnected;
@@ -580,53 +1010,100 @@ private:
   HWControlsType hwControls;
   ContainerType container;
 
-  ImageType::Pointer CreateBModeImage()
+  long GetNumberOfImagesAcquired( bool rf )
     {
-    ImageType::Pointer image = ImageType::New();
-
-    ImageType::IndexType imageIndex;
-    imageIndex.Fill( 0 );
+    return rf ? rfRing.GetNumberOfFrames() : bModeRing.GetNumberOfFrames();
+    }
 
-    ImageType::SizeType imageSize;
-    imageSize[ 0 ] = ContainerType::MAX_SAMPLES;
-    imageSize[ 1 ] = height;
+  void NotifyNewFrame()
+    {
+    //Lock so a waiting thread can not miss the notification between
+    //checking the frame count and going to sleep
+      {
+      std::lock_guard< std::mutex > lock( frameMutex );
+      }
+    frameCondition.notify_all();
+    }
 
-    ImageType::RegionType imageRegion;
+  RFImageType3d::Pointer CreateRFImage3d(
+    const RFImageType::SizeType &frameSize, long nFrames )
+    {
+    RFImageType3d::Pointer image = RFImageType3d::New();
+    RFImageType3d::IndexType imageIndex;
+    imageIndex.Fill( 0 );
+    RFImageType3d::SizeType imageSize;
+    imageSize[ 0 ] = frameSize[ 0 ];
+    imageSize[ 1 ] = frameSize[ 1 ];
+    imageSize[ 2 ] = nFrames;
+    RFImageType3d::RegionType imageRegion;
     imageRegion.SetIndex( imageIndex );
     imageRegion.SetSize( imageSize );
-
     image->SetRegions( imageRegion );
     image->Allocate();
-
     return image;
     }
 
-  void InitalizeBModeRingBuffer()
+  //Writes frames handed out by FrameRingBuffer::CopyOrdered to a file
+  class NrrdSink
+    {
+    public:
+      NrrdSink( std::ofstream &f, std::streampos start, size_t n )
+        : file( f ), dataStart( start ), frame( n ), nFrames( 0 ) {};
+
+      RFPixelType *GetBuffer( long )
+        {
+        return &frame[ 0 ];
+        };
+
+      bool Commit( long k )
+        {
+        file.seekp( dataStart + ( std::streamoff )( k * frame.size() *
+          sizeof( RFPixelType ) ) );
+        file.write( ( const char * )&frame[ 0 ],
+          frame.size() * sizeof( RFPixelType ) );
+        nFrames = std::max( nFrames, k + 1 );
+        return file.good();
+        };
+
+      //Number of frames in the file, including ones written before the
+      //output restarted
+      long GetNumberOfFrames() const
+        {
+        return nFrames;
+        };
+
+    private:
+      std::ofstream &file;
+      std::streampos dataStart;
+      std::vector< RFPixelType > frame;
+      long nFrames;
+    };
+
+  //Copy the first length bytes of a file into a new one
+  static bool CopyFilePrefix( const std::string &from, const std::string &to,
+    std::streamoff length )
     {
-    for( unsigned int i = 0; i < bModeRingBuffer.size(); i++ )
+    std::ifstream in( from.c_str(), std::ios::binary );
+    std::ofstream out( to.c_str(), std::ios::binary );
+    std::vector< char > buffer( 1 << 20 );
+    while( length > 0 && in && out )
       {
-      bModeRingBuffer[ i ] = CreateBModeImage();
+      in.read( &buffer[ 0 ], std::min< std::streamoff >( length,
+        buffer.size() ) );
+      out.write( &buffer[ 0 ], in.gcount() );
+      length -= in.gcount();
       }
-    }
+    out.close();
+    return length == 0 && !out.fail();
+    };
 
-  RFImageType::Pointer CreateRFImage()
+  void InitalizeBModeRingBuffer()
     {
-    RFImageType::Pointer image = RFImageType::New();
-
-    RFImageType::IndexType imageIndex;
-    imageIndex.Fill( 0 );
-
-    RFImageType::SizeType imageSize;
-    imageSize[ 0 ] = ContainerType::MAX_RFSAMPLES;
+    ImageType::SizeType imageSize;
+    imageSize[ 0 ] = ContainerType::MAX_SAMPLES;
     imageSize[ 1 ] = height;
-
-    RFImageType::RegionType imageRegion;
-    imageRegion.SetIndex( imageIndex );
-    imageRegion.SetSize( imageSize );
-
-    image->SetRegions( imageRegion );
-    image->Allocate();
-    return image;
+    bModeRing.Allocate( imageSize );
+    bModeHistory.SetImageSize( imageSize, geometryGeneration );
     }
 
   void InitalizeRFRingBuffer()
@@ -635,11 +1112,11 @@ private:
     std::cout << "Setting up RFRingBuffer" << std::endl;
 #endif
 
-    for( unsigned int i = 0; i < rfRingBuffer.size(); i++ )
-      {
-
-      rfRingBuffer[ i ] = CreateRFImage();
-      }
+    RFImageType::SizeType imageSize;
+    imageSize[ 0 ] = ContainerType::MAX_RFSAMPLES;
+    imageSize[ 1 ] = height;
+    rfRing.Allocate( imageSize );
+    rfHistory.SetImageSize( imageSize, geometryGeneration );
     }
 
   ContainerType::ScanConverterError SetupScanConverter()
@@ -0,0 +1,825 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Zero-copy reader for raw (uncompressed) NRRD files.
+//
+//The file is memory mapped and the pixel data of the returned itk::Image
+//points straight into the mapped pages. Nothing is decoded or copied; pages
+//are faulted in on first access. The mapping stays alive as long as any
+//image (or the MappedImageSequence) that references it is alive.
+//
+//The mapping is copy-on-write: writing into a returned image modifies only
+//the private copy of the touched pages, never the file on disk.
+//
+//Only "encoding: raw" files with native byte order are supported. Anything
+//else (gzip NRRDs, other formats) makes ReadImage return NULL so callers
+//can fall back to ImageIO::ReadImage.
+
+#ifndef MAPPEDIMAGEIO_H
+#define MAPPEDIMAGEIO_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+
+
+//Read only view of a whole file mapped into memory
+class MappedFile
+{
+
+public:
+
+  MappedFile() : data( NULL ), size( 0 )
+#ifdef _WIN32
+    , file( INVALID_HANDLE_VALUE ), mapping( NULL )
+#else
+    , fd( -1 )
+#endif
+    {
+    };
+
+  ~MappedFile()
+    {
+    Close();
+    };
+
+  bool Open( const std::string &filename )
+    {
+    Close();
+#ifdef _WIN32
+    file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+      NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if( file == INVALID_HANDLE_VALUE )
+      {
+      return false;
+      }
+    LARGE_INTEGER fileSize;
+    if( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart == 0 )
+      {
+      Close();
+      return false;
+      }
+    size = ( size_t )fileSize.QuadPart;
+    mapping = CreateFileMappingA( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+    if( mapping == NULL )
+      {
+      Close();
+      return false;
+      }
+    data = ( char * )MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+    if( data == NULL )
+      {
+      Close();
+      return false;
+      }
+#else
+    fd = open( filename.c_str(), O_RDONLY );
+    if( fd < 0 )
+      {
+      return false;
+      }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+      {
+      Close();
+      return false;
+      }
+    size = ( size_t )st.st_size;
+    void *ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    if( ptr == MAP_FAILED )
+      {
+      Close();
+      return false;
+      }
+    data = ( char * )ptr;
+    posix_madvise( data, size, POSIX_MADV_SEQUENTIAL );
+#endif
+    return true;
+    };
+
+  void Close()
+    {
+#ifdef _WIN32
+    if( data != NULL )
+      {
+      UnmapViewOfFile( data );
+      }
+    if( mapping != NULL )
+      {
+      CloseHandle( mapping );
+      }
+    if( file != INVALID_HANDLE_VALUE )
+      {
+      CloseHandle( file );
+      }
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if( data != NULL )
+      {
+      munmap( data, size );
+      }
+    if( fd >= 0 )
+      {
+      close( fd );
+      }
+    fd = -1;
+#endif
+    data = NULL;
+    size = 0;
+    };
+
+  char *GetData()
+    {
+    return data;
+    };
+
+  size_t GetSize()
+    {
+    return size;
+    };
+
+  //Hint the kernel that the given byte range will be needed soon. This only
+  //schedules read ahead, it never blocks on I/O.
+  void Prefetch( size_t offset, size_t length )
+    {
+    if( data == NULL || offset >= size )
+      {
+      return;
+      }
+    length = std::min( length, size - offset );
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = data + offset;
+    range.NumberOfBytes = length;
+    PrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0 );
+#endif
+#else
+    size_t page = ( size_t )sysconf( _SC_PAGESIZE );
+    size_t start = ( offset / page ) * page;
+    posix_madvise( data + start, length + ( offset - start ),
+      POSIX_MADV_WILLNEED );
+#endif
+    };
+
+private:
+
+  MappedFile( const MappedFile & );
+  MappedFile &operator=( const MappedFile & );
+
+  char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+
+};
+
+
+//Pixel container that references mapped pages and keeps the mapping alive
+template <typename TPixel>
+class MappedPixelContainer
+  : public itk::ImportImageContainer< itk::SizeValueType, TPixel >
+{
+
+public:
+
+  typedef MappedPixelContainer Self;
+  typedef itk::ImportImageContainer< itk::SizeValueType, TPixel > Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+  typedef itk::SmartPointer< const Self > ConstPointer;
+
+  itkNewMacro( Self );
+  itkTypeMacro( MappedPixelContainer, ImportImageContainer );
+
+  void SetMappedData( std::shared_ptr< MappedFile > file, TPixel *ptr,
+    itk::SizeValueType n )
+    {
+    mappedFile = file;
+    this->SetImportPointer( ptr, n, false );
+    };
+
+protected:
+
+  MappedPixelContainer() {};
+  ~MappedPixelContainer() {};
+
+private:
+
+  std::shared_ptr< MappedFile > mappedFile;
+
+};
+
+
+//Parsed NRRD header fields needed to locate and interpret raw pixel data
+struct NrrdHeader
+{
+  std::string type;
+  std::string encoding = "raw";
+  std::string endian = "little";
+  std::string dataFile;
+  std::string space;
+  int dimension = 0;
+  long byteSkip = 0;
+  long lineSkip = 0;
+  std::vector< size_t > sizes;
+  std::vector< double > spacings;
+  std::vector< std::vector< double > > directions;
+  std::vector< double > origin;
+  size_t headerLength = 0;
+};
+
+
+template <typename TImage>
+class MappedImageIO
+{
+
+public:
+
+  typedef TImage Image;
+  typedef typename Image::Pointer ImagePointer;
+  typedef typename Image::PixelType PixelType;
+  typedef typename Image::RegionType ImageRegion;
+  typedef typename Image::SizeType ImageSize;
+  typedef typename Image::IndexType ImageIndex;
+  typedef typename Image::SpacingType ImageSpacing;
+  typedef typename Image::PointType ImagePoint;
+  typedef typename Image::DirectionType ImageDirection;
+  typedef MappedPixelContainer< PixelType > PixelContainer;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, Image::ImageDimension );
+
+  //Map a raw NRRD file and wrap it as an image without copying.
+  //Returns NULL if the file can not be mapped as is.
+  static ImagePointer ReadImage( const std::string &filename )
+    {
+    NrrdHeader header;
+    std::shared_ptr< MappedFile > data;
+    size_t offset = 0;
+    if( !Open( filename, header, data, offset ) ||
+      header.dimension != (int)ImageDimension )
+      {
+      return NULL;
+      }
+    return WrapImage( header, data, offset );
+    };
+
+  //Parse the header and map the data file of a raw NRRD.
+  //On success offset is the byte offset of the first pixel in data.
+  static bool Open( const std::string &filename, NrrdHeader &header,
+    std::shared_ptr< MappedFile > &data, size_t &offset )
+    {
+    std::shared_ptr< MappedFile > file( new MappedFile() );
+    if( !file->Open( filename ) || !ParseHeader( file->GetData(),
+      file->GetSize(), header ) )
+      {
+      return false;
+      }
+    if( header.encoding != "raw" || !PixelTypeMatches( header.type ) ||
+      !NativeEndian( header ) || header.dimension < 1 ||
+      (int)header.sizes.size() != header.dimension )
+      {
+      return false;
+      }
+
+    size_t nBytes = sizeof( PixelType );
+    for( unsigned int i = 0; i < header.sizes.size(); i++ )
+      {
+      nBytes *= header.sizes[ i ];
+      }
+
+    if( header.dataFile.empty() )
+      {
+      data = file;
+      offset = header.headerLength;
+      }
+    else
+      {
+      //Detached data, relative to the header location
+      std::string path = header.dataFile;
+      size_t slash = filename.find_last_of( "/\\" );
+      if( slash != std::string::npos && path[ 0 ] != '/' &&
+        path.find( ':' ) == std::string::npos )
+        {
+        path = filename.substr( 0, slash + 1 ) + path;
+        }
+      data.reset( new MappedFile() );
+      if( !data->Open( path ) )
+        {
+        return false;
+        }
+      offset = 0;
+      }
+
+    //Line skips are relative to the start of the data
+    for( long i = 0; i < header.lineSkip; i++ )
+      {
+      const char *eol = ( const char * )std::memchr( data->GetData() + offset,
+        '\n', data->GetSize() - offset );
+      if( eol == NULL )
+        {
+        return false;
+        }
+      offset = eol - data->GetData() + 1;
+      }
+
+    if( header.byteSkip == -1 )
+      {
+      if( nBytes > data->GetSize() )
+        {
+        return false;
+        }
+      offset = data->GetSize() - nBytes;
+      }
+    else
+      {
+      offset += header.byteSkip;
+      }
+
+    if( offset + nBytes > data->GetSize() ||
+      offset % std::alignment_of< PixelType >::value != 0 )
+      {
+      return false;
+      }
+    return true;
+    };
+
+  //Create an image of dimension ImageDimension referencing the mapped pixels
+  //starting at offset. Geometry is taken from the leading header axes.
+  static ImagePointer WrapImage( const NrrdHeader &header,
+    std::shared_ptr< MappedFile > data, size_t offset )
+    {
+    ImageSize size;
+    ImageIndex index;
+    ImageSpacing spacing;
+    ImagePoint origin;
+    ImageDirection direction;
+    direction.SetIdentity();
+    index.Fill( 0 );
+    std::vector< double > sign = SpaceSigns( header.space );
+    size_t nPixels = 1;
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      size[ i ] = i < header.sizes.size() ? header.sizes[ i ] : 1;
+      nPixels *= size[ i ];
+      spacing[ i ] = 1.0;
+      origin[ i ] = 0.0;
+      if( i < header.spacings.size() && header.spacings[ i ] > 0 )
+        {
+        spacing[ i ] = header.spacings[ i ];
+        }
+      if( i < header.origin.size() )
+        {
+        origin[ i ] = sign[ i ] * header.origin[ i ];
+        }
+      if( i < header.directions.size() )
+        {
+        const std::vector< double > &d = header.directions[ i ];
+        double norm = 0;
+        for( unsigned int j = 0; j < d.size(); j++ )
+          {
+          norm += d[ j ] * d[ j ];
+          }
+        norm = std::sqrt( norm );
+        if( norm > 0 )
+          {
+          spacing[ i ] = norm;
+          for( unsigned int j = 0; j < d.size() && j < ImageDimension; j++ )
+            {
+            direction[ j ][ i ] = sign[ j ] * d[ j ] / norm;
+            }
+          }
+        }
+      }
+
+    ImageRegion region( index, size );
+    ImagePointer image = Image::New();
+    image->SetRegions( region );
+    image->SetSpacing( spacing );
+    image->SetOrigin( origin );
+    image->SetDirection( direction );
+
+    typename PixelContainer::Pointer container = PixelContainer::New();
+    container->SetMappedData( data,
+      ( PixelType * )( data->GetData() + offset ), nPixels );
+    image->SetPixelContainer( container );
+    return image;
+    };
+
+  static bool ParseHeader( const char *buffer, size_t length,
+    NrrdHeader &header )
+    {
+    if( length < 8 || std::strncmp( buffer, "NRRD", 4 ) != 0 )
+      {
+      return false;
+      }
+
+    size_t pos = 0;
+    while( pos < length )
+      {
+      const char *start = buffer + pos;
+      const char *eol = ( const char * )std::memchr( start, '\n', length - pos );
+      if( eol == NULL )
+        {
+        return false;
+        }
+      std::string line( start, eol );
+      pos = eol - buffer + 1;
+      if( !line.empty() && line[ line.size() - 1 ] == '\r' )
+        {
+        line.erase( line.size() - 1 );
+        }
+
+      //Blank line terminates the header of attached data
+      if( line.empty() )
+        {
+        header.headerLength = pos;
+        return header.dimension > 0;
+        }
+      if( line[ 0 ] == '#' || line.compare( 0, 4, "NRRD" ) == 0 )
+        {
+        continue;
+        }
+      size_t colon = line.find( ':' );
+      if( colon == std::string::npos )
+        {
+        continue;
+        }
+      //Key/value pairs use ":=" and are ignored
+      if( colon + 1 < line.size() && line[ colon + 1 ] == '=' )
+        {
+        continue;
+        }
+
+      std::string key = line.substr( 0, colon );
+      std::string value = Trim( line.substr( colon + 1 ) );
+
+      if( key == "type" )
+        {
+        header.type = value;
+        }
+      else if( key == "dimension" )
+        {
+        header.dimension = std::atoi( value.c_str() );
+        }
+      else if( key == "encoding" )
+        {
+        header.encoding = value;
+        }
+      else if( key == "endian" )
+        {
+        header.endian = value;
+        }
+      else if( key == "space" )
+        {
+        header.space = value;
+        }
+      else if( key == "byte skip" || key == "byteskip" )
+        {
+        header.byteSkip = std::atol( value.c_str() );
+        }
+      else if( key == "line skip" || key == "lineskip" )
+        {
+        header.lineSkip = std::atol( value.c_str() );
+        }
+      else if( key == "data file" || key == "datafile" )
+        {
+        header.dataFile = value;
+        }
+      else if( key == "sizes" )
+        {
+        std::istringstream in( value );
+        size_t s;
+        while( in >> s )
+          {
+          header.sizes.push_back( s );
+          }
+        }
+      else if( key == "spacings" )
+        {
+        std::istringstream in( value );
+        std::string s;
+        while( in >> s )
+          {
+          header.spacings.push_back( std::atof( s.c_str() ) );
+          }
+        }
+      else if( key == "space directions" )
+        {
+        ParseVectors( value, header.directions );
+        }
+      else if( key == "space origin" )
+        {
+        std::vector< std::vector< double > > origin;
+        ParseVectors( value, origin );
+        if( origin.size() == 1 )
+          {
+          header.origin = origin[ 0 ];
+          }
+        }
+      }
+
+    //Header without data (detached data file)
+    header.headerLength = pos;
+    return header.dimension > 0 && !header.dataFile.empty();
+    };
+
+private:
+
+  static std::string Trim( const std::string &s )
+    {
+    size_t b = s.find_first_not_of( " \t" );
+    size_t e = s.find_last_not_of( " \t" );
+    if( b == std::string::npos )
+      {
+      return "";
+      }
+    return s.substr( b, e - b + 1 );
+    };
+
+  //Parse "(x,y,z) (x,y,z) none" style vector lists. "none" entries are
+  //stored as empty vectors to keep the axis numbering intact.
+  static void ParseVectors( const std::string &value,
+    std::vector< std::vector< double > > &vectors )
+    {
+    size_t pos = 0;
+    while( pos < value.size() )
+      {
+      size_t open = value.find_first_of( "(n", pos );
+      if( open == std::string::npos )
+        {
+        break;
+        }
+      if( value[ open ] == 'n' )
+        {
+        vectors.push_back( std::vector< double >() );
+        pos = open + 4;
+        continue;
+        }
+      size_t close = value.find( ')', open );
+      if( close == std::string::npos )
+        {
+        break;
+        }
+      std::string inner = value.substr( open + 1, close - open - 1 );
+      for( unsigned int i = 0; i < inner.size(); i++ )
+        {
+        if( inner[ i ] == ',' )
+          {
+          inner[ i ] = ' ';
+          }
+        }
+      std::istringstream in( inner );
+      std::vector< double > v;
+      double d;
+      while( in >> d )
+        {
+        v.push_back( d );
+        }
+      vectors.push_back( v );
+      pos = close + 1;
+      }
+    };
+
+  //Per axis sign taking physical coordinates in the NRRD space to ITK's LPS.
+  //Scanner, right handed and unspecified spaces are used as is.
+  static std::vector< double > SpaceSigns( const std::string &space )
+    {
+    std::vector< double > sign( ImageDimension > 3 ? ImageDimension : 3, 1.0 );
+    std::string s;
+    for( unsigned int i = 0; i < space.size(); i++ )
+      {
+      s += (char)std::tolower( (unsigned char)space[ i ] );
+      }
+    if( s == "ras" || s == "rast" || s.compare( 0, 23,
+      "right-anterior-superior" ) == 0 )
+      {
+      sign[ 0 ] = -1.0;
+      sign[ 1 ] = -1.0;
+      }
+    else if( s == "las" || s == "last" || s.compare( 0, 22,
+      "left-anterior-superior" ) == 0 )
+      {
+      sign[ 1 ] = -1.0;
+      }
+    return sign;
+    };
+
+  static bool NativeEndian( const NrrdHeader &header )
+    {
+    if( sizeof( PixelType ) == 1 )
+      {
+      return true;
+      }
+    const uint16_t one = 1;
+    bool little = *( const char * )&one == 1;
+    return little == ( header.endian == "little" );
+    };
+
+  static bool PixelTypeMatches( const std::string &type )
+    {
+    typedef std::numeric_limits< PixelType > Limits;
+    const size_t n = sizeof( PixelType );
+    if( !Limits::is_integer )
+      {
+      return ( n == 4 && type == "float" ) || ( n == 8 && type == "double" );
+      }
+    if( Limits::is_signed )
+      {
+      return ( n == 1 && ( type == "signed char" || type == "int8" ||
+        type == "int8_t" ) ) ||
+        ( n == 2 && ( type == "short" || type == "short int" ||
+        type == "signed short" || type == "int16" || type == "int16_t" ) ) ||
+        ( n == 4 && ( type == "int" || type == "signed int" ||
+        type == "int32" || type == "int32_t" ) ) ||
+        ( n == 8 && ( type == "longlong" || type == "long long" ||
+        type == "int64" || type == "int64_t" ) );
+      }
+    return ( n == 1 && ( type == "uchar" || type == "unsigned char" ||
+      type == "uint8" || type == "uint8_t" ) ) ||
+      ( n == 2 && ( type == "ushort" || type == "unsigned short" ||
+      type == "uint16" || type == "uint16_t" ) ) ||
+      ( n == 4 && ( type == "uint" || type == "unsigned int" ||
+      type == "uint32" || type == "uint32_t" ) ) ||
+      ( n == 8 && ( type == "ulonglong" || type == "unsigned long long" ||
+      type == "uint64" || type == "uint64_t" ) );
+    };
+
+};
+
+
+//Sequence of 2D frames backed by mapped files.
+//
+//Either a single 3D raw NRRD (e.g. a PTX ring buffer save, frames along the
+//last axis) or a list of 2D raw NRRD files (e.g. a recorded sweep). Frames
+//are returned as 2D images that reference the mapped pages directly.
+//GetFrame schedules read ahead for the following frames, so sequential
+//reprocessing rarely waits on the disk.
+template <typename TPixel>
+class MappedImageSequence
+{
+
+public:
+
+  typedef itk::Image< TPixel, 2 > FrameType;
+  typedef typename FrameType::Pointer FramePointer;
+  typedef MappedImageIO< FrameType > FrameIO;
+
+  MappedImageSequence() : frameBytes( 0 ), prefetchFrames( 4 )
+    {
+    };
+
+  //Open a single 3D raw NRRD, frames are slices along the third axis
+  bool Open( const std::string &filename )
+    {
+    Clear();
+    NrrdHeader header;
+    std::shared_ptr< MappedFile > data;
+    size_t offset = 0;
+    if( !FrameIO::Open( filename, header, data, offset ) ||
+      header.dimension < 2 || header.dimension > 3 )
+      {
+      return false;
+      }
+    frameHeader = header;
+    frameBytes = header.sizes[ 0 ] * header.sizes[ 1 ] * sizeof( TPixel );
+    int nFrames = header.dimension == 3 ? (int)header.sizes[ 2 ] : 1;
+    for( int i = 0; i < nFrames; i++ )
+      {
+      frames.push_back( Frame( data, offset + i * frameBytes ) );
+      }
+    return true;
+    };
+
+  //Open a list of 2D raw NRRD files, one frame per file. Files are mapped
+  //when opened but their pages are only read on access.
+  bool Open( const std::vector< std::string > &filenames )
+    {
+    Clear();
+    for( unsigned int i = 0; i < filenames.size(); i++ )
+      {
+      NrrdHeader header;
+      std::shared_ptr< MappedFile > data;
+      size_t offset = 0;
+      if( !FrameIO::Open( filenames[ i ], header, data, offset ) ||
+        header.dimension != 2 )
+        {
+        Clear();
+        return false;
+        }
+      if( i == 0 )
+        {
+        frameHeader = header;
+        frameBytes = header.sizes[ 0 ] * header.sizes[ 1 ] * sizeof( TPixel );
+        }
+      else if( header.sizes != frameHeader.sizes )
+        {
+        Clear();
+        return false;
+        }
+      frames.push_back( Frame( data, offset ) );
+      }
+    return !frames.empty();
+    };
+
+  void Clear()
+    {
+    frames.clear();
+    frameBytes = 0;
+    frameHeader = NrrdHeader();
+    };
+
+  int GetNumberOfFrames()
+    {
+    return frames.size();
+    };
+
+  //Number of frames after the requested one to schedule read ahead for
+  void SetPrefetchFrames( int n )
+    {
+    prefetchFrames = n;
+    };
+
+  //Zero-copy 2D view of frame i
+  FramePointer GetFrame( int i )
+    {
+    if( i < 0 || i >= (int)frames.size() )
+      {
+      return NULL;
+      }
+    Prefetch( i + 1, prefetchFrames );
+    return FrameIO::WrapImage( frameHeader, frames[ i ].data,
+      frames[ i ].offset );
+    };
+
+  void Prefetch( int first, int count )
+    {
+    int last = std::min( (int)frames.size(), first + count );
+    for( int i = std::max( 0, first ); i < last; i++ )
+      {
+      frames[ i ].data->Prefetch( frames[ i ].offset, frameBytes );
+      }
+    };
+
+private:
+
+  struct Frame
+    {
+    Frame( std::shared_ptr< MappedFile > d, size_t o ) : data( d ), offset( o )
+      {
+      };
+    std::shared_ptr< MappedFile > data;
+    size_t offset;
+    };
+
+  std::vector< Frame > frames;
+  NrrdHeader frameHeader;
+  size_t frameBytes;
+  int prefetchFrames;
+
+};
+
+#endif
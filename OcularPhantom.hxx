@@ -0,0 +1,368 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef OCULARPHANTOM_H
+#define OCULARPHANTOM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "itkImage.h"
+
+//Synthetic B-mode like images of the eye globe and the optic nerve with
+//known geometry, for throughput and accuracy tests of OpticNerveEstimator.
+//
+//The layout matches what OpticNerveEstimator::Fit expects: depth along y,
+//the globe (anechoic interior, bright wall) in the upper part of the image
+//and the optic nerve (hypoechoic band with bright sheath borders) running
+//down from the back of the globe. On top of that:
+//  - multiplicative speckle with Rayleigh distributed amplitude
+//  - attenuation with depth
+//  - refraction shadows below the lateral walls of the globe
+//
+//Lengths are in pixels, the image has the given spacing and origin 0.
+//OpticNerveEstimator treats physical coordinates as indices when placing
+//the nerve region, so use a spacing of 1 when testing Fit.
+//
+//Rendering fills row spans and multiplies each row with a window of a
+//precomputed speckle field at a random offset, so there is no per pixel
+//random number generation and the inner loop vectorizes.
+template < typename TImage >
+class OcularPhantom
+{
+
+public:
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::PointType PointType;
+
+  struct Parameters
+    {
+    int    width = 512;
+    int    height = 512;
+    double spacing = 1;
+
+    //Globe, center and radii of the inner boundary of the wall
+    double eyeCenterX = 256;
+    double eyeCenterY = 170;
+    double eyeRadiusX = 140;
+    double eyeRadiusY = 120;
+    double wallThickness = 14;
+
+    //Nerve, full width between the inner borders of the sheath
+    double nerveCenterX = 256;
+    double nerveWidth = 40;
+    double sheathThickness = 6;
+
+    //Intensities before speckle and attenuation
+    double eyeIntensity = 10;
+    double wallIntensity = 220;
+    double tissueIntensity = 120;
+    double nerveIntensity = 45;
+    double sheathIntensity = 170;
+
+    //Speckle amplitude (0 no speckle, 1 fully developed speckle)
+    double speckle = 0.6;
+    //Fraction of the intensity lost from the top to the bottom of the image
+    double attenuation = 0.3;
+    //Depth of the refraction shadows below the lateral walls (0 none) and
+    //their width in pixels
+    double shadowStrength = 0.5;
+    double shadowWidth = 12;
+
+    //Random relative perturbation of the geometry per frame (uniform in
+    //[ -jitter, jitter ] of each length), 0 renders the nominal geometry
+    double jitter = 0;
+    };
+
+  //Geometry of a rendered frame in physical units
+  struct GroundTruth
+    {
+    PointType eyeCenter;
+    double eyeRadiusX;
+    double eyeRadiusY;
+    double nerveCenterX;
+    //Full nerve width. OpticNerveEstimator::Nerve::width is measured from
+    //the nerve center and corresponds to nerveWidth / 2.
+    double nerveWidth;
+    //Depth where the nerve leaves the globe
+    double nerveTop;
+    };
+
+  OcularPhantom()
+    {
+    //Rayleigh amplitudes with mean 1 from evenly spaced quantiles, in
+    //random order
+    const double mean = std::sqrt( 2 * std::atan( 1.0 ) );
+    std::vector< float > rayleigh( TableSize );
+    for( int i = 0; i < TableSize; i++ )
+      {
+      const double u = ( i + 0.5 ) / TableSize;
+      rayleigh[ i ] = ( float )( std::sqrt( -2 * std::log( u ) ) / mean );
+      }
+    uint32_t state = Seed( 0 );
+    noise.resize( NoiseSize );
+    for( int i = 0; i < NoiseSize; i++ )
+      {
+      noise[ i ] = rayleigh[ Next( state ) & ( TableSize - 1 ) ];
+      }
+    };
+
+  Parameters parameters;
+
+  //Change the image size and scale the geometry with it, horizontal
+  //lengths with the width and vertical lengths with the height
+  void SetImageSize( int width, int height )
+    {
+    Parameters &p = parameters;
+    const double sx = ( double )width / p.width;
+    const double sy = ( double )height / p.height;
+    const double s = std::min( sx, sy );
+    p.eyeCenterX *= sx;
+    p.eyeRadiusX *= sx;
+    p.nerveCenterX *= sx;
+    p.nerveWidth *= sx;
+    p.eyeCenterY *= sy;
+    p.eyeRadiusY *= sy;
+    p.wallThickness *= s;
+    p.sheathThickness *= s;
+    p.shadowWidth *= s;
+    p.width = width;
+    p.height = height;
+    };
+
+  //Render a frame into image, which is (re)allocated only if its size does
+  //not match. The same seed gives the same frame.
+  GroundTruth Render( ImagePointer &image, uint32_t seed )
+    {
+    const Parameters p = Perturb( seed );
+    if( image.IsNull() ||
+      ( int )image->GetBufferedRegion().GetSize()[ 0 ] != p.width ||
+      ( int )image->GetBufferedRegion().GetSize()[ 1 ] != p.height )
+      {
+      image = ImageType::New();
+      typename ImageType::RegionType region;
+      region.SetIndex( 0, 0 );
+      region.SetIndex( 1, 0 );
+      region.SetSize( 0, p.width );
+      region.SetSize( 1, p.height );
+      image->SetRegions( region );
+      image->Allocate();
+      }
+    typename ImageType::SpacingType spacing;
+    spacing.Fill( p.spacing );
+    image->SetSpacing( spacing );
+    typename ImageType::PointType origin;
+    origin.Fill( 0 );
+    image->SetOrigin( origin );
+
+    RenderBuffer( p, seed, image->GetBufferPointer() );
+    return GetGroundTruth( p );
+    };
+
+  //Render a frame into a buffer of width * height pixels
+  GroundTruth Render( PixelType *buffer, uint32_t seed )
+    {
+    const Parameters p = Perturb( seed );
+    RenderBuffer( p, seed, buffer );
+    return GetGroundTruth( p );
+    };
+
+  ImagePointer Render( uint32_t seed, GroundTruth *truth = NULL )
+    {
+    ImagePointer image;
+    GroundTruth t = Render( image, seed );
+    if( truth != NULL )
+      {
+      *truth = t;
+      }
+    return image;
+    };
+
+private:
+
+  enum { TableSize = 4096, NoiseSize = 1 << 16 };
+  //Speckle field, NoiseSize values followed by a copy of the first ones so
+  //any window of the image width starting below NoiseSize is valid
+  std::vector< float > noise;
+
+  //xorshift32, never seeded with 0
+  static uint32_t Next( uint32_t &state )
+    {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+    };
+
+  static uint32_t Seed( uint32_t seed )
+    {
+    uint32_t state = seed * 2654435761u + 0x9e3779b9u;
+    return state == 0 ? 1 : state;
+    };
+
+  Parameters Perturb( uint32_t seed ) const
+    {
+    Parameters p = parameters;
+    if( p.jitter <= 0 )
+      {
+      return p;
+      }
+    uint32_t state = Seed( ~seed );
+    double *lengths[] = { &p.eyeCenterX, &p.eyeCenterY, &p.eyeRadiusX,
+      &p.eyeRadiusY, &p.nerveWidth };
+    for( unsigned int i = 0; i < sizeof( lengths ) / sizeof( lengths[ 0 ] ); i++ )
+      {
+      const double u = Next( state ) / 4294967296.0;
+      *lengths[ i ] *= 1 + p.jitter * ( 2 * u - 1 );
+      }
+    //The nerve stays attached to the globe
+    p.nerveCenterX += p.eyeCenterX - parameters.eyeCenterX;
+    return p;
+    };
+
+  GroundTruth GetGroundTruth( const Parameters &p ) const
+    {
+    GroundTruth truth;
+    truth.eyeCenter[ 0 ] = p.eyeCenterX * p.spacing;
+    truth.eyeCenter[ 1 ] = p.eyeCenterY * p.spacing;
+    truth.eyeRadiusX = p.eyeRadiusX * p.spacing;
+    truth.eyeRadiusY = p.eyeRadiusY * p.spacing;
+    truth.nerveCenterX = p.nerveCenterX * p.spacing;
+    truth.nerveWidth = p.nerveWidth * p.spacing;
+    truth.nerveTop = ( p.eyeCenterY + p.eyeRadiusY ) * p.spacing;
+    return truth;
+    };
+
+  //Half width of the ellipse with radii rx, ry at vertical offset dy,
+  //negative outside
+  static double HalfWidth( double rx, double ry, double dy )
+    {
+    const double t = 1 - ( dy * dy ) / ( ry * ry );
+    return t > 0 ? rx * std::sqrt( t ) : -1;
+    };
+
+  static void Fill( float *row, int width, double x0, double x1, float value )
+    {
+    const int a = std::max( 0, ( int )std::ceil( x0 - 0.5 ) );
+    const int b = std::min( width, ( int )std::ceil( x1 - 0.5 ) );
+    if( a < b )
+      {
+      std::fill( row + a, row + b, value );
+      }
+    };
+
+  static void Scale( float *row, int width, double x0, double x1, float factor )
+    {
+    const int a = std::max( 0, ( int )std::ceil( x0 - 0.5 ) );
+    const int b = std::min( width, ( int )std::ceil( x1 - 0.5 ) );
+    for( int x = a; x < b; x++ )
+      {
+      row[ x ] *= factor;
+      }
+    };
+
+  void RenderBuffer( const Parameters &p, uint32_t seed, PixelType *out )
+    {
+    if( ( int )noise.size() < NoiseSize + p.width )
+      {
+      const int n = noise.size();
+      noise.resize( NoiseSize + p.width );
+      for( int i = n; i < NoiseSize + p.width; i++ )
+        {
+        noise[ i ] = noise[ i % NoiseSize ];
+        }
+      }
+
+    const int width = p.width;
+    const float speckle = ( float )std::max( 0.0, std::min( 1.0, p.speckle ) );
+    const double outerRX = p.eyeRadiusX + p.wallThickness;
+    const double outerRY = p.eyeRadiusY + p.wallThickness;
+    const double nerveTop = p.eyeCenterY + p.eyeRadiusY;
+    const double nerveHalf = 0.5 * p.nerveWidth;
+    const float maxValue = ( float )MaximumPixelValue();
+
+    std::vector< float > row( width );
+    uint32_t state = Seed( seed );
+    for( int y = 0; y < p.height; y++ )
+      {
+      const double yc = y + 0.5;
+      const double dy = yc - p.eyeCenterY;
+
+      //Tissue, then the nerve below the globe, then the globe on top
+      std::fill( row.begin(), row.end(), ( float )p.tissueIntensity );
+      if( yc > nerveTop - p.wallThickness )
+        {
+        const double left = p.nerveCenterX - nerveHalf;
+        const double right = p.nerveCenterX + nerveHalf;
+        Fill( &row[ 0 ], width, left - p.sheathThickness, left, ( float )p.sheathIntensity );
+        Fill( &row[ 0 ], width, left, right, ( float )p.nerveIntensity );
+        Fill( &row[ 0 ], width, right, right + p.sheathThickness, ( float )p.sheathIntensity );
+        }
+      const double outer = HalfWidth( outerRX, outerRY, dy );
+      if( outer >= 0 )
+        {
+        Fill( &row[ 0 ], width, p.eyeCenterX - outer, p.eyeCenterX + outer,
+          ( float )p.wallIntensity );
+        const double inner = HalfWidth( p.eyeRadiusX, p.eyeRadiusY, dy );
+        if( inner >= 0 )
+          {
+          Fill( &row[ 0 ], width, p.eyeCenterX - inner, p.eyeCenterX + inner,
+            ( float )p.eyeIntensity );
+          }
+        }
+
+      //Shadows below the lateral walls
+      if( dy > 0 && p.shadowStrength > 0 )
+        {
+        const float factor = ( float )( 1 - p.shadowStrength );
+        const double w = 0.5 * p.shadowWidth;
+        Scale( &row[ 0 ], width, p.eyeCenterX - outerRX - w,
+          p.eyeCenterX - outerRX + w, factor );
+        Scale( &row[ 0 ], width, p.eyeCenterX + outerRX - w,
+          p.eyeCenterX + outerRX + w, factor );
+        }
+
+      //Speckle and attenuation
+      const float gain = ( float )( 1 - p.attenuation * yc / p.height );
+      const float a = gain * ( 1 - speckle );
+      const float b = gain * speckle;
+      const float *n = &noise[ Next( state ) & ( NoiseSize - 1 ) ];
+      PixelType *o = out + ( size_t )y * width;
+      for( int x = 0; x < width; x++ )
+        {
+        const float v = row[ x ] * ( a + b * n[ x ] );
+        o[ x ] = ( PixelType )std::min( maxValue, std::max( 0.f, v ) );
+        }
+      }
+    };
+
+  static double MaximumPixelValue()
+    {
+    return std::min( 255.0, ( double )itk::NumericTraits< PixelType >::max() );
+    };
+
+};
+
+#endif
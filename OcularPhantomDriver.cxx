@@ -0,0 +1,228 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Renders OcularPhantom frames and optionally fits them with
+//OpticNerveEstimator.
+//
+//  OcularPhantom [--frames=<n>] [--size=<w>x<h>] [--seed=<s>]
+//    [--jitter=<fraction>] [--speckle=<amplitude>] [--out=<prefix>]
+//    [--truth=<file.csv>] [--fit]
+//
+//Frames are written as <prefix>_<frame>.nrrd with --out, the ground truth
+//of every frame (and the estimate with --fit) as CSV with --truth. The
+//render rate and with --fit the success rate, the mean absolute errors and
+//the fit rate are printed at the end.
+
+#include "OcularPhantom.hxx"
+#include "OpticNerveEstimator.hxx"
+#include "ImageIO.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+typedef OpticNerveEstimator::ImageType ImageType;
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+int main( int argc, char **argv )
+{
+  int nFrames = 100;
+  int width = 512;
+  int height = 512;
+  unsigned int seed = 1;
+  double jitter = 0.05;
+  double speckle = -1;
+  std::string outPrefix;
+  std::string truthFile;
+  bool fit = false;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    if( GetFlag( arg, "frames", value ) )
+      {
+      nFrames = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "size", value ) )
+      {
+      if( std::sscanf( value.c_str(), "%dx%d", &width, &height ) != 2 ||
+        width <= 0 || height <= 0 )
+        {
+        std::cerr << "Invalid size: " << value << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    else if( GetFlag( arg, "seed", value ) )
+      {
+      seed = std::strtoul( value.c_str(), NULL, 10 );
+      }
+    else if( GetFlag( arg, "jitter", value ) )
+      {
+      jitter = std::atof( value.c_str() );
+      }
+    else if( GetFlag( arg, "speckle", value ) )
+      {
+      speckle = std::atof( value.c_str() );
+      }
+    else if( GetFlag( arg, "out", value ) )
+      {
+      outPrefix = value;
+      }
+    else if( GetFlag( arg, "truth", value ) )
+      {
+      truthFile = value;
+      }
+    else if( arg == "--fit" )
+      {
+      fit = true;
+      }
+    else
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--frames=<n>] [--size=<w>x<h>]"
+        << " [--seed=<s>] [--jitter=<fraction>] [--speckle=<amplitude>]"
+        << " [--out=<prefix>] [--truth=<file.csv>] [--fit]" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  OcularPhantom< ImageType > phantom;
+  phantom.SetImageSize( width, height );
+  phantom.parameters.jitter = jitter;
+  if( speckle >= 0 )
+    {
+    phantom.parameters.speckle = speckle;
+    }
+
+  std::ofstream truth;
+  if( !truthFile.empty() )
+    {
+    truth.open( truthFile.c_str() );
+    if( !truth )
+      {
+      std::cerr << "Could not write " << truthFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    truth << "frame,seed,eyeCenterX,eyeCenterY,eyeRadiusX,eyeRadiusY,"
+      "nerveCenterX,nerveWidth,nerveTop";
+    if( fit )
+      {
+      truth << ",status,fitEyeCenterX,fitEyeCenterY,fitEyeRadiusX,"
+        "fitEyeRadiusY,fitNerveCenterX,fitNerveWidth,fitSeconds";
+      }
+    truth << std::endl;
+    }
+
+  typedef std::chrono::steady_clock Clock;
+  double renderSeconds = 0;
+  double fitSeconds = 0;
+  int successes = 0;
+  double eyeCenterError = 0;
+  double eyeRadiusError = 0;
+  double nerveCenterError = 0;
+  double nerveWidthError = 0;
+
+  ImageType::Pointer image;
+  for( int i = 0; i < nFrames; i++ )
+    {
+    const unsigned int frameSeed = seed + i;
+    Clock::time_point start = Clock::now();
+    const OcularPhantom< ImageType >::GroundTruth t =
+      phantom.Render( image, frameSeed );
+    renderSeconds += std::chrono::duration< double >( Clock::now() - start ).count();
+
+    if( !outPrefix.empty() )
+      {
+      std::ostringstream name;
+      name << outPrefix << "_" << std::setw( 5 ) << std::setfill( '0' ) << i << ".nrrd";
+      ImageIO< ImageType >::WriteImage( image, name.str() );
+      }
+    if( truth.is_open() )
+      {
+      truth << i << "," << frameSeed << "," << t.eyeCenter[ 0 ] << ","
+        << t.eyeCenter[ 1 ] << "," << t.eyeRadiusX << "," << t.eyeRadiusY << ","
+        << t.nerveCenterX << "," << t.nerveWidth << "," << t.nerveTop;
+      }
+    if( fit )
+      {
+      OpticNerveEstimator estimator;
+      start = Clock::now();
+      const OpticNerveEstimator::Status status = estimator.Fit( image );
+      const double seconds =
+        std::chrono::duration< double >( Clock::now() - start ).count();
+      fitSeconds += seconds;
+      const OpticNerveEstimator::Eye eye = estimator.GetEye();
+      const OpticNerveEstimator::Nerve nerve = estimator.GetNerve();
+      if( status == OpticNerveEstimator::ESTIMATION_SUCCESS )
+        {
+        successes++;
+        eyeCenterError += std::sqrt(
+          std::pow( eye.center[ 0 ] - t.eyeCenter[ 0 ], 2 ) +
+          std::pow( eye.center[ 1 ] - t.eyeCenter[ 1 ], 2 ) );
+        eyeRadiusError += 0.5 * ( std::fabs( eye.radiusX - t.eyeRadiusX ) +
+          std::fabs( eye.radiusY - t.eyeRadiusY ) );
+        nerveCenterError += std::fabs( nerve.center[ 0 ] - t.nerveCenterX );
+        //Nerve::width is the half width
+        nerveWidthError += std::fabs( 2 * nerve.width - t.nerveWidth );
+        }
+      if( truth.is_open() )
+        {
+        truth << "," << status << "," << eye.center[ 0 ] << "," << eye.center[ 1 ]
+          << "," << eye.radiusX << "," << eye.radiusY << "," << nerve.center[ 0 ]
+          << "," << 2 * nerve.width << "," << seconds;
+        }
+      }
+    if( truth.is_open() )
+      {
+      truth << std::endl;
+      }
+    }
+
+  std::cout << "Rendered " << nFrames << " frames of " << width << "x" << height
+    << ": " << nFrames / std::max( renderSeconds, 1e-9 ) << " frames/s" << std::endl;
+  if( fit )
+    {
+    const double n = std::max( 1, successes );
+    std::cout << "Fit: " << successes << "/" << nFrames << " succeeded, "
+      << nFrames / std::max( fitSeconds, 1e-9 ) << " frames/s" << std::endl;
+    std::cout << "Mean absolute error: eye center " << eyeCenterError / n
+      << ", eye radius " << eyeRadiusError / n << ", nerve center "
+      << nerveCenterError / n << ", nerve width " << nerveWidthError / n
+      << std::endl;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -24,16 +24,19 @@ limitations under the License.
 //#define DEBUG_PRINT
 
 #include <cmath>
-#include <Windows.h>
 
-#include <QLabel.h>
-
-#include "IntersonArrayDeviceRF.hxx"
-#include "ITKQtHelpers.hxx"
+#include "BModeFrameSource.hxx"
 #include "OpticNerveEstimator.hxx"
 
-#include <vector>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <thread>
+#include <vector>
 
 class OpticNerveCalculator
 {
@@ -49,14 +52,72 @@ public:
     double upperQuartile = -1;
     };
 
+  //Resolution an estimate was computed at
+  enum EstimateTier
+    {
+    ESTIMATE_FULL,
+    ESTIMATE_PREVIEW
+    };
+
+  //Two tier estimation: every frame is first estimated on the image
+  //decimated by factor (OpticNerveEstimator::FitDecimated). The full
+  //resolution estimate runs on every fullInterval-th frame and whenever
+  //the preview is not confident: it failed, there is no full resolution
+  //estimate yet or the width differs from the last full resolution width
+  //by more than tolerance (fraction of that width). Nerve only estimation
+  //always runs at full resolution.
+  struct PreviewParameters
+    {
+    bool   enabled = false;
+    int    factor = 2;
+    int    fullInterval = 10;
+    double tolerance = 0.15;
+    };
+
+  //Estimates with a confidence below minimumConfidence are rejected like
+  //failed ones. With weightByConfidence the statistics weight estimates by
+  //their confidence, otherwise all accepted estimates count the same.
+  struct ConfidenceParameters
+    {
+    double minimumConfidence = 0;
+    bool   weightByConfidence = false;
+    };
+
+  //Outcome of the estimation of one frame, see SetResultCallback
+  struct EstimateResult
+    {
+    //Absolute frame number of the frame source
+    long frame = -1;
+    //ESTIMATION_UNKNOWN if the frame could not be read
+    OpticNerveEstimator::Status status = OpticNerveEstimator::ESTIMATION_UNKNOWN;
+    //Estimated but below ConfidenceParameters::minimumConfidence
+    bool rejected = false;
+    EstimateTier tier = ESTIMATE_FULL;
+    double width = -1;
+    double confidence = -1;
+    bool truncated = false;
+    //Mean of the statistics after this estimate
+    double mean = -1;
+    //NULL unless the estimate was accepted
+    OpticNerveEstimator::RGBImageType::Pointer overlay;
+    };
+
+  typedef std::function< void( const EstimateResult & ) > ResultCallback;
+
   OpticNerveCalculator() : currentWrite( -1 ), nTotalWrite( 0 ),
     currentRead( 0 )
     {
     maxNumberOfThreads = 1;
     stopThreads = true;
     ringBuffer.resize( 10 );
+    ringBufferTier.resize( 10, ESTIMATE_FULL );
     runningSum = 0;
     currentEstimate = -1;
+    currentTier = ESTIMATE_FULL;
+    runningWeight = 0;
+    currentConfidence = -1;
+    nTruncated = 0;
+    lastFullWidth = -1;
     mean = 0;
     nerveOnly = false;
     depth = 80;
@@ -68,6 +129,13 @@ public:
     Stop();
     }
 
+  //Called by the worker threads for every processed frame, accepted or
+  //not, concurrently and in completion order. Set before StartProcessing.
+  void SetResultCallback( ResultCallback callback )
+    {
+    resultCallback = callback;
+    }
+
   void SetNumberOfThreads( int n )
     {
     maxNumberOfThreads = n;
@@ -83,16 +151,21 @@ public:
     if( !stopThreads )
       {
       stopThreads = true;
-      WaitForMultipleObjects( maxNumberOfThreads, threads, true, INFINITE );
-      for( int i = 0; i < maxNumberOfThreads; i++ )
+      //The spawn thread is joined first, so no worker is added while the
+      //workers are joined
+      if( spawnThread.joinable() )
+        {
+        spawnThread.join();
+        }
+      for( unsigned int i = 0; i < threads.size(); i++ )
         {
-        CloseHandle( threads[ i ] );
+        threads[ i ].join();
         }
-      CloseHandle( toProcessMutex );
+      threads.clear();
       }
     }
 
-  bool StartProcessing( IntersonArrayDeviceRF *source )
+  bool StartProcessing( BModeFrameSource *source )
     {
 #ifdef DEBUG_PRINT
     std::cout << "Startprocessing called" << std::endl;
@@ -113,18 +186,17 @@ public:
     currentEstimate = -1;
     mean = 0;
     estimates.clear();
+    runningWeight = 0;
+    currentConfidence = -1;
+    nTruncated = 0;
+    lastFullWidth = -1;
+    currentTier = ESTIMATE_FULL;
+    lastEye = OpticNerveEstimator::Eye();
 
     this->device = source;
 
     //Spawn work threads
-
-    toProcessMutex = CreateMutex( NULL, false, NULL );
-    threads = new HANDLE[ maxNumberOfThreads ];
-    threadsID = new DWORD[ maxNumberOfThreads ];
-
-    DWORD spawnThreadID;
-    HANDLE spawnThread = CreateThread( NULL, 0, OpticNerveCalculator::StartThreads, this, 0, &spawnThreadID );
-    CloseHandle( spawnThread );
+    spawnThread = std::thread( &OpticNerveCalculator::StartThreads, this );
 
     return true;
     }
@@ -135,15 +207,28 @@ public:
     int index = currentRead++;
     while( index >= device->GetNumberOfBModeImagesAcquired() )
       {
-      Sleep( 10 );
+      if( stopThreads )
+        {
+        return false;
+        }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
       }
 #ifdef DEBUG_PRINT
     //std::cout << "Calculating optic nerve on next image" << std::endl;
 #endif
     //This might grab the same image twice if the index in another thread
     //is the same modulo ringbuffer size
-    IntersonArrayDeviceRF::ImageType::Pointer image =
+    BModeFrameSource::ImageType::Pointer image =
       device->GetBModeImageAbsolute( index );
+    if( image.IsNull() )
+      {
+      //The slot was rewritten during every read, report the frame as not
+      //estimated
+      EstimateResult result;
+      result.frame = index;
+      ReportResult( result );
+      return !stopThreads;
+      }
 
 /*
     ITKFilterFunctions<IntersonArrayDevice::ImageType>::FlipArray flip;
@@ -151,23 +236,36 @@ public:
     flip[1] = true;
     image = ITKFilterFunctions<IntersonArrayDevice::ImageType>::FlipImage(image, flip);
 */
-    IntersonArrayDeviceRF::ImageType::DirectionType direction = image->GetDirection();
-    ITKFilterFunctions< IntersonArrayDeviceRF::ImageType >::PermuteArray order;
+    BModeFrameSource::ImageType::DirectionType direction = image->GetDirection();
+    ITKFilterFunctions< BModeFrameSource::ImageType >::PermuteArray order;
     order[ 0 ] = 1;
     order[ 1 ] = 0;
-    image = ITKFilterFunctions< IntersonArrayDeviceRF::ImageType>::PermuteImage( image, order );
+    image = ITKFilterFunctions< BModeFrameSource::ImageType>::PermuteImage( image, order );
 
     image->SetDirection( direction );
 
     //Copy in case it changes during calculation
     bool doNerveOnly = this->nerveOnly;
+    PreviewParameters preview;
+    ConfidenceParameters confidence;
+      {
+      std::lock_guard< std::mutex > lock( toProcessMutex );
+      preview = previewParams;
+      confidence = confidenceParams;
+      }
 
 
     //TODO: Avoid instantion of filters every time -> setup a pipeline
     OpticNerveEstimator one;
     one.algParams = algParams;
+    if( algParams.speculativeNerve && !doNerveOnly )
+      {
+      //Predict the nerve region from the last eye estimate
+      std::lock_guard< std::mutex > lock( toProcessMutex );
+      one.SetPredictedEye( lastEye );
+      }
 
-    typedef itk::CastImageFilter< IntersonArrayDeviceRF::ImageType, OpticNerveEstimator::ImageType> Caster;
+    typedef itk::CastImageFilter< BModeFrameSource::ImageType, OpticNerveEstimator::ImageType> Caster;
     Caster::Pointer caster = Caster::New();
     caster->SetInput( image );
     caster->Update();
@@ -178,6 +276,7 @@ public:
 #endif
     OpticNerveEstimator::Status status =
       OpticNerveEstimator::ESTIMATION_UNKNOWN;
+    EstimateTier tier = ESTIMATE_FULL;
     try
       {
       if( doNerveOnly )
@@ -198,6 +297,7 @@ public:
 
         OpticNerveEstimator::ImageType::RegionType desiredRegion( desiredStart, desiredSize );
 
+        one.StartTimeBudget();
         bool fitNerve = one.FitNerve( castImage, desiredRegion, true, "debug" );
         if( fitNerve )
           {
@@ -210,7 +310,19 @@ public:
         }
       else
         {
-        status = one.Fit( castImage, true, "debug" );
+        bool fitFull = true;
+        if( preview.enabled && index % std::max( 1, preview.fullInterval ) != 0 )
+          {
+          status = one.FitDecimated( castImage, preview.factor, true, "debug" );
+          fitFull = !IsPreviewConfident( status, one.GetNerve().width,
+            GetConfidence( one, false ) >= confidence.minimumConfidence, preview );
+          tier = ESTIMATE_PREVIEW;
+          }
+        if( fitFull )
+          {
+          status = one.Fit( castImage, true, "debug" );
+          tier = ESTIMATE_FULL;
+          }
         }
       }
 #ifdef DEBUG_PRINT
@@ -225,11 +337,31 @@ public:
       std::cerr << "Unspecified exception caught !" << std::endl;
       }
 
+    EstimateResult result;
+    result.frame = index;
+    result.status = status;
+    result.tier = tier;
     if( status != OpticNerveEstimator::ESTIMATION_SUCCESS )
       {
 #ifdef DEBUG_PRINT
       std::cout << "Estimation failed " << index << std::endl;
 #endif
+      ReportResult( result );
+      return !stopThreads;
+      }
+
+    const double estimateConfidence = GetConfidence( one, doNerveOnly );
+    result.width = one.GetNerve().width;
+    result.confidence = estimateConfidence;
+    result.truncated = one.GetTruncated();
+    if( estimateConfidence < confidence.minimumConfidence )
+      {
+#ifdef DEBUG_PRINT
+      std::cout << "Estimation rejected, confidence " << estimateConfidence
+        << " " << index << std::endl;
+#endif
+      result.rejected = true;
+      ReportResult( result );
       return !stopThreads;
       }
 
@@ -243,12 +375,30 @@ public:
 #endif
 
 
-    DWORD waitForMutex = WaitForSingleObject( toProcessMutex, INFINITE );
+    std::unique_lock< std::mutex > lock( toProcessMutex );
+
+    if( !doNerveOnly )
+      {
+      lastEye = one.GetEye();
+      lastEye.aligned = NULL;
+      }
 
+    //Statistics only include full resolution estimates
     currentEstimate = one.GetNerve().width;
-    runningSum += currentEstimate;
-    estimates.insert( currentEstimate );
-    mean = runningSum / nTotalWrite;
+    currentTier = tier;
+    currentConfidence = estimateConfidence;
+    const double weight = confidence.weightByConfidence ? estimateConfidence : 1;
+    if( tier == ESTIMATE_FULL )
+      {
+      lastFullWidth = currentEstimate;
+      }
+    if( tier == ESTIMATE_FULL && weight > 0 )
+      {
+      runningSum += weight * currentEstimate;
+      runningWeight += weight;
+      estimates.insert( std::make_pair( currentEstimate, weight ) );
+      mean = runningSum / runningWeight;
+      }
 
     //TODO: insert in order?
     unsigned int toAdd = currentWrite + 1;
@@ -257,13 +407,22 @@ public:
       toAdd = 0;
       }
     ringBuffer[ toAdd ] = overlay;
+    ringBufferTier[ toAdd ] = tier;
     currentWrite = toAdd;
     ++nTotalWrite;
+    if( one.GetTruncated() )
+      {
+      ++nTruncated;
+      }
 
 #ifdef DEBUG_PRINT
     std::cout << "Storing current estimate " << currentWrite << std::endl;
 #endif
-    ReleaseMutex( toProcessMutex );
+    result.mean = mean;
+    lock.unlock();
+
+    result.overlay = overlay;
+    ReportResult( result );
 
     return !stopThreads;
     };
@@ -278,6 +437,11 @@ public:
     return GetImage( absoluteIndex % ringBuffer.size() );
     };
 
+  EstimateTier GetImageTier( int ringBufferIndex )
+    {
+    return ringBufferTier[ ringBufferIndex ];
+    };
+
   int GetCurrentIndex()
     {
     return currentWrite;
@@ -286,6 +450,7 @@ public:
   void SetRingBufferSize( int size )
     {
     ringBuffer.resize( size );
+    ringBufferTier.resize( size, ESTIMATE_FULL );
     };
 
   long GetNumberOfEstimates()
@@ -293,6 +458,13 @@ public:
     return nTotalWrite;
     };
 
+  //Estimates stopped early by the time budget of the algorithm parameters
+  //(OpticNerveEstimator::Parameters::timeBudget)
+  long GetNumberOfTruncatedEstimates()
+    {
+    return nTruncated;
+    };
+
   double GetMeanEstimate()
     {
     return mean;
@@ -303,46 +475,68 @@ public:
     return currentEstimate;
     };
 
+  EstimateTier GetCurrentEstimateTier()
+    {
+    return currentTier;
+    };
+
+  //Confidence of the current estimate, the lower of the eye and nerve
+  //confidences (OpticNerveEstimator::RegistrationQuality)
+  double GetCurrentConfidence()
+    {
+    return currentConfidence;
+    };
+
+  //Weighted by confidence if ConfidenceParameters::weightByConfidence is
+  //set. Quartiles and median are the first estimates whose cumulative
+  //weight exceeds a quarter, half and three quarters of the total.
   Statistics GetEstimateStatistics()
     {
     Statistics stats;
     if( estimates.size() > 0 )
       {
       //Need to make sure estimates doesn't get modified
-      DWORD wresult = WaitForSingleObject( toProcessMutex, INFINITE );
+      std::lock_guard< std::mutex > lock( toProcessMutex );
       stats.mean = GetMeanEstimate();
-      double m2 = stats.mean * stats.mean;
       stats.stdev = 0;
-      int low = estimates.size() / 4;
-      int med = estimates.size() / 2;
-      int high = 3 * estimates.size() / 4;
-      std::set<double>::iterator it = estimates.begin();
-      for( unsigned int i = 0; i < estimates.size() ; i++, ++it )
+      double weightSum = 0;
+      double weightSquareSum = 0;
+      std::multiset< std::pair< double, double > >::iterator it;
+      for( it = estimates.begin(); it != estimates.end(); ++it )
+        {
+        weightSum += it->second;
+        weightSquareSum += it->second * it->second;
+        }
+      double cumulative = 0;
+      for( it = estimates.begin(); it != estimates.end(); ++it )
         {
-        double tmp = *it - stats.mean;
-        stats.stdev += tmp * tmp;
-        if( i == low )
+        double tmp = it->first - stats.mean;
+        stats.stdev += it->second * tmp * tmp;
+        cumulative += it->second;
+        if( stats.lowerQuartile < 0 && cumulative > 0.25 * weightSum )
           {
-          stats.lowerQuartile = *it;
+          stats.lowerQuartile = it->first;
           }
-        else if( i == med )
+        if( stats.median < 0 && cumulative > 0.5 * weightSum )
           {
-          stats.median = *it;
+          stats.median = it->first;
           }
-        else if( i == high )
+        if( stats.upperQuartile < 0 && cumulative > 0.75 * weightSum )
           {
-          stats.upperQuartile = *it;
+          stats.upperQuartile = it->first;
           }
         }
-      if( estimates.size() > 1 )
+      //Unbiased for reliability weights, the sample standard deviation
+      //for unit weights
+      const double norm = weightSum - weightSquareSum / weightSum;
+      if( estimates.size() > 1 && norm > 0 )
         {
-        stats.stdev = sqrt( stats.stdev / ( estimates.size() - 1 ) );
+        stats.stdev = sqrt( stats.stdev / norm );
         }
       else
         {
         stats.stdev = 0;
         }
-      ReleaseMutex( toProcessMutex );
       }
     return stats;
     }
@@ -372,9 +566,35 @@ public:
     algParams = params;
     };
 
+  void SetPreviewParameters( const PreviewParameters &params )
+    {
+    std::lock_guard< std::mutex > lock( toProcessMutex );
+    previewParams = params;
+    };
+
+  PreviewParameters GetPreviewParameters()
+    {
+    std::lock_guard< std::mutex > lock( toProcessMutex );
+    return previewParams;
+    };
+
+  void SetConfidenceParameters( const ConfidenceParameters &params )
+    {
+    std::lock_guard< std::mutex > lock( toProcessMutex );
+    confidenceParams = params;
+    };
+
+  ConfidenceParameters GetConfidenceParameters()
+    {
+    std::lock_guard< std::mutex > lock( toProcessMutex );
+    return confidenceParams;
+    };
+
 private:
 
   OpticNerveEstimator::Parameters algParams;
+  PreviewParameters previewParams;
+  ConfidenceParameters confidenceParams;
   bool nerveOnly;
   int depth;
   int height;
@@ -382,55 +602,88 @@ private:
   //RingBuffer
   int currentWrite;
   long nTotalWrite;
+  std::atomic< long > nTruncated;
   std::vector< OpticNerveEstimator::RGBImageType::Pointer > ringBuffer;
+  std::vector< EstimateTier > ringBufferTier;
 
   //Estimation resutl
-  std::set<double> estimates;
+  //Width and weight of each estimate in the statistics
+  std::multiset< std::pair< double, double > > estimates;
   double runningSum;
+  double runningWeight;
   double mean;
   double currentEstimate;
+  std::atomic< EstimateTier > currentTier;
+  double currentConfidence;
+  double lastFullWidth;
+
+  //Eye of the last estimate for speculative nerve regions
+  OpticNerveEstimator::Eye lastEye;
 
   //Threading
-  bool stopThreads;
+  std::atomic<bool> stopThreads;
 
   int maxNumberOfThreads;
-  HANDLE *threads;
-  DWORD *threadsID;
-  HANDLE toProcessMutex;
+  std::thread spawnThread;
+  std::vector< std::thread > threads;
+  std::mutex toProcessMutex;
 
   //device reading
   std::atomic<int> currentRead;
-  IntersonArrayDeviceRF *device;
+  BModeFrameSource *device;
+
+  ResultCallback resultCallback;
 
-  static DWORD WINAPI StartThreads( LPVOID lpParam )
+  void ReportResult( const EstimateResult &result )
+    {
+    if( resultCallback )
+      {
+      resultCallback( result );
+      }
+    };
+
+  //Start the workers staggered in time, so they pick up frames spread
+  //over the acquisition
+  void StartThreads()
     {
 #ifdef DEBUG_PRINT
     std::cout << "Spawning worker threads" << std::endl;
 #endif
 
-    OpticNerveCalculator *calc = ( OpticNerveCalculator* )lpParam;
-    for( int i = 0; i < calc->GetMaximumNumberOfThreads(); i++ )
+    for( int i = 0; i < GetMaximumNumberOfThreads() && !stopThreads; i++ )
       {
-      calc->StartThread( i );
-      Sleep( 1300 / ( calc->GetMaximumNumberOfThreads() + 1 ) );
+      threads.push_back( std::thread( &OpticNerveCalculator::CalculateOpticNerveWidth, this ) );
+      std::this_thread::sleep_for( std::chrono::milliseconds(
+        1300 / ( GetMaximumNumberOfThreads() + 1 ) ) );
       }
-    return 0;
     }
 
-  static DWORD WINAPI CalculateOpticNerveWidth( LPVOID lpParam )
+  static double GetConfidence( OpticNerveEstimator &estimator, bool nerveOnly )
     {
-    OpticNerveCalculator *calc = ( OpticNerveCalculator* )lpParam;
-    //Keep processing until ProcessNext says to stop
-    while( calc->ProcessNext() )
+    const double nerveConfidence = estimator.GetNerve().quality.confidence;
+    return nerveOnly ? nerveConfidence :
+      std::min( estimator.GetEye().quality.confidence, nerveConfidence );
+    };
+
+  bool IsPreviewConfident( OpticNerveEstimator::Status status, double width,
+    bool confident, const PreviewParameters &preview )
+    {
+    if( status != OpticNerveEstimator::ESTIMATION_SUCCESS || !confident )
       {
+      return false;
       }
-    return 0;
+    std::lock_guard< std::mutex > lock( toProcessMutex );
+    return lastFullWidth > 0 &&
+      std::fabs( width - lastFullWidth ) <= preview.tolerance * lastFullWidth;
     };
 
-  void StartThread( int i )
+  void CalculateOpticNerveWidth()
     {
-    threads[ i ] = CreateThread( NULL, 0, OpticNerveCalculator::CalculateOpticNerveWidth, this, 0, &threadsID[ i ] );
-    }
+    //Keep processing until ProcessNext says to stop
+    while( ProcessNext() )
+      {
+      }
+    };
 
 };
 
@@ -0,0 +1,363 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Stand-in client of OpticNerveServer. Streams SimulatedProbeDevice frames
+//(OcularPhantom or recorded frames) at a fixed rate and reports the results
+//and the latency from sending a frame to receiving its result.
+//
+//  OpticNerveClient [--host=<h>] [--port=<p>] [--count=<n>] [--fps=<f>]
+//    [--frames=<image>,...] [--overlay] [--out=<file.csv>] [--listen]
+//
+//--overlay requests the overlay of each estimate with the result, --out
+//writes one line per result. With --listen no frames are sent and --count
+//results of a server running with --device are received (0 for all, until
+//the server closes the connection).
+
+#include "SimulatedProbeDevice.hxx"
+#include "EstimationProtocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+std::vector< std::string > Split( const std::string &s, char separator )
+{
+  std::vector< std::string > parts;
+  std::istringstream stream( s );
+  std::string part;
+  while( std::getline( stream, part, separator ) )
+    {
+    if( !part.empty() )
+      {
+      parts.push_back( part );
+      }
+    }
+  return parts;
+}
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+const char *GetStatusName( int status )
+{
+  switch( status )
+    {
+    case EstimationProtocol::RESULT_SUCCESS:
+      return "success";
+    case EstimationProtocol::RESULT_FAIL_EYE:
+      return "fail_eye";
+    case EstimationProtocol::RESULT_FAIL_NERVE:
+      return "fail_nerve";
+    case EstimationProtocol::RESULT_REJECTED:
+      return "rejected";
+    case EstimationProtocol::RESULT_DROPPED:
+      return "dropped";
+    default:
+      return "error";
+    }
+}
+
+//Results received and the send times of the frames still waiting for one
+struct ResultLog
+  {
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::map< int64_t, Clock::time_point > pending;
+  std::vector< double > latencies;
+  std::vector< long > statusCounts;
+  long nReceived = 0;
+  long nOverlays = 0;
+  double lastMean = -1;
+  bool closed = false;
+
+  ResultLog() : statusCounts( EstimationProtocol::RESULT_ERROR + 1, 0 )
+    {
+    };
+  };
+
+void ReceiveResults( EstimationSocket &socket, ResultLog &log, long count,
+  std::ostream *out )
+{
+  EstimationProtocol::MessageHeader header;
+  std::vector< unsigned char > payload;
+  while( EstimationProtocol::ReceiveMessage( socket, header, payload ) )
+    {
+    EstimationProtocol::ResultHeader result;
+    const unsigned char *rgb;
+    if( header.type != EstimationProtocol::MESSAGE_RESULT ||
+      !EstimationProtocol::ParseResult( payload, result, rgb ) )
+      {
+      continue;
+      }
+    const Clock::time_point now = Clock::now();
+
+    std::lock_guard< std::mutex > lock( log.mutex );
+    double latency = -1;
+    std::map< int64_t, Clock::time_point >::iterator sent = log.pending.find( result.id );
+    if( sent != log.pending.end() )
+      {
+      latency = 1000 * std::chrono::duration< double >( now - sent->second ).count();
+      log.pending.erase( sent );
+      if( result.status != EstimationProtocol::RESULT_DROPPED )
+        {
+        log.latencies.push_back( latency );
+        }
+      }
+    log.nReceived++;
+    log.statusCounts[ std::min< int >( std::max( 0, result.status ),
+      EstimationProtocol::RESULT_ERROR ) ]++;
+    if( rgb != NULL )
+      {
+      log.nOverlays++;
+      }
+    if( result.status == EstimationProtocol::RESULT_SUCCESS )
+      {
+      log.lastMean = result.mean;
+      }
+    if( out != NULL )
+      {
+      *out << result.id << "," << GetStatusName( result.status ) << ","
+        << ( result.tier == 0 ? "full" : "preview" ) << "," << result.width
+        << "," << result.confidence << "," << result.mean << ","
+        << result.truncated << "," << latency << std::endl;
+      }
+    log.condition.notify_all();
+    if( count > 0 && log.nReceived >= count )
+      {
+      break;
+      }
+    }
+  std::lock_guard< std::mutex > lock( log.mutex );
+  log.closed = true;
+  log.condition.notify_all();
+}
+
+double GetPercentile( std::vector< double > values, double p )
+{
+  if( values.empty() )
+    {
+    return -1;
+    }
+  std::sort( values.begin(), values.end() );
+  const size_t i = std::min( values.size() - 1, ( size_t )( p * values.size() ) );
+  return values[ i ];
+}
+
+int main( int argc, char **argv )
+{
+  std::string host = "127.0.0.1";
+  int port = EstimationProtocol::DefaultPort;
+  long count = 100;
+  double fps = 30;
+  std::string frames;
+  bool overlay = false;
+  std::string outFile;
+  bool listenOnly = false;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    bool valid = true;
+    if( GetFlag( arg, "host", value ) )
+      {
+      host = value;
+      }
+    else if( GetFlag( arg, "port", value ) )
+      {
+      port = std::atoi( value.c_str() );
+      valid = port > 0 && port < 65536;
+      }
+    else if( GetFlag( arg, "count", value ) )
+      {
+      count = std::atol( value.c_str() );
+      valid = count >= 0;
+      }
+    else if( GetFlag( arg, "fps", value ) )
+      {
+      fps = std::atof( value.c_str() );
+      valid = fps > 0;
+      }
+    else if( GetFlag( arg, "frames", value ) )
+      {
+      frames = value;
+      }
+    else if( arg == "--overlay" )
+      {
+      overlay = true;
+      }
+    else if( GetFlag( arg, "out", value ) )
+      {
+      outFile = value;
+      }
+    else if( arg == "--listen" )
+      {
+      listenOnly = true;
+      }
+    else
+      {
+      valid = false;
+      }
+    if( !valid || ( !listenOnly && count == 0 ) )
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--host=<h>] [--port=<p>]"
+        << " [--count=<n>] [--fps=<f>] [--frames=<image>,...] [--overlay]"
+        << " [--out=<file.csv>] [--listen]" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  std::ofstream out;
+  if( !outFile.empty() )
+    {
+    out.open( outFile.c_str() );
+    if( !out )
+      {
+      std::cerr << "Could not write " << outFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    out << "id,status,tier,width,confidence,mean,truncated,latency_ms" << std::endl;
+    }
+
+  if( !EstimationSocket::Initialize() )
+    {
+    std::cerr << "Could not initialize sockets" << std::endl;
+    return EXIT_FAILURE;
+    }
+  EstimationSocket socket;
+  if( !socket.Connect( host, port ) )
+    {
+    std::cerr << "Could not connect to " << host << ":" << port << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  ResultLog log;
+  std::thread receiver( ReceiveResults, std::ref( socket ), std::ref( log ),
+    listenOnly ? count : 0, outFile.empty() ? NULL : &out );
+
+  const Clock::time_point start = Clock::now();
+  long nSent = 0;
+  if( !listenOnly )
+    {
+    SimulatedProbeDevice device;
+    device.SetFrameFiles( Split( frames, ',' ) );
+    device.SetFrameRate( fps );
+    if( !device.ConnectProbe( false ) || !device.Start() )
+      {
+      std::cerr << "Could not start the simulated probe" << std::endl;
+      socket.Shutdown();
+      receiver.join();
+      return EXIT_FAILURE;
+      }
+
+    std::vector< unsigned char > pixels;
+    while( nSent < count && device.WaitForFrames( nSent + 1 ) )
+      {
+      //Every frame in acquisition order. If sending blocked for a full
+      //device ring, the newer frame now in the slot is sent instead.
+      SimulatedProbeDevice::ImageType::Pointer image =
+        device.GetBModeImageAbsolute( nSent );
+      if( image.IsNull() )
+        {
+        //Slot rewritten during the read, read it again
+        continue;
+        }
+      const SimulatedProbeDevice::ImageType::SizeType size =
+        image->GetLargestPossibleRegion().GetSize();
+      EstimationProtocol::FrameHeader frame;
+      frame.id = nSent;
+      frame.samples = size[ 0 ];
+      frame.lines = size[ 1 ];
+      frame.flags = overlay ? EstimationProtocol::FRAME_OVERLAY : 0;
+      frame.reserved = 0;
+        {
+        std::lock_guard< std::mutex > lock( log.mutex );
+        log.pending[ frame.id ] = Clock::now();
+        }
+      if( !EstimationProtocol::SendFrame( socket, frame, image->GetBufferPointer() ) )
+        {
+        std::cerr << "Connection closed by the server" << std::endl;
+        break;
+        }
+      nSent++;
+      }
+    device.Stop();
+
+    //Results of the last frames, bounded in case the server stalls
+    std::unique_lock< std::mutex > lock( log.mutex );
+    log.condition.wait_for( lock, std::chrono::seconds( 30 ), [ &log, nSent ]
+      {
+      return log.closed || log.nReceived >= nSent;
+      } );
+    lock.unlock();
+    socket.Shutdown();
+    }
+  receiver.join();
+  const double seconds = std::chrono::duration< double >( Clock::now() - start ).count();
+
+  std::cout << "Sent " << nSent << " frames, received " << log.nReceived
+    << " results in " << seconds << " s (" << log.nReceived / std::max( seconds, 1e-9 )
+    << " results/s)" << std::endl;
+  for( unsigned int i = 0; i < log.statusCounts.size(); i++ )
+    {
+    if( log.statusCounts[ i ] > 0 )
+      {
+      std::cout << "  " << GetStatusName( i ) << ": " << log.statusCounts[ i ]
+        << std::endl;
+      }
+    }
+  if( overlay )
+    {
+    std::cout << "  overlays: " << log.nOverlays << std::endl;
+    }
+  if( !log.latencies.empty() )
+    {
+    double sum = 0;
+    for( unsigned int i = 0; i < log.latencies.size(); i++ )
+      {
+      sum += log.latencies[ i ];
+      }
+    std::cout << "Latency mean " << sum / log.latencies.size() << " ms, p50 "
+      << GetPercentile( log.latencies, 0.5 ) << " ms, p95 "
+      << GetPercentile( log.latencies, 0.95 ) << " ms" << std::endl;
+    }
+  std::cout << "Mean width " << log.lastMean << " pixels" << std::endl;
+
+  return log.nReceived > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -26,27 +26,376 @@ OpticNerveEstimator::Fit( OpticNerveEstimator::ImageType::Pointer origImage,
   bool overlay,
   std::string prefix )
 {
+  speculativeNerveKept = false;
+  StartTimeBudget();
+  ImageType::RegionType imageRegion = origImage->GetLargestPossibleRegion();
+
+  //Start the nerve fit on the region predicted from the previous eye. It
+  //runs on its own estimator and a grafted copy of the image, so the two
+  //fits share no pipeline state.
+  OpticNerveEstimator speculative;
+  ImageType::RegionType predictedRegion;
+  const bool speculate = algParams.speculativeNerve &&
+    predictedEye.radiusX > 0 &&
+    ComputeNerveRegion( predictedEye, imageRegion, predictedRegion );
+  std::future< bool > speculativeFit;
+  if( speculate )
+    {
+    speculative.algParams = algParams;
+    speculative.hasDeadline = hasDeadline;
+    speculative.deadline = deadline;
+    ImageType::Pointer nerveInput = ImageType::New();
+    nerveInput->Graft( origImage );
+    ImageType::RegionType speculativeRegion = predictedRegion;
+    const std::string speculativePrefix = catStrings( prefix, "-speculative" );
+    speculativeFit = std::async( std::launch::async,
+      [ &speculative, nerveInput, speculativeRegion, overlay, speculativePrefix ]() mutable
+      {
+      return speculative.FitNerve( nerveInput, speculativeRegion, overlay,
+        speculativePrefix );
+      } );
+    }
+
   bool fitEyeSucces = FitEye( origImage, overlay, prefix );
+
+  bool speculativeSucces = false;
+  if( speculate )
+    {
+    try
+      {
+      speculativeSucces = speculativeFit.get();
+      }
+    catch( ... )
+      {
+      speculativeSucces = false;
+      }
+    }
+
   if( !fitEyeSucces )
     {
     return ESTIMATION_FAIL_EYE;
     }
 
   //Setup nerve region
-  ImageType::RegionType imageRegion = origImage->GetLargestPossibleRegion();
+  ImageType::RegionType desiredRegion;
+  if( !ComputeNerveRegion( eye, imageRegion, desiredRegion ) )
+    {
+    return ESTIMATION_FAIL_NERVE;
+    }
+
+  if( speculativeSucces && IsNerveRegionClose( predictedRegion, desiredRegion ) )
+    {
+    nerve = speculative.GetNerve();
+    speculativeNerveKept = true;
+    const StageTimes &times = speculative.GetStageTimes();
+    for( int i = StageTimes::NERVE_A; i <= StageTimes::NERVE_C2; i++ )
+      {
+      stageTimes.seconds[ i ] = times.seconds[ i ];
+      }
+    }
+  else
+    {
+    bool fitNerveSucces = FitNerve( origImage, desiredRegion, overlay, prefix );
+    if( !fitNerveSucces )
+      {
+      return ESTIMATION_FAIL_NERVE;
+      }
+    }
+
+#ifdef DEBUG_PRINT
+  std::cout << "Speculative nerve region: " << ( speculate ?
+    ( speculativeNerveKept ? "kept" : "redone" ) : "off" ) << std::endl;
+#endif
+
+
+#ifdef REPORT_TIMES
+  std::cout << "Times" << std::endl;
+  for( int i = 0; i < StageTimes::NUMBER_OF_STAGES; i++ )
+    {
+    std::cout << StageTimes::GetName( i ) << ": " << clocks[ i ].GetMean() << std::endl;
+    }
+#endif
+
+
+  return ESTIMATION_SUCCESS;
+}
+
+OpticNerveEstimator::Status
+OpticNerveEstimator::FitDecimated( OpticNerveEstimator::ImageType::Pointer origImage,
+  int factor,
+  bool overlay,
+  std::string prefix )
+{
+  speculativeNerveKept = false;
+  StartTimeBudget();
+  factor = std::max( 1, factor );
+  ImageType::Pointer image = ITKFilterFunctions<ImageType>::Decimate( origImage,
+    factor, algParams.numberOfThreads );
+
+  OpticNerveEstimator coarse;
+  coarse.algParams = GetDecimatedParameters( algParams, factor );
+  coarse.algParams.speculativeNerve = false;
+  //The coarse fit gets what is left of the budget after the decimation
+  if( hasDeadline )
+    {
+    coarse.algParams.timeBudget = std::max( 1e-6, std::chrono::duration< double >(
+      deadline - std::chrono::steady_clock::now() ).count() );
+    }
+  Status status = coarse.Fit( image, overlay, catStrings( prefix, "-decimated" ) );
+  stageTimes = coarse.GetStageTimes();
+
+  //Map the estimates to the input image, the eye is needed for the nerve
+  //region even if the nerve fit failed
+  eye = coarse.GetEye();
+  eye.initialCenterIndex = ExpandIndex( eye.initialCenterIndex, factor );
+  eye.initialCenter = ExpandPoint( eye.initialCenter, image, origImage, factor );
+  eye.centerIndex = ExpandIndex( eye.centerIndex, factor );
+  eye.center = ExpandPoint( eye.center, image, origImage, factor );
+  double *eyeLengths[] = { &eye.initialRadius, &eye.radiusX, &eye.radiusY,
+    &eye.initialRadiusX, &eye.initialRadiusY };
+  for( unsigned int i = 0; i < sizeof( eyeLengths ) / sizeof( eyeLengths[ 0 ] ); i++ )
+    {
+    if( *eyeLengths[ i ] > 0 )
+      {
+      *eyeLengths[ i ] *= factor;
+      }
+    }
+  if( eye.aligned.IsNotNull() )
+    {
+    eye.aligned = ITKFilterFunctions<ImageType>::Expand( eye.aligned, factor,
+      origImage->GetLargestPossibleRegion() );
+    }
+  if( status != ESTIMATION_SUCCESS )
+    {
+    return status;
+    }
+
+  nerve = coarse.GetNerve();
+  nerve.initialCenterIndex = ExpandIndex( nerve.initialCenterIndex, factor );
+  nerve.initialCenter = ExpandPoint( nerve.initialCenter, image, origImage, factor );
+  nerve.centerIndex = ExpandIndex( nerve.centerIndex, factor );
+  nerve.center = ExpandPoint( nerve.center, image, origImage, factor );
+  nerve.initialWidth *= factor;
+  nerve.width *= factor;
+  ImageType::RegionType region = nerve.originalImageRegion;
+  for( unsigned int d = 0; d < 2; d++ )
+    {
+    region.SetIndex( d, region.GetIndex()[ d ] * factor );
+    region.SetSize( d, region.GetSize()[ d ] * factor );
+    }
+  region.Crop( origImage->GetLargestPossibleRegion() );
+  nerve.originalImageRegion = region;
+  if( nerve.aligned.IsNotNull() )
+    {
+    nerve.aligned = ITKFilterFunctions<ImageType>::Expand( nerve.aligned, factor,
+      region );
+    }
+
+  return ESTIMATION_SUCCESS;
+}
+
+OpticNerveEstimator::Parameters
+OpticNerveEstimator::GetDecimatedParameters(
+  const OpticNerveEstimator::Parameters &params, int factor )
+{
+  Parameters decimated = params;
+  if( factor <= 1 )
+    {
+    return decimated;
+    }
+  decimated.eyeInitialBlurFactor /= factor;
+  decimated.eyeYSlab = std::max( 1, params.eyeYSlab / factor );
+  decimated.eyeXSlab = std::max( 1, params.eyeXSlab / factor );
+  decimated.eyeTemplateRadiusStep = std::max( 0.25, params.eyeTemplateRadiusStep / factor );
+  decimated.nerveInitialSmoothXFactor /= factor;
+  decimated.nerveInitialSmoothYFactor /= factor;
+  decimated.nerveHorizontalBoder = std::max( 1, params.nerveHorizontalBoder / factor );
+  decimated.nerveRegsitrationSmooth /= factor;
+  //The shrink factor of the eye registration is relative to the image size
+  decimated.eyeRegistrationSize = std::max( 1.0, params.eyeRegistrationSize / factor );
+  return decimated;
+}
+
+OpticNerveEstimator::ImageType::IndexType
+OpticNerveEstimator::ExpandIndex( const OpticNerveEstimator::ImageType::IndexType &index,
+  int factor )
+{
+  ImageType::IndexType expanded;
+  for( unsigned int d = 0; d < 2; d++ )
+    {
+    expanded[ d ] = index[ d ] * factor + factor / 2;
+    }
+  return expanded;
+}
+
+//Pixel i of the decimated image is centered on pixel
+//i * factor + ( factor - 1 ) / 2 of the input
+OpticNerveEstimator::ImageType::PointType
+OpticNerveEstimator::ExpandPoint( const OpticNerveEstimator::ImageType::PointType &point,
+  OpticNerveEstimator::ImageType::Pointer decimated,
+  OpticNerveEstimator::ImageType::Pointer image, int factor )
+{
+  itk::ContinuousIndex< double, 2 > index;
+  decimated->TransformPhysicalPointToContinuousIndex( point, index );
+  for( unsigned int d = 0; d < 2; d++ )
+    {
+    index[ d ] = index[ d ] * factor + 0.5 * ( factor - 1 );
+    }
+  ImageType::PointType expanded;
+  image->TransformContinuousIndexToPhysicalPoint( index, expanded );
+  return expanded;
+}
+
+OpticNerveEstimator::RegistrationQuality
+OpticNerveEstimator::RunBudgetedOptimization( OpticNerveEstimator::OptimizerType *optimizer,
+  itk::Transform< double, 2, 2 > *transform,
+  const std::function< void() > &optimize )
+{
+  //Budget already used up by the previous stages, keep the initial
+  //transform
+  if( IsTimeBudgetExceeded() )
+    {
+    RegistrationQuality quality;
+    quality.stopReason = RegistrationQuality::STOP_TIME_BUDGET;
+    quality.stopDescription = "Time budget exhausted before the registration";
+    quality.iterations = 0;
+    quality.functionEvaluations = 0;
+    quality.truncated = true;
+    quality.confidence = ComputeConfidence( quality );
+    return quality;
+    }
+
+  TimeBudgetObserver::Pointer observer = TimeBudgetObserver::New();
+  observer->SetEstimator( this );
+  unsigned long tag = 0;
+  if( hasDeadline )
+    {
+    tag = optimizer->AddObserver( itk::IterationEvent(), observer );
+    }
+
+  bool failed = false;
+  bool truncated = false;
+  try
+    {
+    optimize();
+    }
+  catch( const TimeBudgetExceeded & )
+    {
+    truncated = true;
+    }
+#ifdef DEBUG_PRINT
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    //return EXIT_FAILURE;
+    failed = true;
+    }
+#endif
+  catch( ... )
+    {
+    std::cerr << "Unspecified exception caught !" << std::endl;
+    failed = true;
+    }
+
+  if( hasDeadline )
+    {
+    optimizer->RemoveObserver( tag );
+    }
+
+  RegistrationQuality quality = GetOptimizerQuality( optimizer, failed );
+  if( truncated )
+    {
+    //The transform holds the parameters of the last evaluation, which may
+    //be a rejected line search step
+    if( observer->HasBestParameters() )
+      {
+      transform->SetParameters( observer->GetBestParameters() );
+      quality.metricValue = observer->GetBestValue();
+      }
+    quality.stopReason = RegistrationQuality::STOP_TIME_BUDGET;
+    quality.stopDescription = "Time budget exhausted";
+    quality.truncated = true;
+    quality.confidence = ComputeConfidence( quality );
+    }
+  return quality;
+}
+
+OpticNerveEstimator::RegistrationQuality
+OpticNerveEstimator::GetOptimizerQuality( OpticNerveEstimator::OptimizerType *optimizer,
+  bool failed ) const
+{
+  RegistrationQuality quality;
+  quality.stopDescription = optimizer->GetStopConditionDescription();
+  const OptimizerType::InternalOptimizerType *lbfgs = optimizer->GetOptimizer();
+  if( lbfgs != NULL )
+    {
+    quality.metricValue = optimizer->GetValue();
+    quality.iterations = lbfgs->get_num_iterations();
+    quality.functionEvaluations = lbfgs->get_num_evaluations();
+    switch( lbfgs->get_failure_code() )
+      {
+      case vnl_nonlinear_minimizer::CONVERGED_FTOL:
+      case vnl_nonlinear_minimizer::CONVERGED_XTOL:
+      case vnl_nonlinear_minimizer::CONVERGED_XFTOL:
+      case vnl_nonlinear_minimizer::CONVERGED_GTOL:
+        quality.stopReason = RegistrationQuality::STOP_CONVERGED;
+        break;
+      case vnl_nonlinear_minimizer::FAILED_TOO_MANY_ITERATIONS:
+        quality.stopReason = RegistrationQuality::STOP_ITERATION_LIMIT;
+        break;
+      default:
+        quality.stopReason = RegistrationQuality::STOP_FAILED;
+        break;
+      }
+    }
+  if( failed )
+    {
+    quality.stopReason = RegistrationQuality::STOP_FAILED;
+    }
+  quality.confidence = ComputeConfidence( quality );
+  return quality;
+}
+
+double
+OpticNerveEstimator::ComputeConfidence(
+  const OpticNerveEstimator::RegistrationQuality &quality ) const
+{
+  if( quality.metricValue < 0 ||
+    quality.stopReason == RegistrationQuality::STOP_FAILED )
+    {
+    return 0;
+    }
+  double confidence = std::max( 0.0,
+    1 - std::sqrt( quality.metricValue ) / algParams.confidenceResidualScale );
+  if( quality.stopReason == RegistrationQuality::STOP_ITERATION_LIMIT ||
+    quality.stopReason == RegistrationQuality::STOP_TIME_BUDGET )
+    {
+    confidence *= algParams.confidenceIterationLimitFactor;
+    }
+  return confidence;
+}
+
+//Nerve region below the eye
+bool
+OpticNerveEstimator::ComputeNerveRegion(
+  const OpticNerveEstimator::Eye &eyeEstimate,
+  const OpticNerveEstimator::ImageType::RegionType &imageRegion,
+  OpticNerveEstimator::ImageType::RegionType &nerveRegion ) const
+{
   ImageType::SizeType imageSize = imageRegion.GetSize();
 
   ImageType::IndexType desiredStart;
-  desiredStart[ 0 ] = eye.center[ 0 ] - algParams.nerveXRegionFactor * eye.radiusX;
-  desiredStart[ 1 ] = eye.center[ 1 ] + algParams.nerveYRegionFactor * eye.radiusY;
+  desiredStart[ 0 ] = eyeEstimate.center[ 0 ] - algParams.nerveXRegionFactor * eyeEstimate.radiusX;
+  desiredStart[ 1 ] = eyeEstimate.center[ 1 ] + algParams.nerveYRegionFactor * eyeEstimate.radiusY;
 
   ImageType::SizeType desiredSize;
-  desiredSize[ 0 ] = 2 * algParams.nerveXRegionFactor * eye.radiusX;
-  desiredSize[ 1 ] = algParams.nerveYSizeFactor * eye.radiusY;
+  desiredSize[ 0 ] = 2 * algParams.nerveXRegionFactor * eyeEstimate.radiusX;
+  desiredSize[ 1 ] = algParams.nerveYSizeFactor * eyeEstimate.radiusY;
 
   if( desiredStart[ 1 ] > (int)( imageSize[ 1 ] ) )
     {
-    return ESTIMATION_FAIL_NERVE;
+    return false;
     }
   if( desiredStart[ 1 ] + desiredSize[ 1 ] > imageSize[ 1 ] )
     {
@@ -62,32 +411,26 @@ OpticNerveEstimator::Fit( OpticNerveEstimator::ImageType::Pointer origImage,
     desiredSize[ 0 ] = imageSize[ 0 ] - desiredStart[ 0 ];
     }
 
+  nerveRegion = ImageType::RegionType( desiredStart, desiredSize );
+  return true;
+}
 
-  ImageType::RegionType desiredRegion( desiredStart, desiredSize );
-
-  bool fitNerveSucces = FitNerve( origImage, desiredRegion, overlay, prefix );
-  if( !fitNerveSucces )
+bool
+OpticNerveEstimator::IsNerveRegionClose(
+  const OpticNerveEstimator::ImageType::RegionType &predicted,
+  const OpticNerveEstimator::ImageType::RegionType &region ) const
+{
+  for( unsigned int i = 0; i < 2; i++ )
     {
-    return ESTIMATION_FAIL_NERVE;
+    const double tolerance = algParams.nerveSpeculationTolerance * region.GetSize()[ i ];
+    const double startDifference = std::abs( (double) predicted.GetIndex()[ i ] - region.GetIndex()[ i ] );
+    const double sizeDifference = std::abs( (double) predicted.GetSize()[ i ] - region.GetSize()[ i ] );
+    if( startDifference > tolerance || sizeDifference > tolerance )
+      {
+      return false;
+      }
     }
-
-
-#ifdef REPORT_TIMES
-  std::cout << "Times" << std::endl;
-  std::cout << "Eye A:   " << clockEyeA.GetMean() << std::endl;
-  std::cout << "Eye B:   " << clockEyeB.GetMean() << std::endl;
-  std::cout << "Eye C1:  " << clockEyeC1.GetMean() << std::endl;
-  std::cout << "Eye C2:  " << clockEyeC2.GetMean() << std::endl;
-  std::cout << "Eye C3:  " << clockEyeC3.GetMean() << std::endl;
-  std::cout << std::endl;
-  std::cout << "Nerve A:  " << clockNerveA.GetMean() << std::endl;
-  std::cout << "Nerve B:  " << clockNerveB.GetMean() << std::endl;
-  std::cout << "Nerve C1: " << clockNerveC1.GetMean() << std::endl;
-  std::cout << "Nerve C2: " << clockNerveC2.GetMean() << std::endl;
-#endif
-
-
-  return ESTIMATION_SUCCESS;
+  return true;
 }
 
 //Helper function
@@ -162,6 +505,47 @@ OpticNerveEstimator::CreateEllipseImage( ImageType::SpacingType spacing,
   //return imageFilter->GetOutput();
 };
 
+//Maximum of the distance map of a mask to its pixels of value 100
+double
+OpticNerveEstimator::ComputeDistanceMaximum(
+  OpticNerveEstimator::UnsignedCharImageType::Pointer mask,
+  OpticNerveEstimator::ImageType::IndexType &index,
+  const std::string &debugFilename )
+{
+  if( algParams.useFastDistanceTransform )
+    {
+#ifdef DEBUG_IMAGES
+    const bool createDistanceImage = true;
+#else
+    const bool createDistanceImage = false;
+#endif
+    DistanceTransformType::Result result = DistanceTransformType::Compute(
+      mask, 100, createDistanceImage, algParams.numberOfThreads );
+#ifdef DEBUG_IMAGES
+    ImageIO<ImageType>::WriteImage( result.distance, debugFilename );
+#endif
+    index = result.index;
+    return result.maximum;
+    }
+
+  SignedDistanceFilter::Pointer distanceFilter = SignedDistanceFilter::New();
+  distanceFilter->SetInput( mask );
+  distanceFilter->SetInsideValue( 100 );
+  distanceFilter->SetOutsideValue( 0 );
+  distanceFilter->Update();
+  ImageType::Pointer distance = distanceFilter->GetOutput();
+
+#ifdef DEBUG_IMAGES
+  ImageIO<ImageType>::WriteImage( distance, debugFilename );
+#endif
+
+  ImageCalculatorFilterType::Pointer calculator = ImageCalculatorFilterType::New();
+  calculator->SetImage( distance );
+  calculator->Compute();
+  index = calculator->GetIndexOfMaximum();
+  return calculator->GetMaximum();
+};
+
 //Fit an ellipse to an eye ultrasound image in three main steps
 // A) Prepare moving Image
 // B) Prepare fixed image
@@ -182,9 +566,9 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   //A. Prepare fixed image
   ///
 
-#ifdef REPORT_TIMESS
-  clockEyeA.Start();
-#endif
+  ResetStageTimes( StageTimes::EYE_A, StageTimes::EYE_C3 );
+  eye.quality = RegistrationQuality();
+  StartStage( StageTimes::EYE_A );
 
   //-- Steps 1 to 3
   //   1. Rescale the image to 0, 100
@@ -229,17 +613,25 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
 //   4.3 Distance transfrom
 //   4.4 Calculate inital center and radius from distance transform (Max)
 
-  StructuringElementType structuringElement;
-  structuringElement.SetRadius(
-    algParams.eyeClosingRadiusFactor * std::min( imageSize[ 0 ], imageSize[ 1 ] )
-  );
-  structuringElement.CreateStructuringElement();
-  ClosingFilter::Pointer closingFilter = ClosingFilter::New();
-  closingFilter->SetInput( image );
-  closingFilter->SetKernel( structuringElement );
-  closingFilter->SetForegroundValue( 100.0 );
-  closingFilter->Update();
-  image = closingFilter->GetOutput();
+  const int closingRadius =
+    algParams.eyeClosingRadiusFactor * std::min( imageSize[ 0 ], imageSize[ 1 ] );
+  if( algParams.useFastMorphology )
+    {
+    image = MorphologyType::Closing( image, closingRadius, 100.0,
+      algParams.numberOfThreads );
+    }
+  else
+    {
+    StructuringElementType structuringElement;
+    structuringElement.SetRadius( closingRadius );
+    structuringElement.CreateStructuringElement();
+    ClosingFilter::Pointer closingFilter = ClosingFilter::New();
+    closingFilter->SetInput( image );
+    closingFilter->SetKernel( structuringElement );
+    closingFilter->SetForegroundValue( 100.0 );
+    closingFilter->Update();
+    image = closingFilter->GetOutput();
+    }
 
   CastFilter::Pointer castFilter = CastFilter::New();
   castFilter->SetInput( image );
@@ -249,24 +641,9 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   ITKFilterFunctions<UnsignedCharImageType>::AddVerticalBorder( sdImage,
     algParams.eyeVerticalBorderFactor * imageSize[ 0 ] );
 
-  SignedDistanceFilter::Pointer signedDistanceFilter = SignedDistanceFilter::New();
-  signedDistanceFilter->SetInput( sdImage );
-  signedDistanceFilter->SetInsideValue( 100 );
-  signedDistanceFilter->SetOutsideValue( 0 );
-  signedDistanceFilter->Update();
-  ImageType::Pointer imageDistance = signedDistanceFilter->GetOutput();
-
-#ifdef DEBUG_IMAGES
-  ImageIO<ImageType>::WriteImage( imageDistance, catStrings( prefix, "-eye-distance.tif" ) );
-#endif
-
   //Compute max of distance transfrom
-  ImageCalculatorFilterType::Pointer imageCalculatorFilter = ImageCalculatorFilterType::New();
-  imageCalculatorFilter->SetImage( imageDistance );
-  imageCalculatorFilter->Compute();
-
-  eye.initialRadius = imageCalculatorFilter->GetMaximum();
-  eye.initialCenterIndex = imageCalculatorFilter->GetIndexOfMaximum();
+  eye.initialRadius = ComputeDistanceMaximum( sdImage, eye.initialCenterIndex,
+    catStrings( prefix, "-eye-distance.tif" ) );
   image->TransformIndexToPhysicalPoint( eye.initialCenterIndex, eye.initialCenter );
 
 #ifdef DEBUG_PRINT
@@ -304,25 +681,11 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   extractFilterY->SetInput( sdImage2 );
   extractFilterY->Update();
 
-  SignedDistanceFilter::Pointer signedDistanceY = SignedDistanceFilter::New();
-  signedDistanceY->SetInput( extractFilterY->GetOutput() );
-  signedDistanceY->SetInsideValue( 100 );
-  signedDistanceY->SetOutsideValue( 0 );
-  //signedDistanceY->GetOutput()->SetRequestedRegion( yRegion );
-  signedDistanceY->Update();
-  ImageType::Pointer imageDistanceY = signedDistanceY->GetOutput();
-
-#ifdef DEBUG_IMAGES
-  ImageIO<ImageType>::WriteImage( imageDistanceY, catStrings( prefix, "-eye-ydistance.tif" ) );
-#endif
+  ImageType::IndexType maximumIndexY;
+  eye.initialRadiusY = ComputeDistanceMaximum( extractFilterY->GetOutput(),
+    maximumIndexY, catStrings( prefix, "-eye-ydistance.tif" ) );
 
-  ImageCalculatorFilterType::Pointer imageCalculatorY = ImageCalculatorFilterType::New();
-  imageCalculatorY->SetImage( imageDistanceY );
-  imageCalculatorY->Compute();
-
-  eye.initialRadiusY = imageCalculatorY->GetMaximum();
-
-  eye.initialCenterIndex[ 1 ] = imageCalculatorY->GetIndexOfMaximum()[ 1 ];
+  eye.initialCenterIndex[ 1 ] = maximumIndexY[ 1 ];
 #ifdef DEBUG_PRINT
   std::cout << "Eye initial radiusY: " << eye.initialRadiusY << std::endl;
 #endif
@@ -341,25 +704,11 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   extractFilterX->SetInput( sdImage2 );
   extractFilterX->Update();
 
-  SignedDistanceFilter::Pointer signedDistanceX = SignedDistanceFilter::New();
-  signedDistanceX->SetInput( extractFilterX->GetOutput() );
-  signedDistanceX->SetInsideValue( 100 );
-  signedDistanceX->SetOutsideValue( 0 );
-  //signedDistanceX->GetOutput()->SetRequestedRegion( xRegion );
-  signedDistanceX->Update();
-  ImageType::Pointer imageDistanceX = signedDistanceX->GetOutput();
+  ImageType::IndexType maximumIndexX;
+  eye.initialRadiusX = ComputeDistanceMaximum( extractFilterX->GetOutput(),
+    maximumIndexX, catStrings( prefix, "-eye-xdistance.tif" ) );
 
-#ifdef DEBUG_IMAGES
-  ImageIO<ImageType>::WriteImage( imageDistanceX, catStrings( prefix, "-eye-xdistance.tif" ) );
-#endif
-
-  ImageCalculatorFilterType::Pointer imageCalculatorX = ImageCalculatorFilterType::New();
-  imageCalculatorX->SetImage( imageDistanceX );
-  imageCalculatorX->Compute();
-
-  eye.initialRadiusX = imageCalculatorX->GetMaximum();
-
-  eye.initialCenterIndex[ 0 ] = imageCalculatorX->GetIndexOfMaximum()[ 0 ];
+  eye.initialCenterIndex[ 0 ] = maximumIndexX[ 0 ];
 #ifdef DEBUG_PRINT
   std::cout << "Eye initial radiusX: " << eye.initialRadiusX << std::endl;
 #endif
@@ -375,26 +724,23 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   sigma[ 0 ] = 10 * imageSpacing[ 0 ];
   sigma[ 1 ] = 10 * imageSpacing[ 1 ];
   ImageType::Pointer imageSmooth = ITKFilterFunctions<ImageType>::GaussSmooth( image, sigma );
-  imageSmooth = ITKFilterFunctions<ImageType>::ThresholdAbove( imageSmooth,
-    algParams.eyeThreshold, 100 );
-  imageSmooth = ITKFilterFunctions<ImageType>::Rescale( imageSmooth, 0, 100 );
+  ITKFilterFunctions<ImageType>::PixelChain()
+    .ThresholdAbove( algParams.eyeThreshold, 100 )
+    .Rescale( 0, 100 )
+    .Apply( imageSmooth, imageSmooth );
 
 #ifdef DEBUG_IMAGES
   ImageIO<ImageType>::WriteImage( imageSmooth, catStrings( prefix, "-eye-smooth.tif" ) );
 #endif
 
-#ifdef REPORT_TIMES
-  clockEyeA.Stop();
-#endif
+  StopStage( StageTimes::EYE_A );
 
 
   ////
   //B. Prepare fixed image
   ////
 
-#ifdef REPORT_TIMES
-  clockEyeB.Start();
-#endif
+  StartStage( StageTimes::EYE_B );
 
   //-- Steps 1 through 2
   //   1. Create ellipse ring image by subtract two ellipse with different
@@ -407,21 +753,40 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   //inital guess of radiusX axis
   double r2 = eye.initialRadiusY;
   //width of the ellipse ring rf*r1, rf*r2
-  ImageType::Pointer e1 = CreateEllipseImage( imageSpacing, imageSize, imageOrigin, imageDirection,
-    eye.initialCenter, r1, r2, outside );
-  ImageType::Pointer e2 = CreateEllipseImage( imageSpacing, imageSize, imageOrigin, imageDirection,
-    eye.initialCenter, r1 * algParams.eyeRingFactor,
-    r2 * algParams.eyeRingFactor,
-    outside );
-
-  ImageType::Pointer ellipse = ITKFilterFunctions<ImageType>::Subtract( e1, e2 );
-
-  sigma[ 0 ] = algParams.eyeInitialBlurFactor * imageSpacing[ 0 ];
-  sigma[ 1 ] = algParams.eyeInitialBlurFactor * imageSpacing[ 1 ];
-  ellipse = ITKFilterFunctions<ImageType>::GaussSmooth( ellipse, sigma );
-  ellipse = ITKFilterFunctions<ImageType>::ThresholdAbove( ellipse,
-    algParams.eyeThreshold, 100 );
-  ellipse = ITKFilterFunctions<ImageType>::Rescale( ellipse, 0, 100 );
+  ImageType::Pointer ellipse;
+  //Registration mask from the template cache, see C) 1
+  ImageType::Pointer cachedEllipseMask;
+  if( algParams.useEllipseTemplateCache )
+    {
+    EllipseTemplateCache::Parameters templateParams;
+    templateParams.radiusX = r1;
+    templateParams.radiusY = r2;
+    templateParams.ringFactor = algParams.eyeRingFactor;
+    templateParams.blurFactor = algParams.eyeInitialBlurFactor;
+    templateParams.threshold = algParams.eyeThreshold;
+    templateParams.radiusStep = algParams.eyeTemplateRadiusStep;
+    EllipseTemplateCache::GetShared().GetTemplates( image, eye.initialCenter,
+      templateParams, ellipse, cachedEllipseMask );
+    }
+  else
+    {
+    ImageType::Pointer e1 = CreateEllipseImage( imageSpacing, imageSize, imageOrigin, imageDirection,
+      eye.initialCenter, r1, r2, outside );
+    ImageType::Pointer e2 = CreateEllipseImage( imageSpacing, imageSize, imageOrigin, imageDirection,
+      eye.initialCenter, r1 * algParams.eyeRingFactor,
+      r2 * algParams.eyeRingFactor,
+      outside );
+
+    ellipse = ITKFilterFunctions<ImageType>::Subtract( e1, e2 );
+
+    sigma[ 0 ] = algParams.eyeInitialBlurFactor * imageSpacing[ 0 ];
+    sigma[ 1 ] = algParams.eyeInitialBlurFactor * imageSpacing[ 1 ];
+    ITKFilterFunctions<ImageType>::GaussSmooth( ellipse, sigma, ellipse );
+    ITKFilterFunctions<ImageType>::PixelChain()
+      .ThresholdAbove( algParams.eyeThreshold, 100 )
+      .Rescale( 0, 100 )
+      .Apply( ellipse, ellipse );
+    }
 
 #ifdef DEBUG_IMAGES
   ImageIO<ImageType>::WriteImage( ellipse, catStrings( prefix, "-eye-moving.tif" ) );
@@ -434,30 +799,30 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   std::cout << ellipse->GetLargestPossibleRegion().GetSize() << std::endl;
 #endif
 
-#ifdef REPORT_TIMES
-  clockEyeB.Stop();
-#endif
+  StopStage( StageTimes::EYE_B );
 
 
   ////
   //C. Affine registration
   ////
 
-#ifdef REPORT_TIMES
-  clockEyeC1.Start();
-#endif
+  StartStage( StageTimes::EYE_C1 );
 
   //-- Step 1
   //   Create a mask image that only measure mismatch in an ellipse region
   //   macthing the create ellipse image, but not including left and right corners
   //   of the eye (they are often black but sometimes white)
 
-  ImageType::Pointer ellipseMask = CreateEllipseImage( imageSpacing, imageSize,
-    imageOrigin, imageDirection,
-    eye.initialCenter,
-    r1 * ( algParams.eyeRingFactor + 1 ) / 2,
-    r2 * ( algParams.eyeRingFactor + 1 ) / 2,
-    0, 100 );
+  ImageType::Pointer ellipseMask = cachedEllipseMask;
+  if( ellipseMask.IsNull() )
+    {
+    ellipseMask = CreateEllipseImage( imageSpacing, imageSize,
+      imageOrigin, imageDirection,
+      eye.initialCenter,
+      r1 * ( algParams.eyeRingFactor + 1 ) / 2,
+      r2 * ( algParams.eyeRingFactor + 1 ) / 2,
+      0, 100 );
+    }
   //remove left and right corners from mask
   int xlim_l = std::max( 0,
     ( int )( eye.initialCenterIndex[ 0 ] - algParams.eyeMaskCornerXFactor * r1 * imageSpacing[ 0 ] ) );
@@ -490,14 +855,10 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
       }
     }
 
-#ifdef REPORT_TIMES
-  clockEyeC1.Stop();
-#endif
+  StopStage( StageTimes::EYE_C1 );
 
 
-#ifdef REPORT_TIMES
-  clockEyeC2.Start();
-#endif
+  StartStage( StageTimes::EYE_C2 );
 
   //-- Step 2
   //   Affine registration centered on the fixed ellipse image
@@ -519,7 +880,7 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
 #ifdef DEBUG_PRINT
   optimizer->TraceOn();
 #endif
-  optimizer->SetMaximumNumberOfFunctionEvaluations( 20000 );
+  optimizer->SetMaximumNumberOfFunctionEvaluations( algParams.maxFunctionEvaluations );
 
   metric->SetMovingInterpolator( movingInterpolator );
   metric->SetFixedInterpolator( fixedInterpolator );
@@ -563,24 +924,28 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   registration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
   registration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
 
-  //Do registration
-  try
-    {
-    registration->SetNumberOfThreads( 1 );
-    registration->Update();
-    }
-#ifdef DEBUG_PRINT
-  catch( itk::ExceptionObject & err )
-    {
-    std::cerr << "ExceptionObject caught !" << std::endl;
-    std::cerr << err << std::endl;
-    //return EXIT_FAILURE;
-    }
-#endif
-  catch( ... )
-    {
-    std::cerr << "Unspecified exception caught !" << std::endl;
-    }
+  //Do registration, stopped by the time budget of the frame
+  eye.quality = RunBudgetedOptimization( optimizer, transform.GetPointer(),
+    [ & ]()
+      {
+      if( algParams.useFastMetric )
+        {
+        FastMetricType::Pointer fastMetric = FastMetricType::New();
+        fastMetric->SetFixedImage( ellipse );
+        fastMetric->SetMovingImage( imageSmooth );
+        fastMetric->SetFixedImageMask( castFilter3->GetOutput() );
+        fastMetric->SetShrinkFactor( shrinkFactorsPerLevel[ 0 ] );
+        fastMetric->SetTransform( transform );
+        fastMetric->Initialize();
+        optimizer->SetMetric( fastMetric );
+        optimizer->StartOptimization();
+        }
+      else
+        {
+        registration->SetNumberOfThreads( 1 );
+        registration->Update();
+        }
+      } );
 
 #ifdef DEBUG_PRINT
   const double bestValue = optimizer->GetValue();
@@ -588,17 +953,13 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   std::cout << " Metric value  = " << bestValue << std::endl;
 
   std::cout << "Optimized transform paramters:" << std::endl;
-  std::cout << registration->GetTransform()->GetParameters() << std::endl;
+  std::cout << transform->GetParameters() << std::endl;
   std::cout << transform->GetCenter() << std::endl;
 #endif
 
-#ifdef REPORT_TIMES
-  clockEyeC2.Stop();
-#endif
+  StopStage( StageTimes::EYE_C2 );
 
-#ifdef REPORT_TIMES
-  clockEyeC3.Start();
-#endif
+  StartStage( StageTimes::EYE_C3 );
 
   //Created registered ellipse image
   if( alignEllipse )
@@ -663,9 +1024,7 @@ OpticNerveEstimator::FitEye( OpticNerveEstimator::ImageType::Pointer inputImage,
   std::cout << "--- Done Fitting Eye ---" << std::endl << std::endl;
 #endif
 
-#ifdef REPORT_TIMES
-  clockEyeC3.Stop();
-#endif
+  StopStage( StageTimes::EYE_C3 );
 
   return true;
 };
@@ -693,9 +1052,9 @@ OpticNerveEstimator::FitNerve(
   //A) Prepare moving image
   ////
 
-#ifdef REPORT_TIMES
-  clockNerveA.Start();
-#endif
+  ResetStageTimes( StageTimes::NERVE_A, StageTimes::NERVE_C2 );
+  nerve.quality = RegistrationQuality();
+  StartStage( StageTimes::NERVE_A );
 
   ImageType::SpacingType imageSpacing = inputImage->GetSpacing();
   ImageType::RegionType imageRegion = inputImage->GetLargestPossibleRegion();
@@ -743,9 +1102,9 @@ OpticNerveEstimator::FitNerve(
   ImageType::Pointer nerveImage = ITKFilterFunctions<ImageType>::GaussSmooth( nerveImageOrig, sigma );
 
   //Rescale indiviudal rows
-  ITKFilterFunctions<ImageType>::RescaleRows( nerveImage );
+  ITKFilterFunctions<ImageType>::RescaleRows( nerveImage, algParams.numberOfThreads );
 
-  nerveImage = ITKFilterFunctions<ImageType>::Rescale( nerveImage, 0, 100 );
+  ITKFilterFunctions<ImageType>::Rescale( nerveImage, 0, 100, nerveImage );
 
 #ifdef DEBUG_IMAGES
   ImageIO<ImageType>::WriteImage( nerveImage, catStrings( prefix, "-nerve-smooth.tif" ) );
@@ -767,15 +1126,25 @@ OpticNerveEstimator::FitNerve(
   ImageIO<ImageType>::WriteImage( nerveImageB, catStrings( prefix, "-nerve-sd-thres.tif" ) );
 #endif
 
-  StructuringElementType structuringElement;
-  structuringElement.SetRadius( std::min( imageSize[ 0 ], imageSize[ 1 ] ) * algParams.nerveOpeningRadiusFactor );
-  structuringElement.CreateStructuringElement();
-  OpeningFilter::Pointer openingFilter = OpeningFilter::New();
-  openingFilter->SetInput( nerveImageB );
-  openingFilter->SetKernel( structuringElement );
-  openingFilter->SetForegroundValue( 100.0 );
-  openingFilter->Update();
-  nerveImageB = openingFilter->GetOutput();
+  const int openingRadius =
+    std::min( imageSize[ 0 ], imageSize[ 1 ] ) * algParams.nerveOpeningRadiusFactor;
+  if( algParams.useFastMorphology )
+    {
+    nerveImageB = MorphologyType::Opening( nerveImageB, openingRadius, 100.0,
+      0.0, algParams.numberOfThreads );
+    }
+  else
+    {
+    StructuringElementType structuringElement;
+    structuringElement.SetRadius( openingRadius );
+    structuringElement.CreateStructuringElement();
+    OpeningFilter::Pointer openingFilter = OpeningFilter::New();
+    openingFilter->SetInput( nerveImageB );
+    openingFilter->SetKernel( structuringElement );
+    openingFilter->SetForegroundValue( 100.0 );
+    openingFilter->Update();
+    nerveImageB = openingFilter->GetOutput();
+    }
 
 #ifdef DEBUG_IMAGES
   ImageIO<ImageType>::WriteImage( nerveImageB, catStrings( prefix, "-nerve-morpho.tif" ) );
@@ -824,29 +1193,14 @@ OpticNerveEstimator::FitNerve(
 
   ITKFilterFunctions<UnsignedCharImageType>::AddHorizontalBorder( nerveImage2, algParams.nerveHorizontalBoder );
 
-  SignedDistanceFilter::Pointer nerveDistanceFilter = SignedDistanceFilter::New();
-  nerveDistanceFilter->SetInput( nerveImage2 );
-  nerveDistanceFilter->SetInsideValue( 100 );
-  nerveDistanceFilter->SetOutsideValue( 0 );
-  nerveDistanceFilter->Update();
-  ImageType::Pointer nerveDistance = nerveDistanceFilter->GetOutput();
-
-#ifdef DEBUG_IMAGES
-  ImageIO<ImageType>::WriteImage( nerveDistance, catStrings( prefix, "-nerve-distance.tif" ) );
-#endif
-
   //Compute max of distance transfrom
-  ImageCalculatorFilterType::Pointer nerveCalculatorFilter = ImageCalculatorFilterType::New();
-  nerveCalculatorFilter->SetImage( nerveDistance );
-  nerveCalculatorFilter->Compute();
-
-  nerve.initialWidth = nerveCalculatorFilter->GetMaximum();
+  nerve.initialWidth = ComputeDistanceMaximum( nerveImage2,
+    nerve.initialCenterIndex, catStrings( prefix, "-nerve-distance.tif" ) );
 
   if( nerve.initialWidth <= 0 )
     {
     return false;
     }
-  nerve.initialCenterIndex = nerveCalculatorFilter->GetIndexOfMaximum();
   nerveImage->TransformIndexToPhysicalPoint( nerve.initialCenterIndex, nerve.initialCenter );
 
 #ifdef DEBUG_PRINT
@@ -862,50 +1216,9 @@ OpticNerveEstimator::FitNerve(
 #ifdef DEBUG_PRINT
   std::cout << "Approximate nerve center intensity: " << centerIntensity << std::endl;
 #endif
-  for( unsigned int i = 0; i < nerveSize[ 1 ]; i++ )
-    {
-    ImageType::IndexType index;
-    index[ 1 ] = i;
-    float maxIntensityLeft = 0;
-    for( int j = 0; j < nerve.initialCenterIndex[ 0 ]; j++ )
-      {
-      index[ 0 ] = j;
-      maxIntensityLeft = std::max( nerveImage->GetPixel( index ), maxIntensityLeft );
-      }
-    for( int j = 0; j < nerve.initialCenterIndex[ 0 ]; j++ )
-      {
-      index[ 0 ] = j;
-      float value = 0;
-      if( maxIntensityLeft > centerIntensity )
-        {
-        value = ( nerveImage->GetPixel( index ) - centerIntensity ) /
-          ( maxIntensityLeft - centerIntensity );
-        value = std::max( 0.f, value ) * 100;
-        value = std::min( 100.f, value );
-        }
-      nerveImage->SetPixel( index, value );
-      }
-
-    float maxIntensityRight = 0;
-    for( unsigned int j = nerve.initialCenterIndex[ 0 ]; j < nerveSize[ 0 ]; j++ )
-      {
-      index[ 0 ] = j;
-      maxIntensityRight = std::max( nerveImage->GetPixel( index ), maxIntensityRight );
-      }
-    for( unsigned int j = nerve.initialCenterIndex[ 0 ]; j < nerveSize[ 0 ]; j++ )
-      {
-      index[ 0 ] = j;
-      float value = 0;
-      if( maxIntensityRight > centerIntensity )
-        {
-        value = ( nerveImage->GetPixel( index ) - centerIntensity ) /
-          ( maxIntensityRight - centerIntensity );
-        value = std::max( 0.f, value ) * 100;
-        value = std::min( 100.f, value );
-        }
-      nerveImage->SetPixel( index, value );
-      }
-    }
+  ITKFilterFunctions<ImageType>::RescaleRowsAroundColumn( nerveImage,
+    nerve.initialCenterIndex[ 0 ] - nerveImage->GetBufferedRegion().GetIndex()[ 0 ],
+    centerIntensity, 100, algParams.numberOfThreads );
 
 #ifdef DEBUG_IMAGES
   ImageIO<ImageType>::WriteImage( nerveImage, catStrings( prefix, "-nerve-scaled.tif" ) );
@@ -954,28 +1267,13 @@ OpticNerveEstimator::FitNerve(
   ITKFilterFunctions<UnsignedCharImageType>::AddHorizontalBorder( nerveImage3,
     algParams.nerveHorizontalBoder );
 
-  SignedDistanceFilter::Pointer nerveDistanceFilter2 = SignedDistanceFilter::New();
-  nerveDistanceFilter2->SetInput( nerveImage3 );
-  nerveDistanceFilter2->SetInsideValue( 100 );
-  nerveDistanceFilter2->SetOutsideValue( 0 );
-  nerveDistanceFilter2->Update();
-  ImageType::Pointer nerveDistance2 = nerveDistanceFilter2->GetOutput();
-
-#ifdef DEBUG_IMAGES
-  ImageIO<ImageType>::WriteImage( nerveDistance, catStrings( prefix, "-nerve-scaled-distance.tif" ) );
-#endif
-
   //Compute max of distance transfrom
-  ImageCalculatorFilterType::Pointer nerveCalculatorFilter2 = ImageCalculatorFilterType::New();
-  nerveCalculatorFilter2->SetImage( nerveDistance2 );
-  nerveCalculatorFilter2->Compute();
-
-  nerve.initialWidth = nerveCalculatorFilter2->GetMaximum();
+  nerve.initialWidth = ComputeDistanceMaximum( nerveImage3,
+    nerve.initialCenterIndex, catStrings( prefix, "-nerve-scaled-distance.tif" ) );
   if( nerve.initialWidth <= 0 )
     {
     return false;
     }
-  nerve.initialCenterIndex = nerveCalculatorFilter2->GetIndexOfMaximum();
   nerveImage->TransformIndexToPhysicalPoint( nerve.initialCenterIndex, nerve.initialCenter );
 
 #ifdef DEBUG_PRINT
@@ -984,6 +1282,12 @@ OpticNerveEstimator::FitNerve(
   std::cout << "Refined approximate nerve center Index: " << nerve.initialCenterIndex << std::endl;
 #endif
 
+  if( algParams.nerveFitMethod == NERVE_FIT_PROFILE )
+    {
+    StopStage( StageTimes::NERVE_A );
+    return FitNerveProfile( nerveImage, alignNerve, prefix );
+    }
+
   //-- Step 6
   //   Add a bit of smoothing for the registration process
   sigma[ 0 ] = algParams.nerveRegsitrationSmooth * nerveSpacing[ 0 ];
@@ -994,9 +1298,7 @@ OpticNerveEstimator::FitNerve(
   ImageIO<ImageType>::WriteImage( nerveImage, catStrings( prefix, "-nerve-thres.tif" ) );
 #endif
 
-#ifdef REPORT_TIMES
-  clockNerveA.Stop();
-#endif
+  StopStage( StageTimes::NERVE_A );
 
 
   /////
@@ -1004,9 +1306,7 @@ OpticNerveEstimator::FitNerve(
   //  Create artifical nerve image to fit to region of interest.
   /////
 
-#ifdef REPORT_TIMES
-  clockNerveB.Start();
-#endif
+  StartStage( StageTimes::NERVE_B );
 
   //--Step 1 and C) 1
   //  Create a black and white image with two bars that
@@ -1085,18 +1385,14 @@ OpticNerveEstimator::FitNerve(
   ImageIO<ImageType>::WriteImage( moving, catStrings( prefix, "-nerve-moving.tif" ) );
 #endif
 
-#ifdef REPORT_TIMES
-  clockNerveB.Stop();
-#endif
+  StopStage( StageTimes::NERVE_B );
 
 
   ////
   //C. Registration of artifical nerve image to threhsold nerve image
   ////
 
-#ifdef REPORT_TIMES
-  clockNerveC1.Start();
-#endif
+  StartStage( StageTimes::NERVE_C1 );
 
   //-- Step 2 (Step 1 was inclued in B)
   //   Similarity transfrom registration centered on the fixed bars image
@@ -1117,7 +1413,7 @@ OpticNerveEstimator::FitNerve(
 #ifdef DEBUG_PRINT
   optimizer->TraceOn();
 #endif
-  optimizer->SetMaximumNumberOfFunctionEvaluations( 20000 );
+  optimizer->SetMaximumNumberOfFunctionEvaluations( algParams.maxFunctionEvaluations );
 
   metric->SetMovingInterpolator( movingInterpolator );
   metric->SetFixedInterpolator( fixedInterpolator );
@@ -1155,41 +1451,41 @@ OpticNerveEstimator::FitNerve(
   registration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
   registration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
 
-  //Do registration
-  try
-    {
-    registration->SetNumberOfThreads( 1 );
-    registration->Update();
-    }
-#ifdef DEBUG_PRINT
-  catch( itk::ExceptionObject & err )
-    {
-    std::cerr << "ExceptionObject caught !" << std::endl;
-    std::cerr << err << std::endl;
-    //return EXIT_FAILURE;
-    }
-#endif
-  catch( ... )
-    {
-    std::cerr << "Unspecified exception caught !" << std::endl;
-    }
+  //Do registration, stopped by the time budget of the frame
+  nerve.quality = RunBudgetedOptimization( optimizer, transform.GetPointer(),
+    [ & ]()
+      {
+      if( algParams.useFastMetric )
+        {
+        FastMetricType::Pointer fastMetric = FastMetricType::New();
+        fastMetric->SetFixedImage( moving );
+        fastMetric->SetMovingImage( nerveImage );
+        fastMetric->SetFixedImageMask( movingMask );
+        fastMetric->SetTransform( transform );
+        fastMetric->Initialize();
+        optimizer->SetMetric( fastMetric );
+        optimizer->StartOptimization();
+        }
+      else
+        {
+        registration->SetNumberOfThreads( 1 );
+        registration->Update();
+        }
+      } );
+
 #ifdef DEBUG_PRINT
   const double bestValue = optimizer->GetValue();
   std::cout << "Result = " << std::endl;
   std::cout << " Metric value  = " << bestValue << std::endl;
 
   std::cout << "Registered transform parameters: " << std::endl;
-  std::cout << registration->GetTransform()->GetParameters() << std::endl;
+  std::cout << transform->GetParameters() << std::endl;
   std::cout << transform->GetCenter() << std::endl;
 #endif
 
-#ifdef REPORT_TIMES
-  clockNerveC1.Stop();
-#endif
+  StopStage( StageTimes::NERVE_C1 );
 
-#ifdef REPORT_TIMES
-  clockNerveC2.Start();
-#endif
+  StartStage( StageTimes::NERVE_C2 );
 
   if( alignNerve )
     {
@@ -1278,9 +1574,296 @@ OpticNerveEstimator::FitNerve(
   std::cout << "--- Done fitting nerve ---" << std::endl << std::endl;
 #endif
 
-#ifdef REPORT_TIMES
-  clockNerveC2.Stop();
+  StopStage( StageTimes::NERVE_C2 );
+
+  return true;
+};
+
+
+  //Fit the Gauss smoothed two bar model of the registration path directly
+  //to the column profile of the thresholded nerve image
+  // B') Column profile
+  // C') Gauss-Newton fit of center and scale
+  //
+  //For a detailed descritpion and overview of the whole pipleine
+  //see the top of this file
+bool
+OpticNerveEstimator::FitNerveProfile(
+  OpticNerveEstimator::ImageType::Pointer nerveImage,
+  bool alignNerve,
+  const std::string &prefix )
+{
+
+  ////
+  //B') Column profile
+  ////
+
+  StartStage( StageTimes::NERVE_B );
+
+  ImageType::RegionType nerveRegion = nerveImage->GetLargestPossibleRegion();
+  ImageType::SizeType nerveSize = nerveRegion.GetSize();
+  ImageType::IndexType nerveIndex = nerveRegion.GetIndex();
+  ImageType::SpacingType nerveSpacing = nerveImage->GetSpacing();
+  const int width = nerveSize[ 0 ];
+  const int height = nerveSize[ 1 ];
+
+  //-- Step 1
+  //   Average over the rows covered by the bars in the registration path
+
+  int nerveYStart = nerveSize[ 0 ] * algParams.nerveYOffsetFactor;
+  nerveYStart = std::max( 0, std::min( nerveYStart, height - 1 ) );
+  std::vector< double > rawProfile( width, 0.0 );
+  const float *buffer = nerveImage->GetBufferPointer();
+  for( int i = nerveYStart; i < height; i++ )
+    {
+    const float *row = buffer + ( size_t )i * width;
+    for( int j = 0; j < width; j++ )
+      {
+      rawProfile[ j ] += row[ j ];
+      }
+    }
+  for( int j = 0; j < width; j++ )
+    {
+    rawProfile[ j ] /= height - nerveYStart;
+    }
+
+  //-- Step 2
+  //   Gaussian smoothing, the registration path smoothes both the bars and
+  //   the thresholded image
+
+  const double sigma = std::max( 0.5, algParams.nerveRegsitrationSmooth );
+  const int kernelRadius = ( int )std::ceil( 3 * sigma );
+  std::vector< double > kernel( 2 * kernelRadius + 1 );
+  for( int k = -kernelRadius; k <= kernelRadius; k++ )
+    {
+    kernel[ k + kernelRadius ] = std::exp( -0.5 * k * k / ( sigma * sigma ) );
+    }
+  std::vector< double > profile( width, 0.0 );
+  for( int j = 0; j < width; j++ )
+    {
+    double sum = 0;
+    double weight = 0;
+    for( int k = std::max( -kernelRadius, -j );
+      k <= std::min( kernelRadius, width - 1 - j ); k++ )
+      {
+      sum += kernel[ k + kernelRadius ] * rawProfile[ j + k ];
+      weight += kernel[ k + kernelRadius ];
+      }
+    profile[ j ] = sum / weight;
+    }
+
+  StopStage( StageTimes::NERVE_B );
+
+
+  ////
+  //C') Fit two bar model
+  ////
+
+  StartStage( StageTimes::NERVE_C1 );
+
+  //-- Step 3
+  //   Bars at center -+ [ w, 1.5 w ] * scale (in pixels) smoothed with sigma,
+  //   matched over the extent of the bars like the registration mask.
+  //   Damped Gauss-Newton on ( center, scale ).
+
+  const double w0 = nerve.initialWidth / nerveSpacing[ 0 ];
+  const double edgeFactor[ 4 ] = { -1.5, -1.0, 1.0, 1.5 };
+  const double edgeSign[ 4 ] = { 1, -1, 1, -1 };
+  const double sqrt2 = std::sqrt( 2.0 );
+  const double normal = 1.0 / ( sigma * std::sqrt( 2 * M_PI ) );
+
+  //Model value at column x
+  auto model = [ & ]( double x, double c, double s )
+    {
+    double m = 0;
+    for( int k = 0; k < 4; k++ )
+      {
+      const double z = ( x - c - edgeFactor[ k ] * w0 * s ) / sigma;
+      m += edgeSign[ k ] * 0.5 * std::erfc( -z / sqrt2 );
+      }
+    return 100 * m;
+    };
+
+  //Mean squared residual and normal equations at ( c, s )
+  auto evaluate = [ & ]( double c, double s, double JTJ[ 3 ], double JTr[ 2 ] )
+    {
+    const int start = std::max( 0, ( int )std::ceil( c - 1.5 * w0 * s ) );
+    const int end = std::min( width - 1, ( int )std::floor( c + 1.5 * w0 * s ) );
+    double cost = 0;
+    int n = 0;
+    std::fill( JTJ, JTJ + 3, 0.0 );
+    std::fill( JTr, JTr + 2, 0.0 );
+    for( int x = start; x <= end; x++ )
+      {
+      double dc = 0;
+      double ds = 0;
+      for( int k = 0; k < 4; k++ )
+        {
+        const double z = ( x - c - edgeFactor[ k ] * w0 * s ) / sigma;
+        const double d = -edgeSign[ k ] * 100 * normal * std::exp( -0.5 * z * z );
+        dc += d;
+        ds += d * edgeFactor[ k ] * w0;
+        }
+      const double r = profile[ x ] - model( x, c, s );
+      cost += r * r;
+      JTJ[ 0 ] += dc * dc;
+      JTJ[ 1 ] += dc * ds;
+      JTJ[ 2 ] += ds * ds;
+      JTr[ 0 ] += dc * r;
+      JTr[ 1 ] += ds * r;
+      n++;
+      }
+    if( n == 0 )
+      {
+      return std::numeric_limits< double >::max();
+      }
+    for( int i = 0; i < 3; i++ )
+      {
+      JTJ[ i ] /= n;
+      }
+    JTr[ 0 ] /= n;
+    JTr[ 1 ] /= n;
+    return cost / n;
+    };
+
+  double c = nerve.initialCenterIndex[ 0 ];
+  double s = 1;
+  double JTJ[ 3 ];
+  double JTr[ 2 ];
+  double cost = evaluate( c, s, JTJ, JTr );
+  double lambda = 1e-3;
+  int iteration = 0;
+  int evaluations = 1;
+  RegistrationQuality::StopReason stopReason = RegistrationQuality::STOP_ITERATION_LIMIT;
+  for( ; iteration < algParams.nerveProfileIterations; iteration++ )
+    {
+    if( IsTimeBudgetExceeded() )
+      {
+      stopReason = RegistrationQuality::STOP_TIME_BUDGET;
+      break;
+      }
+    //Solve ( JTJ + lambda diag( JTJ ) ) delta = JTr
+    const double a = JTJ[ 0 ] * ( 1 + lambda );
+    const double b = JTJ[ 1 ];
+    const double d = JTJ[ 2 ] * ( 1 + lambda );
+    const double det = a * d - b * b;
+    if( !( det > 0 ) )
+      {
+      stopReason = RegistrationQuality::STOP_FAILED;
+      break;
+      }
+    const double deltaC = ( d * JTr[ 0 ] - b * JTr[ 1 ] ) / det;
+    const double deltaS = ( a * JTr[ 1 ] - b * JTr[ 0 ] ) / det;
+
+    double JTJNew[ 3 ];
+    double JTrNew[ 2 ];
+    const double costNew = s + deltaS > 0 ?
+      evaluate( c + deltaC, s + deltaS, JTJNew, JTrNew ) :
+      std::numeric_limits< double >::max();
+    evaluations++;
+    if( costNew < cost )
+      {
+      c += deltaC;
+      s += deltaS;
+      cost = costNew;
+      std::copy( JTJNew, JTJNew + 3, JTJ );
+      std::copy( JTrNew, JTrNew + 2, JTr );
+      lambda = std::max( 1e-6, lambda / 10 );
+      if( std::fabs( deltaC ) < 1e-3 && std::fabs( deltaS ) < 1e-4 )
+        {
+        stopReason = RegistrationQuality::STOP_CONVERGED;
+        break;
+        }
+      }
+    else
+      {
+      //No descent for any damping, ( c, s ) is a local minimum
+      lambda *= 10;
+      if( lambda > 1e6 )
+        {
+        stopReason = RegistrationQuality::STOP_CONVERGED;
+        break;
+        }
+      }
+    }
+
+  nerve.quality.metricValue = cost < std::numeric_limits< double >::max() ? cost : -1;
+  nerve.quality.iterations = iteration;
+  nerve.quality.functionEvaluations = evaluations;
+  nerve.quality.stopReason = stopReason;
+  nerve.quality.truncated = stopReason == RegistrationQuality::STOP_TIME_BUDGET;
+  nerve.quality.stopDescription = stopReason == RegistrationQuality::STOP_CONVERGED ?
+    "Profile fit converged" : stopReason == RegistrationQuality::STOP_FAILED ?
+    "Profile fit normal equations singular" : nerve.quality.truncated ?
+    "Time budget exhausted" : "Profile fit iteration limit reached";
+  nerve.quality.confidence = ComputeConfidence( nerve.quality );
+
+#ifdef DEBUG_PRINT
+  std::cout << "Profile fit: center " << c << " scale " << s
+    << " cost " << cost << std::endl;
 #endif
 
+  StopStage( StageTimes::NERVE_C1 );
+
+  StartStage( StageTimes::NERVE_C2 );
+
+  if( alignNerve )
+    {
+    //Fitted bars image
+    ImageType::Pointer moved = ImageType::New();
+    moved->SetRegions( nerveRegion );
+    moved->Allocate();
+    moved->FillBuffer( 0.0 );
+    moved->SetSpacing( nerveSpacing );
+    moved->SetOrigin( nerveImage->GetOrigin() );
+    moved->SetDirection( nerveImage->GetDirection() );
+    std::vector< float > row( width );
+    for( int j = 0; j < width; j++ )
+      {
+      row[ j ] = std::max( 0.0, std::min( 100.0, model( j, c, s ) ) );
+      }
+    float *movedBuffer = moved->GetBufferPointer();
+    for( int i = nerveYStart; i < height; i++ )
+      {
+      std::copy( row.begin(), row.end(), movedBuffer + ( size_t )i * width );
+      }
+
+    nerve.aligned = moved;
+
+#ifdef DEBUG_IMAGES
+    ImageIO<ImageType>::WriteImage( moved, catStrings( prefix, "-nerve-registered.tif" ) );
+#endif
+    }
+
+  //-- Step 4
+  //   Compute nerve center and width from the fitted model
+
+  itk::ContinuousIndex< double, 2 > centerIndex;
+  centerIndex[ 0 ] = nerveIndex[ 0 ] + c;
+  centerIndex[ 1 ] = nerve.initialCenterIndex[ 1 ];
+  nerveImage->TransformContinuousIndexToPhysicalPoint( centerIndex, nerve.center );
+  nerveImage->TransformPhysicalPointToIndex( nerve.center, nerve.centerIndex );
+  nerve.width = s * nerve.initialWidth;
+
+  //Check validity of estimates
+  if( s <= 0 || nerve.centerIndex[ 0 ] < nerveIndex[ 0 ] ||
+    nerve.centerIndex[ 0 ] > (int)( nerveIndex[ 0 ] + nerveSize[ 0 ] ) )
+    {
+#ifdef DEBUG_PRINT
+    std::cout << "Estimation failed: Nerve out of bounds" << std::endl;
+    std::cout << nerve.centerIndex << std::endl;
+#endif
+    return false;
+    }
+
+#ifdef DEBUG_PRINT
+  std::cout << "Nerve center: " << nerve.centerIndex << std::endl;
+  std::cout << "Nerve width: " << nerve.width * 2 << std::endl;
+
+  std::cout << "--- Done fitting nerve ---" << std::endl << std::endl;
+#endif
+
+  StopStage( StageTimes::NERVE_C2 );
+
   return true;
 };
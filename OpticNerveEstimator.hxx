@@ -100,6 +100,15 @@ limitations under the License.
 //  2. Similarity transfrom registration centered on the fixed bars image
 //  3. Compute nerve width by pushing intital width through the transform
 //
+// B') and C') Profile fit (nerveFitMethod = NERVE_FIT_PROFILE), replaces
+//  step A) 6, B) and C)
+//  1. Average the thresholded nerve image over the rows covered by the
+//     bars into a column profile
+//  2. Gaussian smoothing of the profile
+//  3. Fit the Gauss smoothed two bar model (center, scale of the initial
+//     width) to the profile with damped Gauss-Newton steps
+//  4. Compute nerve center and width from the fitted model
+//
 
 #define _USE_MATH_DEFINES
 
@@ -109,8 +118,9 @@ limitations under the License.
 //If DEBUG_PRINT is defined print out intermediate messages
 //#define DEBUG_PRINT
 
-//If REPORT_TIMES is defined perform time measurments of individual steps
-//and report them
+//The durations of the individual steps of the last fit are always
+//available through GetStageTimes. If REPORT_TIMES is defined the mean times
+//are also printed after each Fit.
 //#define REPORT_TIMES
 #ifdef REPORT_TIMES
 #include "itkTimeProbe.h"
@@ -142,12 +152,23 @@ limitations under the License.
 #include "itkImageMaskSpatialObject.h"
 #include "itkEllipseSpatialObject.h"
 #include "itkSpatialObjectToImageFilter.h"
+#include "itkCommand.h"
 
 #include <cmath>
 #include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <limits>
+#include <string>
+#include <vector>
 
 #include "ImageIO.h"
 #include "ITKFilterFunctions.h"
+#include "FastMeanSquaresMetric2D.h"
+#include "EllipseTemplateCache.h"
+#include "DistanceTransform.h"
+#include "BinaryMorphology.h"
 #include "itkImageRegionIterator.h"
 
 class OpticNerveEstimator
@@ -161,11 +182,13 @@ public:
 
   typedef itk::CastImageFilter< ImageType, UnsignedCharImageType > CastFilter;
   typedef itk::ApproximateSignedDistanceMapImageFilter< UnsignedCharImageType, ImageType  > SignedDistanceFilter;
+  typedef DistanceTransform< UnsignedCharImageType > DistanceTransformType;
 
   typedef itk::BinaryBallStructuringElement<ImageType::PixelType, ImageType::ImageDimension> StructuringElementType;
   typedef itk::BinaryMorphologicalClosingImageFilter<ImageType, ImageType, StructuringElementType> ClosingFilter;
   typedef itk::BinaryMorphologicalOpeningImageFilter<ImageType, ImageType, StructuringElementType> OpeningFilter;
   typedef itk::GrayscaleMorphologicalOpeningImageFilter<ImageType, ImageType, StructuringElementType> GrayOpeningFilter;
+  typedef BinaryMorphology< ImageType > MorphologyType;
 
   typedef itk::MinimumMaximumImageCalculator <ImageType> ImageCalculatorFilterType;
 
@@ -187,6 +210,7 @@ public:
   typedef itk::MeanSquaresImageToImageMetricv4< ImageType, ImageType >  MetricType;
   typedef itk::LinearInterpolateImageFunction< ImageType, double >    InterpolatorType;
   typedef itk::ImageRegistrationMethodv4< ImageType, ImageType >    RegistrationType;
+  typedef FastMeanSquaresMetric2D    FastMetricType;
 
   typedef itk::Similarity2DTransform< double >     SimilarityTransformType;
   typedef itk::AffineTransform< double, 2 >     AffineTransformType;
@@ -200,6 +224,15 @@ public:
   typedef itk::SpatialObjectToImageFilter< EllipseType, ImageType >   SpatialObjectToImageFilterType;
   typedef EllipseType::TransformType EllipseTransformType;
 
+  //Nerve estimation method
+  enum NerveFitMethod
+    {
+    //Similarity registration of a two bar image
+    NERVE_FIT_REGISTRATION,
+    //Analytic two bar model fit to the column profile
+    NERVE_FIT_PROFILE
+    };
+
   struct Parameters
     {
     //Eye fitting paramaters
@@ -216,6 +249,10 @@ public:
     double eyeMaskCornerXFactor = 0.8;
     double eyeMaskCornerYFactor = 1.0;
     double eyeRegistrationSize = 100;
+    //Take ring templates and masks from the shared EllipseTemplateCache,
+    //radii quantized to eyeTemplateRadiusStep pixels
+    bool   useEllipseTemplateCache = false;
+    double eyeTemplateRadiusStep = 0.5;
 
     //Nerve fitting paramaters
     double nerveXRegionFactor = 1.2;
@@ -232,11 +269,98 @@ public:
     int    nerveRegistrationThreshold = 50;
     //double nerveRefineVerticalBorderFactor = 1/20.0;
     double nerveRegsitrationSmooth = 3;
+    NerveFitMethod nerveFitMethod = NERVE_FIT_REGISTRATION;
+    int    nerveProfileIterations = 20;
+
+    //Registration
+    //Optimize the eye and nerve registrations directly on
+    //FastMeanSquaresMetric2D instead of ImageRegistrationMethodv4
+    bool useFastMetric = false;
+    //Function evaluation limit of the eye and nerve optimizers
+    int  maxFunctionEvaluations = 20000;
+
+    //Time budget
+    //Seconds per frame for Fit and FitDecimated, 0 for no limit. Stages
+    //check the budget, registrations stop early with the best parameters
+    //found so far and the estimate is flagged as truncated
+    //(RegistrationQuality::truncated). Confidences of truncated fits are
+    //scaled like fits stopped by the iteration limit.
+    double timeBudget = 0;
+
+    //Speculation
+    //Fit the nerve on the region predicted from SetPredictedEye while the
+    //eye is fitted. The result is kept if the region computed from the
+    //fitted eye differs by at most nerveSpeculationTolerance of its size,
+    //otherwise the nerve is fitted again.
+    bool   speculativeNerve = false;
+    double nerveSpeculationTolerance = 0.05;
+
+    //Initialization
+    //Exact separable distance transform (DistanceTransform) instead of
+    //ApproximateSignedDistanceMapImageFilter
+    bool useFastDistanceTransform = false;
+    //Bit packed closing and opening (BinaryMorphology) with cached disk
+    //kernels instead of the ITK binary morphology filters
+    bool useFastMorphology = false;
+    //Threads of the in-house filters, 0 for all cores
+    int  numberOfThreads = 0;
+
+    //Quality
+    //RMS residual (0 to 100 intensity scale) at which the confidence of a
+    //fit drops to 0, and confidence factor of fits stopped by the
+    //iteration limit
+    double confidenceResidualScale = 50;
+    double confidenceIterationLimitFactor = 0.5;
     };
 
   //Allow paramters to be set directly
   Parameters algParams;
 
+  //Parameter presets trading accuracy for speed, compare them with
+  //OpticNerveParameterSweep --preset=<name> on a corpus before relying on
+  //them
+  enum Preset
+    {
+    //Defaults of Parameters
+    PRESET_DEFAULT,
+    //Lowest latency for continuous monitoring: in-house filters, template
+    //cache, analytic nerve profile fit and a coarse eye registration
+    PRESET_FAST,
+    //Lowest width error for documentation: fine eye registration and
+    //templates, nerve registration
+    PRESET_ACCURATE
+    };
+
+  static Parameters GetPresetParameters( Preset preset )
+    {
+    Parameters params;
+    switch( preset )
+      {
+      case PRESET_FAST:
+        params.useEllipseTemplateCache = true;
+        params.eyeTemplateRadiusStep = 1;
+        params.eyeRegistrationSize = 60;
+        params.useFastMetric = true;
+        params.useFastDistanceTransform = true;
+        params.useFastMorphology = true;
+        params.nerveFitMethod = NERVE_FIT_PROFILE;
+        params.nerveProfileIterations = 10;
+        params.speculativeNerve = true;
+        break;
+      case PRESET_ACCURATE:
+        params.eyeRegistrationSize = 200;
+        params.eyeTemplateRadiusStep = 0.25;
+        params.nerveFitMethod = NERVE_FIT_REGISTRATION;
+        params.nerveRegsitrationSmooth = 2;
+        params.useFastDistanceTransform = true;
+        params.useFastMorphology = true;
+        break;
+      default:
+        break;
+      }
+    return params;
+    };
+
   //Estimation feedback
   enum Status
     {
@@ -246,6 +370,38 @@ public:
     ESTIMATION_UNKNOWN
     };
 
+  //Outcome of the optimization behind an eye or nerve estimate
+  struct RegistrationQuality
+    {
+    enum StopReason
+      {
+      STOP_UNKNOWN,
+      //Gradient, step or value tolerance reached
+      STOP_CONVERGED,
+      //Iteration or function evaluation limit reached
+      STOP_ITERATION_LIMIT,
+      //Optimizer error or exception
+      STOP_FAILED,
+      //Time budget of the frame exhausted (Parameters::timeBudget)
+      STOP_TIME_BUDGET
+      };
+
+    //Final mean squared difference, images and profiles are on a 0 to 100
+    //scale. -1 if the optimization did not run.
+    double metricValue = -1;
+    int iterations = -1;
+    int functionEvaluations = -1;
+    StopReason stopReason = STOP_UNKNOWN;
+    std::string stopDescription;
+    //Stopped early by the time budget, the estimate is the best one
+    //found before the deadline
+    bool truncated = false;
+    //From 0 (unreliable) to 1: 1 - RMS residual / confidenceResidualScale,
+    //scaled by confidenceIterationLimitFactor if the iteration limit or
+    //the time budget stopped it, 0 if the optimization failed
+    double confidence = 0;
+    };
+
   //Storage for eye and nerve location and sizes
   struct Eye
     {
@@ -260,6 +416,8 @@ public:
     double initialRadiusX = -1;
     double initialRadiusY = -1;
 
+    RegistrationQuality quality;
+
     ImageType::Pointer aligned;
     };
 
@@ -272,10 +430,53 @@ public:
     double initialWidth = -1;
     double width = -1;
 
+    RegistrationQuality quality;
+
     ImageType::Pointer aligned;
     ImageType::RegionType originalImageRegion;
     };
 
+  //Durations of the steps (see top of the file) of the last FitEye and
+  //FitNerve calls in seconds, -1 for steps that did not run
+  struct StageTimes
+    {
+    enum Stage
+      {
+      EYE_A,
+      EYE_B,
+      EYE_C1,
+      EYE_C2,
+      EYE_C3,
+      NERVE_A,
+      NERVE_B,
+      NERVE_C1,
+      NERVE_C2,
+      NUMBER_OF_STAGES
+      };
+
+    double seconds[ NUMBER_OF_STAGES ];
+
+    StageTimes()
+      {
+      std::fill( seconds, seconds + NUMBER_OF_STAGES, -1.0 );
+      };
+
+    static const char *GetName( int stage )
+      {
+      static const char *names[ NUMBER_OF_STAGES ] =
+        {
+        "EyeA", "EyeB", "EyeC1", "EyeC2", "EyeC3",
+        "NerveA", "NerveB", "NerveC1", "NerveC2"
+        };
+      return names[ stage ];
+      };
+    };
+
+  const StageTimes &GetStageTimes() const
+    {
+    return stageTimes;
+    };
+
   //Helper function
   std::string catStrings( std::string s1, std::string s2 );
 
@@ -283,6 +484,64 @@ public:
   Status Fit( ImageType::Pointer origImage, bool overlay = false,
     std::string prefix = "" );
 
+  //Fit on the image decimated by factor in both directions
+  //(ITKFilterFunctions::Decimate) with GetDecimatedParameters. The eye,
+  //the nerve and the aligned images are mapped back to the geometry of
+  //origImage, so GetEye, GetNerve and GetOverlay work as after Fit. The
+  //speculative nerve fit is not used.
+  Status FitDecimated( ImageType::Pointer origImage, int factor,
+    bool overlay = false, std::string prefix = "" );
+
+  //Parameters for an image decimated by factor: the ones given in pixels
+  //(smoothing, slabs, borders) are divided by factor, the ones relative to
+  //the image or eye size are kept
+  static Parameters GetDecimatedParameters( const Parameters &params, int factor );
+
+  //Eye estimate (typically of the previous frame) used to predict the
+  //nerve region for algParams.speculativeNerve
+  void SetPredictedEye( const Eye &predicted )
+    {
+    predictedEye = predicted;
+    predictedEye.aligned = NULL;
+    };
+
+  //Start the time budget algParams.timeBudget of a frame. Fit and
+  //FitDecimated start it, call it before using FitEye or FitNerve directly.
+  void StartTimeBudget()
+    {
+    hasDeadline = algParams.timeBudget > 0;
+    if( hasDeadline )
+      {
+      deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast< std::chrono::steady_clock::duration >(
+        std::chrono::duration< double >( algParams.timeBudget ) );
+      }
+    };
+
+  bool IsTimeBudgetExceeded() const
+    {
+    return hasDeadline && std::chrono::steady_clock::now() > deadline;
+    };
+
+  //True if the eye or nerve fit of the last estimate was stopped by the
+  //time budget
+  bool GetTruncated()
+    {
+    return eye.quality.truncated || nerve.quality.truncated;
+    };
+
+  //True if the last Fit kept the speculative nerve estimate
+  bool GetSpeculativeNerveKept()
+    {
+    return speculativeNerveKept;
+    };
+
+  //Nerve region below the eye clipped to imageRegion, false if it lies
+  //below the image
+  bool ComputeNerveRegion( const Eye &eyeEstimate,
+    const ImageType::RegionType &imageRegion,
+    ImageType::RegionType &nerveRegion ) const;
+
   //Fit an ellipse to an eye ultrasound image in three main steps
   // A) Prepare moving Image
   // B) Prepare fixed image
@@ -305,6 +564,12 @@ public:
     ImageType::RegionType &nerveRegion,
     bool alignNerve, const std::string &prefix );
 
+  //Fit the two bar model to the column profile of the thresholded nerve
+  //image from step A) 5 of FitNerve. Fills the nerve estimates the same
+  //way as the registration path.
+  bool FitNerveProfile( ImageType::Pointer nerveImage,
+    bool alignNerve, const std::string &prefix );
+
   Eye GetEye()
     {
     return eye;
@@ -375,24 +640,146 @@ public:
 
 private:
 
+  StageTimes stageTimes;
+  std::chrono::steady_clock::time_point stageStart[ StageTimes::NUMBER_OF_STAGES ];
+#ifdef REPORT_TIMES
+  itk::TimeProbe clocks[ StageTimes::NUMBER_OF_STAGES ];
+#endif
+
+  void StartStage( StageTimes::Stage stage )
+    {
+    stageStart[ stage ] = std::chrono::steady_clock::now();
+#ifdef REPORT_TIMES
+    clocks[ stage ].Start();
+#endif
+    };
+
+  void StopStage( StageTimes::Stage stage )
+    {
+    stageTimes.seconds[ stage ] = std::chrono::duration< double >(
+      std::chrono::steady_clock::now() - stageStart[ stage ] ).count();
 #ifdef REPORT_TIMES
-  itk::TimeProbe clockEyeA;
-  itk::TimeProbe clockEyeB;
-  itk::TimeProbe clockEyeC1;
-  itk::TimeProbe clockEyeC2;
-  itk::TimeProbe clockEyeC3;
-
-
-  itk::TimeProbe clockNerveA;
-  itk::TimeProbe clockNerveB;
-  itk::TimeProbe clockNerveC1;
-  itk::TimeProbe clockNerveC2;
-  itk::TimeProbe clockNerveC3;
+    clocks[ stage ].Stop();
 #endif
+    };
+
+  void ResetStageTimes( StageTimes::Stage first, StageTimes::Stage last )
+    {
+    for( int i = first; i <= last; i++ )
+      {
+      stageTimes.seconds[ i ] = -1;
+      }
+    };
 
   Eye eye;
   Nerve nerve;
 
+  Eye predictedEye;
+  bool speculativeNerveKept = false;
+
+  bool hasDeadline = false;
+  std::chrono::steady_clock::time_point deadline;
+
+  //Thrown from TimeBudgetObserver to leave the optimizer
+  struct TimeBudgetExceeded
+    {
+    };
+
+  //Observes the iterations of an optimizer, keeps the parameters with the
+  //lowest metric value and throws TimeBudgetExceeded once the time budget
+  //of the estimator is exhausted
+  class TimeBudgetObserver : public itk::Command
+    {
+  public:
+    typedef TimeBudgetObserver Self;
+    typedef itk::Command Superclass;
+    typedef itk::SmartPointer< Self > Pointer;
+
+    itkNewMacro( Self );
+
+    void SetEstimator( const OpticNerveEstimator *e )
+      {
+      estimator = e;
+      };
+
+    bool HasBestParameters() const
+      {
+      return bestParameters.GetSize() > 0;
+      };
+
+    const OptimizerType::ParametersType &GetBestParameters() const
+      {
+      return bestParameters;
+      };
+
+    double GetBestValue() const
+      {
+      return bestValue;
+      };
+
+    void Execute( itk::Object *caller, const itk::EventObject &event ) override
+      {
+      Execute( ( const itk::Object * ) caller, event );
+      };
+
+    void Execute( const itk::Object *caller, const itk::EventObject &event ) override
+      {
+      if( !itk::IterationEvent().CheckEvent( &event ) )
+        {
+        return;
+        }
+      const OptimizerType *optimizer = static_cast< const OptimizerType * >( caller );
+      if( optimizer->GetValue() < bestValue )
+        {
+        bestValue = optimizer->GetValue();
+        bestParameters = optimizer->GetCurrentPosition();
+        }
+      if( estimator != NULL && estimator->IsTimeBudgetExceeded() )
+        {
+        throw TimeBudgetExceeded();
+        }
+      };
+
+  protected:
+    TimeBudgetObserver()
+      {
+      };
+
+  private:
+    const OpticNerveEstimator *estimator = NULL;
+    double bestValue = std::numeric_limits< double >::max();
+    OptimizerType::ParametersType bestParameters;
+    };
+
+  //Runs optimize, which starts optimizer, under the time budget. If the
+  //budget is exhausted transform is set to the best parameters seen and
+  //the quality is flagged as truncated. Returns the quality of the
+  //optimization.
+  RegistrationQuality RunBudgetedOptimization( OptimizerType *optimizer,
+    itk::Transform< double, 2, 2 > *transform,
+    const std::function< void() > &optimize );
+
+  RegistrationQuality GetOptimizerQuality( OptimizerType *optimizer,
+    bool failed ) const;
+  double ComputeConfidence( const RegistrationQuality &quality ) const;
+
+  //Map estimates of an image decimated by factor to the input image
+  static ImageType::IndexType ExpandIndex( const ImageType::IndexType &index,
+    int factor );
+  static ImageType::PointType ExpandPoint( const ImageType::PointType &point,
+    ImageType::Pointer decimated, ImageType::Pointer image, int factor );
+
+  //Regions differ by at most algParams.nerveSpeculationTolerance of the
+  //size of region
+  bool IsNerveRegionClose( const ImageType::RegionType &predicted,
+    const ImageType::RegionType &region ) const;
+
+  //Maximum of the distance map of mask to the pixels with value 100 and
+  //its index. Uses DistanceTransform if algParams.useFastDistanceTransform
+  //is set.
+  double ComputeDistanceMaximum( UnsignedCharImageType::Pointer mask,
+    ImageType::IndexType &index, const std::string &debugFilename );
+
   //Create ellipse image
   ImageType::Pointer CreateEllipseImage( ImageType::SpacingType spacing,
     ImageType::SizeType size,
@@ -0,0 +1,568 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Headless optic nerve estimation. Clients stream B-mode frames over TCP
+//(EstimationProtocol.h) and receive one result per frame: nerve width,
+//confidence and, on request, the overlay of the estimate.
+//
+//  OpticNerveServer [--port=<p>] [--bind=<address>] [--threads=<n>]
+//    [--buffer=<frames>] [--preset=default|fast|accurate]
+//    [--preview[=<factor>]] [--min-confidence=<c>] [--weight-confidence]
+//    [--budget=<ms>] [--device]
+//
+//Each client gets its own OpticNerveCalculator with --threads workers and a
+//PushFrameSource of --buffer frames, so the statistics (result mean) are
+//per client. With --device the server estimates on the probe backend of
+//the build (ProbeDevice.hxx) instead and sends the results to all
+//connected clients, frames sent by clients are ignored. By default only
+//local clients can connect, --bind=0.0.0.0 listens on all interfaces.
+
+#include "OpticNerveCalculator.hxx"
+#include "PushFrameSource.hxx"
+#include "EstimationProtocol.h"
+
+#ifdef SERVER_PROBE_DEVICE
+#include "ProbeDevice.hxx"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Settings
+  {
+  int nThreads = 4;
+  int bufferSize = 20;
+  OpticNerveEstimator::Parameters algParams;
+  OpticNerveCalculator::PreviewParameters preview;
+  OpticNerveCalculator::ConfidenceParameters confidence;
+  };
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+void SetupCalculator( OpticNerveCalculator &calculator, const Settings &settings )
+{
+  OpticNerveEstimator::Parameters algParams = settings.algParams;
+  calculator.SetNumberOfThreads( settings.nThreads );
+  calculator.SetRingBufferSize( settings.bufferSize );
+  calculator.SetAlgorithmParameters( algParams );
+  calculator.SetPreviewParameters( settings.preview );
+  calculator.SetConfidenceParameters( settings.confidence );
+}
+
+//Result message of an estimate, without id and overlay
+EstimationProtocol::ResultHeader GetResultHeader(
+  const OpticNerveCalculator::EstimateResult &estimate )
+{
+  EstimationProtocol::ResultHeader result;
+  std::memset( &result, 0, sizeof( result ) );
+  switch( estimate.status )
+    {
+    case OpticNerveEstimator::ESTIMATION_SUCCESS:
+      result.status = estimate.rejected ? EstimationProtocol::RESULT_REJECTED :
+        EstimationProtocol::RESULT_SUCCESS;
+      break;
+    case OpticNerveEstimator::ESTIMATION_FAIL_EYE:
+      result.status = EstimationProtocol::RESULT_FAIL_EYE;
+      break;
+    case OpticNerveEstimator::ESTIMATION_FAIL_NERVE:
+      result.status = EstimationProtocol::RESULT_FAIL_NERVE;
+      break;
+    default:
+      result.status = EstimationProtocol::RESULT_ERROR;
+      break;
+    }
+  result.tier = estimate.tier;
+  result.width = estimate.width;
+  result.confidence = estimate.confidence;
+  result.mean = estimate.mean;
+  result.truncated = estimate.truncated;
+  return result;
+}
+
+//Send a result with the overlay of the estimate, if there is one
+bool SendResult( EstimationSocket &socket, std::mutex &sendMutex,
+  EstimationProtocol::ResultHeader &result,
+  OpticNerveEstimator::RGBImageType::Pointer overlay )
+{
+  const unsigned char *rgb = NULL;
+  if( overlay.IsNotNull() )
+    {
+    const OpticNerveEstimator::RGBImageType::SizeType size =
+      overlay->GetLargestPossibleRegion().GetSize();
+    result.overlayWidth = size[ 0 ];
+    result.overlayHeight = size[ 1 ];
+    //RGBPixel< unsigned char > is three packed bytes
+    rgb = reinterpret_cast< const unsigned char * >( overlay->GetBufferPointer() );
+    }
+  std::lock_guard< std::mutex > lock( sendMutex );
+  return EstimationProtocol::SendResult( socket, result, rgb );
+}
+
+
+//Connection of one client. In frame mode the frames of the client are
+//estimated by the calculator of the session, in device mode the client
+//only receives the results of the probe. Those are queued with Post and
+//sent by a thread of the session, so a slow client never blocks the
+//estimation workers.
+class Session
+{
+
+public:
+
+  typedef std::shared_ptr< Session > Pointer;
+
+  Session( EstimationSocket::Pointer s, const Settings &settings,
+    bool receiveFrames, int n )
+    : socket( s ), source( settings.bufferSize ), id( n ), done( false ),
+    nFrames( 0 ), nDropped( 0 ), queueSize( settings.bufferSize ),
+    stopSending( false )
+    {
+    if( receiveFrames )
+      {
+      calculator.reset( new OpticNerveCalculator() );
+      SetupCalculator( *calculator, settings );
+      calculator->SetResultCallback(
+        [ this ]( const OpticNerveCalculator::EstimateResult &estimate )
+        {
+        OnResult( estimate );
+        } );
+      }
+    };
+
+  ~Session()
+    {
+    Join();
+    };
+
+  void Start()
+    {
+    thread = std::thread( &Session::Run, this );
+    };
+
+  //Closes the connection, Run returns
+  void Shutdown()
+    {
+    socket->Shutdown();
+    };
+
+  void Join()
+    {
+    if( thread.joinable() )
+      {
+      thread.join();
+      }
+    };
+
+  bool IsDone()
+    {
+    return done;
+    };
+
+  bool Send( EstimationProtocol::ResultHeader &result,
+    OpticNerveEstimator::RGBImageType::Pointer overlay )
+    {
+    return SendResult( *socket, sendMutex, result, overlay );
+    };
+
+  //Queue a result for the client (device mode), dropped if the client is
+  //more than the buffer size results behind. Does not block.
+  bool Post( const EstimationProtocol::ResultHeader &result,
+    OpticNerveEstimator::RGBImageType::Pointer overlay )
+    {
+    std::lock_guard< std::mutex > lock( queueMutex );
+    if( stopSending || queue.size() >= queueSize )
+      {
+      nDropped++;
+      return false;
+      }
+    queue.push_back( QueuedResult() );
+    queue.back().result = result;
+    queue.back().overlay = overlay;
+    queueCondition.notify_one();
+    return true;
+    };
+
+private:
+
+  struct QueuedResult
+    {
+    EstimationProtocol::ResultHeader result;
+    OpticNerveEstimator::RGBImageType::Pointer overlay;
+    };
+
+  EstimationSocket::Pointer socket;
+  std::mutex sendMutex;
+  PushFrameSource source;
+  std::unique_ptr< OpticNerveCalculator > calculator;
+  std::thread thread;
+  int id;
+  std::atomic< bool > done;
+  long nFrames;
+  std::atomic< long > nDropped;
+
+  std::deque< QueuedResult > queue;
+  size_t queueSize;
+  bool stopSending;
+  std::mutex queueMutex;
+  std::condition_variable queueCondition;
+  std::thread sender;
+
+  void Run()
+    {
+    std::cout << "Client " << id << " connected" << std::endl;
+    if( calculator )
+      {
+      calculator->StartProcessing( &source );
+      }
+    else
+      {
+      sender = std::thread( &Session::SendQueued, this );
+      }
+
+    EstimationProtocol::MessageHeader header;
+    std::vector< unsigned char > payload;
+    while( EstimationProtocol::ReceiveMessage( *socket, header, payload ) )
+      {
+      if( !calculator || header.type != EstimationProtocol::MESSAGE_FRAME )
+        {
+        continue;
+        }
+      EstimationProtocol::FrameHeader frame;
+      const unsigned char *pixels = EstimationProtocol::ParseFrame( payload, frame );
+      if( pixels == NULL )
+        {
+        std::cerr << "Client " << id << ": malformed frame" << std::endl;
+        break;
+        }
+      nFrames++;
+      if( !source.Add( pixels, frame.samples, frame.lines, frame.id, frame.flags ) )
+        {
+        nDropped++;
+        EstimationProtocol::ResultHeader result;
+        std::memset( &result, 0, sizeof( result ) );
+        result.id = frame.id;
+        result.status = EstimationProtocol::RESULT_DROPPED;
+        result.width = -1;
+        result.confidence = -1;
+        result.mean = -1;
+        Send( result, NULL );
+        }
+      }
+
+    socket->Shutdown();
+    if( calculator )
+      {
+      calculator->Stop();
+      std::cout << "Client " << id << " disconnected: " << nFrames
+        << " frames, " << nDropped << " dropped, "
+        << calculator->GetNumberOfEstimates() << " estimates, mean width "
+        << calculator->GetMeanEstimate() << " pixels" << std::endl;
+      }
+    else
+      {
+        {
+        std::lock_guard< std::mutex > lock( queueMutex );
+        stopSending = true;
+        }
+      queueCondition.notify_one();
+      sender.join();
+      std::cout << "Client " << id << " disconnected, " << nDropped
+        << " results dropped" << std::endl;
+      }
+    done = true;
+    };
+
+  //Sends the queued results until the session ends or the connection fails
+  void SendQueued()
+    {
+    while( true )
+      {
+      QueuedResult next;
+        {
+        std::unique_lock< std::mutex > lock( queueMutex );
+        queueCondition.wait( lock, [ this ]
+          {
+          return stopSending || !queue.empty();
+          } );
+        if( stopSending )
+          {
+          return;
+          }
+        next = queue.front();
+        queue.pop_front();
+        }
+      if( !Send( next.result, next.overlay ) )
+        {
+        //Wakes up Run
+        socket->Shutdown();
+        return;
+        }
+      }
+    };
+
+  void OnResult( const OpticNerveCalculator::EstimateResult &estimate )
+    {
+    EstimationProtocol::ResultHeader result = GetResultHeader( estimate );
+    result.id = source.GetFrameId( estimate.frame );
+    const bool sendOverlay =
+      ( source.GetFrameFlags( estimate.frame ) & EstimationProtocol::FRAME_OVERLAY ) != 0;
+    //The slot of the frame can be reused from here on
+    source.Complete( estimate.frame );
+    OpticNerveEstimator::RGBImageType::Pointer overlay;
+    if( sendOverlay )
+      {
+      overlay = estimate.overlay;
+      }
+    Send( result, overlay );
+    };
+
+};
+
+
+EstimationSocket listener;
+
+void StopServer( int )
+{
+  //Wakes up Accept
+  listener.Shutdown();
+#ifdef _WIN32
+  listener.Close();
+#endif
+}
+
+int main( int argc, char **argv )
+{
+  int port = EstimationProtocol::DefaultPort;
+  std::string address = "127.0.0.1";
+  std::string preset = "default";
+  bool useDevice = false;
+  double timeBudget = 0;
+  Settings settings;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    bool valid = true;
+    if( GetFlag( arg, "port", value ) )
+      {
+      port = std::atoi( value.c_str() );
+      valid = port > 0 && port < 65536;
+      }
+    else if( GetFlag( arg, "bind", value ) )
+      {
+      address = value;
+      }
+    else if( GetFlag( arg, "threads", value ) )
+      {
+      settings.nThreads = std::max( 1, std::atoi( value.c_str() ) );
+      }
+    else if( GetFlag( arg, "buffer", value ) )
+      {
+      settings.bufferSize = std::max( 1, std::atoi( value.c_str() ) );
+      }
+    else if( GetFlag( arg, "preset", value ) )
+      {
+      preset = value;
+      valid = preset == "default" || preset == "fast" || preset == "accurate";
+      }
+    else if( arg == "--preview" )
+      {
+      settings.preview.enabled = true;
+      }
+    else if( GetFlag( arg, "preview", value ) )
+      {
+      settings.preview.enabled = true;
+      settings.preview.factor = std::max( 1, std::atoi( value.c_str() ) );
+      }
+    else if( GetFlag( arg, "min-confidence", value ) )
+      {
+      settings.confidence.minimumConfidence = std::atof( value.c_str() );
+      }
+    else if( arg == "--weight-confidence" )
+      {
+      settings.confidence.weightByConfidence = true;
+      }
+    else if( GetFlag( arg, "budget", value ) )
+      {
+      timeBudget = std::max( 0.0, std::atof( value.c_str() ) / 1000 );
+      }
+#ifdef SERVER_PROBE_DEVICE
+    else if( arg == "--device" )
+      {
+      useDevice = true;
+      }
+#endif
+    else
+      {
+      valid = false;
+      }
+    if( !valid )
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--port=<p>] [--bind=<address>]"
+        << " [--threads=<n>] [--buffer=<frames>] [--preset=default|fast|accurate]"
+        << " [--preview[=<factor>]] [--min-confidence=<c>] [--weight-confidence]"
+        << " [--budget=<ms>]"
+#ifdef SERVER_PROBE_DEVICE
+        << " [--device]"
+#endif
+        << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  OpticNerveEstimator::Preset presetType = OpticNerveEstimator::PRESET_DEFAULT;
+  if( preset == "fast" )
+    {
+    presetType = OpticNerveEstimator::PRESET_FAST;
+    }
+  else if( preset == "accurate" )
+    {
+    presetType = OpticNerveEstimator::PRESET_ACCURATE;
+    }
+  settings.algParams = OpticNerveEstimator::GetPresetParameters( presetType );
+  settings.algParams.timeBudget = timeBudget;
+
+  if( !EstimationSocket::Initialize() )
+    {
+    std::cerr << "Could not initialize sockets" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( !listener.Listen( address, port ) )
+    {
+    std::cerr << "Could not listen on " << address << ":" << port << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::signal( SIGINT, StopServer );
+  std::signal( SIGTERM, StopServer );
+#ifdef SIGPIPE
+  //Sends to closed connections fail instead
+  std::signal( SIGPIPE, SIG_IGN );
+#endif
+
+  std::list< Session::Pointer > sessions;
+  std::mutex sessionsMutex;
+
+#ifdef SERVER_PROBE_DEVICE
+  ProbeDevice device;
+  OpticNerveCalculator deviceCalculator;
+  if( useDevice )
+    {
+    if( !device.ConnectProbe( false ) || !device.Start() )
+      {
+      std::cerr << "Could not start the probe" << std::endl;
+      return EXIT_FAILURE;
+      }
+    SetupCalculator( deviceCalculator, settings );
+    //Results go to every client connected at the time of the estimate
+    deviceCalculator.SetResultCallback(
+      [ &sessions, &sessionsMutex ]( const OpticNerveCalculator::EstimateResult &estimate )
+      {
+      std::list< Session::Pointer > receivers;
+        {
+        std::lock_guard< std::mutex > lock( sessionsMutex );
+        receivers = sessions;
+        }
+      EstimationProtocol::ResultHeader result = GetResultHeader( estimate );
+      result.id = estimate.frame;
+      for( std::list< Session::Pointer >::iterator it = receivers.begin();
+        it != receivers.end(); ++it )
+        {
+        ( *it )->Post( result, estimate.overlay );
+        }
+      } );
+    deviceCalculator.StartProcessing( &device );
+    }
+#endif
+
+  std::cout << "Listening on " << address << ":" << port
+    << ( useDevice ? ", estimating on the probe" : "" ) << std::endl;
+
+  int nClients = 0;
+  while( true )
+    {
+    EstimationSocket::Pointer connection = listener.Accept();
+    if( !connection )
+      {
+      break;
+      }
+    std::lock_guard< std::mutex > lock( sessionsMutex );
+    for( std::list< Session::Pointer >::iterator it = sessions.begin();
+      it != sessions.end(); )
+      {
+      if( ( *it )->IsDone() )
+        {
+        it = sessions.erase( it );
+        }
+      else
+        {
+        ++it;
+        }
+      }
+    Session::Pointer session( new Session( connection, settings, !useDevice,
+      nClients++ ) );
+    sessions.push_back( session );
+    session->Start();
+    }
+
+  std::cout << "Shutting down" << std::endl;
+#ifdef SERVER_PROBE_DEVICE
+  if( useDevice )
+    {
+    deviceCalculator.Stop();
+    device.Stop();
+    }
+#endif
+  std::list< Session::Pointer > remaining;
+    {
+    std::lock_guard< std::mutex > lock( sessionsMutex );
+    remaining.swap( sessions );
+    }
+  for( std::list< Session::Pointer >::iterator it = remaining.begin();
+    it != remaining.end(); ++it )
+    {
+    ( *it )->Shutdown();
+    ( *it )->Join();
+    }
+  listener.Close();
+
+  return EXIT_SUCCESS;
+}
@@ -48,7 +48,7 @@ void OpticNerveUI::closeEvent( QCloseEvent *event )
 OpticNerveUI::OpticNerveUI( int numberOfThreads, int bufferSize, QWidget *parent )
   : QMainWindow( parent ), ui( new Ui::MainWindow ),
   lastRendered( -1 ), lastOverlayRendered( -1 ),
-  mmPerPixel( 1 ), previousNumberOfEstimates( 0 )
+  mmPerPixel( 1 ), geometryGeneration( 0 ), previousNumberOfEstimates( 0 )
 {
 
   //Setup the graphical layout on this current Widget
@@ -117,6 +117,24 @@ OpticNerveUI::~OpticNerveUI()
   delete ui;
 }
 
+void OpticNerveUI::SetPreviewParameters(
+  const OpticNerveCalculator::PreviewParameters &params )
+{
+  opticNerveCalculator.SetPreviewParameters( params );
+}
+
+void OpticNerveUI::SetConfidenceParameters(
+  const OpticNerveCalculator::ConfidenceParameters &params )
+{
+  opticNerveCalculator.SetConfidenceParameters( params );
+}
+
+void OpticNerveUI::SetTimeBudget( double seconds )
+{
+  algParams.timeBudget = seconds;
+  opticNerveCalculator.SetAlgorithmParameters( algParams );
+}
+
 void OpticNerveUI::ConnectProbe()
 {
 #ifdef DEBUG_PRINT
@@ -131,7 +149,7 @@ void OpticNerveUI::ConnectProbe()
     //TODO: Show UI message
     }
 
-  IntersonArrayDeviceRF::FrequenciesType fs = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType fs = intersonDevice.GetFrequencies();
   ui->dropDown_Frequency->clear();
   for( unsigned int i = 0; i < fs.size(); i++ )
     {
@@ -144,6 +162,7 @@ void OpticNerveUI::ConnectProbe()
   intersonDevice.GetHWControls().SetNewHardButtonCallback( &ProbeHardButtonCallback, this );
 
   mmPerPixel = intersonDevice.GetMmPerPixel();
+  geometryGeneration = intersonDevice.GetGeometryGeneration();
   if( !intersonDevice.Start() )
     {
 #ifdef DEBUG_PRINT
@@ -158,13 +177,27 @@ void OpticNerveUI::ConnectProbe()
 
 void OpticNerveUI::UpdateImage()
 {
+  //The ring buffers are reallocated on a geometry change, drop cached
+  //geometry and ring positions
+  if( intersonDevice.GetGeometryGeneration() != geometryGeneration )
+    {
+    geometryGeneration = intersonDevice.GetGeometryGeneration();
+    mmPerPixel = intersonDevice.GetMmPerPixel();
+    lastRendered = -1;
+    }
+
   //display bmode image
   int currentIndex = intersonDevice.GetCurrentBModeIndex();
+  ProbeDevice::ImageType::Pointer bmode;
   if( currentIndex >= 0 && currentIndex != lastRendered )
+    {
+    //NULL if the slot was rewritten during the read, retried on the next
+    //update
+    bmode = intersonDevice.GetBModeImage( currentIndex );
+    }
+  if( bmode.IsNotNull() )
     {
     lastRendered = currentIndex;
-    IntersonArrayDeviceRF::ImageType::Pointer bmode =
-      intersonDevice.GetBModeImage( currentIndex );
 
 /*
     ITKFilterFunctions<IntersonArrayDevice::ImageType>::FlipArray flip;
@@ -172,12 +205,12 @@ void OpticNerveUI::UpdateImage()
     flip[1] = true;
     bmode = ITKFilterFunctions<IntersonArrayDevice::ImageType>::FlipImage(bmode , flip);
 */
-    ITKFilterFunctions< IntersonArrayDeviceRF::ImageType >::PermuteArray order;
+    ITKFilterFunctions< ProbeDevice::ImageType >::PermuteArray order;
     order[ 0 ] = 1;
     order[ 1 ] = 0;
-    bmode = ITKFilterFunctions< IntersonArrayDeviceRF::ImageType>::PermuteImage( bmode, order );
+    bmode = ITKFilterFunctions< ProbeDevice::ImageType>::PermuteImage( bmode, order );
 
-    QImage image = ITKQtHelpers::GetQImageColor<IntersonArrayDeviceRF::ImageType>(
+    QImage image = ITKQtHelpers::GetQImageColor<ProbeDevice::ImageType>(
       bmode,
       bmode->GetLargestPossibleRegion(),
       QImage::Format_RGB16
@@ -236,6 +269,16 @@ void OpticNerveUI::UpdateImage()
     std::ostringstream cestimate;
     cestimate << std::setprecision( 1 ) << std::setw( 3 ) << std::fixed;
     cestimate << opticNerveCalculator.GetCurrentEstimate() * mmPerPixel << " mm";
+    if( opticNerveCalculator.GetCurrentEstimateTier() ==
+      OpticNerveCalculator::ESTIMATE_PREVIEW )
+      {
+      cestimate << " (preview)";
+      }
+    if( opticNerveCalculator.GetCurrentConfidence() >= 0 )
+      {
+      cestimate << " [" << std::setprecision( 0 )
+                << opticNerveCalculator.GetCurrentConfidence() * 100 << "%]";
+      }
     ui->label_estimateCurrent->setText( cestimate.str().c_str() );
 
     std::ostringstream mestimate;
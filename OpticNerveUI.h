@@ -37,7 +37,7 @@ limitations under the License.
 #include <qgroupbox.h>
 #include <QCloseEvent>
 
-#include "IntersonArrayDeviceRF.hxx"
+#include "ProbeDevice.hxx"
 #include "ui_OpticNerve.h"
 #include "OpticNerveCalculator.hxx"
 
@@ -56,6 +56,11 @@ public:
   OpticNerveUI( int numberOfThreads, int bufferSize, QWidget *parent = nullptr );
   ~OpticNerveUI();
 
+  void SetPreviewParameters( const OpticNerveCalculator::PreviewParameters &params );
+  void SetConfidenceParameters( const OpticNerveCalculator::ConfidenceParameters &params );
+  //Seconds per frame, 0 for no limit (OpticNerveEstimator::Parameters::timeBudget)
+  void SetTimeBudget( double seconds );
+
 protected:
   void  closeEvent( QCloseEvent * event );
 
@@ -92,15 +97,17 @@ private:
 
   OpticNerveEstimator::Parameters algParams;
   OpticNerveCalculator opticNerveCalculator;
-  IntersonArrayDeviceRF intersonDevice;
+  ProbeDevice intersonDevice;
   float mmPerPixel;
+  //Geometry generation of the device mmPerPixel was read for
+  unsigned long geometryGeneration;
 
   int previousNumberOfEstimates;
 
   int lastRendered;
   int lastOverlayRendered;
 
-  static void __stdcall ProbeHardButtonCallback( void *instance )
+  static void PROBE_CALLBACK ProbeHardButtonCallback( void *instance )
     {
     OpticNerveUI *oui = ( OpticNerveUI* )instance;
     oui->ToggleEstimation();
@@ -28,6 +28,9 @@ limitations under the License.
 #include <QDebug>
 
 // STD includes
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 
@@ -36,9 +39,44 @@ int main( int argc, char *argv[] )
   qDebug() << "Starting ...";
   QApplication app( argc, argv );
 
+  //--preview [factor] estimates frames on decimated images and runs the
+  //full resolution estimate periodically or when the preview is uncertain.
+  //--min-confidence c rejects estimates below confidence c in [0, 1] and
+  //--weight-confidence weights the statistics by confidence.
+  //--budget ms limits the estimation time per frame
+  OpticNerveCalculator::PreviewParameters preview;
+  OpticNerveCalculator::ConfidenceParameters confidence;
+  double timeBudget = 0;
+  for( int i = 1; i < argc; i++ )
+    {
+    if( std::strcmp( argv[ i ], "--preview" ) == 0 )
+      {
+      preview.enabled = true;
+      if( i + 1 < argc && argv[ i + 1 ][ 0 ] != '-' )
+        {
+        preview.factor = std::max( 1, std::atoi( argv[ ++i ] ) );
+        }
+      }
+    else if( std::strcmp( argv[ i ], "--min-confidence" ) == 0 && i + 1 < argc )
+      {
+      confidence.minimumConfidence = std::atof( argv[ ++i ] );
+      }
+    else if( std::strcmp( argv[ i ], "--weight-confidence" ) == 0 )
+      {
+      confidence.weightByConfidence = true;
+      }
+    else if( std::strcmp( argv[ i ], "--budget" ) == 0 && i + 1 < argc )
+      {
+      timeBudget = std::max( 0.0, std::atof( argv[ ++i ] ) / 1000 );
+      }
+    }
+
   int nThreads = 4;
   int ringBufferSize = 20;
   OpticNerveUI window( nThreads, ringBufferSize, nullptr );
+  window.SetPreviewParameters( preview );
+  window.SetConfidenceParameters( confidence );
+  window.SetTimeBudget( timeBudget );
   window.show();
 
   try
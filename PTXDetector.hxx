@@ -33,9 +33,9 @@ public:
 
   static RGBImageTypePointer DetectMMode( ImageType2dPointer mmode){
 
-    ImageType2d::SizeType size = mmode->GetLargestPossibleRegion().GetSize();
+    typename ImageType2d::SizeType size = mmode->GetLargestPossibleRegion().GetSize();
     typedef itk::RescaleIntensityImageFilter< ImageType2d, ImageType2d> RescaleFilter;
-    RescaleFilter::Pointer rescale = RescaleFilter::New();
+    typename RescaleFilter::Pointer rescale = RescaleFilter::New();
     rescale->SetInput( mmode);
     rescale->SetOutputMaximum( 1.0 );
     rescale->SetOutputMinimum( 0 );
@@ -43,37 +43,37 @@ public:
 
 
     typedef itk::DerivativeImageFilter< ImageType2d, ImageType2d > DerivativeFilter;
-    DerivativeFilter::Pointer derivativeZ = DerivativeFilter::New();
+    typename DerivativeFilter::Pointer derivativeZ = DerivativeFilter::New();
     derivativeZ->SetDirection(0);
     derivativeZ->SetOrder( 2 );
     derivativeZ->SetInput( rescale->GetOutput() );
 
 
     typedef itk::AbsImageFilter<ImageType2d, ImageType2d> AbsFilter;
-    AbsFilter::Pointer absZ = AbsFilter::New();
+    typename AbsFilter::Pointer absZ = AbsFilter::New();
     absZ->SetInput( derivativeZ->GetOutput() );
   
     typedef itk::SmoothingRecursiveGaussianImageFilter< ImageType2d, ImageType2d> GaussianFilter;
-    GaussianFilter::Pointer gaussianZ = GaussianFilter::New();
+    typename GaussianFilter::Pointer gaussianZ = GaussianFilter::New();
     gaussianZ->SetInput( absZ->GetOutput() );
-    GaussianFilter::SigmaArrayType sigma;
+    typename GaussianFilter::SigmaArrayType sigma;
     sigma[0] = 5;
     sigma[1] = 40;
     gaussianZ->SetSigmaArray( sigma );
 
     double thresholdValue = 0.1;
     typedef itk::ThresholdImageFilter<ImageType2d> ThresholdFilter;
-    ThresholdFilter::Pointer threshold = ThresholdFilter::New();
+    typename ThresholdFilter::Pointer threshold = ThresholdFilter::New();
     threshold->SetInput( gaussianZ->GetOutput() );
     threshold->ThresholdAbove( thresholdValue);
     threshold->SetOutsideValue( thresholdValue );
     threshold->Update();
 
-    ImageType2d::Pointer ptx= threshold->GetOutput();
+    typename ImageType2d::Pointer ptx= threshold->GetOutput();
 
 
     typedef itk::CastImageFilter< ImageType2d, RGBImageType> RGBCastFilter;
-    RGBCastFilter::Pointer rgbConvert = RGBCastFilter::New();
+    typename RGBCastFilter::Pointer rgbConvert = RGBCastFilter::New();
     rgbConvert->SetInput( mmode );
     rgbConvert->Update();
     RGBImageType::Pointer overlayImage = rgbConvert->GetOutput();
@@ -28,6 +28,9 @@ limitations under the License.
 #include <QDebug>
 
 // STD includes
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 
@@ -36,8 +39,37 @@ int main( int argc, char *argv[] )
   qDebug() << "Starting ...";
   QApplication app( argc, argv );
 
+  //--compress [maxError] saves recordings with the RF codec
+  //--history seconds [megabytes] sets the span of "Save Last", 0 disables
+  //the history
+  bool compress = false;
+  int maxError = 0;
+  double historySeconds = 10;
+  int historyMegabytes = 256;
+  for( int i = 1; i < argc; i++ )
+    {
+    if( std::strcmp( argv[ i ], "--compress" ) == 0 )
+      {
+      compress = true;
+      if( i + 1 < argc && argv[ i + 1 ][ 0 ] != '-' )
+        {
+        maxError = std::atoi( argv[ ++i ] );
+        }
+      }
+    else if( std::strcmp( argv[ i ], "--history" ) == 0 && i + 1 < argc )
+      {
+      historySeconds = std::atof( argv[ ++i ] );
+      if( i + 1 < argc && argv[ i + 1 ][ 0 ] != '-' )
+        {
+        historyMegabytes = std::atoi( argv[ ++i ] );
+        }
+      }
+    }
+
   int ringBufferSize = 200;
   PTXUI window( ringBufferSize, nullptr, false);
+  window.SetCompressRecordings( compress, maxError );
+  window.SetHistory( historySeconds, std::max( 1, historyMegabytes ) );
   window.show();
 
   try
@@ -58,6 +58,8 @@ PTXUI::PTXUI( int bufferSize, QWidget *parent, bool runBMode)
   : QMainWindow( parent ), ui( new PTXUILayout() ), runInBMode(runBMode),
   lastRenderedIndex( -1 ),
   lastMModeIndex( -1 ),
+  geometryGeneration( 0 ),
+  historySeconds( 0 ),
   mMode1Location( 32 ),
   mMode2Location( 64 ),
   mMode3Location( 96 )
@@ -96,6 +98,9 @@ PTXUI::PTXUI( int bufferSize, QWidget *parent, bool runBMode)
 
   connect( ui->pushButton_Save,
     SIGNAL( clicked() ), this, SLOT( Save() ) );
+  connect( ui->pushButton_SaveHistory,
+    SIGNAL( clicked() ), this, SLOT( SaveHistory() ) );
+  ui->pushButton_SaveHistory->setEnabled( false );
   
    intersonDevice.SetRingBufferSize( bufferSize );
 
@@ -133,10 +138,28 @@ PTXUI::PTXUI( int bufferSize, QWidget *parent, bool runBMode)
 
 PTXUI::~PTXUI()
 {
+  //Waits for pending compressed saves
+  rfWriter.reset();
   //this->intersonDevice.Stop();
   delete ui;
 }
 
+void PTXUI::SetCompressRecordings( bool compress, int maxError )
+{
+  if( compress )
+    {
+    if( !rfWriter )
+      {
+      rfWriter.reset( new RFWriter( 1 ) );
+      }
+    rfWriter->SetMaximumError( maxError );
+    }
+  else
+    {
+    rfWriter.reset();
+    }
+}
+
 void PTXUI::ToggleProbe()
 {
   if( ui->pushButton_ConnectProbe->isChecked() )
@@ -182,22 +205,9 @@ void PTXUI::ConnectProbe()
     //TODO: Show UI message
     }
 
-  
-  int height = 0;
-  int width = intersonDevice.GetRingBufferSize();
-  if( runInBMode )
-    {
-    height = intersonDevice.GetBModeDepthResolution();
-    }
-  else
-    {
-    height = intersonDevice.GetRFModeDepthResolution();
-    }
-  mMode1 = CreateMModeImage(width, height);
-  mMode2 = CreateMModeImage(width, height);
-  mMode3 = CreateMModeImage(width, height);
+  SetupMModeImages();
 
-  IntersonArrayDeviceRF::FrequenciesType fs = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType fs = intersonDevice.GetFrequencies();
   ui->dropDown_Frequency->clear();
   for( unsigned int i = 0; i < fs.size(); i++ )
     {
@@ -215,8 +225,36 @@ void PTXUI::ConnectProbe()
 
 
 
+//M-mode images sized for the current ring buffer and depth resolution
+void PTXUI::SetupMModeImages()
+{
+  geometryGeneration = intersonDevice.GetGeometryGeneration();
+  int height = 0;
+  int width = intersonDevice.GetRingBufferSize();
+  if( runInBMode )
+    {
+    height = intersonDevice.GetBModeDepthResolution();
+    }
+  else
+    {
+    height = intersonDevice.GetRFModeDepthResolution();
+    }
+  mMode1 = CreateMModeImage(width, height);
+  mMode2 = CreateMModeImage(width, height);
+  mMode3 = CreateMModeImage(width, height);
+  lastMModeIndex = -1;
+  lastRenderedIndex = -1;
+}
+
 void PTXUI::UpdateImage()
 {
+  //The ring buffers are reallocated on a geometry change, restart the
+  //M-mode traces for the new geometry
+  if( intersonDevice.GetGeometryGeneration() != geometryGeneration )
+    {
+    SetupMModeImages();
+    }
+
   int currentIndex;
   if(runInBMode)
     {
@@ -228,7 +266,7 @@ void PTXUI::UpdateImage()
     }
   if( currentIndex >= 0 && currentIndex != lastRenderedIndex )
     {
-    
+    const int previousIndex = lastRenderedIndex;
     nSkippedFrames = (currentIndex - lastRenderedIndex) - 1;
     if(nSkippedFrames < 0 ){
       nSkippedFrames += (intersonDevice.GetRingBufferSize() - 1);
@@ -239,6 +277,13 @@ void PTXUI::UpdateImage()
     if(!runInBMode)
       {
       RFImageType::Pointer rf = intersonDevice.GetRFImage( currentIndex );
+      if( rf.IsNull() )
+        {
+        //Slot rewritten during the read, retry on the next update
+        lastRenderedIndex = previousIndex;
+        this->timer->start();
+        return;
+        }
 
       //Create BMode image
       m_CastFilter->SetInput( rf );
@@ -248,6 +293,12 @@ void PTXUI::UpdateImage()
     else
       {
       BModeImageType::Pointer probeBMode = intersonDevice.GetBModeImage( currentIndex );
+      if( probeBMode.IsNull() )
+        {
+        lastRenderedIndex = previousIndex;
+        this->timer->start();
+        return;
+        }
       m_BModeCastFilter->SetInput( probeBMode);
       m_BModeCastFilter->Update();
       bmode = m_BModeCastFilter->GetOutput();
@@ -313,7 +364,7 @@ void PTXUI::SetFrequency()
 {
   bool success = this->intersonDevice.SetFrequency(
     this->ui->dropDown_Frequency->currentIndex() );
-  IntersonArrayDeviceRF::FrequenciesType frequencies = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType frequencies = intersonDevice.GetFrequencies();
   if( !success )
     {
     std::cout << "Failed to set frequency index: " << this->ui->dropDown_Frequency->currentIndex() << std::endl;
@@ -345,39 +396,128 @@ void PTXUI::Save()
     {
     return;
     }
-   StopScan(); 
+   //Snapshot the frames leading up to the save request right away, the
+   //probe keeps scanning while the dialog is open
+   RFImageType3d::Pointer rf = intersonDevice.GetRingBufferRFOrdered();
+   if( rf.IsNull() )
+     {
+     return;
+     }
+
+   std::string filename;
+   if( GetSaveFilename( filename ) )
+     {
+     SaveRF( rf, filename );
+     }
+}
+
+void PTXUI::SaveHistory()
+{
+  if( !intersonDevice.IsProbeConnected() || historySeconds <= 0 )
+    {
+    return;
+    }
+   //Export right away as for Save, the history keeps advancing while the
+   //dialog is open
+   RFImageType3d::Pointer rf;
+   BModeImageType3d::Pointer bmode;
+   if( runInBMode )
+     {
+     bmode = intersonDevice.GetBModeHistory( historySeconds );
+     }
+   else
+     {
+     rf = intersonDevice.GetRFHistory( historySeconds );
+     }
+   if( rf.IsNull() && bmode.IsNull() )
+     {
+     std::cout << "No frames in the history" << std::endl;
+     return;
+     }
 
+   std::string filename;
+   if( !GetSaveFilename( filename ) )
+     {
+     return;
+     }
+   filename += "_history";
+   if( rf.IsNotNull() )
+     {
+     SaveRF( rf, filename );
+     }
+   else
+     {
+     filename += ".nrrd";
+     std::cout << filename << std::endl;
+     ImageIO<BModeImageType3d>::WriteImage( bmode, filename );
+     }
+}
+
+//Runs the patient data dialog, returns the file name without extension
+bool PTXUI::GetSaveFilename( std::string &name )
+{
    PTXUISaveDialog dialog(patientData, this);
    int ret = dialog.exec();
-   if( ret > 0)
+   if( ret <= 0 )
+     {
+     return false;
+     }
+
+   std::stringstream filename;
+   filename << patientData.filepath  << "/";  
+   filename << patientData.id        << "_";  
+   filename << std::setw(3) << std::setfill('0');
+   filename << patientData.session   << "_";  
+   filename << std::setw(3) << std::setfill('0');
+   filename << patientData.age       << "_";  
+   filename << patientData.diagnosis << "_";
+   QString format = QString::fromStdString( "yy-mm-dd-hh-mm-ss");
+   filename << QDateTime::currentDateTime().toString( format ).toStdString();
+   name = filename.str();
+
+   if( ret == 2 )
      {
-     //Save data
-     RFImageType3d::Pointer rf = intersonDevice.GetRingBufferRFOrdered();
-     std::stringstream filename;
-     filename << patientData.filepath  << "/";  
-     filename << patientData.id        << "_";  
-     filename << std::setw(3) << std::setfill('0');
-     filename << patientData.session   << "_";  
-     filename << std::setw(3) << std::setfill('0');
-     filename << patientData.age       << "_";  
-     filename << patientData.diagnosis << "_";
-     QString format = QString::fromStdString( "yy-mm-dd-hh-mm-ss");
-     filename << QDateTime::currentDateTime().toString( format ).toStdString();
-     filename << ".nrrd"; 
-     std::cout << filename.str() << std::endl; 
-     ImageIO<RFImageType3d>::WriteImage( rf, filename.str() );
-     
-     if( ret == 2 )
-       {
-       patientData = PTXPatientData();
-       }
-     else
-       {
-       patientData.session += 1;
-       }
+     patientData = PTXPatientData();
      }
+   else
+     {
+     patientData.session += 1;
+     }
+   return true;
+}
 
-   StartScan();   
+void PTXUI::SaveRF( RFImageType3d::Pointer rf, std::string filename )
+{
+   if( rfWriter )
+     {
+     filename += ".rfz";
+     std::cout << filename << std::endl;
+     rfWriter->Write( rf, filename );
+     }
+   else
+     {
+     filename += ".nrrd";
+     std::cout << filename << std::endl;
+     ImageIO<RFImageType3d>::WriteImage( rf, filename );
+     }
+}
+
+void PTXUI::SetHistory( double seconds, size_t megabytes )
+{
+  historySeconds = seconds;
+  const size_t bytes = seconds > 0 ? megabytes * 1024 * 1024 : 0;
+  if( runInBMode )
+    {
+    intersonDevice.SetHistoryMemoryBudget( bytes, 0 );
+    }
+  else
+    {
+    intersonDevice.SetHistoryMemoryBudget( 0, bytes );
+    }
+  ui->pushButton_SaveHistory->setEnabled( seconds > 0 );
+  std::ostringstream text;
+  text << "Save Last " << seconds << " s";
+  ui->pushButton_SaveHistory->setText( text.str().c_str() );
 }
 
 
@@ -40,7 +40,7 @@ limitations under the License.
 
 //#include "ui_PTX.h"
 #include "PTXUILayout.h"
-#include "IntersonArrayDeviceRF.hxx"
+#include "ProbeDevice.hxx"
 
 #include "itkBModeImageFilter.h"
 #include "itkCastImageFilter.h"
@@ -50,7 +50,7 @@ limitations under the License.
 #include "itkInverse1DFFTImageFilter.h"
 #include "itkAbsImageFilter.h"
 #include "itkAddImageFilter.h"
-#include "itkMultiplyImageFIlter.h"
+#include "itkMultiplyImageFilter.h"
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkLog10ImageFilter.h"
 
@@ -59,6 +59,9 @@ limitations under the License.
 #include "PTXPatientData.h"
 
 #include "PTXDetector.hxx"
+#include "CompressedImageWriter.hxx"
+
+#include <memory>
 
 //Forward declaration of Ui::MainWindow;
 //namespace Ui
@@ -75,6 +78,16 @@ public:
   PTXUI( int bufferSize, QWidget *parent = nullptr, bool runBMode = false );
   ~PTXUI();
 
+  //Save recordings as ".rfz" (see RFCompression.h) on a background thread
+  //instead of uncompressed NRRD. maxError > 0 enables bounded error
+  //quantization of the RF samples.
+  void SetCompressRecordings( bool compress, int maxError = 0 );
+
+  //Keep a compressed history of the frames within the given memory budget
+  //(see FrameHistory.hxx), "Save Last" exports its last seconds. 0
+  //seconds disables the history.
+  void SetHistory( double seconds, size_t megabytes );
+
 protected:
   void  closeEvent( QCloseEvent * event );
 
@@ -82,6 +95,7 @@ protected:
 
   void ToggleProbe();
   void Save();
+  void SaveHistory();
 
   void SetFrequency();
   void SetDepth();
@@ -103,10 +117,13 @@ private:
  
   PTXPatientData patientData;
 
-  IntersonArrayDeviceRF intersonDevice;
+  ProbeDevice intersonDevice;
   int lastRenderedIndex;
   int lastMModeIndex;
   bool runInBMode;
+  //Geometry generation of the device the M-mode images were set up for
+  unsigned long geometryGeneration;
+  double historySeconds;
 
   int mMode1Location; 
   int mMode2Location; 
@@ -115,9 +132,13 @@ private:
   std::atomic<int> nFramesRendered;
   std::atomic<int> nSkippedFrames;
 
-  typedef IntersonArrayDeviceRF::RFImageType  RFImageType;
-  typedef IntersonArrayDeviceRF::RFImageType3d  RFImageType3d;
-  typedef IntersonArrayDeviceRF::ImageType  BModeImageType;
+  typedef ProbeDevice::RFImageType  RFImageType;
+  typedef ProbeDevice::RFImageType3d  RFImageType3d;
+  typedef ProbeDevice::ImageType  BModeImageType;
+  typedef ProbeDevice::ImageType3d  BModeImageType3d;
+
+  typedef CompressedImageWriter< RFImageType3d > RFWriter;
+  std::unique_ptr< RFWriter > rfWriter;
 
   typedef itk::Image<double, 2> ImageType;
   ImageType::Pointer mMode1;
@@ -176,6 +197,11 @@ private:
 
 
   ImageType::Pointer CreateMModeImage(int width, int height);
+
+  void SetupMModeImages();
+
+  bool GetSaveFilename( std::string &filename );
+  void SaveRF( RFImageType3d::Pointer rf, std::string filename );
   
   void ShiftImage( ImageType::Pointer mMode ); 
 
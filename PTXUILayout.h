@@ -53,6 +53,7 @@ public:
     QSpinBox *spinBox_Power;
     QLabel *label_Depth;
     QPushButton *pushButton_Save;
+    QPushButton *pushButton_SaveHistory;
     QPushButton *pushButton_ConnectProbe;
     QLabel *label_BModeImage;
     QFrame *line1;
@@ -184,6 +185,10 @@ public:
         pushButton_Save->setFont(font2);
         //controlPanel->addWidget(pushButton_Save, 0, 1, 1, 1, Qt::AlignTop);
 
+        pushButton_SaveHistory = new QPushButton();
+        pushButton_SaveHistory->setObjectName(QStringLiteral("pushButton_SaveHistory"));
+        pushButton_SaveHistory->setFont(font2);
+
         pushButton_ConnectProbe = new QPushButton();
         pushButton_ConnectProbe->setCheckable( true );
         pushButton_ConnectProbe->setObjectName(QStringLiteral("pushButton_ConnectProbe"));
@@ -217,6 +222,7 @@ public:
         controlPanelVertical->addWidget(line2);
         
         controlPanelVertical->addWidget( pushButton_Save );
+        controlPanelVertical->addWidget( pushButton_SaveHistory );
 
         topLayout->addStretch( 0 );
 
@@ -300,6 +306,7 @@ public:
         label_Power->setText(QApplication::translate("MainWindow", "Power", nullptr));
         label_Depth->setText(QApplication::translate("MainWindow", "Depth:", nullptr));
         pushButton_Save->setText(QApplication::translate("MainWindow", "Save", nullptr));
+        pushButton_SaveHistory->setText(QApplication::translate("MainWindow", "Save Last", nullptr));
         pushButton_ConnectProbe->setText(QApplication::translate("MainWindow", "Start Scan", nullptr));
     } // retranslateUi
 
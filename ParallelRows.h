@@ -0,0 +1,89 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef PARALLELROWS_H
+#define PARALLELROWS_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+//Split the range [ begin, end ) (rows or columns of an image) into
+//contiguous chunks and call f( chunkBegin, chunkEnd, chunkNumber ) for each
+//chunk on its own thread. The calling thread processes the first chunk.
+//
+//nThreads <= 0 uses the hardware concurrency. Ranges with less than
+//minPerThread items per thread use fewer threads, so small images do not
+//pay for thread creation. Returns the number of chunks used.
+class ParallelRows
+{
+
+public:
+
+  template <typename TFunction>
+  static int For( int begin, int end, TFunction f, int nThreads = 0,
+    int minPerThread = 16 )
+    {
+    const int n = end - begin;
+    if( n <= 0 )
+      {
+      return 0;
+      }
+    const int nChunks = GetNumberOfChunks( n, nThreads, minPerThread );
+    if( nChunks == 1 )
+      {
+      f( begin, end, 0 );
+      return 1;
+      }
+
+    std::vector< std::thread > threads;
+    for( int i = 1; i < nChunks; i++ )
+      {
+      threads.push_back( std::thread( f, ChunkStart( begin, n, nChunks, i ),
+        ChunkStart( begin, n, nChunks, i + 1 ), i ) );
+      }
+    f( begin, ChunkStart( begin, n, nChunks, 1 ), 0 );
+    for( unsigned int i = 0; i < threads.size(); i++ )
+      {
+      threads[ i ].join();
+      }
+    return nChunks;
+    };
+
+  //Number of chunks For would use, to size per chunk results
+  static int GetNumberOfChunks( int n, int nThreads = 0, int minPerThread = 16 )
+    {
+    if( nThreads <= 0 )
+      {
+      nThreads = std::max( 1u, std::thread::hardware_concurrency() );
+      }
+    return std::max( 1, std::min( nThreads, n / std::max( 1, minPerThread ) ) );
+    };
+
+private:
+
+  static int ChunkStart( int begin, int n, int nChunks, int i )
+    {
+    return begin + ( int )( ( long )n * i / nChunks );
+    };
+
+};
+
+#endif
@@ -0,0 +1,526 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef PARAMETERSWEEP_H
+#define PARAMETERSWEEP_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "OpticNerveEstimator.hxx"
+
+//Accuracy versus speed sweeps of OpticNerveEstimator::Parameters.
+//
+//A sweep varies some tunables (by name, see GetTunables) over ranges,
+//either on a grid or by uniform random sampling, starting from a base
+//parameter set. Every configuration fits all frames of a corpus. Frames
+//carry a reference full nerve width (ground truth of OcularPhantom frames
+//or a manual measurement), the result of a configuration is its success
+//rate, the mean absolute width error of the successful fits and the mean
+//time of Fit and of each stage (OpticNerveEstimator::StageTimes).
+//
+//Configurations run in parallel, one per worker thread, with the
+//estimator itself single threaded. Times are measured under that load;
+//use one worker for latencies comparable to the application.
+//
+//Results are ranked into Pareto fronts on ( time, width error, success
+//rate ): front 0 holds the configurations no other configuration beats in
+//all three, front 1 those only beaten by front 0 and so on.
+class ParameterSweep
+{
+
+public:
+
+  typedef OpticNerveEstimator::ImageType ImageType;
+  typedef OpticNerveEstimator::Parameters Parameters;
+  typedef OpticNerveEstimator::StageTimes StageTimes;
+
+  //Numeric view of a field of Parameters, flags and the nerve fit method
+  //map to 0 and 1
+  struct Tunable
+    {
+    const char *name;
+    double Parameters::*real;
+    int Parameters::*integer;
+    bool Parameters::*flag;
+    OpticNerveEstimator::NerveFitMethod Parameters::*method;
+
+    void Set( Parameters &params, double value ) const
+      {
+      if( real )
+        {
+        params.*real = value;
+        }
+      else if( integer )
+        {
+        params.*integer = ( int )std::floor( value + 0.5 );
+        }
+      else if( flag )
+        {
+        params.*flag = value >= 0.5;
+        }
+      else
+        {
+        params.*method = value >= 0.5 ? OpticNerveEstimator::NERVE_FIT_PROFILE :
+          OpticNerveEstimator::NERVE_FIT_REGISTRATION;
+        }
+      };
+
+    double Get( const Parameters &params ) const
+      {
+      if( real )
+        {
+        return params.*real;
+        }
+      if( integer )
+        {
+        return params.*integer;
+        }
+      if( flag )
+        {
+        return params.*flag ? 1 : 0;
+        }
+      return params.*method == OpticNerveEstimator::NERVE_FIT_PROFILE ? 1 : 0;
+      };
+    };
+
+  static const std::vector< Tunable > &GetTunables()
+    {
+    static const std::vector< Tunable > tunables = CreateTunables();
+    return tunables;
+    };
+
+  //Tunable of the given name, NULL if there is none
+  static const Tunable *FindTunable( const std::string &name )
+    {
+    const std::vector< Tunable > &tunables = GetTunables();
+    for( unsigned int i = 0; i < tunables.size(); i++ )
+      {
+      if( name == tunables[ i ].name )
+        {
+        return &tunables[ i ];
+        }
+      }
+    return NULL;
+    };
+
+  //Values minimum .. maximum in steps equal intervals (steps + 1 values on
+  //the grid, steps 0 keeps the minimum)
+  struct Range
+    {
+    const Tunable *tunable;
+    double minimum;
+    double maximum;
+    int steps;
+
+    double GetValue( int step ) const
+      {
+      return steps <= 0 ? minimum : minimum + ( maximum - minimum ) * step / steps;
+      };
+    };
+
+  struct Frame
+    {
+    std::string name;
+    ImageType::Pointer image;
+    //Full nerve width, negative if unknown
+    double referenceWidth;
+    };
+
+  struct Result
+    {
+    //Values of the ranges in order
+    std::vector< double > values;
+    Parameters parameters;
+    int frames = 0;
+    int successes = 0;
+    int measured = 0;
+    double successRate = 0;
+    //Mean absolute error of the full nerve width over the successful fits
+    //of frames with a reference, -1 if there are none
+    double widthError = -1;
+    //Mean duration of Fit and of each stage over the frames where it ran
+    double seconds = 0;
+    StageTimes stageSeconds;
+    int front = -1;
+    };
+
+  ParameterSweep() : numberOfThreads( 0 )
+    {
+    };
+
+  void SetBaseParameters( const Parameters &params )
+    {
+    base = params;
+    };
+
+  void AddRange( const Range &range )
+    {
+    ranges.push_back( range );
+    };
+
+  const std::vector< Range > &GetRanges() const
+    {
+    return ranges;
+    };
+
+  void AddFrame( const Frame &frame )
+    {
+    corpus.push_back( frame );
+    };
+
+  //Worker threads, 0 for all cores
+  void SetNumberOfThreads( int n )
+    {
+    numberOfThreads = n;
+    };
+
+  //All combinations of the range values
+  std::vector< std::vector< double > > GetGrid() const
+    {
+    std::vector< std::vector< double > > points( 1 );
+    for( unsigned int r = 0; r < ranges.size(); r++ )
+      {
+      std::vector< std::vector< double > > next;
+      for( unsigned int i = 0; i < points.size(); i++ )
+        {
+        for( int step = 0; step <= std::max( 0, ranges[ r ].steps ); step++ )
+          {
+          next.push_back( points[ i ] );
+          next.back().push_back( ranges[ r ].GetValue( step ) );
+          }
+        }
+      points.swap( next );
+      }
+    return points;
+    };
+
+  //n points uniformly distributed in the ranges
+  std::vector< std::vector< double > > GetRandom( int n, uint32_t seed ) const
+    {
+    std::mt19937 generator( seed );
+    std::uniform_real_distribution< double > uniform( 0, 1 );
+    std::vector< std::vector< double > > points( std::max( 0, n ) );
+    for( unsigned int i = 0; i < points.size(); i++ )
+      {
+      for( unsigned int r = 0; r < ranges.size(); r++ )
+        {
+        const Range &range = ranges[ r ];
+        points[ i ].push_back( range.minimum +
+          ( range.maximum - range.minimum ) * uniform( generator ) );
+        }
+      }
+    return points;
+    };
+
+  Parameters GetParameters( const std::vector< double > &values ) const
+    {
+    Parameters params = base;
+    for( unsigned int r = 0; r < ranges.size() && r < values.size(); r++ )
+      {
+      ranges[ r ].tunable->Set( params, values[ r ] );
+      }
+    params.numberOfThreads = 1;
+    return params;
+    };
+
+  //Fit the corpus with every point, results in the order of the points
+  //with the Pareto fronts assigned. progress (if not NULL) gets a line per
+  //finished configuration.
+  std::vector< Result > Run( const std::vector< std::vector< double > > &points,
+    std::ostream *progress = NULL )
+    {
+    std::vector< Result > results( points.size() );
+    std::atomic< int > next( 0 );
+    std::atomic< int > done( 0 );
+    std::mutex progressMutex;
+
+    auto worker = [ & ]()
+      {
+      for( int i = next++; i < ( int )points.size(); i = next++ )
+        {
+        results[ i ] = Evaluate( points[ i ] );
+        const int finished = ++done;
+        if( progress != NULL )
+          {
+          std::lock_guard< std::mutex > lock( progressMutex );
+          *progress << finished << "/" << points.size() << ": success "
+            << results[ i ].successRate << ", width error "
+            << results[ i ].widthError << ", " << 1000 * results[ i ].seconds
+            << " ms" << std::endl;
+          }
+        }
+      };
+
+    int nThreads = numberOfThreads;
+    if( nThreads <= 0 )
+      {
+      nThreads = std::max( 1u, std::thread::hardware_concurrency() );
+      }
+    nThreads = std::max( 1, std::min( nThreads, ( int )points.size() ) );
+    std::vector< std::thread > threads;
+    for( int i = 1; i < nThreads; i++ )
+      {
+      threads.push_back( std::thread( worker ) );
+      }
+    worker();
+    for( unsigned int i = 0; i < threads.size(); i++ )
+      {
+      threads[ i ].join();
+      }
+
+    AssignFronts( results );
+    return results;
+    };
+
+  //Fit the corpus with one configuration
+  Result Evaluate( const std::vector< double > &values ) const
+    {
+    typedef std::chrono::steady_clock Clock;
+    Result result;
+    result.values = values;
+    result.parameters = GetParameters( values );
+    std::fill( result.stageSeconds.seconds,
+      result.stageSeconds.seconds + StageTimes::NUMBER_OF_STAGES, 0.0 );
+    std::vector< int > stageCounts( StageTimes::NUMBER_OF_STAGES, 0 );
+    double widthError = 0;
+
+    for( unsigned int f = 0; f < corpus.size(); f++ )
+      {
+      //Own image object on the shared buffer, the filters update the
+      //requested region of their input
+      ImageType::Pointer image = ImageType::New();
+      image->Graft( corpus[ f ].image );
+
+      OpticNerveEstimator estimator;
+      estimator.algParams = result.parameters;
+      const Clock::time_point start = Clock::now();
+      const OpticNerveEstimator::Status status = estimator.Fit( image );
+      result.seconds += std::chrono::duration< double >( Clock::now() - start ).count();
+      result.frames++;
+
+      const StageTimes &times = estimator.GetStageTimes();
+      for( int s = 0; s < StageTimes::NUMBER_OF_STAGES; s++ )
+        {
+        if( times.seconds[ s ] >= 0 )
+          {
+          result.stageSeconds.seconds[ s ] += times.seconds[ s ];
+          stageCounts[ s ]++;
+          }
+        }
+
+      if( status == OpticNerveEstimator::ESTIMATION_SUCCESS )
+        {
+        result.successes++;
+        if( corpus[ f ].referenceWidth >= 0 )
+          {
+          //Nerve::width is measured from the center
+          widthError += std::fabs( 2 * estimator.GetNerve().width -
+            corpus[ f ].referenceWidth );
+          result.measured++;
+          }
+        }
+      }
+
+    for( int s = 0; s < StageTimes::NUMBER_OF_STAGES; s++ )
+      {
+      result.stageSeconds.seconds[ s ] = stageCounts[ s ] > 0 ?
+        result.stageSeconds.seconds[ s ] / stageCounts[ s ] : -1;
+      }
+    if( result.frames > 0 )
+      {
+      result.seconds /= result.frames;
+      result.successRate = ( double )result.successes / result.frames;
+      }
+    if( result.measured > 0 )
+      {
+      result.widthError = widthError / result.measured;
+      }
+    return result;
+    };
+
+  //Non dominated sorting on ( time, width error, success rate ). Results
+  //without a width error rank behind all others.
+  static void AssignFronts( std::vector< Result > &results )
+    {
+    int remaining = results.size();
+    for( unsigned int i = 0; i < results.size(); i++ )
+      {
+      results[ i ].front = -1;
+      }
+    for( int front = 0; remaining > 0; front++ )
+      {
+      std::vector< int > members;
+      for( unsigned int i = 0; i < results.size(); i++ )
+        {
+        if( results[ i ].front >= 0 )
+          {
+          continue;
+          }
+        bool dominated = false;
+        for( unsigned int j = 0; j < results.size() && !dominated; j++ )
+          {
+          dominated = j != i && results[ j ].front < 0 &&
+            Dominates( results[ j ], results[ i ] );
+          }
+        if( !dominated )
+          {
+          members.push_back( i );
+          }
+        }
+      for( unsigned int m = 0; m < members.size(); m++ )
+        {
+        results[ members[ m ] ].front = front;
+        }
+      remaining -= members.size();
+      }
+    };
+
+  //CSV with the range values, the metrics, the stage times in
+  //milliseconds and the front of each result
+  void WriteCSV( std::ostream &out, const std::vector< Result > &results ) const
+    {
+    for( unsigned int r = 0; r < ranges.size(); r++ )
+      {
+      out << ranges[ r ].tunable->name << ",";
+      }
+    out << "frames,successRate,widthError,ms";
+    for( int s = 0; s < StageTimes::NUMBER_OF_STAGES; s++ )
+      {
+      out << "," << StageTimes::GetName( s ) << "_ms";
+      }
+    out << ",front" << std::endl;
+
+    for( unsigned int i = 0; i < results.size(); i++ )
+      {
+      const Result &result = results[ i ];
+      for( unsigned int r = 0; r < ranges.size(); r++ )
+        {
+        out << ranges[ r ].tunable->Get( result.parameters ) << ",";
+        }
+      out << result.frames << "," << result.successRate << ","
+        << result.widthError << "," << 1000 * result.seconds;
+      for( int s = 0; s < StageTimes::NUMBER_OF_STAGES; s++ )
+        {
+        const double seconds = result.stageSeconds.seconds[ s ];
+        out << "," << ( seconds < 0 ? -1 : 1000 * seconds );
+        }
+      out << "," << result.front << std::endl;
+      }
+    };
+
+private:
+
+  Parameters base;
+  std::vector< Range > ranges;
+  std::vector< Frame > corpus;
+  int numberOfThreads;
+
+  static bool Dominates( const Result &a, const Result &b )
+    {
+    if( a.widthError < 0 )
+      {
+      return false;
+      }
+    if( b.widthError < 0 )
+      {
+      return true;
+      }
+    return a.seconds <= b.seconds && a.widthError <= b.widthError &&
+      a.successRate >= b.successRate &&
+      ( a.seconds < b.seconds || a.widthError < b.widthError ||
+      a.successRate > b.successRate );
+    };
+
+  static std::vector< Tunable > CreateTunables()
+    {
+    std::vector< Tunable > tunables;
+    AddReal( tunables, "eyeInitialBlurFactor", &Parameters::eyeInitialBlurFactor );
+    AddReal( tunables, "eyeHorizontalBorderFactor", &Parameters::eyeHorizontalBorderFactor );
+    AddReal( tunables, "eyeInitialBinaryThreshold", &Parameters::eyeInitialBinaryThreshold );
+    AddReal( tunables, "eyeClosingRadiusFactor", &Parameters::eyeClosingRadiusFactor );
+    AddReal( tunables, "eyeVerticalBorderFactor", &Parameters::eyeVerticalBorderFactor );
+    AddInteger( tunables, "eyeYSlab", &Parameters::eyeYSlab );
+    AddInteger( tunables, "eyeXSlab", &Parameters::eyeXSlab );
+    AddInteger( tunables, "eyeThreshold", &Parameters::eyeThreshold );
+    AddReal( tunables, "eyeRingFactor", &Parameters::eyeRingFactor );
+    AddReal( tunables, "eyeMaskCornerXFactor", &Parameters::eyeMaskCornerXFactor );
+    AddReal( tunables, "eyeMaskCornerYFactor", &Parameters::eyeMaskCornerYFactor );
+    AddReal( tunables, "eyeRegistrationSize", &Parameters::eyeRegistrationSize );
+    AddFlag( tunables, "useEllipseTemplateCache", &Parameters::useEllipseTemplateCache );
+    AddReal( tunables, "eyeTemplateRadiusStep", &Parameters::eyeTemplateRadiusStep );
+    AddReal( tunables, "nerveXRegionFactor", &Parameters::nerveXRegionFactor );
+    AddReal( tunables, "nerveYRegionFactor", &Parameters::nerveYRegionFactor );
+    AddReal( tunables, "nerveYSizeFactor", &Parameters::nerveYSizeFactor );
+    AddReal( tunables, "nerveYOffsetFactor", &Parameters::nerveYOffsetFactor );
+    AddReal( tunables, "nerveInitialSmoothXFactor", &Parameters::nerveInitialSmoothXFactor );
+    AddReal( tunables, "nerveInitialSmoothYFactor", &Parameters::nerveInitialSmoothYFactor );
+    AddInteger( tunables, "nerveInitialThreshold", &Parameters::nerveInitialThreshold );
+    AddReal( tunables, "nerveOpeningRadiusFactor", &Parameters::nerveOpeningRadiusFactor );
+    AddInteger( tunables, "nerveBorderThreshold", &Parameters::nerveBorderThreshold );
+    AddInteger( tunables, "nerveHorizontalBoder", &Parameters::nerveHorizontalBoder );
+    AddInteger( tunables, "nerveRegistrationThreshold", &Parameters::nerveRegistrationThreshold );
+    AddReal( tunables, "nerveRegsitrationSmooth", &Parameters::nerveRegsitrationSmooth );
+    Tunable method = { "nerveFitMethod", NULL, NULL, NULL, &Parameters::nerveFitMethod };
+    tunables.push_back( method );
+    AddInteger( tunables, "nerveProfileIterations", &Parameters::nerveProfileIterations );
+    AddFlag( tunables, "useFastMetric", &Parameters::useFastMetric );
+    AddInteger( tunables, "maxFunctionEvaluations", &Parameters::maxFunctionEvaluations );
+    AddReal( tunables, "timeBudget", &Parameters::timeBudget );
+    AddFlag( tunables, "speculativeNerve", &Parameters::speculativeNerve );
+    AddReal( tunables, "nerveSpeculationTolerance", &Parameters::nerveSpeculationTolerance );
+    AddFlag( tunables, "useFastDistanceTransform", &Parameters::useFastDistanceTransform );
+    AddFlag( tunables, "useFastMorphology", &Parameters::useFastMorphology );
+    return tunables;
+    };
+
+  static void AddReal( std::vector< Tunable > &tunables, const char *name,
+    double Parameters::*field )
+    {
+    Tunable tunable = { name, field, NULL, NULL, NULL };
+    tunables.push_back( tunable );
+    };
+
+  static void AddInteger( std::vector< Tunable > &tunables, const char *name,
+    int Parameters::*field )
+    {
+    Tunable tunable = { name, NULL, field, NULL, NULL };
+    tunables.push_back( tunable );
+    };
+
+  static void AddFlag( std::vector< Tunable > &tunables, const char *name,
+    bool Parameters::*field )
+    {
+    Tunable tunable = { name, NULL, NULL, field, NULL };
+    tunables.push_back( tunable );
+    };
+
+};
+
+#endif
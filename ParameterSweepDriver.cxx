@@ -0,0 +1,357 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Accuracy versus speed sweeps of OpticNerveEstimator::Parameters
+//(ParameterSweep.h).
+//
+//  OpticNerveParameterSweep [--mode=grid|random] [--samples=<n>]
+//    [--seed=<s>] [--range=<name>:<min>:<max>[:<steps>]]...
+//    [--preset=default|fast|accurate] [--phantom=<n>] [--size=<w>x<h>]
+//    [--jitter=<fraction>] [--frames=<image>,...] [--reference=<file.csv>]
+//    [--threads=<n>] [--out=<file.csv>] [--list]
+//
+//Without --range the four parameters of the OpticNerveUI sliders are swept.
+//The corpus is made of --phantom OcularPhantom frames (reference width from
+//the ground truth) and recorded --frames. Reference widths of recorded
+//frames are read from a CSV with lines <image>,<full nerve width>. All
+//results go to --out, the first Pareto front and the fastest and most
+//accurate configuration on it are printed.
+
+#include "ParameterSweep.h"
+#include "OcularPhantom.hxx"
+#include "ImageIO.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef ParameterSweep::ImageType ImageType;
+
+std::vector< std::string > Split( const std::string &s, char separator )
+{
+  std::vector< std::string > parts;
+  std::istringstream stream( s );
+  std::string part;
+  while( std::getline( stream, part, separator ) )
+    {
+    if( !part.empty() )
+      {
+      parts.push_back( part );
+      }
+    }
+  return parts;
+}
+
+bool GetFlag( const std::string &arg, const std::string &flag, std::string &value )
+{
+  const std::string prefix = "--" + flag + "=";
+  if( arg.compare( 0, prefix.size(), prefix ) != 0 )
+    {
+    return false;
+    }
+  value = arg.substr( prefix.size() );
+  return true;
+}
+
+bool ParseRange( const std::string &s, ParameterSweep::Range &range )
+{
+  std::vector< std::string > parts = Split( s, ':' );
+  if( parts.size() < 3 || parts.size() > 4 )
+    {
+    return false;
+    }
+  range.tunable = ParameterSweep::FindTunable( parts[ 0 ] );
+  range.minimum = std::atof( parts[ 1 ].c_str() );
+  range.maximum = std::atof( parts[ 2 ].c_str() );
+  range.steps = parts.size() == 4 ? std::atoi( parts[ 3 ].c_str() ) : 4;
+  return range.tunable != NULL;
+}
+
+void PrintResult( const ParameterSweep &sweep, const ParameterSweep::Result &result )
+{
+  const std::vector< ParameterSweep::Range > &ranges = sweep.GetRanges();
+  for( unsigned int r = 0; r < ranges.size(); r++ )
+    {
+    std::cout << "  " << ranges[ r ].tunable->name << " = "
+      << ranges[ r ].tunable->Get( result.parameters ) << std::endl;
+    }
+  std::cout << "  success rate " << result.successRate << ", width error "
+    << result.widthError << ", " << 1000 * result.seconds << " ms" << std::endl;
+}
+
+int main( int argc, char **argv )
+{
+  std::string mode = "grid";
+  int samples = 50;
+  unsigned int seed = 1;
+  std::vector< std::string > rangeList;
+  std::string preset = "default";
+  int phantomFrames = -1;
+  int width = 512;
+  int height = 512;
+  double jitter = 0.1;
+  std::string frames;
+  std::string referenceFile;
+  int nThreads = 0;
+  std::string outFile;
+  bool list = false;
+
+  for( int i = 1; i < argc; i++ )
+    {
+    const std::string arg = argv[ i ];
+    std::string value;
+    bool valid = true;
+    if( GetFlag( arg, "mode", value ) )
+      {
+      mode = value;
+      valid = mode == "grid" || mode == "random";
+      }
+    else if( GetFlag( arg, "samples", value ) )
+      {
+      samples = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "seed", value ) )
+      {
+      seed = std::strtoul( value.c_str(), NULL, 10 );
+      }
+    else if( GetFlag( arg, "range", value ) )
+      {
+      rangeList.push_back( value );
+      }
+    else if( GetFlag( arg, "preset", value ) )
+      {
+      preset = value;
+      valid = preset == "default" || preset == "fast" || preset == "accurate";
+      }
+    else if( GetFlag( arg, "phantom", value ) )
+      {
+      phantomFrames = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "size", value ) )
+      {
+      valid = std::sscanf( value.c_str(), "%dx%d", &width, &height ) == 2 &&
+        width > 0 && height > 0;
+      }
+    else if( GetFlag( arg, "jitter", value ) )
+      {
+      jitter = std::atof( value.c_str() );
+      }
+    else if( GetFlag( arg, "frames", value ) )
+      {
+      frames = value;
+      }
+    else if( GetFlag( arg, "reference", value ) )
+      {
+      referenceFile = value;
+      }
+    else if( GetFlag( arg, "threads", value ) )
+      {
+      nThreads = std::atoi( value.c_str() );
+      }
+    else if( GetFlag( arg, "out", value ) )
+      {
+      outFile = value;
+      }
+    else if( arg == "--list" )
+      {
+      list = true;
+      }
+    else
+      {
+      valid = false;
+      }
+    if( !valid )
+      {
+      std::cerr << "Usage: " << argv[ 0 ] << " [--mode=grid|random] [--samples=<n>]"
+        << " [--seed=<s>] [--range=<name>:<min>:<max>[:<steps>]]..."
+        << " [--preset=default|fast|accurate] [--phantom=<n>] [--size=<w>x<h>]"
+        << " [--jitter=<fraction>] [--frames=<image>,...] [--reference=<file.csv>]"
+        << " [--threads=<n>] [--out=<file.csv>] [--list]" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  OpticNerveEstimator::Preset presetType = OpticNerveEstimator::PRESET_DEFAULT;
+  if( preset == "fast" )
+    {
+    presetType = OpticNerveEstimator::PRESET_FAST;
+    }
+  else if( preset == "accurate" )
+    {
+    presetType = OpticNerveEstimator::PRESET_ACCURATE;
+    }
+  const OpticNerveEstimator::Parameters base =
+    OpticNerveEstimator::GetPresetParameters( presetType );
+
+  if( list )
+    {
+    const std::vector< ParameterSweep::Tunable > &tunables =
+      ParameterSweep::GetTunables();
+    for( unsigned int i = 0; i < tunables.size(); i++ )
+      {
+      std::cout << tunables[ i ].name << " " << tunables[ i ].Get( base ) << std::endl;
+      }
+    return EXIT_SUCCESS;
+    }
+
+  ParameterSweep sweep;
+  sweep.SetBaseParameters( base );
+  sweep.SetNumberOfThreads( nThreads );
+
+  if( rangeList.empty() )
+    {
+    //Sliders of OpticNerveUI
+    rangeList.push_back( "eyeInitialBinaryThreshold:15:35:4" );
+    rangeList.push_back( "eyeThreshold:20:40:4" );
+    rangeList.push_back( "nerveInitialThreshold:55:95:4" );
+    rangeList.push_back( "nerveRegistrationThreshold:30:70:4" );
+    }
+  for( unsigned int i = 0; i < rangeList.size(); i++ )
+    {
+    ParameterSweep::Range range;
+    if( !ParseRange( rangeList[ i ], range ) )
+      {
+      std::cerr << "Invalid range (see --list for the names): " << rangeList[ i ]
+        << std::endl;
+      return EXIT_FAILURE;
+      }
+    sweep.AddRange( range );
+    }
+
+  //Corpus
+  std::map< std::string, double > references;
+  if( !referenceFile.empty() )
+    {
+    std::ifstream in( referenceFile.c_str() );
+    if( !in )
+      {
+      std::cerr << "Could not read " << referenceFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    std::string line;
+    while( std::getline( in, line ) )
+      {
+      std::vector< std::string > parts = Split( line, ',' );
+      if( parts.size() == 2 )
+        {
+        references[ parts[ 0 ] ] = std::atof( parts[ 1 ].c_str() );
+        }
+      }
+    }
+
+  std::vector< std::string > frameList = Split( frames, ',' );
+  for( unsigned int i = 0; i < frameList.size(); i++ )
+    {
+    ParameterSweep::Frame frame;
+    frame.name = frameList[ i ];
+    try
+      {
+      frame.image = ImageIO< ImageType >::ReadImageMapped( frameList[ i ] );
+      }
+    catch( itk::ExceptionObject &e )
+      {
+      std::cerr << "Could not read " << frameList[ i ] << ": " << e << std::endl;
+      return EXIT_FAILURE;
+      }
+    std::map< std::string, double >::const_iterator reference =
+      references.find( frame.name );
+    frame.referenceWidth = reference != references.end() ? reference->second : -1;
+    sweep.AddFrame( frame );
+    }
+
+  if( phantomFrames < 0 )
+    {
+    phantomFrames = frameList.empty() ? 20 : 0;
+    }
+  OcularPhantom< ImageType > phantom;
+  phantom.SetImageSize( width, height );
+  phantom.parameters.jitter = jitter;
+  for( int i = 0; i < phantomFrames; i++ )
+    {
+    OcularPhantom< ImageType >::GroundTruth truth;
+    ParameterSweep::Frame frame;
+    std::ostringstream name;
+    name << "phantom/" << i;
+    frame.name = name.str();
+    frame.image = phantom.Render( seed + i, &truth );
+    frame.referenceWidth = truth.nerveWidth;
+    sweep.AddFrame( frame );
+    }
+
+  //Sweep
+  const std::vector< std::vector< double > > points = mode == "grid" ?
+    sweep.GetGrid() : sweep.GetRandom( samples, seed );
+  std::cout << "Fitting " << frameList.size() + phantomFrames << " frames with "
+    << points.size() << " configurations" << std::endl;
+  std::vector< ParameterSweep::Result > results = sweep.Run( points, &std::cout );
+
+  if( !outFile.empty() )
+    {
+    std::ofstream out( outFile.c_str() );
+    if( !out )
+      {
+      std::cerr << "Could not write " << outFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    sweep.WriteCSV( out, results );
+    }
+
+  //First front by time
+  std::vector< const ParameterSweep::Result * > front;
+  for( unsigned int i = 0; i < results.size(); i++ )
+    {
+    if( results[ i ].front == 0 && results[ i ].widthError >= 0 )
+      {
+      front.push_back( &results[ i ] );
+      }
+    }
+  if( front.empty() )
+    {
+    std::cout << "No configuration fitted a frame with a reference width" << std::endl;
+    return EXIT_SUCCESS;
+    }
+  std::sort( front.begin(), front.end(),
+    []( const ParameterSweep::Result *a, const ParameterSweep::Result *b )
+    {
+    return a->seconds < b->seconds;
+    } );
+  std::cout << std::endl << "Pareto front:" << std::endl;
+  const ParameterSweep::Result *accurate = front[ 0 ];
+  for( unsigned int i = 0; i < front.size(); i++ )
+    {
+    PrintResult( sweep, *front[ i ] );
+    if( front[ i ]->widthError < accurate->widthError )
+      {
+      accurate = front[ i ];
+      }
+    }
+  std::cout << std::endl << "Fastest:" << std::endl;
+  PrintResult( sweep, *front[ 0 ] );
+  std::cout << "Most accurate:" << std::endl;
+  PrintResult( sweep, *accurate );
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef PROBEDEVICE_H
+#define PROBEDEVICE_H
+
+//Probe backend of the applications. With USE_FRAME_BUS (CMake option of
+//the same name) the apps read the frames FrameBusPublisher publishes on a
+//SharedFrameBus through FrameBusDevice, so several apps share one probe.
+//With USE_SIMULATED_PROBE they acquire from SimulatedProbeDevice and build
+//without the Interson SDK, otherwise from IntersonArrayDeviceRF.
+#if defined( USE_FRAME_BUS )
+#include "FrameBusDevice.hxx"
+typedef FrameBusDevice ProbeDevice;
+#elif defined( USE_SIMULATED_PROBE )
+#include "SimulatedProbeDevice.hxx"
+typedef SimulatedProbeDevice ProbeDevice;
+#else
+#include "IntersonArrayDeviceRF.hxx"
+typedef IntersonArrayDeviceRF ProbeDevice;
+#endif
+
+//Calling convention of the probe SDK callbacks
+#ifdef _WIN32
+#define PROBE_CALLBACK __stdcall
+#else
+#define PROBE_CALLBACK
+#endif
+
+#endif
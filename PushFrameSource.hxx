@@ -0,0 +1,152 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef PUSHFRAMESOURCE_H
+#define PUSHFRAMESOURCE_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "BModeFrameSource.hxx"
+#include "FrameRingBuffer.hxx"
+
+//BModeFrameSource fed by the caller, e.g. with frames received over the
+//network by OpticNerveServer. Each frame carries an id and flags chosen by
+//the producer, looked up by frame number when its estimate is reported.
+//
+//Frames complete out of order when the calculator runs several workers.
+//A slot is only reused once its frame and all older frames are completed,
+//and Add refuses frames while GetNumberOfPending() frames fill the ring,
+//so a frame and its id are never overwritten while it is estimated.
+class PushFrameSource : public BModeFrameSource
+{
+
+public:
+
+  PushFrameSource( int size = 20 )
+    : ring( size ), frames( size ), nReleased( 0 )
+    {
+    };
+
+  //Copy a frame of samples x lines pixels (probe layout) into the ring.
+  //A frame of a different size than the previous ones reallocates the
+  //ring, which is only possible once all pending frames are completed.
+  //Returns false, without adding, if the ring is full of frames that were
+  //not completed yet or the size changes while frames are pending.
+  bool Add( const PixelType *pixels, unsigned int samples, unsigned int lines,
+    int64_t id, unsigned int flags = 0 )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    const long pending = GetNumberOfPendingLocked();
+    if( pending >= ring.GetSize() )
+      {
+      return false;
+      }
+    ImageType::SizeType size;
+    size[ 0 ] = samples;
+    size[ 1 ] = lines;
+    const ImageType::SizeType current = ring.GetImageSize();
+    if( current[ 0 ] != size[ 0 ] || current[ 1 ] != size[ 1 ] )
+      {
+      if( pending > 0 )
+        {
+        return false;
+        }
+      ring.Allocate( size );
+      }
+    FrameInfo &info = frames[ ring.GetNumberOfFrames() % frames.size() ];
+    info.id = id;
+    info.flags = flags;
+    info.done = false;
+    ring.Add( pixels );
+    return true;
+    };
+
+  //Mark a frame as done (estimated or failed). Its slot is freed once all
+  //older frames are done as well.
+  void Complete( long frame )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    if( frame < nReleased || frame >= ring.GetNumberOfFrames() )
+      {
+      return;
+      }
+    frames[ frame % frames.size() ].done = true;
+    while( nReleased < ring.GetNumberOfFrames() &&
+      frames[ nReleased % frames.size() ].done )
+      {
+      frames[ nReleased % frames.size() ].done = false;
+      nReleased++;
+      }
+    };
+
+  //Frames added whose slot is not free yet
+  long GetNumberOfPending()
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return GetNumberOfPendingLocked();
+    };
+
+  int64_t GetFrameId( long frame )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return frames[ frame % frames.size() ].id;
+    };
+
+  unsigned int GetFrameFlags( long frame )
+    {
+    std::lock_guard< std::mutex > lock( mutex );
+    return frames[ frame % frames.size() ].flags;
+    };
+
+  long GetNumberOfBModeImagesAcquired() override
+    {
+    return ring.GetNumberOfFrames();
+    };
+
+  ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex ) override
+    {
+    return ring.GetImageAbsolute( absoluteIndex );
+    };
+
+private:
+
+  struct FrameInfo
+    {
+    int64_t id = -1;
+    unsigned int flags = 0;
+    bool done = false;
+    };
+
+  FrameRingBuffer< ImageType > ring;
+  std::vector< FrameInfo > frames;
+  //Frames before this one are completed and their slots free
+  long nReleased;
+  std::mutex mutex;
+
+  long GetNumberOfPendingLocked()
+    {
+    return ring.GetNumberOfFrames() - nReleased;
+    };
+
+};
+
+#endif
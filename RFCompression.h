@@ -0,0 +1,533 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+//Fast codec for RF and B-mode frames.
+//
+//Frames are coded scan line by scan line (the contiguous axis, i.e.
+//MAX_RFSAMPLES samples of one line). Each line is split into blocks of
+//BlockSize samples. For every block the predictor with the smallest
+//residuals is chosen from:
+//  - none:        x[i]
+//  - delta:       x[i] - x[i-1]
+//  - linear:      x[i] - ( 2 x[i-1] - x[i-2] )
+//  - line:        x[i] - y[i], y being the previous scan line
+//The residuals are zigzag mapped and bit packed with the smallest width
+//that holds all residuals of the block. A block costs one header byte plus
+//BlockSize * width bits.
+//
+//With maxError > 0 the residuals are quantized with a step of
+//2 * maxError + 1 inside the prediction loop (near-lossless coding): every
+//decoded sample differs from the original by at most maxError.
+//With maxError == 0 the coding is lossless.
+//
+//The codec has no dependencies and is fast enough to run on a background
+//thread next to live acquisition (see CompressedImageWriter.hxx).
+//CompressedImageIO stores ITK images in a small ".rfz" container.
+
+#ifndef RFCOMPRESSION_H
+#define RFCOMPRESSION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+
+template <typename TPixel>
+class RFCompression
+{
+
+public:
+
+  typedef TPixel PixelType;
+
+  static_assert( std::numeric_limits< TPixel >::is_integer &&
+    sizeof( TPixel ) <= 2, "RFCompression supports 8 and 16 bit pixels" );
+
+  enum Predictor
+    {
+    PREDICT_NONE = 0,
+    PREDICT_DELTA = 1,
+    PREDICT_LINEAR = 2,
+    PREDICT_LINE = 3
+    };
+
+  static const int BlockSize = 64;
+
+  //Encode nLines scan lines of lineLength samples each and append the
+  //result to out. Returns the number of bytes appended.
+  static size_t Encode( const TPixel *data, size_t lineLength, size_t nLines,
+    int maxError, std::vector< uint8_t > &out )
+    {
+    const size_t start = out.size();
+    const int step = 2 * std::max( 0, maxError ) + 1;
+
+    //Worst case: header byte plus full width for every block
+    const size_t nBlocks = ( lineLength + BlockSize - 1 ) / BlockSize;
+    out.resize( start + nLines * nBlocks * ( 1 + BlockSize * MaxBits / 8 ) + 8 );
+
+    std::vector< int32_t > previous( lineLength, 0 );
+    std::vector< int32_t > current( lineLength, 0 );
+    std::vector< uint32_t > residuals( BlockSize );
+
+    BitWriter writer( &out[ start ] );
+    for( size_t l = 0; l < nLines; l++ )
+      {
+      const TPixel *line = data + l * lineLength;
+      for( size_t b = 0; b < lineLength; b += BlockSize )
+        {
+        const int n = (int)std::min( ( size_t )BlockSize, lineLength - b );
+        int predictor = ChoosePredictor( line, previous, b, n, l > 0 );
+
+        //Closed loop: predict from reconstructed samples so quantization
+        //errors do not accumulate
+        uint32_t maxResidual = 0;
+        for( int i = 0; i < n; i++ )
+          {
+          const size_t k = b + i;
+          const int32_t p = Predict( predictor, current, previous, k );
+          const int32_t r = Quantize( ( int32_t )line[ k ] - p, maxError, step );
+          current[ k ] = Clamp( p + r * step );
+          residuals[ i ] = ZigZag( r );
+          maxResidual |= residuals[ i ];
+          }
+
+        const int width = BitWidth( maxResidual );
+        writer.WriteByte( ( uint8_t )( ( predictor << 6 ) | width ) );
+        for( int i = 0; i < n; i++ )
+          {
+          writer.Write( residuals[ i ], width );
+          }
+        writer.Align();
+        }
+      std::swap( previous, current );
+      }
+
+    const size_t length = writer.GetLength();
+    out.resize( start + length );
+    return length;
+    };
+
+  //Decode nLines scan lines of lineLength samples from in.
+  //Returns the number of bytes consumed or 0 on corrupt input.
+  static size_t Decode( const uint8_t *in, size_t inLength, size_t lineLength,
+    size_t nLines, int maxError, TPixel *data )
+    {
+    const int step = 2 * std::max( 0, maxError ) + 1;
+    std::vector< int32_t > previous( lineLength, 0 );
+    std::vector< int32_t > current( lineLength, 0 );
+
+    BitReader reader( in, inLength );
+    for( size_t l = 0; l < nLines; l++ )
+      {
+      TPixel *line = data + l * lineLength;
+      for( size_t b = 0; b < lineLength; b += BlockSize )
+        {
+        const int n = (int)std::min( ( size_t )BlockSize, lineLength - b );
+        uint8_t header;
+        if( !reader.ReadByte( header ) )
+          {
+          return 0;
+          }
+        const int predictor = header >> 6;
+        const int width = header & 0x3F;
+        if( width > MaxBits )
+          {
+          return 0;
+          }
+        for( int i = 0; i < n; i++ )
+          {
+          const size_t k = b + i;
+          uint32_t z;
+          if( !reader.Read( z, width ) )
+            {
+            return 0;
+            }
+          const int32_t p = Predict( predictor, current, previous, k );
+          current[ k ] = Clamp( p + UnZigZag( z ) * step );
+          line[ k ] = ( TPixel )current[ k ];
+          }
+        reader.Align();
+        }
+      std::swap( previous, current );
+      }
+    return reader.GetPosition();
+    };
+
+private:
+
+  //Zigzag residuals of 16 bit data need at most 18 bits
+  static const int MaxBits = 8 * sizeof( TPixel ) + 2;
+
+  static int32_t Clamp( int32_t v )
+    {
+    return std::min( ( int32_t )std::numeric_limits< TPixel >::max(),
+      std::max( ( int32_t )std::numeric_limits< TPixel >::min(), v ) );
+    };
+
+  static int32_t Quantize( int32_t r, int maxError, int step )
+    {
+    if( step == 1 )
+      {
+      return r;
+      }
+    return r >= 0 ? ( r + maxError ) / step : -( ( maxError - r ) / step );
+    };
+
+  static uint32_t ZigZag( int32_t v )
+    {
+    return ( ( uint32_t )v << 1 ) ^ ( uint32_t )( v >> 31 );
+    };
+
+  static int32_t UnZigZag( uint32_t z )
+    {
+    return ( int32_t )( z >> 1 ) ^ -( int32_t )( z & 1 );
+    };
+
+  static int BitWidth( uint32_t v )
+    {
+    int width = 0;
+    while( v != 0 )
+      {
+      width++;
+      v >>= 1;
+      }
+    return width;
+    };
+
+  static int32_t Predict( int predictor, const std::vector< int32_t > &current,
+    const std::vector< int32_t > &previous, size_t k )
+    {
+    switch( predictor )
+      {
+      case PREDICT_DELTA:
+        return k > 0 ? current[ k - 1 ] : previous[ k ];
+      case PREDICT_LINEAR:
+        return k > 1 ? Clamp( 2 * current[ k - 1 ] - current[ k - 2 ] ) :
+          ( k > 0 ? current[ k - 1 ] : previous[ k ] );
+      case PREDICT_LINE:
+        return previous[ k ];
+      default:
+        return 0;
+      }
+    };
+
+  //Pick the predictor with the smallest sum of absolute residuals, computed
+  //on the original samples (the reconstruction only differs by maxError)
+  static int ChoosePredictor( const TPixel *line,
+    const std::vector< int32_t > &previous, size_t b, int n, bool hasPrevious )
+    {
+    int64_t cost[ 4 ] = { 0, 0, 0, 0 };
+    for( int i = 0; i < n; i++ )
+      {
+      const size_t k = b + i;
+      const int32_t x = line[ k ];
+      const int32_t x1 = k > 0 ? line[ k - 1 ] : previous[ k ];
+      const int32_t x2 = k > 1 ? 2 * line[ k - 1 ] - line[ k - 2 ] : x1;
+      cost[ PREDICT_NONE ] += std::abs( x );
+      cost[ PREDICT_DELTA ] += std::abs( x - x1 );
+      cost[ PREDICT_LINEAR ] += std::abs( x - x2 );
+      cost[ PREDICT_LINE ] += std::abs( x - previous[ k ] );
+      }
+    if( !hasPrevious )
+      {
+      cost[ PREDICT_LINE ] = std::numeric_limits< int64_t >::max();
+      }
+    return (int)( std::min_element( cost, cost + 4 ) - cost );
+    };
+
+  class BitWriter
+    {
+    public:
+      BitWriter( uint8_t *out ) : out( out ), pos( 0 ), acc( 0 ), nBits( 0 ) {};
+
+      void WriteByte( uint8_t v )
+        {
+        out[ pos++ ] = v;
+        };
+
+      void Write( uint32_t v, int width )
+        {
+        acc |= ( uint64_t )v << nBits;
+        nBits += width;
+        while( nBits >= 8 )
+          {
+          out[ pos++ ] = ( uint8_t )acc;
+          acc >>= 8;
+          nBits -= 8;
+          }
+        };
+
+      void Align()
+        {
+        if( nBits > 0 )
+          {
+          out[ pos++ ] = ( uint8_t )acc;
+          }
+        acc = 0;
+        nBits = 0;
+        };
+
+      size_t GetLength()
+        {
+        return pos;
+        };
+
+    private:
+      uint8_t *out;
+      size_t pos;
+      uint64_t acc;
+      int nBits;
+    };
+
+  class BitReader
+    {
+    public:
+      BitReader( const uint8_t *in, size_t length )
+        : in( in ), length( length ), pos( 0 ), acc( 0 ), nBits( 0 ) {};
+
+      bool ReadByte( uint8_t &v )
+        {
+        if( pos >= length )
+          {
+          return false;
+          }
+        v = in[ pos++ ];
+        return true;
+        };
+
+      bool Read( uint32_t &v, int width )
+        {
+        while( nBits < width )
+          {
+          if( pos >= length )
+            {
+            return false;
+            }
+          acc |= ( uint64_t )in[ pos++ ] << nBits;
+          nBits += 8;
+          }
+        v = ( uint32_t )( acc & ( ( ( uint64_t )1 << width ) - 1 ) );
+        acc >>= width;
+        nBits -= width;
+        return true;
+        };
+
+      void Align()
+        {
+        acc = 0;
+        nBits = 0;
+        };
+
+      size_t GetPosition()
+        {
+        return pos;
+        };
+
+    private:
+      const uint8_t *in;
+      size_t length;
+      size_t pos;
+      uint64_t acc;
+      int nBits;
+    };
+
+};
+
+
+//Read and write ITK images in the ".rfz" container:
+//  char[4]   "RFZ1"
+//  uint32    dimension, bytes per pixel, signed flag, max error
+//  uint64    size[ 3 ]
+//  double    spacing[ 3 ], origin[ 3 ]
+//  uint64    payload length
+//  payload   RFCompression stream, lines along axis 0
+template <typename TImage>
+class CompressedImageIO
+{
+
+public:
+
+  typedef TImage Image;
+  typedef typename Image::Pointer ImagePointer;
+  typedef typename Image::PixelType PixelType;
+  typedef typename Image::RegionType ImageRegion;
+  typedef typename Image::SizeType ImageSize;
+  typedef typename Image::IndexType ImageIndex;
+  typedef typename Image::SpacingType ImageSpacing;
+  typedef typename Image::PointType ImagePoint;
+  typedef RFCompression< PixelType > Codec;
+
+  itkStaticConstMacro( ImageDimension, unsigned int, Image::ImageDimension );
+
+  static bool IsCompressedFilename( const std::string &filename )
+    {
+    return filename.size() > 4 &&
+      filename.compare( filename.size() - 4, 4, ".rfz" ) == 0;
+    };
+
+  //Compress an image into a self contained buffer (header and payload)
+  static void Compress( ImagePointer image, int maxError,
+    std::vector< uint8_t > &out )
+    {
+    const ImageSize size = image->GetBufferedRegion().GetSize();
+    const ImageSpacing spacing = image->GetSpacing();
+    const ImagePoint origin = image->GetOrigin();
+
+    Header header;
+    std::memcpy( header.magic, "RFZ1", 4 );
+    header.dimension = ImageDimension;
+    header.pixelBytes = sizeof( PixelType );
+    header.isSigned = std::numeric_limits< PixelType >::is_signed;
+    header.maxError = maxError;
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      header.size[ i ] = i < ImageDimension ? size[ i ] : 1;
+      header.spacing[ i ] = i < ImageDimension ? spacing[ i ] : 1;
+      header.origin[ i ] = i < ImageDimension ? origin[ i ] : 0;
+      }
+
+    const size_t lineLength = header.size[ 0 ];
+    const size_t nLines = header.size[ 1 ] * header.size[ 2 ];
+
+    out.resize( sizeof( Header ) );
+    header.payloadLength = Codec::Encode( image->GetBufferPointer(),
+      lineLength, nLines, maxError, out );
+    std::memcpy( &out[ 0 ], &header, sizeof( Header ) );
+    };
+
+  static bool WriteImage( ImagePointer image, const std::string &filename,
+    int maxError = 0 )
+    {
+    std::vector< uint8_t > buffer;
+    Compress( image, maxError, buffer );
+    std::ofstream file( filename.c_str(), std::ios::binary );
+    file.write( ( const char * )&buffer[ 0 ], buffer.size() );
+    return file.good();
+    };
+
+  //Returns NULL if the file is not a valid container for this image type
+  static ImagePointer ReadImage( const std::string &filename )
+    {
+    std::ifstream file( filename.c_str(), std::ios::binary );
+    Header header;
+    if( !file.read( ( char * )&header, sizeof( Header ) ) ||
+      std::memcmp( header.magic, "RFZ1", 4 ) != 0 ||
+      header.dimension != ImageDimension ||
+      header.pixelBytes != sizeof( PixelType ) ||
+      ( header.isSigned != 0 ) != std::numeric_limits< PixelType >::is_signed )
+      {
+      return NULL;
+      }
+    std::vector< uint8_t > payload( header.payloadLength );
+    if( header.payloadLength > 0 &&
+      !file.read( ( char * )&payload[ 0 ], payload.size() ) )
+      {
+      return NULL;
+      }
+
+    ImageSize size;
+    ImageIndex index;
+    ImageSpacing spacing;
+    ImagePoint origin;
+    index.Fill( 0 );
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      size[ i ] = header.size[ i ];
+      spacing[ i ] = header.spacing[ i ];
+      origin[ i ] = header.origin[ i ];
+      }
+    ImagePointer image = Image::New();
+    image->SetRegions( ImageRegion( index, size ) );
+    image->SetSpacing( spacing );
+    image->SetOrigin( origin );
+    image->Allocate();
+
+    const size_t lineLength = header.size[ 0 ];
+    const size_t nLines = header.size[ 1 ] * header.size[ 2 ];
+    if( payload.empty() || Codec::Decode( &payload[ 0 ], payload.size(),
+      lineLength, nLines, header.maxError, image->GetBufferPointer() ) == 0 )
+      {
+      return NULL;
+      }
+    return image;
+    };
+
+private:
+
+#pragma pack( push, 1 )
+  struct Header
+    {
+    char magic[ 4 ];
+    uint32_t dimension;
+    uint32_t pixelBytes;
+    uint32_t isSigned;
+    uint32_t maxError;
+    uint64_t size[ 3 ];
+    double spacing[ 3 ];
+    double origin[ 3 ];
+    uint64_t payloadLength;
+    };
+#pragma pack( pop )
+
+};
+
+
+//Selects CompressedImageIO for pixel types the codec supports, so generic
+//code such as ImageIO can dispatch on the ".rfz" extension for any image
+//type. For unsupported types WriteImage fails and ReadImage returns NULL.
+template <typename TImage, bool Supported =
+  std::numeric_limits< typename TImage::PixelType >::is_integer &&
+  sizeof( typename TImage::PixelType ) <= 2 >
+class CompressedImageDispatch
+{
+
+public:
+
+  static bool IsCompressedFilename( const std::string &filename )
+    {
+    return filename.size() > 4 &&
+      filename.compare( filename.size() - 4, 4, ".rfz" ) == 0;
+    };
+
+  static bool WriteImage( typename TImage::Pointer, const std::string &,
+    int = 0 )
+    {
+    return false;
+    };
+
+  static typename TImage::Pointer ReadImage( const std::string & )
+    {
+    return NULL;
+    };
+
+};
+
+template <typename TImage>
+class CompressedImageDispatch< TImage, true > : public CompressedImageIO< TImage >
+{
+};
+
+#endif
@@ -0,0 +1,467 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef SHAREDFRAMEBUS_H
+#define SHAREDFRAMEBUS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+//Ring of frames in shared memory, filled by one acquisition process
+//(FrameBusPublisher) and read by any number of consumer processes
+//(FrameBusDevice), so several applications can use one probe stream.
+//
+//The bus is a named POSIX shared memory object (shm_open), a named file
+//mapping on Windows. Consumers map it read only. The layout is a Header
+//with the frame geometry and probe settings, followed by the slots, each
+//a SlotHeader and the pixels of one frame. As in FrameRingBuffer frame
+//number a lives in slot a % nSlots and each slot carries a sequence number
+//(seqlock): 2a + 1 while frame a is written, 2a + 2 once it is complete.
+//The publisher never waits for consumers. Consumers read frames in place,
+//GetFramePointer and IsFrameIntact, or copy them, CopyFrame, and detect
+//frames overwritten while they were read.
+class SharedFrameBus
+{
+
+public:
+
+  static const uint32_t Magic = 0x42465355;
+  static const uint32_t Version = 1;
+  static const int MaximumFrequencies = 8;
+
+  enum FrameType
+    {
+    FRAME_BMODE = 1,
+    FRAME_RF = 2
+    };
+
+  //Frame geometry and probe settings of the publisher
+  struct FrameInfo
+    {
+    uint32_t frameType;
+    //Bytes per pixel
+    uint32_t pixelSize;
+    //Probe layout, depth along the first dimension
+    uint32_t samples;
+    uint32_t lines;
+    float    mmPerPixel;
+    int32_t  depth;
+    uint32_t frequencyIndex;
+    uint32_t voltage;
+    uint32_t nFrequencies;
+    int32_t  frequencies[ MaximumFrequencies ];
+    };
+
+  SharedFrameBus()
+    : header( NULL ), mapping( NULL ), mappingSize( 0 ), publisher( false )
+#ifdef _WIN32
+    , mappingHandle( NULL )
+#endif
+    {
+    };
+
+  ~SharedFrameBus()
+    {
+    Close();
+    };
+
+  //Default bus name, the environment variable ULTRASOUND_FRAME_BUS
+  //overrides it
+  static std::string GetDefaultName()
+    {
+    const char *name = std::getenv( "ULTRASOUND_FRAME_BUS" );
+    return name != NULL && name[ 0 ] != '\0' ? name : "UltrasoundFrameBus";
+    };
+
+  //Create the bus as its publisher. A stale bus of the same name, left by
+  //a publisher that did not exit cleanly, is replaced. On Windows the
+  //mapping of a bus lives on while consumers have it open and cannot be
+  //resized, it is reinitialized in place if its layout is that of the new
+  //bus (or it was never completed), so the consumers' frame buffers stay
+  //valid. Creating a bus with another layout fails until they let go.
+  bool Create( const std::string &name, const FrameInfo &info, int nSlots )
+    {
+    Close();
+    if( info.pixelSize == 0 || info.samples == 0 || info.lines == 0 ||
+      nSlots < 1 )
+      {
+      return false;
+      }
+    const size_t size = GetSlotsOffset() +
+      ( size_t )nSlots * GetSlotStride( info );
+#ifdef _WIN32
+    mappingHandle = CreateFileMappingA( INVALID_HANDLE_VALUE, NULL,
+      PAGE_READWRITE, ( DWORD )( ( uint64_t )size >> 32 ), ( DWORD )size,
+      GetSystemName( name ).c_str() );
+    if( mappingHandle == NULL )
+      {
+      return false;
+      }
+    const bool exists = GetLastError() == ERROR_ALREADY_EXISTS;
+    //Fails if an existing mapping is smaller than size
+    mapping = MapViewOfFile( mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, size );
+    if( mapping != NULL && exists )
+      {
+      Header *stale = static_cast< Header * >( mapping );
+      if( !CanReinitialize( *stale, info, nSlots, size ) )
+        {
+        Close();
+        return false;
+        }
+      //Consumers of the stale bus stop accepting it until it is complete
+      stale->magic = 0;
+      std::atomic_thread_fence( std::memory_order_release );
+      }
+#else
+    const std::string systemName = GetSystemName( name );
+    shm_unlink( systemName.c_str() );
+    const int fd = shm_open( systemName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+    if( fd < 0 )
+      {
+      return false;
+      }
+    if( ftruncate( fd, size ) == 0 )
+      {
+      mapping = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+      if( mapping == MAP_FAILED )
+        {
+        mapping = NULL;
+        }
+      }
+    close( fd );
+    if( mapping == NULL )
+      {
+      shm_unlink( systemName.c_str() );
+      }
+#endif
+    if( mapping == NULL )
+      {
+      Close();
+      return false;
+      }
+    busName = name;
+    mappingSize = size;
+    publisher = true;
+
+    header = new( mapping ) Header();
+    header->version = Version;
+    header->mappingSize = size;
+    header->nSlots = nSlots;
+    header->info = info;
+    header->nFrames.store( 0, std::memory_order_relaxed );
+    header->closed.store( 0, std::memory_order_relaxed );
+    for( int i = 0; i < nSlots; i++ )
+      {
+      SlotHeader *slot = new( GetSlot( i ) ) SlotHeader();
+      slot->sequence.store( 0, std::memory_order_relaxed );
+      }
+    //Consumers only accept the bus once the magic number is set
+    std::atomic_thread_fence( std::memory_order_release );
+    header->magic = Magic;
+    return true;
+    };
+
+  //Map an existing bus read only as a consumer. Fails if there is no bus
+  //of that name or its publisher has not finished creating it.
+  bool Open( const std::string &name )
+    {
+    Close();
+#ifdef _WIN32
+    mappingHandle = OpenFileMappingA( FILE_MAP_READ, FALSE,
+      GetSystemName( name ).c_str() );
+    if( mappingHandle == NULL )
+      {
+      return false;
+      }
+    mapping = MapViewOfFile( mappingHandle, FILE_MAP_READ, 0, 0, 0 );
+    MEMORY_BASIC_INFORMATION region;
+    if( mapping != NULL &&
+      VirtualQuery( mapping, &region, sizeof( region ) ) == sizeof( region ) )
+      {
+      mappingSize = region.RegionSize;
+      }
+#else
+    const int fd = shm_open( GetSystemName( name ).c_str(), O_RDONLY, 0 );
+    if( fd < 0 )
+      {
+      return false;
+      }
+    struct stat status;
+    if( fstat( fd, &status ) == 0 && ( size_t )status.st_size >= sizeof( Header ) )
+      {
+      mapping = mmap( NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+      if( mapping == MAP_FAILED )
+        {
+        mapping = NULL;
+        }
+      else
+        {
+        mappingSize = status.st_size;
+        }
+      }
+    close( fd );
+#endif
+    if( mapping == NULL || mappingSize < sizeof( Header ) )
+      {
+      Close();
+      return false;
+      }
+    header = static_cast< Header * >( mapping );
+    const bool valid = header->magic == Magic && header->version == Version &&
+      header->mappingSize <= mappingSize;
+    std::atomic_thread_fence( std::memory_order_acquire );
+    if( !valid || header->nSlots < 1 || GetSlotsOffset() +
+      ( size_t )header->nSlots * GetSlotStride( header->info ) > mappingSize )
+      {
+      Close();
+      return false;
+      }
+    busName = name;
+    return true;
+    };
+
+  //Unmap the bus. The publisher marks it closed for the consumers and
+  //removes the name, consumers that still have it mapped keep reading the
+  //last frames.
+  void Close()
+    {
+    if( header != NULL && publisher )
+      {
+      header->closed.store( 1, std::memory_order_release );
+#ifndef _WIN32
+      shm_unlink( GetSystemName( busName ).c_str() );
+#endif
+      }
+    if( mapping != NULL )
+      {
+#ifdef _WIN32
+      UnmapViewOfFile( mapping );
+#else
+      munmap( mapping, mappingSize );
+#endif
+      }
+#ifdef _WIN32
+    if( mappingHandle != NULL )
+      {
+      CloseHandle( mappingHandle );
+      mappingHandle = NULL;
+      }
+#endif
+    header = NULL;
+    mapping = NULL;
+    mappingSize = 0;
+    publisher = false;
+    };
+
+  bool IsOpen() const
+    {
+    return header != NULL;
+    };
+
+  //The publisher closed the bus, no more frames will arrive
+  bool IsClosed() const
+    {
+    return header == NULL || header->closed.load( std::memory_order_acquire ) != 0;
+    };
+
+  const FrameInfo &GetFrameInfo() const
+    {
+    return header->info;
+    };
+
+  int GetNumberOfSlots() const
+    {
+    return header->nSlots;
+    };
+
+  //Bytes of one frame
+  size_t GetFrameSize() const
+    {
+    return GetFrameSize( header->info );
+    };
+
+  //Total number of frames published
+  long GetNumberOfFrames() const
+    {
+    return ( long )header->nFrames.load( std::memory_order_acquire );
+    };
+
+  //Copy a frame of GetFrameSize() bytes into the next slot. Publisher
+  //only, from one thread.
+  void Publish( const void *pixels )
+    {
+    const int64_t n = header->nFrames.load( std::memory_order_relaxed );
+    SlotHeader *slot = GetSlot( n % header->nSlots );
+    slot->sequence.store( 2 * n + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    std::memcpy( GetPixels( slot ), pixels, GetFrameSize() );
+    slot->sequence.store( 2 * n + 2, std::memory_order_release );
+    header->nFrames.store( n + 1, std::memory_order_release );
+    };
+
+  //Pixels of frame number a in the shared memory, NULL if the frame is
+  //not complete or already overwritten. The frame can be overwritten
+  //while it is used, check IsFrameIntact( a ) afterwards.
+  const void *GetFramePointer( long a ) const
+    {
+    if( a < 0 )
+      {
+      return NULL;
+      }
+    const SlotHeader *slot = GetSlot( a % header->nSlots );
+    if( slot->sequence.load( std::memory_order_acquire ) != 2 * ( int64_t )a + 2 )
+      {
+      return NULL;
+      }
+    return GetPixels( slot );
+    };
+
+  //Frame a was not overwritten since GetFramePointer( a )
+  bool IsFrameIntact( long a ) const
+    {
+    std::atomic_thread_fence( std::memory_order_acquire );
+    return a >= 0 && GetSlot( a % header->nSlots )->sequence.load(
+      std::memory_order_relaxed ) == 2 * ( int64_t )a + 2;
+    };
+
+  //Copy frame number a, GetFrameSize() bytes, false if it is not (or no
+  //longer) in the bus or was overwritten during the copy
+  bool CopyFrame( long a, void *out ) const
+    {
+    const void *pixels = GetFramePointer( a );
+    if( pixels == NULL )
+      {
+      return false;
+      }
+    std::memcpy( out, pixels, GetFrameSize() );
+    return IsFrameIntact( a );
+    };
+
+private:
+
+  static_assert( ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "Shared memory synchronization needs lock free atomics" );
+
+  //Slots start at multiples of the cache line size, so the sequence
+  //numbers of neighbouring slots do not share a line
+  enum { Alignment = 64 };
+
+  struct Header
+    {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mappingSize;
+    uint32_t nSlots;
+    uint32_t reserved;
+    FrameInfo info;
+    std::atomic< int64_t > nFrames;
+    std::atomic< uint32_t > closed;
+    };
+
+  struct SlotHeader
+    {
+    std::atomic< int64_t > sequence;
+    };
+
+  Header *header;
+  void *mapping;
+  size_t mappingSize;
+  bool publisher;
+  std::string busName;
+#ifdef _WIN32
+  HANDLE mappingHandle;
+#endif
+
+  SharedFrameBus( const SharedFrameBus & );
+  SharedFrameBus &operator=( const SharedFrameBus & );
+
+  static std::string GetSystemName( const std::string &name )
+    {
+#ifdef _WIN32
+    return "Local\\" + name;
+#else
+    return "/" + name;
+#endif
+    };
+
+  static size_t Align( size_t n )
+    {
+    return ( n + Alignment - 1 ) / Alignment * Alignment;
+    };
+
+  static size_t GetFrameSize( const FrameInfo &info )
+    {
+    return ( size_t )info.pixelSize * info.samples * info.lines;
+    };
+
+  static size_t GetSlotStride( const FrameInfo &info )
+    {
+    return Align( sizeof( SlotHeader ) ) + Align( GetFrameSize( info ) );
+    };
+
+  static size_t GetSlotsOffset()
+    {
+    return Align( sizeof( Header ) );
+    };
+
+  //An existing bus can be reused for a new one of the same layout, or if
+  //no consumer can have accepted it
+  static bool CanReinitialize( const Header &stale, const FrameInfo &info,
+    int nSlots, size_t size )
+    {
+    if( stale.magic != Magic || stale.version != Version )
+      {
+      return true;
+      }
+    return stale.mappingSize == size && stale.nSlots == ( uint32_t )nSlots &&
+      stale.info.frameType == info.frameType &&
+      stale.info.pixelSize == info.pixelSize &&
+      stale.info.samples == info.samples && stale.info.lines == info.lines;
+    };
+
+  SlotHeader *GetSlot( long i ) const
+    {
+    return reinterpret_cast< SlotHeader * >( static_cast< char * >( mapping ) +
+      GetSlotsOffset() + i * GetSlotStride( header->info ) );
+    };
+
+  static void *GetPixels( const SlotHeader *slot )
+    {
+    return const_cast< char * >( reinterpret_cast< const char * >( slot ) ) +
+      Align( sizeof( SlotHeader ) );
+    };
+
+};
+
+#endif
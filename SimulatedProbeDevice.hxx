@@ -0,0 +1,721 @@
+/*=========================================================================
+Copyright 2010 Kitware Inc. 28 Corporate Drive,
+Clifton Park, NY, 12065, USA.
+
+All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+=========================================================================*/
+
+#ifndef SIMULATEDPROBEDEVICE_H
+#define SIMULATEDPROBEDEVICE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "BModeFrameSource.hxx"
+#include "FrameHistory.hxx"
+#include "FrameRingBuffer.hxx"
+#include "ImageIO.h"
+#include "OcularPhantom.hxx"
+
+//Stand in for IntersonArrayDeviceRF without the probe SDK, selected with
+//the CMake option USE_SIMULATED_PROBE (see ProbeDevice.hxx).
+//
+//Provides the part of the IntersonArrayDeviceRF interface the
+//applications use. An acquisition thread produces frames at a fixed rate
+//into the same ring buffers as the probe callbacks, either OcularPhantom
+//frames or, if the environment variable ULTRASOUND_SIMULATED_FRAMES holds
+//a comma separated list of image files, those frames in a loop. Frames
+//have the probe layout: depth along the first dimension, one column per
+//line. RF frames are the B-mode envelope on a carrier at the selected
+//frequency with twice the number of depth samples.
+//
+//ULTRASOUND_SIMULATED_FPS sets the frame rate, 30 by default.
+class SimulatedProbeDevice : public BModeFrameSource
+{
+
+public:
+
+  typedef unsigned char PixelType;
+  typedef itk::Image< PixelType, 2 > ImageType;
+  typedef itk::Image< PixelType, 3 > ImageType3d;
+
+  typedef short RFPixelType;
+  typedef itk::Image< RFPixelType, 2 > RFImageType;
+  typedef itk::Image< RFPixelType, 3 > RFImageType3d;
+
+  typedef std::vector< int > FrequenciesType;
+
+  //Same geometry as the Interson probes
+  static const int MAX_SAMPLES = 1024;
+  static const int MAX_RFSAMPLES = 2048;
+  static const int NUMBER_OF_LINES = 127;
+
+  typedef void ( *HardButtonCallbackType )( void *instance );
+
+  //Hard button registration of the probe controls, the simulated probe
+  //has no button so the callback is never called
+  class HWControls
+    {
+  public:
+    void SetNewHardButtonCallback( HardButtonCallbackType callback, void *instance )
+      {
+      hardButtonCallback = callback;
+      hardButtonInstance = instance;
+      };
+
+  private:
+    HardButtonCallbackType hardButtonCallback = NULL;
+    void *hardButtonInstance = NULL;
+    };
+  typedef HWControls HWControlsType;
+
+  struct SweepPoint
+    {
+    SweepPoint( unsigned char f = 0, unsigned char v = 0, int n = 1 )
+      : frequencyIndex( f ), voltage( v ), nSamples( n ) {};
+    unsigned char frequencyIndex;
+    unsigned char voltage;
+    int nSamples;
+    };
+
+  struct SweepResult
+    {
+    SweepPoint point;
+    bool success;
+    std::vector< RFImageType::Pointer > rfImages;
+    std::vector< ImageType::Pointer > bModeImages;
+    };
+
+  SimulatedProbeDevice()
+    {
+    frequencies.push_back( 2500000 );
+    frequencies.push_back( 3500000 );
+    frequencies.push_back( 5000000 );
+    frequencyIndex = 0;
+    highVoltage = 10;
+    depth = 100;
+    doubler = false;
+    rfData = false;
+    probeIsConnected = false;
+    probeIsRunning = false;
+    stopAcquisition = false;
+    frameRate = 30;
+    nRendered = 0;
+    geometryGeneration = 0;
+    sweepSettleFrames = 2;
+
+    const char *rate = std::getenv( "ULTRASOUND_SIMULATED_FPS" );
+    if( rate != NULL && std::atof( rate ) > 0 )
+      {
+      frameRate = std::atof( rate );
+      }
+
+    const char *files = std::getenv( "ULTRASOUND_SIMULATED_FRAMES" );
+    if( files != NULL )
+      {
+      std::stringstream list( files );
+      std::string file;
+      while( std::getline( list, file, ',' ) )
+        {
+        if( !file.empty() )
+          {
+          frameFiles.push_back( file );
+          }
+        }
+      }
+
+    SetRingBufferSize( 10 );
+    };
+
+  ~SimulatedProbeDevice()
+    {
+    Stop();
+    };
+
+  //Frames to play back instead of phantom frames, overrides
+  //ULTRASOUND_SIMULATED_FRAMES. Set before ConnectProbe.
+  void SetFrameFiles( const std::vector< std::string > &files )
+    {
+    frameFiles = files;
+    };
+
+  //Frames per second, overrides ULTRASOUND_SIMULATED_FPS. Set before Start.
+  void SetFrameRate( double fps )
+    {
+    if( fps > 0 )
+      {
+      frameRate = fps;
+      }
+    };
+
+  //Called on the acquisition thread with every new frame, as in
+  //IntersonArrayDeviceRF. Set before Start.
+  typedef std::function< void( const PixelType * ) > BModeFrameCallback;
+  typedef std::function< void( const RFPixelType * ) > RFFrameCallback;
+
+  void SetNewBModeFrameCallback( BModeFrameCallback callback )
+    {
+    bModeFrameCallback = callback;
+    };
+
+  void SetNewRFFrameCallback( RFFrameCallback callback )
+    {
+    rfFrameCallback = callback;
+    };
+
+  //Loads the frame files, if any, and allocates the ring buffers. Fails if
+  //a frame can not be read or the frames differ in size.
+  bool ConnectProbe( bool rf )
+    {
+    if( probeIsConnected )
+      {
+      return true;
+      }
+    rfData = rf;
+
+    ImageType::SizeType size;
+    size[ 0 ] = MAX_SAMPLES;
+    size[ 1 ] = NUMBER_OF_LINES;
+    recorded.clear();
+    for( unsigned int i = 0; i < frameFiles.size(); i++ )
+      {
+      const std::string &file = frameFiles[ i ];
+      try
+        {
+        recorded.push_back( ImageIO< ImageType >::ReadImageMapped( file ) );
+        }
+      catch( itk::ExceptionObject &e )
+        {
+        std::cerr << "Could not read " << file << ": " << e << std::endl;
+        return false;
+        }
+      if( recorded.back()->GetLargestPossibleRegion().GetSize() !=
+        recorded[ 0 ]->GetLargestPossibleRegion().GetSize() )
+        {
+        std::cerr << "Frame size of " << file << " differs" << std::endl;
+        return false;
+        }
+      }
+    if( recorded.size() > 0 )
+      {
+      size = recorded[ 0 ]->GetLargestPossibleRegion().GetSize();
+      }
+    std::cout << "Simulated probe: " << ( recorded.size() > 0 ?
+      "recorded frames" : "phantom frames" ) << " of " << size[ 0 ] << " x "
+      << size[ 1 ] << " at " << frameRate << " fps" << std::endl;
+
+    //The phantom is rendered with depth along y
+    phantom.SetImageSize( size[ 1 ], size[ 0 ] );
+    phantom.parameters.jitter = 0.02;
+    phantomFrame.resize( size[ 0 ] * size[ 1 ] );
+    bModeFrame.resize( size[ 0 ] * size[ 1 ] );
+    bModeRing.Allocate( size );
+
+    RFImageType::SizeType rfSize;
+    rfSize[ 0 ] = 2 * size[ 0 ];
+    rfSize[ 1 ] = size[ 1 ];
+    rfFrame.resize( rfSize[ 0 ] * rfSize[ 1 ] );
+    rfRing.Allocate( rfSize );
+
+    geometryGeneration++;
+    bModeHistory.SetImageSize( size, geometryGeneration );
+    rfHistory.SetImageSize( rfSize, geometryGeneration );
+    probeIsConnected = true;
+    return true;
+    };
+
+  bool IsProbeConnected()
+    {
+    return probeIsConnected;
+    };
+
+  bool Start()
+    {
+    if( !probeIsConnected )
+      {
+      return false;
+      }
+    if( probeIsRunning )
+      {
+      return true;
+      }
+    stopAcquisition = false;
+    acquisitionThread = std::thread( &SimulatedProbeDevice::Acquire, this );
+    probeIsRunning = true;
+    return true;
+    };
+
+  void Stop()
+    {
+    stopAcquisition = true;
+    if( acquisitionThread.joinable() )
+      {
+      acquisitionThread.join();
+      }
+    probeIsRunning = false;
+    };
+
+  FrequenciesType GetFrequencies()
+    {
+    return frequencies;
+    };
+
+  unsigned char GetFrequency()
+    {
+    return frequencyIndex;
+    };
+
+  bool SetFrequency( unsigned char fIndex )
+    {
+    if( fIndex >= frequencies.size() )
+      {
+      return false;
+      }
+    frequencyIndex = fIndex;
+    return true;
+    };
+
+  unsigned char GetVoltage()
+    {
+    return highVoltage;
+    };
+
+  bool SetVoltage( unsigned char voltage )
+    {
+    highVoltage = voltage;
+    return true;
+    };
+
+  bool SetFrequencyAndVoltage( unsigned char fIndex, unsigned char voltage )
+    {
+    return SetFrequency( fIndex ) && SetVoltage( voltage );
+    };
+
+  bool GetDoubler()
+    {
+    return doubler;
+    };
+
+  void SetDoubler( bool d )
+    {
+    doubler = d;
+    };
+
+  int GetDepth()
+    {
+    return depth;
+    };
+
+  //Depth in mm, only changes the pixel spacing
+  int SetDepth( int d )
+    {
+    d = std::max( 10, std::min( 200, d ) );
+    if( d != depth )
+      {
+      depth = d;
+      geometryGeneration++;
+      bModeHistory.SetImageSize( bModeRing.GetImageSize(), geometryGeneration );
+      rfHistory.SetImageSize( rfRing.GetImageSize(), geometryGeneration );
+      }
+    return depth;
+    };
+
+  //Incremented by ConnectProbe and depth changes, as in
+  //IntersonArrayDeviceRF
+  unsigned long GetGeometryGeneration()
+    {
+    return geometryGeneration;
+    };
+
+  float GetMmPerPixel()
+    {
+    return ( float )depth / bModeRing.GetImageSize()[ 0 ];
+    };
+
+  HWControlsType &GetHWControls()
+    {
+    return hwControls;
+    };
+
+  int GetNumberOfLines()
+    {
+    return bModeRing.GetImageSize()[ 1 ];
+    };
+
+  int GetBModeDepthResolution()
+    {
+    return bModeRing.GetImageSize()[ 0 ];
+    };
+
+  int GetRFModeDepthResolution()
+    {
+    return rfRing.GetImageSize()[ 0 ];
+    };
+
+  void SetRingBufferSize( int size )
+    {
+    rfRing.SetSize( size );
+    bModeRing.SetSize( size );
+    };
+
+  int GetRingBufferSize()
+    {
+    return rfRing.GetSize();
+    };
+
+  //Compressed history of frames beyond the ring buffers, as in
+  //IntersonArrayDeviceRF. 0 disables the history.
+  void SetHistoryMemoryBudget( size_t bModeBytes, size_t rfBytes )
+    {
+    bModeHistory.SetMemoryBudget( bModeBytes );
+    rfHistory.SetMemoryBudget( rfBytes );
+    };
+
+  ImageType3d::Pointer GetBModeHistory( double seconds )
+    {
+    return bModeHistory.ExportLastSeconds( seconds );
+    };
+
+  RFImageType3d::Pointer GetRFHistory( double seconds )
+    {
+    return rfHistory.ExportLastSeconds( seconds );
+    };
+
+  double GetBModeHistoryDuration()
+    {
+    return bModeHistory.GetDuration();
+    };
+
+  double GetRFHistoryDuration()
+    {
+    return rfHistory.GetDuration();
+    };
+
+  double GetBModeFrameRate()
+    {
+    return bModeRing.GetFrameRate();
+    };
+
+  double GetRFFrameRate()
+    {
+    return rfRing.GetFrameRate();
+    };
+
+  ImageType::Pointer GetBModeImage( int ringBufferIndex )
+    {
+    return bModeRing.GetImage( ringBufferIndex );
+    };
+
+  ImageType::Pointer GetBModeImageAbsolute( int absoluteIndex ) override
+    {
+    return bModeRing.GetImageAbsolute( absoluteIndex );
+    };
+
+  long GetNumberOfBModeImagesAcquired() override
+    {
+    return bModeRing.GetNumberOfFrames();
+    };
+
+  int GetCurrentBModeIndex()
+    {
+    return bModeRing.GetCurrentIndex();
+    };
+
+  RFImageType::Pointer GetRFImage( int ringBufferIndex )
+    {
+    return rfRing.GetImage( ringBufferIndex );
+    };
+
+  RFImageType::Pointer GetRFImageAbsolute( int absoluteIndex )
+    {
+    return rfRing.GetImageAbsolute( absoluteIndex );
+    };
+
+  int GetCurrentRFIndex()
+    {
+    return rfRing.GetCurrentIndex();
+    };
+
+  //Snapshot of the RF ring buffer, oldest frame first, NULL if there are
+  //no frames
+  RFImageType3d::Pointer GetRingBufferRFOrdered()
+    {
+    const RFImageType::SizeType frameSize = rfRing.GetImageSize();
+    const long nFrames = std::min< long >( GetRingBufferSize(),
+      rfRing.GetNumberOfFrames() );
+    if( nFrames == 0 )
+      {
+      return NULL;
+      }
+    const size_t nPixels = frameSize[ 0 ] * frameSize[ 1 ];
+    std::vector< RFPixelType > frames( nFrames * nPixels );
+    const long copied = rfRing.CopyOrdered( &frames[ 0 ], nPixels, nFrames );
+    if( copied == 0 )
+      {
+      return NULL;
+      }
+    RFImageType3d::Pointer image = RFImageType3d::New();
+    RFImageType3d::RegionType region;
+    region.SetIndex( 0, 0 );
+    region.SetIndex( 1, 0 );
+    region.SetIndex( 2, 0 );
+    region.SetSize( 0, frameSize[ 0 ] );
+    region.SetSize( 1, frameSize[ 1 ] );
+    region.SetSize( 2, copied );
+    image->SetRegions( region );
+    image->Allocate();
+    std::copy( frames.begin(), frames.begin() + copied * nPixels,
+      image->GetBufferPointer() );
+    return image;
+    };
+
+  //Frequency and voltage changes take effect with the next rendered
+  //frame, so the sweep runs the points in the given order, skips the frame
+  //in progress during each change and then sweepSettleFrames frames as
+  //the real device does, and records the next nSamples frames. A probe started by the sweep is
+  //stopped again.
+  std::vector< SweepResult > Sweep( const std::vector< SweepPoint > &points )
+    {
+    std::vector< SweepResult > results( points.size() );
+    const unsigned char startFrequency = frequencyIndex;
+    const unsigned char startVoltage = highVoltage;
+    const bool wasRunning = probeIsRunning;
+    if( !wasRunning )
+      {
+      Start();
+      }
+    for( unsigned int i = 0; i < points.size(); i++ )
+      {
+      SweepResult &result = results[ i ];
+      result.point = points[ i ];
+      result.success = SetFrequencyAndVoltage( points[ i ].frequencyIndex,
+        points[ i ].voltage );
+      //The frame being rendered during the change may still use the old
+      //settings
+      result.success = result.success && WaitForFrames(
+        GetNumberOfImagesAcquired() + 1 + sweepSettleFrames );
+      long last = GetNumberOfImagesAcquired();
+      for( int sample = 0; result.success && sample < points[ i ].nSamples; sample++ )
+        {
+        if( !WaitForFrames( last + 1 ) )
+          {
+          result.success = false;
+          break;
+          }
+        last = GetNumberOfImagesAcquired();
+        //A frame that could not be read consistently is replaced by the
+        //next one
+        if( rfData )
+          {
+          RFImageType::Pointer image = GetRFImage( GetCurrentRFIndex() );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.rfImages.push_back( image );
+          }
+        else
+          {
+          ImageType::Pointer image = GetBModeImage( GetCurrentBModeIndex() );
+          if( image.IsNull() )
+            {
+            sample--;
+            continue;
+            }
+          result.bModeImages.push_back( image );
+          }
+        }
+      }
+    SetFrequencyAndVoltage( startFrequency, startVoltage );
+    if( !wasRunning )
+      {
+      Stop();
+      }
+    return results;
+    };
+
+  //Number of frames to discard after a change of settings during a sweep
+  void SetSweepSettleFrames( int n )
+    {
+    sweepSettleFrames = n;
+    };
+
+  //Block until at least count frames of the current mode have been
+  //acquired. Returns false after two seconds.
+  bool WaitForFrames( long count )
+    {
+    std::unique_lock< std::mutex > lock( frameMutex );
+    return frameCondition.wait_for( lock, std::chrono::seconds( 2 ),
+      [ this, count ]
+      {
+      return GetNumberOfImagesAcquired() >= count;
+      } );
+    };
+
+private:
+
+  FrameRingBuffer< ImageType > bModeRing;
+  FrameRingBuffer< RFImageType > rfRing;
+
+  FrameHistory< ImageType > bModeHistory;
+  FrameHistory< RFImageType > rfHistory;
+
+  std::mutex frameMutex;
+  std::condition_variable frameCondition;
+  int sweepSettleFrames;
+
+  std::thread acquisitionThread;
+  std::atomic< bool > stopAcquisition;
+
+  bool probeIsConnected;
+  bool probeIsRunning;
+  bool rfData;
+
+  FrequenciesType frequencies;
+  std::atomic< unsigned char > frequencyIndex;
+  std::atomic< unsigned char > highVoltage;
+  int depth;
+  bool doubler;
+  double frameRate;
+  std::atomic< unsigned long > geometryGeneration;
+
+  HWControlsType hwControls;
+
+  BModeFrameCallback bModeFrameCallback;
+  RFFrameCallback rfFrameCallback;
+
+  //Frame sources and staging buffers of the acquisition thread
+  std::vector< std::string > frameFiles;
+  std::vector< ImageType::Pointer > recorded;
+  OcularPhantom< ImageType > phantom;
+  std::vector< PixelType > phantomFrame;
+  std::vector< PixelType > bModeFrame;
+  std::vector< RFPixelType > rfFrame;
+  long nRendered;
+
+  long GetNumberOfImagesAcquired()
+    {
+    return rfData ? rfRing.GetNumberOfFrames() : bModeRing.GetNumberOfFrames();
+    };
+
+  //Produces frames at frameRate until stopped, timing against absolute
+  //frame times so rendering time does not add up
+  void Acquire()
+    {
+    const std::chrono::duration< double > interval( 1 / frameRate );
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while( !stopAcquisition )
+      {
+      RenderBMode();
+      if( rfData )
+        {
+        RenderRF();
+        if( rfFrameCallback )
+          {
+          rfFrameCallback( &rfFrame[ 0 ] );
+          }
+        rfRing.Add( &rfFrame[ 0 ] );
+        rfHistory.Push( &rfFrame[ 0 ] );
+        }
+      else
+        {
+        if( bModeFrameCallback )
+          {
+          bModeFrameCallback( &bModeFrame[ 0 ] );
+          }
+        bModeRing.Add( &bModeFrame[ 0 ] );
+        bModeHistory.Push( &bModeFrame[ 0 ] );
+        }
+      nRendered++;
+        {
+        std::lock_guard< std::mutex > lock( frameMutex );
+        }
+      frameCondition.notify_all();
+
+      next += std::chrono::duration_cast< std::chrono::steady_clock::duration >( interval );
+      if( next < std::chrono::steady_clock::now() )
+        {
+        next = std::chrono::steady_clock::now();
+        }
+      std::this_thread::sleep_until( next );
+      }
+    };
+
+  //Next B-mode frame in probe layout into bModeFrame
+  void RenderBMode()
+    {
+    const ImageType::SizeType size = bModeRing.GetImageSize();
+    const size_t samples = size[ 0 ];
+    const size_t lines = size[ 1 ];
+    if( recorded.size() > 0 )
+      {
+      const ImageType::Pointer &frame = recorded[ nRendered % recorded.size() ];
+      std::copy( frame->GetBufferPointer(),
+        frame->GetBufferPointer() + samples * lines, bModeFrame.begin() );
+      return;
+      }
+    //The phantom has one row per depth sample, transpose to one column
+    //per line
+    phantom.Render( &phantomFrame[ 0 ], ( uint32_t )nRendered );
+    for( size_t line = 0; line < lines; line++ )
+      {
+      PixelType *out = &bModeFrame[ line * samples ];
+      for( size_t sample = 0; sample < samples; sample++ )
+        {
+        out[ sample ] = phantomFrame[ sample * lines + line ];
+        }
+      }
+    };
+
+  //RF frame from the B-mode envelope: two RF samples per B-mode sample on
+  //a carrier of about four samples per period at the lowest frequency
+  void RenderRF()
+    {
+    const size_t samples = bModeRing.GetImageSize()[ 0 ];
+    const size_t lines = bModeRing.GetImageSize()[ 1 ];
+    const double omega = 2 * std::acos( -1.0 ) / 4 *
+      frequencies[ frequencyIndex ] / frequencies[ 0 ];
+    const double amplitude = std::min( 120.0, 4.0 * highVoltage );
+    for( size_t line = 0; line < lines; line++ )
+      {
+      const PixelType *envelope = &bModeFrame[ line * samples ];
+      RFPixelType *out = &rfFrame[ line * 2 * samples ];
+      const double phase = 0.37 * ( line + nRendered );
+      for( size_t k = 0; k < 2 * samples; k++ )
+        {
+        out[ k ] = ( RFPixelType )( amplitude * envelope[ k / 2 ] *
+          std::sin( omega * k + phase ) );
+        }
+      }
+    };
+
+};
+
+#endif
@@ -23,7 +23,7 @@ limitations under the License.
 
 #include "SpectroscopyBModeUI.h"
 
-#include "imageIO.h"
+#include "ImageIO.h"
 #include "ITKQtHelpers.hxx"
 #include "ITKFilterFunctions.h"
 
@@ -52,6 +52,7 @@ SpectroscopyBModeUI::SpectroscopyBModeUI( QWidget *parent )
     lastIndexRendered( -1 )
 {
   recordRF = false;
+  historySeconds = 0;
 
   //Setup the graphical layout on this current Widget
   ui->setupUi( this );
@@ -69,6 +70,8 @@ SpectroscopyBModeUI::SpectroscopyBModeUI( QWidget *parent )
     SIGNAL( clicked() ), this, SLOT( BrowseOutputDirectory() ) );
   connect( ui->pushButton_recordRF,
     SIGNAL( clicked() ), this, SLOT( RecordBMode() ) );
+  connect( ui->pushButton_saveHistory,
+    SIGNAL( clicked() ), this, SLOT( SaveHistory() ) );
 
   // Timer
   this->timer = new QTimer( this );
@@ -101,7 +104,7 @@ void SpectroscopyBModeUI::ConnectProbe()
     {
     delete freqCheckBoxes[ i ];
     }
-  IntersonArrayDeviceRF::FrequenciesType fs =
+  ProbeDevice::FrequenciesType fs =
     intersonDevice.GetFrequencies();
   ui->dropDown_Frequency->clear();
   freqCheckBoxes.resize( fs.size() );
@@ -148,6 +151,13 @@ void SpectroscopyBModeUI::UpdateImage()
       {
       RFImageType::Pointer image =
         intersonDevice.GetRFImage( currentIndex );
+      if( image.IsNull() )
+        {
+        //Slot rewritten during the read, retry on the next update
+        lastIndexRendered = -1;
+        this->timer->start();
+        return;
+        }
       ITKFilterFunctions< RFImageType >::PermuteArray order;
       order[ 0 ] = 1;
       order[ 1 ] = 0;
@@ -164,6 +174,12 @@ void SpectroscopyBModeUI::UpdateImage()
       {
       BModeImageType::Pointer image =
         intersonDevice.GetBModeImage( currentIndex );
+      if( image.IsNull() )
+        {
+        lastIndexRendered = -1;
+        this->timer->start();
+        return;
+        }
       ITKFilterFunctions< BModeImageType >::PermuteArray order;
       order[ 0 ] = 1;
       order[ 1 ] = 0;
@@ -192,7 +208,7 @@ void SpectroscopyBModeUI::SetFrequency()
     {
     bool success = this->intersonDevice.SetFrequency(
       this->ui->dropDown_Frequency->currentIndex() );
-    IntersonArrayDeviceRF::FrequenciesType frequencies =
+    ProbeDevice::FrequenciesType frequencies =
       intersonDevice.GetFrequencies();
     if( !success )
       {
@@ -206,6 +222,62 @@ void SpectroscopyBModeUI::SetFrequency()
     }
 }
 
+void SpectroscopyBModeUI::SetHistory( double seconds, size_t megabytes )
+{
+  historySeconds = seconds;
+  const size_t bytes = seconds > 0 ? megabytes * 1024 * 1024 : 0;
+  if( recordRF )
+    {
+    intersonDevice.SetHistoryMemoryBudget( 0, bytes );
+    }
+  else
+    {
+    intersonDevice.SetHistoryMemoryBudget( bytes, 0 );
+    }
+  ui->pushButton_saveHistory->setEnabled( seconds > 0 );
+  std::ostringstream text;
+  text << "Save Last " << seconds << " s";
+  ui->pushButton_saveHistory->setText( text.str().c_str() );
+}
+
+void SpectroscopyBModeUI::SaveHistory()
+{
+  if( !intersonDevice.IsProbeConnected() || historySeconds <= 0 )
+    {
+    return;
+    }
+
+  char stamp[ 32 ];
+  time_t now = time( 0 );
+  strftime( stamp, sizeof( stamp ), "%Y-%m-%d_%H-%M-%S", localtime( &now ) );
+  std::string filename = ui->comboBox_outputDir->currentText().toStdString()
+    + "/" + ( recordRF ? "rf" : "bm" ) + "_history_" + stamp + ".nrrd";
+
+  if( recordRF )
+    {
+    ProbeDevice::RFImageType3d::Pointer rf =
+      intersonDevice.GetRFHistory( historySeconds );
+    if( rf.IsNull() )
+      {
+      std::cout << "No frames in the history" << std::endl;
+      return;
+      }
+    ImageIO<ProbeDevice::RFImageType3d>::WriteImage( rf, filename );
+    }
+  else
+    {
+    ProbeDevice::ImageType3d::Pointer bmode =
+      intersonDevice.GetBModeHistory( historySeconds );
+    if( bmode.IsNull() )
+      {
+      std::cout << "No frames in the history" << std::endl;
+      return;
+      }
+    ImageIO<ProbeDevice::ImageType3d>::WriteImage( bmode, filename );
+    }
+  std::cout << "Saved history to " << filename << std::endl;
+}
+
 void SpectroscopyBModeUI::BrowseOutputDirectory()
 {
   QString outputFolder = QFileDialog::getExistingDirectory( this,
@@ -224,26 +296,21 @@ void SpectroscopyBModeUI::RecordBMode()
   QSignalBlocker myTimer( this->timer );
   std::cout << "Recording Started" << std::endl;
 
-  IntersonArrayDeviceRF::FrequenciesType frequencies =
+  ProbeDevice::FrequenciesType frequencies =
     intersonDevice.GetFrequencies();
   unsigned char voltLow = ui->spinBox_voltLow->value();
   unsigned char voltHigh = ui->spinBox_voltHigh->value();
   unsigned char voltStep = ui->spinBox_voltStep->value();
-  unsigned char volt = intersonDevice.GetVoltage();
-  unsigned char fi = intersonDevice.GetFrequency();
-  std::vector< IntersonArrayDeviceRF::RFImageType::Pointer > rfImages;
-  std::vector< IntersonArrayDeviceRF::ImageType::Pointer > bmImages;
+  std::vector< ProbeDevice::RFImageType::Pointer > rfImages;
+  std::vector< ProbeDevice::ImageType::Pointer > bmImages;
   std::vector< std::string > imageNames;
 
   /**
-   * Changing the frequencies is more time consuming. Do it in the outer
-   *  loop.
+   * The device orders the points to minimize reconfigurations and waits
+   * for new frames instead of sleeping.
    */
   int numberOfSamples = ui->spinBox_numberOfSamples->value();
-  int numVol = (int)((voltHigh-voltLow) / voltStep)+1;
-  int numberOfImages = freqCheckBoxes.size() * numVol;
-  int lastIndex = -1;
-  int index = lastIndex;
+  std::vector< ProbeDevice::SweepPoint > points;
   for( unsigned char i = 0; i < freqCheckBoxes.size(); i++ )
     {
     if( !freqCheckBoxes[ i ]->isChecked() )
@@ -252,89 +319,38 @@ void SpectroscopyBModeUI::RecordBMode()
       }
     for( int v = voltLow; v <= voltHigh; v += voltStep )
       {
-      std::cout << "Image " << i * numVol + (int)((v-voltLow)/voltStep)
-        << " of " << numberOfImages << std::endl;
-      if( v == voltLow )
-        {
-        std::cout << " Frequency Index = " << (int)i << std::endl;
-        std::cout << " Voltage = " << v << std::endl;
-        if( !intersonDevice.SetFrequencyAndVoltage( i, v ) )
-          {
-          std::cout << "Failed to set frequency: " << frequencies[ i ]
-            << " and voltage " << v << std::endl;
-          continue;
-          }
-        }
-      else
-        {
-        std::cout << " Voltage = " << v << std::endl;
-        if( !intersonDevice.SetVoltage( v ) )
-          {
-          std::cout << "Failed to set voltage: " << v << std::endl;
-          continue;
-          }
-        }
-      Sleep( 500 );
-      if( recordRF )
-        {
-        lastIndex = intersonDevice.GetCurrentRFIndex();
-        index = intersonDevice.GetCurrentRFIndex();
-        std::cout << " Waiting for probe to reset." << std::endl;
-        while( index == lastIndex )
-          {
-          Sleep( 10 );
-          index = intersonDevice.GetCurrentRFIndex();
-          }
-        }
-      else
-        {
-        lastIndex = intersonDevice.GetCurrentBModeIndex();
-        index = intersonDevice.GetCurrentBModeIndex();
-        std::cout << " Waiting for probe to reset." << std::endl;
-        while( index == lastIndex )
-          {
-          Sleep( 10 );
-          index = intersonDevice.GetCurrentBModeIndex();
-          }
-        }
-      for( int sample=0; sample<numberOfSamples; ++sample)
-        {
-        lastIndex = index;
-        if( recordRF )
-          {
-          rfImages.push_back( intersonDevice.GetRFImage( index ));
-          std::cout << " Waiting for probe to reset." << std::endl;
-          if( sample+1 < numberOfSamples )
-            {
-            while( index == lastIndex )
-              {
-              Sleep( 10 );
-              index = intersonDevice.GetCurrentRFIndex();
-              }
-            }
-          }
-        else
-          {
-          bmImages.push_back( intersonDevice.GetBModeImage( index ));
-          std::cout << " Waiting for probe to reset." << std::endl;
-          if( sample+1 < numberOfSamples )
-            {
-            while( index == lastIndex )
-              {
-              Sleep( 10 );
-              index = intersonDevice.GetCurrentBModeIndex();
-              }
-            }
-          }
-        }
-      std::ostringstream ftext;
-      ftext << std::setw( 3 ) << std::fixed << std::setfill( '0' );
-      ftext << "voltage_" << v;
-      ftext << "_freq_" << std::setw( 10 ) << std::fixed << frequencies[i];
-      ftext << ".nrrd";
-      imageNames.push_back( ftext.str() );
+      points.push_back(
+        ProbeDevice::SweepPoint( i, v, numberOfSamples ) );
       }
     }
+
+  std::vector< ProbeDevice::SweepResult > sweep =
+    intersonDevice.Sweep( points );
+  for( unsigned int i = 0; i < sweep.size(); i++ )
+    {
+    const ProbeDevice::SweepPoint &point = sweep[ i ].point;
+    if( !sweep[ i ].success )
+      {
+      std::cout << "Failed to record frequency: "
+        << frequencies[ point.frequencyIndex ] << " and voltage "
+        << ( int )point.voltage << std::endl;
+      continue;
+      }
+    rfImages.insert( rfImages.end(), sweep[ i ].rfImages.begin(),
+      sweep[ i ].rfImages.end() );
+    bmImages.insert( bmImages.end(), sweep[ i ].bModeImages.begin(),
+      sweep[ i ].bModeImages.end() );
+
+    std::ostringstream ftext;
+    ftext << std::setw( 3 ) << std::fixed << std::setfill( '0' );
+    ftext << "voltage_" << ( int )point.voltage;
+    ftext << "_freq_" << std::setw( 10 ) << std::fixed
+      << frequencies[ point.frequencyIndex ];
+    ftext << ".nrrd";
+    imageNames.push_back( ftext.str() );
+    }
+  int numberOfImages = imageNames.size();
+
   if( numberOfSamples > 1 )
     {
     if( recordRF )
@@ -400,11 +416,12 @@ void SpectroscopyBModeUI::RecordBMode()
   std::string output_directory =
     ui->comboBox_outputDir->currentText().toStdString() + "/"
     + subDirName.str();
-  std::string sysMkDir = std::string( "mkdir \"" + output_directory
-    + "\"" );
-  std::cout << "Saving to directory " << std::endl << "   " << sysMkDir
+  std::cout << "Saving to directory " << std::endl << "   " << output_directory
     << std::endl;
-  system( sysMkDir.c_str() );
+  if( !QDir().mkpath( QString::fromStdString( output_directory ) ) )
+    {
+    std::cerr << "Could not create " << output_directory << std::endl;
+    }
   
   //Save Images
   for( int i = 0; i < numberOfImages; i++ )
@@ -412,20 +429,16 @@ void SpectroscopyBModeUI::RecordBMode()
     if( recordRF )
       {
       std::string rfFilename = "rf_" + imageNames[i];
-      ImageIO<IntersonArrayDeviceRF::RFImageType>::saveImage(
+      ImageIO<ProbeDevice::RFImageType>::saveImage(
         rfImages[ i*numberOfSamples ], output_directory + "/" + rfFilename );
       }
     else
       {
       std::string bmFilename = "bm_" + imageNames[i];
-      ImageIO<IntersonArrayDeviceRF::ImageType>::saveImage(
+      ImageIO<ProbeDevice::ImageType>::saveImage(
         bmImages[ i*numberOfSamples ], output_directory + "/" + bmFilename );
       }
     }
 
-  //reset probe
-  intersonDevice.SetFrequencyAndVoltage( fi, volt );
-  Sleep( 100 );
-
   std::cout << "Recording Stopped" << std::endl;
 }
@@ -38,7 +38,7 @@ limitations under the License.
 #include <QCloseEvent>
 
 #include "ui_SpectroscopyBMode.h"
-#include "IntersonArrayDeviceRF.hxx"
+#include "ProbeDevice.hxx"
 
 //Forward declaration of Ui::MainWindow;
 namespace Ui
@@ -55,6 +55,11 @@ public:
   SpectroscopyBModeUI( QWidget *parent = nullptr );
   ~SpectroscopyBModeUI();
 
+  //Keep a compressed history of the frames within the given memory budget
+  //(see FrameHistory.hxx), "Save Last" exports its last seconds into the
+  //output directory. 0 seconds disables the history.
+  void SetHistory( double seconds, size_t megabytes );
+
 protected:
   void  closeEvent( QCloseEvent * event );
 
@@ -69,6 +74,7 @@ protected:
 
   void BrowseOutputDirectory();
   void RecordBMode();
+  void SaveHistory();
 
 private:
   /** Layout for the Window */
@@ -76,13 +82,14 @@ private:
   QTimer *timer;
   std::vector< QCheckBox * > freqCheckBoxes;
 
-  IntersonArrayDeviceRF intersonDevice;
+  ProbeDevice intersonDevice;
   int lastIndexRendered;
 
   bool recordRF;
+  double historySeconds;
 
-  typedef IntersonArrayDeviceRF::RFImageType  RFImageType;
-  typedef IntersonArrayDeviceRF::ImageType    BModeImageType;
+  typedef ProbeDevice::RFImageType  RFImageType;
+  typedef ProbeDevice::ImageType    BModeImageType;
 
   typedef itk::Image<double, 2> ImageType;
 };
@@ -28,7 +28,7 @@ limitations under the License.
 
 #include "SpectroscopyUI.h"
 
-#include "imageIO.h"
+#include "ImageIO.h"
 #include "ITKQtHelpers.hxx"
 #include "ITKFilterFunctions.h"
 
@@ -173,7 +173,7 @@ void SpectroscopyUI::ConnectProbe()
     {
     delete freqCheckBoxes[ i ];
     }
-  IntersonArrayDeviceRF::FrequenciesType fs = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType fs = intersonDevice.GetFrequencies();
   ui->dropDown_Frequency->clear();
   freqCheckBoxes.resize( fs.size() );
   for( unsigned int i = 0; i < fs.size(); i++ )
@@ -204,10 +204,16 @@ void SpectroscopyUI::ConnectProbe()
 void SpectroscopyUI::UpdateImage()
 {
   int currentIndex = intersonDevice.GetCurrentRFIndex();
+  RFImageType::Pointer rf;
   if( currentIndex >= 0 && currentIndex != lastRFRendered )
+    {
+    //NULL if the slot was rewritten during the read, retried on the next
+    //update
+    rf = intersonDevice.GetRFImage( currentIndex );
+    }
+  if( rf.IsNotNull() )
     {
     lastRFRendered = currentIndex;
-    RFImageType::Pointer rf = intersonDevice.GetRFImage( currentIndex );
 
     //Create BMode image
 
@@ -273,7 +279,7 @@ void SpectroscopyUI::SetFrequency()
 {
   bool success = this->intersonDevice.SetFrequency(
     this->ui->dropDown_Frequency->currentIndex() );
-  IntersonArrayDeviceRF::FrequenciesType frequencies = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType frequencies = intersonDevice.GetFrequencies();
   if( !success )
     {
     std::cout << "Failed to set frequency index: " << this->ui->dropDown_Frequency->currentIndex() << std::endl;
@@ -325,79 +331,66 @@ void SpectroscopyUI::BrowseOutputDirectory()
 
 void SpectroscopyUI::RecordRF()
 {
-  IntersonArrayDeviceRF::FrequenciesType frequencies = intersonDevice.GetFrequencies();
+  ProbeDevice::FrequenciesType frequencies = intersonDevice.GetFrequencies();
   unsigned char voltLow = ui->spinBox_voltLow->value();
   unsigned char voltHigh = ui->spinBox_voltHigh->value();
   unsigned char voltStep = ui->spinBox_voltStep->value();
-  unsigned char volt = intersonDevice.GetVoltage();
-  unsigned char fi = intersonDevice.GetFrequency();
-  std::vector< IntersonArrayDeviceRF::RFImageType::Pointer > images;
+  std::vector< ProbeDevice::RFImageType::Pointer > images;
   std::vector< std::string > imageNames;
 
   /**
-   * Changing the frequencies is more time consuming. Do it in the outer loop.
+   * The device orders the points to minimize reconfigurations and waits
+   * for new frames instead of sleeping.
    */
+  std::vector< ProbeDevice::SweepPoint > points;
   for( unsigned char i = 0; i < freqCheckBoxes.size(); i++ )
     {
     if( !freqCheckBoxes[ i ]->isChecked() )
       {
       continue;
       }
-    if( !intersonDevice.SetFrequency( i ) )
+    for( int v = voltLow; v <= voltHigh; v += voltStep )
       {
-      //TODO: report to ui
-      std::cout << "Failed to set frequency: " << frequencies[ i ] << std::endl;
-      continue;
+      points.push_back( ProbeDevice::SweepPoint( i, v, 1 ) );
       }
+    }
 
-    for( int v = voltLow; v <= voltHigh; v += voltStep )
+  time_t now = time( 0 );
+  tm *ltm = localtime( &now );
+  std::string date = std::to_string( 1900 + ltm->tm_year ) + "-"
+    + std::to_string( 1 + ltm->tm_mon ) + "-"
+    + std::to_string( ltm->tm_mday ) + "_"
+    + std::to_string( 1 + ltm->tm_hour ) + "-"
+    + std::to_string( 1 + ltm->tm_min ) + "-"
+    + std::to_string( 1 + ltm->tm_sec );
+
+  std::vector< ProbeDevice::SweepResult > sweep =
+    intersonDevice.Sweep( points );
+  for( unsigned int i = 0; i < sweep.size(); i++ )
+    {
+    const ProbeDevice::SweepPoint &point = sweep[ i ].point;
+    if( !sweep[ i ].success || sweep[ i ].rfImages.empty() )
       {
-
-      if( !intersonDevice.SetVoltage( v ) )
-        {
-        std::cout << "Failed to set voltage: " << v << std::endl;
-        continue;
-        }
-      Sleep(100);
-      int lastIndex = intersonDevice.GetCurrentRFIndex();
-      int index = intersonDevice.GetCurrentRFIndex();
-      //for(int nIm =0; nIm<3; nIm++){
-      while( index == lastIndex )
-        {
-        Sleep( 10 );
-        index = intersonDevice.GetCurrentRFIndex();
-        }
-      lastIndex = index;
-      images.push_back( intersonDevice.GetRFImage( intersonDevice.GetCurrentRFIndex() ) );
-
-      time_t now = time( 0 );
-      tm *ltm = localtime( &now );
-      std::string date = std::to_string( 1900 + ltm->tm_year ) + "-"
-        + std::to_string( 1 + ltm->tm_mon ) + "-"
-        + std::to_string( ltm->tm_mday ) + "_"
-        + std::to_string( 1 + ltm->tm_hour ) + "-"
-        + std::to_string( 1 + ltm->tm_min ) + "-"
-        + std::to_string( 1 + ltm->tm_sec );
-
-      std::ostringstream ftext;
-      ftext << std::setw( 3 ) << std::fixed << std::setfill( '0' );
-      ftext << "rf_voltage_" << v << "_freq_";
-      ftext << std::setw( 10 ) << std::fixed;
-      ftext << frequencies[ i ] << "_" << date << ".nrrd";
-      imageNames.push_back( ftext.str() );
-      //}
+      //TODO: report to ui
+      std::cout << "Failed to record frequency: "
+        << frequencies[ point.frequencyIndex ] << " and voltage "
+        << ( int )point.voltage << std::endl;
+      continue;
       }
+    images.push_back( sweep[ i ].rfImages[ 0 ] );
+
+    std::ostringstream ftext;
+    ftext << std::setw( 3 ) << std::fixed << std::setfill( '0' );
+    ftext << "rf_voltage_" << ( int )point.voltage << "_freq_";
+    ftext << std::setw( 10 ) << std::fixed;
+    ftext << frequencies[ point.frequencyIndex ] << "_" << date << ".nrrd";
+    imageNames.push_back( ftext.str() );
     }
 
   std::string output_directory = ui->comboBox_outputDir->currentText().toStdString() + "/";
   //Save Images
   for( unsigned int i = 0; i < images.size(); i++ )
     {
-    ImageIO<IntersonArrayDeviceRF::RFImageType>::saveImage( images[ i ], output_directory + imageNames[ i ] );
+    ImageIO<ProbeDevice::RFImageType>::saveImage( images[ i ], output_directory + imageNames[ i ] );
     }
-
-  //reset probe
-  intersonDevice.SetFrequency( fi );
-  intersonDevice.SetVoltage( volt );
-
 }
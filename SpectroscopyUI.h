@@ -38,7 +38,7 @@ limitations under the License.
 #include <QCloseEvent>
 
 #include "ui_Spectroscopy.h"
-#include "IntersonArrayDeviceRF.hxx"
+#include "ProbeDevice.hxx"
 
 #include "itkBModeImageFilter.h"
 #include "itkCastImageFilter.h"
@@ -48,7 +48,7 @@ limitations under the License.
 #include "itkInverse1DFFTImageFilter.h"
 #include "itkAbsImageFilter.h"
 #include "itkAddImageFilter.h"
-#include "itkMultiplyImageFIlter.h"
+#include "itkMultiplyImageFilter.h"
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkLog10ImageFilter.h"
 
@@ -93,11 +93,11 @@ private:
   QTimer *timer;
   std::vector< QCheckBox * > freqCheckBoxes;
 
-  IntersonArrayDeviceRF intersonDevice;
+  ProbeDevice intersonDevice;
   int lastBModeRendered;
   int lastRFRendered;
 
-  typedef IntersonArrayDeviceRF::RFImageType  RFImageType;
+  typedef ProbeDevice::RFImageType  RFImageType;
 
   typedef itk::Image<double, 2> ImageType;
 